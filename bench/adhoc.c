@@ -0,0 +1,502 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Checks the config sync between a master and an ADHOC node over the
+	loopback interface, and reports the size of each reply.
+
+	A master and a node are started with generated configs. The node
+	connects through a proxy in this program, which keeps the config
+	replies of the master and can cut the link, so the node reconnects
+	and syncs again. The checks are:
+	- the first sync sends the full config;
+	- a resync after a device changed only sends that device;
+	- a resync without changes sends no devices;
+	- a request with an unknown epoch, a future version or without
+	  a version gets the full config, the current version a delta.
+
+	pilight-bench-adhoc [-d ./pilight-daemon] [-w web/] [-P 5000]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "json.h"
+#include "socket.h"
+
+#define MASTER_CONFIG \
+	"{\"devices\":{" \
+		"\"sw1\":{\"protocol\":[\"kaku_switch\"],\"id\":[{\"id\":1234,\"unit\":1}],\"state\":\"off\"}," \
+		"\"sw2\":{\"protocol\":[\"kaku_switch\"],\"id\":[{\"id\":1234,\"unit\":2}],\"state\":\"off\"}," \
+		"\"sw3\":{\"protocol\":[\"kaku_switch\"],\"id\":[{\"id\":1234,\"unit\":3}],\"state\":\"off\"}" \
+	"},\"gui\":{" \
+		"\"sw1\":{\"name\":\"Lamp 1\",\"group\":[\"Living\"],\"media\":[\"all\"]}," \
+		"\"sw2\":{\"name\":\"Lamp 2\",\"group\":[\"Living\"],\"media\":[\"all\"]}," \
+		"\"sw3\":{\"name\":\"Lamp 3\",\"group\":[\"Kitchen\"],\"media\":[\"all\"]}" \
+	"},\"rules\":{},\"settings\":{" \
+		"\"log-level\":4,\"pid-file\":\"%s/master.pid\",\"log-file\":\"%s/master.log\"," \
+		"\"port\":%d,\"standalone\":1,\"webserver-enable\":0,\"webserver-port\":%d," \
+		"\"webserver-root\":\"%s\",\"firmware-update\":0" \
+	"},\"hardware\":{},\"registry\":{}}"
+
+#define NODE_CONFIG \
+	"{\"devices\":{},\"gui\":{},\"rules\":{},\"settings\":{" \
+		"\"log-level\":4,\"pid-file\":\"%s/node.pid\",\"log-file\":\"%s/node.log\"," \
+		"\"port\":%d,\"standalone\":1,\"webserver-enable\":0,\"webserver-port\":%d," \
+		"\"webserver-root\":\"%s\",\"firmware-update\":0" \
+	"},\"hardware\":{},\"registry\":{}}"
+
+struct pilight_t pilight;
+
+static char tmpdir[] = "/tmp/pilight-adhoc.XXXXXX";
+static char localhost[] = "127.0.0.1";
+static unsigned short master_port = 5000;
+static unsigned short proxy_port = 0;
+
+/* The config replies the master sent through the proxy */
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *proxy_reply = NULL;
+static int proxy_replies = 0;
+static volatile int proxy_cut = 0;
+static volatile int proxy_loop = 1;
+
+static int failures = 0;
+
+static void adhoc_check(int ok, const char *what) {
+	printf("%s %s\n", (ok == 1) ? "ok:  " : "FAIL:", what);
+	if(ok == 0) {
+		failures++;
+	}
+}
+
+static int adhoc_write(const char *name, int node, const char *webroot, unsigned short port) {
+	char file[PATH_MAX];
+	FILE *fp = NULL;
+
+	snprintf(file, sizeof(file), "%s/%s", tmpdir, name);
+	if((fp = fopen(file, "w")) == NULL) {
+		return -1;
+	}
+	fprintf(fp, (node == 1) ? NODE_CONFIG : MASTER_CONFIG, tmpdir, tmpdir, port, port+1, webroot);
+	fclose(fp);
+	return 0;
+}
+
+static pid_t adhoc_start(const char *daemon, const char *name, int node) {
+	char config[PATH_MAX], log[PATH_MAX], port[8];
+	pid_t pid = 0;
+	int fd = 0;
+
+	snprintf(config, sizeof(config), "%s/%s.json", tmpdir, name);
+	snprintf(log, sizeof(log), "%s/%s.out", tmpdir, name);
+	snprintf(port, sizeof(port), "%d", proxy_port);
+
+	if((pid = fork()) == 0) {
+		if((fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		if(node == 1) {
+			execl(daemon, daemon, "-D", "-C", config, "-S", "127.0.0.1", "-P", port, (char *)NULL);
+		} else {
+			execl(daemon, daemon, "-D", "-C", config, (char *)NULL);
+		}
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void adhoc_stop(pid_t pid) {
+	int i = 0, status = 0;
+
+	kill(pid, SIGTERM);
+	for(i=0;i<50;i++) {
+		if(waitpid(pid, &status, WNOHANG) == pid) {
+			return;
+		}
+		usleep(100000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+}
+
+/* Keeps the config replies in a stream from the master */
+static void proxy_scan(char **stream, size_t *len, const char *data, size_t bytes) {
+	char *tmp = NULL, *start = NULL, *end = NULL;
+
+	if((tmp = REALLOC(*stream, *len+bytes+1)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	*stream = tmp;
+	memcpy(&(*stream)[*len], data, bytes);
+	*len += bytes;
+	(*stream)[*len] = '\0';
+
+	start = *stream;
+	while((end = strstr(start, EOSS)) != NULL) {
+		*end = '\0';
+		if(strstr(start, "\"message\":\"config\"") != NULL) {
+			pthread_mutex_lock(&proxy_lock);
+			if(proxy_reply != NULL) {
+				FREE(proxy_reply);
+			}
+			if((proxy_reply = MALLOC(strlen(start)+1)) == NULL) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			strcpy(proxy_reply, start);
+			proxy_replies++;
+			pthread_mutex_unlock(&proxy_lock);
+		}
+		start = end+strlen(EOSS);
+	}
+	*len -= (size_t)(start-*stream);
+	memmove(*stream, start, *len+1);
+}
+
+static void *proxy(void *param) {
+	int listenfd = *(int *)param, nodefd = -1, masterfd = -1, i = 0;
+	char buffer[BUFFER_SIZE], *stream = NULL;
+	struct pollfd fds[3];
+	size_t len = 0;
+	ssize_t bytes = 0;
+
+	while(proxy_loop) {
+		if(proxy_cut == 1 && nodefd >= 0) {
+			close(nodefd);
+			close(masterfd);
+			nodefd = masterfd = -1;
+			len = 0;
+		}
+		proxy_cut = 0;
+
+		fds[0].fd = listenfd;
+		fds[1].fd = nodefd;
+		fds[2].fd = masterfd;
+		for(i=0;i<3;i++) {
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if(poll(fds, 3, 100) <= 0) {
+			continue;
+		}
+
+		/* The node leaves the connection it probed the master with
+		   open, so the newest connection replaces the previous one */
+		if(fds[0].revents & POLLIN) {
+			int fd = accept(listenfd, NULL, NULL);
+			if(nodefd >= 0) {
+				close(nodefd);
+				close(masterfd);
+				nodefd = masterfd = -1;
+			}
+			if(fd >= 0 && (masterfd = socket_connect(localhost, master_port)) < 0) {
+				close(fd);
+			} else {
+				nodefd = fd;
+				len = 0;
+			}
+			continue;
+		}
+		if(nodefd >= 0 && (fds[1].revents & (POLLIN | POLLHUP))) {
+			if((bytes = recv(nodefd, buffer, sizeof(buffer), 0)) <= 0) {
+				proxy_cut = 1;
+				continue;
+			}
+			send(masterfd, buffer, (size_t)bytes, MSG_NOSIGNAL);
+		}
+		if(masterfd >= 0 && (fds[2].revents & (POLLIN | POLLHUP))) {
+			if((bytes = recv(masterfd, buffer, sizeof(buffer), 0)) <= 0) {
+				proxy_cut = 1;
+				continue;
+			}
+			proxy_scan(&stream, &len, buffer, (size_t)bytes);
+			send(nodefd, buffer, (size_t)bytes, MSG_NOSIGNAL);
+		}
+	}
+	if(nodefd >= 0) {
+		close(nodefd);
+		close(masterfd);
+	}
+	if(stream != NULL) {
+		FREE(stream);
+	}
+	return NULL;
+}
+
+/* Waits for the next config reply through the proxy */
+static struct JsonNode *proxy_wait(int replies, size_t *size) {
+	struct JsonNode *json = NULL;
+	int i = 0;
+
+	for(i=0;i<300;i++) {
+		pthread_mutex_lock(&proxy_lock);
+		if(proxy_replies > replies) {
+			*size = strlen(proxy_reply);
+			json = json_decode(proxy_reply);
+			pthread_mutex_unlock(&proxy_lock);
+			return json;
+		}
+		pthread_mutex_unlock(&proxy_lock);
+		usleep(100000);
+	}
+	return NULL;
+}
+
+static struct JsonNode *adhoc_request(struct socket_reader_t *reader, const char *request, size_t *size) {
+	char *message = NULL;
+
+	socket_write(reader->fd, request);
+	while(socket_reader_next(reader, &message, 3) == 0) {
+		if(strstr(message, "\"message\":\"config\"") != NULL) {
+			*size = strlen(message);
+			return json_decode(message);
+		}
+	}
+	return NULL;
+}
+
+static int adhoc_client(struct socket_reader_t *reader, const char *identify) {
+	char *message = NULL;
+	int fd = socket_connect(localhost, master_port);
+
+	if(fd < 0) {
+		return -1;
+	}
+	socket_reader_init(reader, fd);
+	socket_write(fd, identify);
+	if(socket_reader_next(reader, &message, 3) != 0 || strcmp(message, "{\"status\":\"success\"}") != 0) {
+		socket_reader_gc(reader);
+		socket_close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Counts the devices a delta reply contains */
+static int adhoc_values(struct JsonNode *json) {
+	struct JsonNode *jvalues = json_find_member(json, "values"), *jchilds = NULL;
+	int nr = 0;
+
+	if(jvalues == NULL) {
+		return -1;
+	}
+	jchilds = json_first_child(jvalues);
+	while(jchilds) {
+		nr++;
+		jchilds = jchilds->next;
+	}
+	return nr;
+}
+
+int main(int argc, char **argv) {
+	struct options_t *options = NULL;
+	struct socket_reader_t client;
+	struct sockaddr_in addr;
+	struct JsonNode *json = NULL;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t pth;
+	char daemon[PATH_MAX], webroot[PATH_MAX], request[128];
+	char optdaemon[PATH_MAX] = "./pilight-daemon", optwebroot[PATH_MAX] = "web", *args = NULL;
+	double epoch = 0, version = 0;
+	size_t size = 0;
+	pid_t master = 0, node = 0;
+	int listenfd = 0, replies = 0, i = 0, nr = 0;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_ERR);
+
+	if((progname = MALLOC(20)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(progname, "pilight-bench-adhoc");
+
+	options_add(&options, 'H', "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'd', "daemon", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'w', "webserver-root", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'P', "port", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]{1,5}");
+
+	while(1) {
+		int c = options_parse(&options, argc, argv, 1, &args);
+		if(c == -1)
+			break;
+		if(c == -2)
+			c = 'H';
+		switch(c) {
+			case 'd':
+				snprintf(optdaemon, sizeof(optdaemon), "%s", args);
+			break;
+			case 'w':
+				snprintf(optwebroot, sizeof(optwebroot), "%s", args);
+			break;
+			case 'P':
+				master_port = (unsigned short)atoi(args);
+			break;
+			case 'H':
+			default:
+				printf("Usage: %s [options]\n", progname);
+				printf("\t -H --help\t\t\tdisplay this message\n");
+				printf("\t -d --daemon=file\t\tpilight-daemon to test\n");
+				printf("\t -w --webserver-root=path\tweb folder the configs refer to\n");
+				printf("\t -P --port=xxxx\t\t\tfirst of the four ports to use\n");
+				exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+
+	if(realpath(optdaemon, daemon) == NULL || realpath(optwebroot, webroot) == NULL) {
+		logprintf(LOG_ERR, "cannot find %s or %s", optdaemon, optwebroot);
+		exit(EXIT_FAILURE);
+	}
+	options_delete(options);
+
+	if(mkdtemp(tmpdir) == NULL) {
+		logprintf(LOG_ERR, "cannot create a temporary folder");
+		exit(EXIT_FAILURE);
+	}
+	/* The proxy takes any free port */
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	   bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	   listen(listenfd, 4) != 0 ||
+	   getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+		logprintf(LOG_ERR, "cannot start the proxy");
+		exit(EXIT_FAILURE);
+	}
+	proxy_port = ntohs(addr.sin_port);
+
+	if(adhoc_write("master.json", 0, webroot, master_port) != 0 ||
+	   adhoc_write("node.json", 1, webroot, (unsigned short)(master_port+2)) != 0) {
+		logprintf(LOG_ERR, "cannot write the configs to %s", tmpdir);
+		exit(EXIT_FAILURE);
+	}
+	pthread_create(&pth, NULL, proxy, &listenfd);
+
+	printf("master on port %d, node through port %d, logs in %s\n", master_port, proxy_port, tmpdir);
+	master = adhoc_start(daemon, "master", 0);
+	for(i=0;i<50;i++) {
+		if(adhoc_client(&client, "{\"action\":\"identify\"}") == 0) {
+			break;
+		}
+		usleep(100000);
+	}
+	if(i == 50) {
+		logprintf(LOG_ERR, "the master did not start");
+		adhoc_stop(master);
+		exit(EXIT_FAILURE);
+	}
+	node = adhoc_start(daemon, "node", 1);
+
+	/* First sync */
+	json = proxy_wait(replies, &size);
+	adhoc_check(json != NULL && json_find_member(json, "config") != NULL, "first sync sends the full config");
+	printf("       full config: %zu bytes\n", size);
+	if(json != NULL) {
+		json_find_number(json, "epoch", &epoch);
+		json_delete(json);
+	}
+	replies++;
+
+	/* A change while the node is connected, then a resync */
+	socket_write(client.fd, "{\"action\":\"control\",\"code\":{\"device\":\"sw2\",\"state\":\"on\"}}");
+	usleep(500000);
+	proxy_cut = 1;
+	json = proxy_wait(replies, &size);
+	nr = adhoc_values(json);
+	adhoc_check(json != NULL && json_find_member(json, "config") == NULL && nr == 1, "resync after a change sends one device");
+	printf("       delta: %zu bytes\n", size);
+	if(json != NULL) {
+		json_find_number(json, "version", &version);
+		json_delete(json);
+	}
+	replies++;
+
+	/* A resync without changes */
+	proxy_cut = 1;
+	json = proxy_wait(replies, &size);
+	nr = adhoc_values(json);
+	adhoc_check(json != NULL && json_find_member(json, "config") == NULL && nr == 0, "resync without changes sends no devices");
+	printf("       empty delta: %zu bytes\n", size);
+	if(json != NULL) {
+		json_delete(json);
+	}
+	socket_reader_gc(&client);
+	socket_close(client.fd);
+
+	/* Requests like a node would send them */
+	if(adhoc_client(&client, "{\"action\":\"identify\",\"options\":{\"config\":1,\"forward\":1}}") == 0) {
+		snprintf(request, sizeof(request), "{\"action\":\"request config\",\"epoch\":%.0f,\"version\":%.0f}", epoch-1, version);
+		json = adhoc_request(&client, request, &size);
+		adhoc_check(json != NULL && json_find_member(json, "config") != NULL, "an unknown epoch gets the full config");
+		json_delete(json);
+
+		snprintf(request, sizeof(request), "{\"action\":\"request config\",\"epoch\":%.0f,\"version\":%.0f}", epoch, version+100);
+		json = adhoc_request(&client, request, &size);
+		adhoc_check(json != NULL && json_find_member(json, "config") != NULL, "a future version gets the full config");
+		json_delete(json);
+
+		json = adhoc_request(&client, "{\"action\":\"request config\"}", &size);
+		adhoc_check(json != NULL && json_find_member(json, "config") != NULL, "no version gets the full config");
+		json_delete(json);
+
+		snprintf(request, sizeof(request), "{\"action\":\"request config\",\"epoch\":%.0f,\"version\":%.0f}", epoch, version);
+		json = adhoc_request(&client, request, &size);
+		adhoc_check(json != NULL && adhoc_values(json) == 0, "the current version gets an empty delta");
+		json_delete(json);
+
+		socket_reader_gc(&client);
+		socket_close(client.fd);
+	} else {
+		adhoc_check(0, "connect to the master");
+	}
+
+	adhoc_stop(node);
+	adhoc_stop(master);
+	proxy_loop = 0;
+	pthread_join(pth, NULL);
+	close(listenfd);
+	if(proxy_reply != NULL) {
+		FREE(proxy_reply);
+	}
+	FREE(progname);
+
+	printf("%d checks failed\n", failures);
+	return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
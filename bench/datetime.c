@@ -0,0 +1,163 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Compares the timezone conversions per second of localtztime and
+	datetime2ts with switching TZ around localtime_r and mktime, the
+	way the conversions used to be done. Both convert the same instants
+	in four rotating zones, and every difference is reported.
+
+	pilight-bench-datetime [-n conversions]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "datetime.h"
+
+struct pilight_t pilight;
+
+static char zones[4][20] = {
+	"Europe/Amsterdam",
+	"America/New_York",
+	"Australia/Sydney",
+	"Asia/Kolkata"
+};
+
+static double bench_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec+(double)tv.tv_usec/1000000.0;
+}
+
+static time_t bench_instant(int i) {
+	/* Spread over 2000 until 2030 */
+	return (time_t)946684800+(time_t)(((unsigned long)i*2654435761u)%946080000u);
+}
+
+static void bench_setenv(int i, struct tm *tm, time_t *ts) {
+	time_t t = bench_instant(i);
+	struct tm tmp;
+
+	setenv("TZ", zones[i%4], 1);
+	tzset();
+	localtime_r(&t, tm);
+	memcpy(&tmp, tm, sizeof(struct tm));
+	tmp.tm_isdst = 0;
+	*ts = mktime(&tmp);
+}
+
+static void bench_cached(int i, struct tm *tm, time_t *ts) {
+	time_t t = bench_instant(i);
+
+	memcpy(tm, localtztime(zones[i%4], t), sizeof(struct tm));
+	*ts = datetime2ts(tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, zones[i%4]);
+}
+
+int main(int argc, char **argv) {
+	struct options_t *options = NULL;
+	struct tm tm1, tm2;
+	char *args = NULL;
+	double start = 0.0, old = 0.0, new = 0.0;
+	time_t ts1 = 0, ts2 = 0;
+	int nrconversions = 200000, differences = 0, i = 0;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_ERR);
+
+	if((progname = MALLOC(23)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(progname, "pilight-bench-datetime");
+
+	options_add(&options, 'H', "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'n', "conversions", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]+");
+
+	while(1) {
+		int c = options_parse(&options, argc, argv, 1, &args);
+		if(c == -1)
+			break;
+		if(c == -2)
+			c = 'H';
+		switch(c) {
+			case 'n':
+				nrconversions = atoi(args);
+			break;
+			case 'H':
+			default:
+				printf("Usage: %s [options]\n", progname);
+				printf("\t -H --help\t\t\tdisplay this message\n");
+				printf("\t -n --conversions=xxxx\t\tnumber of conversions\n");
+				exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+	options_delete(options);
+
+	if(nrconversions <= 0) {
+		printf("Usage: %s [options]\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Both load their zones before the clock starts */
+	for(i=0;i<4;i++) {
+		bench_setenv(i, &tm1, &ts1);
+		bench_cached(i, &tm2, &ts2);
+	}
+
+	start = bench_now();
+	for(i=0;i<nrconversions;i++) {
+		bench_setenv(i, &tm1, &ts1);
+	}
+	old = bench_now()-start;
+
+	start = bench_now();
+	for(i=0;i<nrconversions;i++) {
+		bench_cached(i, &tm2, &ts2);
+	}
+	new = bench_now()-start;
+
+	for(i=0;i<nrconversions;i++) {
+		bench_setenv(i, &tm1, &ts1);
+		bench_cached(i, &tm2, &ts2);
+		if(ts1 != ts2 || tm1.tm_hour != tm2.tm_hour || tm1.tm_mday != tm2.tm_mday ||
+		   tm1.tm_isdst != tm2.tm_isdst || tm1.tm_wday != tm2.tm_wday) {
+			differences++;
+		}
+	}
+	unsetenv("TZ");
+
+	printf("conversions:       %d\n", nrconversions);
+	printf("setenv/mktime:     %.0f/s\n", (double)nrconversions/old);
+	printf("cached zones:      %.0f/s (%.1fx)\n", (double)nrconversions/new, old/new);
+	printf("differences:       %d\n", differences);
+
+	datetime_gc();
+	FREE(progname);
+	return (differences == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
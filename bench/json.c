@@ -0,0 +1,172 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Measures the JSON parse and emit throughput for a config file and
+	for a typical receiver message. Parsing is done with json_decode and
+	json_decode_arena, emitting with json_stringify and a reused buffer
+	of json_stringify_buffer. The best of seven rounds is reported.
+
+	pilight-bench-json [-c bench/config.json]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "json.h"
+
+#define BENCH_ROUNDS	7
+
+struct pilight_t pilight;
+
+static const char *message = "{\"message\":{\"id\":1234,\"unit\":3,\"state\":\"on\"},\"origin\":\"receiver\",\"protocol\":\"arctech_switch\",\"uuid\":\"0000-b8-27-eb-0f3db7\",\"repeats\":1}";
+
+static double bench_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec+(double)tv.tv_usec/1000000.0;
+}
+
+static double bench_best(double best, double start) {
+	double elapsed = bench_now()-start;
+	return (elapsed < best) ? elapsed : best;
+}
+
+static void bench_run(const char *name, const char *content, int loops) {
+	struct JsonNode *jroot = json_decode(content), *jtmp = NULL;
+	JsonBuffer buffer = JSON_BUFFER_INITIALIZER;
+	double heap = 1e9, arena = 1e9, emit = 1e9, reuse = 1e9, start = 0.0, mb = 0.0;
+	char *output = NULL;
+	int i = 0, x = 0;
+
+	if(jroot == NULL) {
+		logprintf(LOG_ERR, "%s is not in a valid json format", name);
+		exit(EXIT_FAILURE);
+	}
+
+	for(x=0;x<BENCH_ROUNDS;x++) {
+		start = bench_now();
+		for(i=0;i<loops;i++) {
+			jtmp = json_decode(content);
+			json_delete(jtmp);
+		}
+		heap = bench_best(heap, start);
+
+		start = bench_now();
+		for(i=0;i<loops;i++) {
+			jtmp = json_decode_arena(content);
+			json_delete(jtmp);
+		}
+		arena = bench_best(arena, start);
+
+		start = bench_now();
+		for(i=0;i<loops;i++) {
+			output = json_stringify(jroot, NULL);
+			json_free(output);
+		}
+		emit = bench_best(emit, start);
+
+		start = bench_now();
+		for(i=0;i<loops;i++) {
+			json_stringify_buffer(&buffer, jroot, NULL);
+		}
+		reuse = bench_best(reuse, start);
+	}
+
+	mb = (double)strlen(content)*(double)loops/1000000.0;
+	printf("%s (%zu bytes)\n", name, strlen(content));
+	printf("  json_decode:           %8.1f MB/s\n", mb/heap);
+	printf("  json_decode_arena:     %8.1f MB/s (%.2fx)\n", mb/arena, heap/arena);
+	printf("  json_stringify:        %8.0f/s\n", (double)loops/emit);
+	printf("  json_stringify_buffer: %8.0f/s (%.2fx)\n", (double)loops/reuse, emit/reuse);
+
+	json_buffer_free(&buffer);
+	json_delete(jroot);
+}
+
+int main(int argc, char **argv) {
+	struct options_t *options = NULL;
+	struct stat st;
+	char config[PATH_MAX] = "bench/config.json", *args = NULL, *content = NULL;
+	FILE *fp = NULL;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_ERR);
+
+	if((progname = MALLOC(19)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(progname, "pilight-bench-json");
+
+	options_add(&options, 'H', "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'c', "config", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+
+	while(1) {
+		int c = options_parse(&options, argc, argv, 1, &args);
+		if(c == -1)
+			break;
+		if(c == -2)
+			c = 'H';
+		switch(c) {
+			case 'c':
+				snprintf(config, sizeof(config), "%s", args);
+			break;
+			case 'H':
+			default:
+				printf("Usage: %s [options]\n", progname);
+				printf("\t -H --help\t\t\tdisplay this message\n");
+				printf("\t -c --config=file\t\tconfig file to parse and emit\n");
+				exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+
+	if((fp = fopen(config, "rb")) == NULL || fstat(fileno(fp), &st) != 0) {
+		logprintf(LOG_ERR, "cannot read config file: %s", config);
+		exit(EXIT_FAILURE);
+	}
+	if((content = MALLOC((size_t)st.st_size+1)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	if(fread(content, sizeof(char), (size_t)st.st_size, fp) != (size_t)st.st_size) {
+		logprintf(LOG_ERR, "cannot read config file: %s", config);
+		exit(EXIT_FAILURE);
+	}
+	content[st.st_size] = '\0';
+	fclose(fp);
+
+	bench_run(config, content, 1000);
+	bench_run("receiver message", message, 100000);
+
+	FREE(content);
+	options_delete(options);
+	FREE(progname);
+	return EXIT_SUCCESS;
+}
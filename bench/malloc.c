@@ -0,0 +1,124 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Counts the heap allocations of a process it is preloaded in:
+
+	LD_PRELOAD=./pilight-bench-malloc.so pilight-daemon -D
+
+	Each SIGUSR2 writes the number of allocations so far to the
+	file in PILIGHT_BENCH_MALLOC (default /tmp/pilight-bench-malloc).
+*/
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#define BENCH_MALLOC_FILE "/tmp/pilight-bench-malloc"
+
+static unsigned long allocs = 0;
+
+static void *(*real_malloc)(size_t) = NULL;
+static void *(*real_calloc)(size_t, size_t) = NULL;
+static void *(*real_realloc)(void *, size_t) = NULL;
+static void (*real_free)(void *) = NULL;
+
+/* dlsym allocates through calloc before it is resolved */
+static char bootstrap[4096];
+static size_t bootstrapped = 0;
+
+void *malloc(size_t size) {
+	if(real_malloc == NULL) {
+		real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	}
+	__sync_add_and_fetch(&allocs, 1);
+	return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	static int resolving = 0;
+	if(real_calloc == NULL) {
+		if(resolving == 1) {
+			void *p = NULL;
+			size = ((nmemb*size)+15) & ~(size_t)15;
+			if(bootstrapped+size > sizeof(bootstrap)) {
+				return NULL;
+			}
+			p = &bootstrap[bootstrapped];
+			bootstrapped += size;
+			return p;
+		}
+		resolving = 1;
+		real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	}
+	__sync_add_and_fetch(&allocs, 1);
+	return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if(real_realloc == NULL) {
+		real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+	}
+	__sync_add_and_fetch(&allocs, 1);
+	return real_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	if((char *)ptr >= bootstrap && (char *)ptr < &bootstrap[sizeof(bootstrap)]) {
+		return;
+	}
+	if(real_free == NULL) {
+		real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+	}
+	real_free(ptr);
+}
+
+static void bench_malloc_dump(int sig) {
+	const char *file = getenv("PILIGHT_BENCH_MALLOC");
+	char line[32];
+	int fd = 0, len = 0;
+
+	if(file == NULL) {
+		file = BENCH_MALLOC_FILE;
+	}
+	len = snprintf(line, sizeof(line), "%lu\n", allocs);
+	if((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		if(write(fd, line, (size_t)len) != len) {
+			unlink(file);
+		}
+		close(fd);
+	}
+}
+
+__attribute__((constructor)) static void bench_malloc_init(void) {
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = bench_malloc_dump;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGUSR2, &act, NULL);
+}
@@ -0,0 +1,249 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Measures the daemon CPU time and heap allocations per received frame.
+
+	Raw codes sent to a daemon without sending hardware are fed back into
+	its receiver, so every frame passes the ring, the decoders, the
+	broadcast message and the socket writes to the receiving clients.
+	The frames are sent one at a time and each is awaited on a receiver
+	connection, so none are merged in the send queue. The numbers include
+	parsing the send action that injects the frame.
+
+	LD_PRELOAD=./pilight-bench-malloc.so pilight-daemon -D &
+	pilight-bench-receive -p $! -a -n 10000
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "socket.h"
+
+#define BENCH_MALLOC_FILE "/tmp/pilight-bench-malloc"
+
+struct pilight_t pilight;
+
+/* An arctech_switch id 1234 unit 3 with the state on and off */
+static const char *frames[2] = {
+	"279 2511 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 1395 279 279 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 1395 279 279 279 9486",
+	"279 2511 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 1395 279 279 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 279 279 1395 279 1395 279 279 279 1395 279 279 279 9486"
+};
+
+static int bench_cpu(pid_t pid, double *cpu) {
+	char file[32], buffer[1024], *p = NULL;
+	unsigned long utime = 0, stime = 0;
+	size_t len = 0;
+	FILE *fp = NULL;
+
+	snprintf(file, sizeof(file), "/proc/%d/stat", (int)pid);
+	if((fp = fopen(file, "r")) == NULL) {
+		return -1;
+	}
+	len = fread(buffer, 1, sizeof(buffer)-1, fp);
+	fclose(fp);
+	buffer[len] = '\0';
+
+	/* The process name can contain spaces, so the fields are
+	   counted from the closing parenthesis, which is field 2 */
+	if((p = strrchr(buffer, ')')) == NULL ||
+	   sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return -1;
+	}
+	*cpu = (double)(utime+stime)/(double)sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+static int bench_allocs(pid_t pid, unsigned long *allocs) {
+	const char *file = getenv("PILIGHT_BENCH_MALLOC");
+	char buffer[32];
+	size_t len = 0;
+	FILE *fp = NULL;
+	int i = 0;
+
+	if(file == NULL) {
+		file = BENCH_MALLOC_FILE;
+	}
+	unlink(file);
+	if(kill(pid, SIGUSR2) != 0) {
+		return -1;
+	}
+	for(i=0;i<100;i++) {
+		if((fp = fopen(file, "r")) != NULL) {
+			len = fread(buffer, 1, sizeof(buffer)-1, fp);
+			fclose(fp);
+			buffer[len] = '\0';
+			if(len > 0 && buffer[len-1] == '\n') {
+				*allocs = strtoul(buffer, NULL, 10);
+				return 0;
+			}
+		}
+		usleep(10000);
+	}
+	return -1;
+}
+
+static int bench_frame(struct socket_reader_t *tx, struct socket_reader_t *rx, int i) {
+	char *message = NULL;
+
+	socket_write(tx->fd, "{\"action\":\"send\",\"code\":{\"protocol\":[\"raw\"],\"code\":\"%s\"}}", frames[i%2]);
+	while(socket_reader_next(rx, &message, 3) == 0) {
+		if(strstr(message, "\"origin\":\"receiver\"") != NULL &&
+		   strstr(message, "\"protocol\":\"arctech_switch\"") != NULL) {
+			/* Every send is answered on the sending connection */
+			return socket_reader_next(tx, &message, 3);
+		}
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	struct options_t *options = NULL;
+	struct socket_reader_t rx, tx;
+	struct timeval tstart, tend;
+	char localhost[] = "127.0.0.1", *server = localhost;
+	char *args = NULL, *message = NULL;
+	unsigned short port = 5000, allocations = 0;
+	unsigned long allocs[2] = { 0, 0 };
+	double cpu[2] = { 0.0, 0.0 }, elapsed = 0.0;
+	int rxfd = 0, txfd = 0, nrframes = 10000, i = 0;
+	pid_t pid = 0;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_NOTICE);
+
+	if((progname = MALLOC(22)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(progname, "pilight-bench-receive");
+
+	options_add(&options, 'H', "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'S', "server", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'P', "port", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]{1,5}");
+	options_add(&options, 'p', "pid", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]+");
+	options_add(&options, 'n', "frames", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]+");
+	options_add(&options, 'a', "allocations", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+
+	while(1) {
+		int c = options_parse(&options, argc, argv, 1, &args);
+		if(c == -1)
+			break;
+		if(c == -2)
+			c = 'H';
+		switch(c) {
+			case 'S':
+				server = args;
+			break;
+			case 'P':
+				port = (unsigned short)atoi(args);
+			break;
+			case 'p':
+				pid = (pid_t)atoi(args);
+			break;
+			case 'n':
+				nrframes = atoi(args);
+			break;
+			case 'a':
+				allocations = 1;
+			break;
+			case 'H':
+			default:
+				printf("Usage: %s -p pid [options]\n", progname);
+				printf("\t -H --help\t\t\tdisplay this message\n");
+				printf("\t -S --server=x.x.x.x\t\tconnect to server address\n");
+				printf("\t -P --port=xxxx\t\t\tconnect to server port\n");
+				printf("\t -p --pid=xxxx\t\t\tprocess id of the pilight-daemon\n");
+				printf("\t -n --frames=xxxx\t\tnumber of frames to receive\n");
+				printf("\t -a --allocations\t\tcount allocations, the daemon must\n\t\t\t\t\thave pilight-bench-malloc.so preloaded\n");
+				exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+
+	if(pid <= 0 || nrframes <= 0) {
+		printf("Usage: %s -p pid [options]\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	if((rxfd = socket_connect(server, port)) == -1 || (txfd = socket_connect(server, port)) == -1) {
+		logprintf(LOG_ERR, "could not connect to pilight-daemon");
+		exit(EXIT_FAILURE);
+	}
+	socket_reader_init(&rx, rxfd);
+	socket_reader_init(&tx, txfd);
+
+	socket_write(rxfd, "{\"action\":\"identify\",\"options\":{\"receiver\":1}}");
+	socket_write(txfd, "{\"action\":\"identify\"}");
+	if(socket_reader_next(&rx, &message, 3) != 0 || strcmp(message, "{\"status\":\"success\"}") != 0 ||
+	   socket_reader_next(&tx, &message, 3) != 0 || strcmp(message, "{\"status\":\"success\"}") != 0) {
+		logprintf(LOG_ERR, "pilight-daemon did not accept the benchmark clients");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Fill the pools and caches first */
+	for(i=0;i<100;i++) {
+		if(bench_frame(&tx, &rx, i) != 0) {
+			logprintf(LOG_ERR, "pilight-daemon did not receive the raw codes");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(bench_cpu(pid, &cpu[0]) != 0 || (allocations == 1 && bench_allocs(pid, &allocs[0]) != 0)) {
+		logprintf(LOG_ERR, "cannot sample pilight-daemon %d", (int)pid);
+		exit(EXIT_FAILURE);
+	}
+	gettimeofday(&tstart, NULL);
+	for(i=0;i<nrframes;i++) {
+		if(bench_frame(&tx, &rx, i) != 0) {
+			logprintf(LOG_ERR, "frame %d was not received", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	gettimeofday(&tend, NULL);
+	if(bench_cpu(pid, &cpu[1]) != 0 || (allocations == 1 && bench_allocs(pid, &allocs[1]) != 0)) {
+		logprintf(LOG_ERR, "cannot sample pilight-daemon %d", (int)pid);
+		exit(EXIT_FAILURE);
+	}
+
+	elapsed = (double)(tend.tv_sec-tstart.tv_sec)+(double)(tend.tv_usec-tstart.tv_usec)/1000000.0;
+	printf("frames:            %d\n", nrframes);
+	printf("frames/s:          %.0f\n", (double)nrframes/elapsed);
+	printf("daemon cpu/frame:  %.1f us\n", (cpu[1]-cpu[0])*1000000.0/(double)nrframes);
+	if(allocations == 1) {
+		printf("allocations/frame: %.2f\n", (double)(allocs[1]-allocs[0])/(double)nrframes);
+	}
+
+	socket_reader_gc(&rx);
+	socket_reader_gc(&tx);
+	socket_close(rxfd);
+	socket_close(txfd);
+	options_delete(options);
+	FREE(progname);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Measures how many device updates per second the rules engine handles.
+
+	A switch, a dimmer and a weather station are updated in turn, and after
+	each update the rules using that device are evaluated the way the
+	events loop does. The actions are replaced by a counter, so only the
+	device update and the rule evaluation are measured.
+
+	pilight-bench-rules [-r rules] [-n events]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "options.h"
+#include "json.h"
+#include "config.h"
+#include "devices.h"
+#include "rules.h"
+#include "action.h"
+#include "events.h"
+
+struct pilight_t pilight;
+
+static unsigned long actions = 0;
+
+static const char *devices =
+	"\"sw\":{\"protocol\":[\"kaku_switch\"],\"id\":[{\"id\":1234,\"unit\":3}],\"state\":\"off\"},"
+	"\"dim\":{\"protocol\":[\"generic_dimmer\"],\"id\":[{\"id\":100}],\"state\":\"on\",\"dimlevel\":10},"
+	"\"wx\":{\"protocol\":[\"generic_weather\"],\"id\":[{\"id\":1}],\"temperature\":21.5,\"humidity\":45.0,\"battery\":1}";
+
+/* Each rule takes one of these with its own number in between */
+static const char *conditions[4][2] = {
+	{ "IF wx.temperature > ", " AND sw.state IS off THEN switch DEVICE sw TO on" },
+	{ "IF dim.dimlevel >= ", " OR wx.humidity < 40 THEN dim DEVICE dim TO 5" },
+	{ "IF wx.temperature - wx.humidity < ", " AND dim.state IS on THEN switch DEVICE sw TO off" },
+	{ "IF sw.state IS on AND dim.dimlevel < ", " AND wx.temperature >= 10 THEN dim DEVICE dim TO 2" }
+};
+
+static int bench_action(struct JsonNode *arguments) {
+	actions++;
+	return 0;
+}
+
+static char *bench_config(int nrrules) {
+	size_t len = strlen(devices)+64, pos = 0;
+	char *config = NULL;
+	int i = 0;
+
+	len += (size_t)nrrules*160;
+	if((config = MALLOC(len)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	pos += (size_t)snprintf(&config[pos], len-pos, "{\"devices\":{%s},\"rules\":{", devices);
+	for(i=0;i<nrrules;i++) {
+		pos += (size_t)snprintf(&config[pos], len-pos, "%s\"r%d\":{\"rule\":\"%s%d%s\",\"active\":1}",
+			(i > 0) ? "," : "", i, conditions[i%4][0], 10+(i%15), conditions[i%4][1]);
+	}
+	snprintf(&config[pos], len-pos, "}}");
+	return config;
+}
+
+/* Runs the rules using one of the updated devices, like events_loop */
+static unsigned long bench_rules(struct JsonNode *jupdate) {
+	struct JsonNode *jdevices = json_find_member(jupdate, "devices"), *jchilds = NULL;
+	struct rules_t *tmp_rules = rules_get();
+	unsigned long nrrules = 0;
+	int i = 0, match = 0;
+
+	while(tmp_rules) {
+		match = 0;
+		jchilds = (jdevices != NULL) ? json_first_child(jdevices) : NULL;
+		while(jchilds && match == 0) {
+			for(i=0;i<tmp_rules->nrdevices;i++) {
+				if(jchilds->tag == JSON_STRING && strcmp(jchilds->string_, tmp_rules->devices[i]) == 0) {
+					match = 1;
+					break;
+				}
+			}
+			jchilds = jchilds->next;
+		}
+		if(match == 1) {
+			event_run_rule(tmp_rules);
+			tmp_rules->status = 0;
+			nrrules++;
+		}
+		tmp_rules = tmp_rules->next;
+	}
+	return nrrules;
+}
+
+int main(int argc, char **argv) {
+	struct options_t *options = NULL;
+	struct event_actions_t *tmp_actions = NULL;
+	struct JsonNode *jconfig = NULL, *jcode = NULL, *jupdate = NULL;
+	struct timeval tstart, tend;
+	char *args = NULL, *config = NULL, code[128], protoname[16];
+	unsigned long nrrules = 0;
+	double elapsed = 0.0;
+	int rules = 200, nrevents = 100000, i = 0;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_ERR);
+
+	if((progname = MALLOC(20)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(progname, "pilight-bench-rules");
+
+	options_add(&options, 'H', "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, 'r', "rules", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]+");
+	options_add(&options, 'n', "events", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, "[0-9]+");
+
+	while(1) {
+		int c = options_parse(&options, argc, argv, 1, &args);
+		if(c == -1)
+			break;
+		if(c == -2)
+			c = 'H';
+		switch(c) {
+			case 'r':
+				rules = atoi(args);
+			break;
+			case 'n':
+				nrevents = atoi(args);
+			break;
+			case 'H':
+			default:
+				printf("Usage: %s [options]\n", progname);
+				printf("\t -H --help\t\t\tdisplay this message\n");
+				printf("\t -r --rules=xxxx\t\tnumber of active rules\n");
+				printf("\t -n --events=xxxx\t\tnumber of device updates\n");
+				exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+	options_delete(options);
+
+	if(rules <= 0 || nrevents <= 0) {
+		printf("Usage: %s [options]\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	protocol_init();
+	config_init();
+
+	config = bench_config(rules);
+	if((jconfig = json_decode(config)) == NULL || config_parse(jconfig) != EXIT_SUCCESS) {
+		logprintf(LOG_ERR, "benchmark config is invalid");
+		exit(EXIT_FAILURE);
+	}
+	json_delete(jconfig);
+	FREE(config);
+
+	tmp_actions = event_actions;
+	while(tmp_actions) {
+		tmp_actions->run = &bench_action;
+		tmp_actions = tmp_actions->next;
+	}
+
+	gettimeofday(&tstart, NULL);
+	for(i=0;i<nrevents;i++) {
+		switch(i%3) {
+			case 0:
+				strcpy(protoname, "arctech_switch");
+				snprintf(code, sizeof(code), "{\"message\":{\"id\":1234,\"unit\":3,\"state\":\"%s\"}}", (i%2 == 0) ? "on" : "off");
+			break;
+			case 1:
+				strcpy(protoname, "generic_dimmer");
+				snprintf(code, sizeof(code), "{\"message\":{\"id\":100,\"state\":\"on\",\"dimlevel\":%d}}", i%16);
+			break;
+			default:
+				strcpy(protoname, "generic_weather");
+				snprintf(code, sizeof(code), "{\"message\":{\"id\":1,\"temperature\":%d.5,\"humidity\":%d}}", 10+(i%20), 30+(i%40));
+			break;
+		}
+		jcode = json_decode(code);
+		if(devices_update(protoname, jcode, &jupdate) == 0 && jupdate != NULL) {
+			nrrules += bench_rules(jupdate);
+		}
+		if(jupdate != NULL) {
+			json_delete(jupdate);
+			jupdate = NULL;
+		}
+		json_delete(jcode);
+	}
+	gettimeofday(&tend, NULL);
+
+	elapsed = (double)(tend.tv_sec-tstart.tv_sec)+(double)(tend.tv_usec-tstart.tv_usec)/1000000.0;
+	printf("rules:             %d\n", rules);
+	printf("events:            %d\n", nrevents);
+	printf("events/s:          %.0f\n", (double)nrevents/elapsed);
+	printf("rules evaluated:   %lu\n", nrrules);
+	printf("us per rule:       %.3f\n", (nrrules > 0) ? elapsed*1000000.0/(double)nrrules : 0.0);
+	printf("actions triggered: %lu\n", actions);
+
+	config_gc();
+	protocol_gc();
+	FREE(progname);
+	return EXIT_SUCCESS;
+}
@@ -202,8 +202,7 @@ int main(int argc, char **argv) {
 	json_delete(json);
 
 	if(socket_read(sockfd, &recvBuff, 0) == 0) {
-		if(json_validate(recvBuff) == true) {
-			json = json_decode(recvBuff);
+		if((json = json_decode(recvBuff)) != NULL) {
 			if(json_find_string(json, "message", &message) == 0) {
 				if(strcmp(message, "config") == 0) {
 					struct JsonNode *jconfig = NULL;
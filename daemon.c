@@ -18,6 +18,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
@@ -31,6 +33,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <ctype.h>
 #include <dirent.h>
 
@@ -55,6 +58,7 @@
 #include "firmware.h"
 #include "proc.h"
 #include "registry.h"
+#include "ring.h"
 
 #ifdef EVENTS
 	#include "events.h"
@@ -80,13 +84,22 @@ typedef struct clients_t {
 
 static struct clients_t *clients = NULL;
 
+/* The media a client can identify itself with */
+static const char *client_media[] = { "all", "web", "mobile", "desktop" };
+#define CLIENT_MEDIA_NUMBER (int)(sizeof(client_media)/sizeof(client_media[0]))
+
 typedef struct sendqueue_t {
 	unsigned int id;
 	char *message;
 	char *protoname;
 	char *settings;
+	/* The id values of the device this code is for */
+	struct JsonNode *jid;
 	struct protocol_t *protopt;
 	int code[MAXPULSESTREAMLENGTH];
+	int rawlen;
+	/* Codes with a higher priority are sent first */
+	int priority;
 	char uuid[UUID_LENGTH];
 	struct sendqueue_t *next;
 } sendqueue_t;
@@ -94,27 +107,67 @@ typedef struct sendqueue_t {
 static struct sendqueue_t *sendqueue;
 static struct sendqueue_t *sendqueue_head;
 
+/* Every receiving hardware module hands its frames to the receive
+   parser through a ring of its own. The first ring is used for the
+   frames queued by pilight itself (e.g. by the raw protocol). */
+typedef struct recvring_t {
+	struct hardware_t *hw;
+	struct ring_t *ring;
+} recvring_t;
+
+static struct recvring_t *recvrings = NULL;
+static int recvrings_number = 0;
+
+/* A copy of a frame shared by the receive workers */
 typedef struct recvqueue_t {
-	int raw[MAXPULSESTREAMLENGTH];
-	int rawlen;
-	int hwtype;
-	int plslen;
-	struct recvqueue_t *next;
+	struct frame_t frame;
+	/* Number of workers still decoding this frame */
+	int refs;
 } recvqueue_t;
 
-static struct recvqueue_t *recvqueue;
-static struct recvqueue_t *recvqueue_head;
+/* A frame to be decoded by a single protocol */
+typedef struct recvjob_t {
+	struct recvqueue_t *rnode;
+	struct protocol_t *protocol;
+	struct recvjob_t *next;
+} recvjob_t;
+
+/* Every protocol is always decoded by the same worker,
+   so frames reach a protocol in the order they were received */
+typedef struct recvworker_t {
+	struct recvjob_t *jobs;
+	struct recvjob_t *jobs_head;
+	int number;
+	pthread_mutex_t lock;
+	pthread_cond_t signal;
+} recvworker_t;
+
+static struct recvworker_t *recvworkers = NULL;
+static int recvworkers_number = 1;
 
 static pthread_mutex_t sendqueue_lock;
 static pthread_cond_t sendqueue_signal;
 static pthread_mutexattr_t sendqueue_attr;
 
 static int sendqueue_number = 0;
-static int recvqueue_number = 0;
 
+/* Sender statistics since they were last logged */
+static int sendqueue_watermark = 0;
+static unsigned long sendqueue_sent = 0;
+static unsigned long sendqueue_merged = 0;
+static unsigned long sendqueue_airtime = 0;
+static struct timeval sendqueue_stats;
+/* Start of the transmission in progress, if any */
+static struct timeval sendqueue_txstart;
+
+/* Number of parsed frames and the protocols visited for them */
+static unsigned long recvqueue_frames = 0;
+static unsigned long recvqueue_candidates = 0;
+
+/* Only serializes the non real-time producers of the first ring */
 static pthread_mutex_t recvqueue_lock;
-static pthread_cond_t recvqueue_signal;
-static pthread_mutexattr_t recvqueue_attr;
+/* Posted once for every frame pushed into any of the rings */
+static sem_t recvqueue_sem;
 
 typedef struct bcqueue_t {
 	JsonNode *jmessage;
@@ -125,6 +178,12 @@ typedef struct bcqueue_t {
 static struct bcqueue_t *bcqueue;
 static struct bcqueue_t *bcqueue_head;
 
+/* Queue nodes are allocated for every code sent or received */
+static struct mempool_t bcqueue_pool = MEMPOOL_INITIALIZER("bcqueue", sizeof(struct bcqueue_t));
+static struct mempool_t recvqueue_pool = MEMPOOL_INITIALIZER("recvqueue", sizeof(struct recvqueue_t));
+static struct mempool_t recvjob_pool = MEMPOOL_INITIALIZER("recvjob", sizeof(struct recvjob_t));
+static struct mempool_t sendqueue_pool = MEMPOOL_INITIALIZER("sendqueue", sizeof(struct sendqueue_t));
+
 static pthread_mutex_t bcqueue_lock;
 static pthread_cond_t bcqueue_signal;
 static pthread_mutexattr_t bcqueue_attr;
@@ -157,8 +216,6 @@ static int sockfd = 0;
 static pthread_t logpth;
 /* While loop conditions */
 static unsigned short main_loop = 1;
-/* Reset repeats after a certain amount of time */
-static struct timeval tv;
 /* Are we running standalone */
 static int standalone = 0;
 /* What is the minimum rawlenth to consider a pulse stream valid */
@@ -168,6 +225,9 @@ static int maxrawlen = 0;
 /* Do we need to connect to a master server:port? */
 static char *master_server = NULL;
 static unsigned short master_port = 0;
+/* The master configuration version this node last synced with */
+static unsigned long long master_epoch = 0;
+static unsigned long master_version = 0;
 
 struct pilight_t pilight;
 static char *configtmp = NULL;
@@ -207,24 +267,24 @@ static void client_remove(int id) {
 	}
 }
 
-static void broadcast_queue(char *protoname, JsonNode *json) {
+/* Queue a message tree for broadcasting. The queue
+   takes ownership of the tree in any case. */
+static void broadcast_queue_node(char *protoname, JsonNode *json) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	if(main_loop == 1) {
 		pthread_mutex_lock(&bcqueue_lock);
 		if(bcqueue_number <= 1024) {
-			struct bcqueue_t *bnode = MALLOC(sizeof(struct bcqueue_t));
+			struct bcqueue_t *bnode = POOL_MALLOC(&bcqueue_pool);
 			if(!bnode) {
 				logprintf(LOG_ERR, "out of memory");
 				exit(EXIT_FAILURE);
 			}
 
-			char *jstr = json_stringify(json, NULL);
-			bnode->jmessage = json_decode(jstr);
+			bnode->jmessage = json;
 			if(json_find_member(bnode->jmessage, "uuid") == NULL && strlen(pilight_uuid) > 0) {
 				json_append_member(bnode->jmessage, "uuid", json_mkstring(pilight_uuid));
 			}
-			json_free(jstr);
 
 			bnode->protoname = MALLOC(strlen(protoname)+1);
 			if(!bnode->protoname) {
@@ -244,15 +304,108 @@ static void broadcast_queue(char *protoname, JsonNode *json) {
 			bcqueue_number++;
 		} else {
 			logprintf(LOG_ERR, "broadcast queue full");
+			json_delete(json);
 		}
 		pthread_mutex_unlock(&bcqueue_lock);
 		pthread_cond_signal(&bcqueue_signal);
+	} else {
+		json_delete(json);
 	}
 }
 
+/* The caller keeps ownership of the json, so queue a copy. The
+   copy only lives until it is broadcasted so it's arena backed */
+static void broadcast_queue(char *protoname, JsonNode *json) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	char *jstr = json_stringify(json, NULL);
+	broadcast_queue_node(protoname, json_decode_arena(jstr));
+	json_free(jstr);
+}
+
+/* Serialize a devices update the way a client of a specific media
+   sees it. The devices not shown on that media are temporarily taken
+   out of the tree instead of working on a decoded copy per client. */
+static char *broadcast_config_view(JsonNode *jret, const char *media) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct JsonNode *jdevices = json_find_member(jret, "devices");
+	struct JsonNode *jchilds = NULL;
+	struct JsonNode **nodes = NULL;
+	struct gui_values_t *gui_values = NULL;
+	char *conf = NULL;
+	int nrnodes = 0, i = 0;
+	unsigned short match1 = 0, match2 = 0;
+
+	if(jdevices == NULL) {
+		return NULL;
+	}
+
+	jchilds = json_first_child(jdevices);
+	while(jchilds) {
+		nrnodes++;
+		jchilds = jchilds->next;
+	}
+	if(nrnodes == 0) {
+		return NULL;
+	}
+	if(!(nodes = MALLOC(sizeof(struct JsonNode *)*(size_t)nrnodes))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	i = 0;
+	while((jchilds = json_first_child(jdevices)) != NULL) {
+		json_remove_from_parent(jchilds);
+		nodes[i++] = jchilds;
+	}
+
+	for(i=0;i<nrnodes;i++) {
+		match2 = 0;
+		if(nodes[i]->tag == JSON_STRING) {
+			if((gui_values = gui_media(nodes[i]->string_)) != NULL) {
+				while(gui_values) {
+					if(gui_values->type == JSON_STRING) {
+						if(strcmp(gui_values->string_, media) == 0 ||
+							 strcmp(gui_values->string_, "all") == 0 ||
+							 strcmp(media, "all") == 0) {
+								match2 = 1;
+						}
+					}
+					gui_values = gui_values->next;
+				}
+			} else {
+				match2 = 1;
+			}
+		}
+		if(match2 == 1) {
+			match1 = 1;
+			json_append_element(jdevices, nodes[i]);
+		}
+	}
+
+	if(match1 == 1) {
+		conf = json_stringify(jret, NULL);
+	}
+
+	/* Restore the full devices list */
+	while((jchilds = json_first_child(jdevices)) != NULL) {
+		json_remove_from_parent(jchilds);
+	}
+	for(i=0;i<nrnodes;i++) {
+		json_append_element(jdevices, nodes[i]);
+	}
+	FREE(nodes);
+
+	return conf;
+}
+
 void *broadcast(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	/* Output buffers reused for every broadcasted message */
+	JsonBuffer bcout = JSON_BUFFER_INITIALIZER;
+	JsonBuffer bcfwd = JSON_BUFFER_INITIALIZER;
 	int broadcasted = 0;
 
 	pthread_mutex_lock(&bcqueue_lock);
@@ -270,7 +423,7 @@ void *broadcast(void *param) {
 				if(strcmp(origin, "core") == 0) {
 					double tmp = 0;
 					json_find_number(bcqueue->jmessage, "type", &tmp);
-					char *conf = json_stringify(bcqueue->jmessage, NULL);
+					char *conf = json_stringify_buffer(&bcout, bcqueue->jmessage, NULL);
 					struct clients_t *tmp_clients = clients;
 					while(tmp_clients) {
 						if(((int)tmp < 0 && tmp_clients->core == 1) ||
@@ -282,90 +435,81 @@ void *broadcast(void *param) {
 						tmp_clients = tmp_clients->next;
 					}
 					if(pilight.runmode == ADHOC && sockfd > 0) {
-						struct JsonNode *jupdate = json_decode(conf);
-						json_append_member(jupdate, "action", json_mkstring("update"));
-						char *ret = json_stringify(jupdate, NULL);
+						json_append_member(bcqueue->jmessage, "action", json_mkstring("update"));
+						char *ret = json_stringify_buffer(&bcfwd, bcqueue->jmessage, NULL);
 						socket_write(sockfd, ret);
 						broadcasted = 1;
-						json_delete(jupdate);
-						json_free(ret);
 					}
 					if(broadcasted == 1) {
 						logprintf(LOG_DEBUG, "broadcasted: %s", conf);
 					}
-					json_free(conf);
 				} else {
 					/* Update the config */
 					if(devices_update(bcqueue->protoname, bcqueue->jmessage, &jret) == 0) {
-						char *tmp = json_stringify(jret, NULL);
+						config_journal(jret);
+
 						struct clients_t *tmp_clients = clients;
-						unsigned short match1 = 0, match2 = 0;
+						/* Every media view is only rendered once and the same
+						   buffer is written to all clients sharing that media */
+						char *views[CLIENT_MEDIA_NUMBER];
+						unsigned short rendered[CLIENT_MEDIA_NUMBER];
+						int m = 0;
+
+						for(m=0;m<CLIENT_MEDIA_NUMBER;m++) {
+							views[m] = NULL;
+							rendered[m] = 0;
+						}
 
 						while(tmp_clients) {
 							if(tmp_clients->config == 1) {
-								struct JsonNode *jtmp = json_decode(tmp);
-								struct JsonNode *jdevices = json_find_member(jtmp, "devices");
-								if(jdevices != NULL) {
-									match1 = 0;
-									struct JsonNode *jchilds = json_first_child(jdevices);
-									struct gui_values_t *gui_values = NULL;
-									while(jchilds) {
-										match2 = 0;
-										if(jchilds->tag == JSON_STRING) {
-											if((gui_values = gui_media(jchilds->string_)) != NULL) {
-												while(gui_values) {
-													if(gui_values->type == JSON_STRING) {
-														if(strcmp(gui_values->string_, tmp_clients->media) == 0 ||
-															 strcmp(gui_values->string_, "all") == 0 ||
-															 strcmp(tmp_clients->media, "all") == 0) {
-																match1 = 1;
-																match2 = 1;
-														}
-													}
-													gui_values = gui_values->next;
-												}
-											} else {
-												match1 = 1;
-												match2 = 1;
-											}
-										}
-										if(match2 == 0) {
-											json_remove_from_parent(jchilds);
-										}
-										struct JsonNode *jtmp1 = jchilds;
-										jchilds = jchilds->next;
-										if(match2 == 0) {
-											json_delete(jtmp1);
-										}
+								for(m=0;m<CLIENT_MEDIA_NUMBER;m++) {
+									if(strcmp(client_media[m], tmp_clients->media) == 0) {
+										break;
 									}
 								}
-								if(match1 == 1) {
-									char *conf = json_stringify(jtmp, NULL);
-									socket_write(tmp_clients->id, conf);
-									logprintf(LOG_DEBUG, "broadcasted: %s", conf);
-									json_free(conf);
+								if(m < CLIENT_MEDIA_NUMBER) {
+									if(rendered[m] == 0) {
+										views[m] = broadcast_config_view(jret, client_media[m]);
+										rendered[m] = 1;
+									}
+									if(views[m] != NULL) {
+										socket_write(tmp_clients->id, views[m]);
+										logprintf(LOG_DEBUG, "broadcasted: %s", views[m]);
+									}
 								}
-								json_delete(jtmp);
 							}
 							tmp_clients = tmp_clients->next;
 						}
 
-						json_free(tmp);
+						for(m=0;m<CLIENT_MEDIA_NUMBER;m++) {
+							if(views[m] != NULL) {
+								json_free(views[m]);
+							}
+						}
 						json_delete(jret);
 					}
 
 					/* The settings objects inside the broadcast queue is only of interest for the
-					   internal pilight functions. For the outside world we only communicate the
-					   message part of the queue so we remove the settings */
-					char *jinternal = json_stringify(bcqueue->jmessage, NULL);
+					   internal pilight functions, so the master does get them */
+					if(pilight.runmode == ADHOC && sockfd > 0) {
+						struct JsonNode *jaction = json_mkstring("update");
+						json_append_member(bcqueue->jmessage, "action", jaction);
+						char *jinternal = json_stringify_buffer(&bcfwd, bcqueue->jmessage, NULL);
+						socket_write(sockfd, jinternal);
+						broadcasted = 1;
+						json_remove_from_parent(jaction);
+						json_delete(jaction);
+					}
 
+					/* For the outside world we only communicate the
+					   message part of the queue so we remove the settings */
 					JsonNode *jsettings = NULL;
 					if((jsettings = json_find_member(bcqueue->jmessage, "settings"))) {
 						json_remove_from_parent(jsettings);
 						json_delete(jsettings);
 					}
 
-					char *jbroadcast = json_stringify(bcqueue->jmessage, NULL);
+					char *jbroadcast = json_stringify_buffer(&bcout, bcqueue->jmessage, NULL);
 					if(strcmp(bcqueue->protoname, "pilight_firmware") == 0) {
 						struct JsonNode *code = NULL;
 						if((code = json_find_member(bcqueue->jmessage, "message")) != NULL) {
@@ -393,8 +537,6 @@ void *broadcast(void *param) {
 							}
 						}
 					}
-					broadcasted = 0;
-
 					struct JsonNode *childs = json_first_child(bcqueue->jmessage);
 					int nrchilds = 0;
 					while(childs) {
@@ -414,243 +556,380 @@ void *broadcast(void *param) {
 						tmp_clients = tmp_clients->next;
 					}
 
-					if(pilight.runmode == ADHOC && sockfd > 0) {
-						struct JsonNode *jupdate = json_decode(jinternal);
-						json_append_member(jupdate, "action", json_mkstring("update"));
-						char *ret = json_stringify(jupdate, NULL);
-						socket_write(sockfd, ret);
-						broadcasted = 1;
-						json_delete(jupdate);
-						json_free(ret);
-					}
 					if((broadcasted == 1 || nodaemon == 1) && (strcmp(jbroadcast, "{}") != 0 && nrchilds > 1)) {
 						logprintf(LOG_DEBUG, "broadcasted: %s", jbroadcast);
 					}
-					json_free(jinternal);
-					json_free(jbroadcast);
 				}
 			}
 			struct bcqueue_t *tmp = bcqueue;
 			FREE(tmp->protoname);
 			json_delete(tmp->jmessage);
 			bcqueue = bcqueue->next;
-			FREE(tmp);
+			POOL_FREE(tmp);
 			bcqueue_number--;
 			pthread_mutex_unlock(&bcqueue_lock);
 		} else {
 			pthread_cond_wait(&bcqueue_signal, &bcqueue_lock);
 		}
 	}
+	json_buffer_free(&bcout);
+	json_buffer_free(&bcfwd);
 	return (void *)NULL;
 }
 
 static void receive_queue(int *raw, int rawlen, int plslen, int hwtype) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	int i = 0;
+	int x = 0;
 
-	if(main_loop == 1) {
+	if(main_loop == 1 && recvrings != NULL) {
 		pthread_mutex_lock(&recvqueue_lock);
-		if(recvqueue_number <= 1024) {
-			struct recvqueue_t *rnode = MALLOC(sizeof(struct recvqueue_t));
-			if(!rnode) {
-				logprintf(LOG_ERR, "out of memory");
-				exit(EXIT_FAILURE);
-			}
-			for(i=0;i<rawlen;i++) {
-				rnode->raw[i] = raw[i];
-			}
-			rnode->rawlen = rawlen;
-			rnode->plslen = plslen;
-			rnode->hwtype = hwtype;
-
-			if(recvqueue_number == 0) {
-				recvqueue = rnode;
-				recvqueue_head = rnode;
-			} else {
-				recvqueue_head->next = rnode;
-				recvqueue_head = rnode;
-			}
-
-			recvqueue_number++;
+		x = ring_push(recvrings[0].ring, raw, rawlen, plslen, hwtype);
+		pthread_mutex_unlock(&recvqueue_lock);
+		if(x == 0) {
+			sem_post(&recvqueue_sem);
 		} else {
 			logprintf(LOG_ERR, "receiver queue full");
 		}
-		pthread_mutex_unlock(&recvqueue_lock);
-		pthread_cond_signal(&recvqueue_signal);
 	}
 }
 
-static void receiver_create_message(protocol_t *protocol) {
+static void receive_rings_init(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	if(protocol->message != NULL) {
-		char *valid = json_stringify(protocol->message, NULL);
-		json_delete(protocol->message);
-		if(valid != NULL && json_validate(valid) == true) {
-			JsonNode *jmessage = json_mkobject();
-
-			json_append_member(jmessage, "message", json_decode(valid));
-			json_append_member(jmessage, "origin", json_mkstring("receiver"));
-			json_append_member(jmessage, "protocol", json_mkstring(protocol->id));
-			if(strlen(pilight_uuid) > 0) {
-				json_append_member(jmessage, "uuid", json_mkstring(pilight_uuid));
-			}
-			if(protocol->repeats > -1) {
-				json_append_member(jmessage, "repeats", json_mknumber(protocol->repeats, 0));
-			}
-			char *output = json_stringify(jmessage, NULL);
-			JsonNode *json = json_decode(output);
-			broadcast_queue(protocol->id, json);
-			json_free(output);
-			json_delete(json);
-			json = NULL;
-			json_delete(jmessage);
-		}	
-		json_free(valid);
+	struct conf_hardware_t *tmp_confhw = conf_hardware;
+	int i = 1;
+
+	recvrings_number = 1;
+	while(tmp_confhw) {
+		recvrings_number++;
+		tmp_confhw = tmp_confhw->next;
+	}
+	if(!(recvrings = MALLOC(sizeof(struct recvring_t)*(size_t)recvrings_number))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	recvrings[0].hw = NULL;
+	recvrings[0].ring = ring_init(RECEIVE_QUEUE_SIZE);
+
+	tmp_confhw = conf_hardware;
+	while(tmp_confhw) {
+		recvrings[i].hw = tmp_confhw->hardware;
+		recvrings[i].ring = ring_init(RECEIVE_QUEUE_SIZE);
+		tmp_confhw = tmp_confhw->next;
+		i++;
 	}
-	protocol->message = NULL;
 }
 
-void *receive_parse_code(void *param) {
+static void receive_rings_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	pthread_mutex_lock(&recvqueue_lock);
-	while(main_loop) {
-		if(recvqueue_number > 0) {
-			pthread_mutex_lock(&recvqueue_lock);
+	int i = 0;
 
-			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
+	if(recvrings == NULL) {
+		return;
+	}
+	for(i=0;i<recvrings_number;i++) {
+		ring_gc(recvrings[i].ring);
+	}
+	FREE(recvrings);
+	recvrings_number = 0;
+}
 
-			struct protocol_t *protocol = NULL;
-			struct protocols_t *pnode = protocols;
-			struct protocol_plslen_t *plslengths = NULL;
-			int x = 0, match = 0;
+static void receive_rings_stats(void) {
+	struct ring_t *ring = NULL;
+	int i = 0;
 
-			while(pnode && main_loop) {
-				protocol = pnode->listener;
-				match = 0;
+	for(i=0;i<recvrings_number;i++) {
+		ring = recvrings[i].ring;
+		if(ring->pushed > 0 || ring->dropped > 0) {
+			logprintf(LOG_DEBUG, "- receiver %s: %lu frames, %lu dropped, high watermark %u/%u",
+			          (recvrings[i].hw == NULL) ? "pilight" : recvrings[i].hw->id,
+			          ring->pushed, ring->dropped, ring->watermark, ring->size);
+		}
+	}
+}
 
-				if((protocol->hwtype == recvqueue->hwtype || protocol->hwtype == -1 || recvqueue->hwtype == -1) &&
-				   ((((protocol->parseRaw || protocol->parseCode) &&
-					  (protocol->rawlen > 0 || (protocol->minrawlen > 0 && protocol->maxrawlen > 0)))
-					   || protocol->parseBinary) && protocol->pulse > 0 && protocol->plslen)) {
-					plslengths = protocol->plslen;
-					while(plslengths && main_loop) {
-						if((recvqueue->plslen >= ((double)plslengths->length-5) &&
-						    recvqueue->plslen <= ((double)plslengths->length+5))) {
-							match = 1;
-							break;
-						}
-						plslengths = plslengths->next;
-					}
-					if((recvqueue->rawlen == protocol->rawlen || (
-					   (protocol->minrawlen > 0 && protocol->maxrawlen > 0 &&
-					    (recvqueue->rawlen >= protocol->minrawlen && recvqueue->rawlen <= protocol->maxrawlen))))
-					    && match == 1) {
-						for(x=0;x<(int)recvqueue->rawlen;x++) {
-							if(x < MAXPULSESTREAMLENGTH) {
-								memcpy(&protocol->raw[x], &recvqueue->raw[x], sizeof(int));
-							}
-						}
-						if(protocol->parseRaw) {
-							logprintf(LOG_DEBUG, "recevied pulse length of %d", recvqueue->plslen);
-							logprintf(LOG_DEBUG, "called %s parseRaw()", protocol->id);
-							protocol->parseRaw();
-							protocol->repeats = -1;
-							receiver_create_message(protocol);
-						}
+static void receive_stats(JsonNode *code) {
+	JsonNode *jreceiver = json_mkobject();
+	unsigned long frames = recvqueue_frames;
+	unsigned long candidates = recvqueue_candidates;
 
-						/* Convert the raw codes to one's and zero's */
-						for(x=0;x<recvqueue->rawlen;x++) {
-							protocol->pCode[x] = protocol->code[x];
+	if(frames > 0) {
+		logprintf(LOG_DEBUG, "receiver: %lu frames, %.2f protocols visited per frame",
+		          frames, (double)candidates/(double)frames);
+	}
+	json_append_member(jreceiver, "frames", json_mknumber((double)frames, 0));
+	json_append_member(jreceiver, "candidates", json_mknumber((double)candidates, 0));
+	json_append_member(code, "receiver", jreceiver);
+}
 
-							if(protocol->raw[x] >= (plslengths->length * (1+protocol->pulse)/2)) {
-								protocol->code[x] = 1;
-							} else {
-								protocol->code[x] = 0;
-							}
-							/* Check if the current code matches the previous one */
-							// if(protocol->pCode[x] != protocol->code[x]) {
-								// protocol->repeats = 0;
-								// protocol->first = 0;
-								// protocol->second = 0;
-							// }
-						}
+static void mempool_stats(JsonNode *code) {
+	struct mempool_t *pool = mempool_list();
+	JsonNode *jpools = json_mkobject();
+
+	while(pool) {
+		JsonNode *jpool = json_mkobject();
+		pthread_mutex_lock(&pool->lock);
+		logprintf(LOG_DEBUG, "- pool %s: %lu used, high watermark %lu, %lu slabs",
+		          pool->name, pool->used, pool->peak, pool->slabs);
+		json_append_member(jpool, "used", json_mknumber((double)pool->used, 0));
+		json_append_member(jpool, "peak", json_mknumber((double)pool->peak, 0));
+		json_append_member(jpool, "slabs", json_mknumber((double)pool->slabs, 0));
+		json_append_member(jpool, "bytes", json_mknumber((double)(pool->slabs*MEMPOOL_SLAB_SIZE), 0));
+		pthread_mutex_unlock(&pool->lock);
+		json_append_member(jpools, pool->name, jpool);
+		pool = pool->next;
+	}
+	json_append_member(code, "pools", jpools);
+}
 
-						gettimeofday(&tv, NULL);
-						if(protocol->first > 0) {
-							protocol->first = protocol->second;
-						}
-						protocol->second = 1000000 * (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
-						if(protocol->first == 0) {
-							protocol->first = protocol->second;
-						}
+static void receiver_create_message(protocol_t *protocol, struct decode_ctx_t *ctx) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-						/* Reset # of repeats after a certain delay */
-						if(((int)protocol->second-(int)protocol->first) > 500000) {
-							protocol->repeats = 0;
-						}
+	/* The decoded message is moved into the broadcast
+	   message as is, so it's never serialized here */
+	if(ctx->message != NULL) {
+		JsonNode *jmessage = json_mkobject();
 
-						protocol->repeats++;
-						/* Continue if we have recognized enough repeated codes */
-						if(protocol->repeats >= (receive_repeat*protocol->rxrpt) ||
-						   strcmp(protocol->id, "pilight_firmware") == 0) {
-							if(protocol->parseCode) {
-								logprintf(LOG_DEBUG, "caught minimum # of repeats %d of %s", protocol->repeats, protocol->id);
-								logprintf(LOG_DEBUG, "called %s parseCode()", protocol->id);
-								protocol->parseCode();
-								receiver_create_message(protocol);
-							}
+		json_append_member(jmessage, "message", ctx->message);
+		json_append_member(jmessage, "origin", json_mkstring("receiver"));
+		json_append_member(jmessage, "protocol", json_mkstring(protocol->id));
+		if(strlen(pilight_uuid) > 0) {
+			json_append_member(jmessage, "uuid", json_mkstring(pilight_uuid));
+		}
+		if(ctx->repeats > -1) {
+			json_append_member(jmessage, "repeats", json_mknumber(ctx->repeats, 0));
+		}
+		broadcast_queue_node(protocol->id, jmessage);
+	}
+	ctx->message = NULL;
+}
 
-							if(protocol->parseBinary) {
-								/* Convert the one's and zero's into binary */
-								for(x=0; x<(int)recvqueue->rawlen; x+=4) {
-									if(protocol->code[x+protocol->lsb] == 1) {
-										protocol->binary[x/4] = 1;
-									} else {
-										protocol->binary[x/4] = 0;
-									}
-								}
+static void receive_frame_release(struct recvqueue_t *rnode) {
+	if(__sync_sub_and_fetch(&rnode->refs, 1) == 0) {
+		POOL_FREE(rnode);
+	}
+}
 
-								if((double)protocol->raw[1]/((plslengths->length * (1+protocol->pulse)/2)) < 2.1) {
-									x -= 4;
-								}
+static struct recvworker_t *receive_worker_get(struct protocol_t *protocol) {
+	uintptr_t hash = ((uintptr_t)protocol >> 4) * 2654435761u;
+	return &recvworkers[(hash >> 8) % (uintptr_t)recvworkers_number];
+}
 
-								/* Check if the binary matches the binary length */
-								if(((protocol->binlen > 0) && ((x/4) == protocol->binlen)) ||
-								   ((protocol->binlen == 0) && ((x == protocol->rawlen) ||
-																(x == protocol->minrawlen) ||
-																(x == protocol->maxrawlen)))) {
-									logprintf(LOG_DEBUG, "called %s parseBinary()", protocol->id);
+static void receive_worker_queue(struct recvqueue_t *rnode, struct protocol_t *protocol) {
+	struct recvworker_t *worker = receive_worker_get(protocol);
+	struct recvjob_t *job = POOL_MALLOC(&recvjob_pool);
+	if(!job) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	__sync_add_and_fetch(&rnode->refs, 1);
+	job->rnode = rnode;
+	job->protocol = protocol;
+	job->next = NULL;
 
-									protocol->parseBinary();
-									receiver_create_message(protocol);
-								}
-							}
-						}
-					}
+	pthread_mutex_lock(&worker->lock);
+	if(worker->number == 0) {
+		worker->jobs = job;
+		worker->jobs_head = job;
+	} else {
+		worker->jobs_head->next = job;
+		worker->jobs_head = job;
+	}
+	worker->number++;
+	pthread_mutex_unlock(&worker->lock);
+	pthread_cond_signal(&worker->signal);
+}
+
+void *receive_worker(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct recvworker_t *worker = (struct recvworker_t *)param;
+	struct recvjob_t *job = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	while(main_loop) {
+		if(worker->number > 0) {
+			job = worker->jobs;
+			worker->jobs = worker->jobs->next;
+			worker->number--;
+			pthread_mutex_unlock(&worker->lock);
+
+			protocol_decode(job->protocol, &job->rnode->frame, receive_repeat, &receiver_create_message);
+			receive_frame_release(job->rnode);
+			POOL_FREE(job);
+
+			pthread_mutex_lock(&worker->lock);
+		} else {
+			pthread_cond_wait(&worker->signal, &worker->lock);
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return (void *)NULL;
+}
+
+static void receive_workers_init(void) {
+	int i = 0;
+
+	if(settings_find_number("receive-workers", &recvworkers_number) != 0) {
+		recvworkers_number = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(recvworkers_number < 1) {
+		recvworkers_number = 1;
+	}
+	/* A single worker decodes inside the receive parser itself */
+	if(recvworkers_number == 1) {
+		return;
+	}
+
+	if(!(recvworkers = MALLOC(sizeof(struct recvworker_t)*(size_t)recvworkers_number))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	for(i=0;i<recvworkers_number;i++) {
+		recvworkers[i].jobs = NULL;
+		recvworkers[i].jobs_head = NULL;
+		recvworkers[i].number = 0;
+		pthread_mutex_init(&recvworkers[i].lock, NULL);
+		pthread_cond_init(&recvworkers[i].signal, NULL);
+		threads_register("receive worker", &receive_worker, (void *)&recvworkers[i], 0);
+	}
+	logprintf(LOG_DEBUG, "started %d receive workers", recvworkers_number);
+}
+
+static void receive_workers_gc(void) {
+	struct recvjob_t *job = NULL;
+	int i = 0;
+
+	if(recvworkers == NULL) {
+		return;
+	}
+	/* Join all workers before their queues are drained */
+	for(i=0;i<recvworkers_number;i++) {
+		pthread_mutex_lock(&recvworkers[i].lock);
+		pthread_cond_signal(&recvworkers[i].signal);
+		pthread_mutex_unlock(&recvworkers[i].lock);
+		thread_stop("receive worker");
+	}
+	for(i=0;i<recvworkers_number;i++) {
+		while(recvworkers[i].number > 0) {
+			job = recvworkers[i].jobs;
+			recvworkers[i].jobs = recvworkers[i].jobs->next;
+			recvworkers[i].number--;
+			receive_frame_release(job->rnode);
+			POOL_FREE(job);
+		}
+	}
+	FREE(recvworkers);
+	recvworkers_number = 1;
+}
+
+static void receive_parse_frame(struct frame_t *frame) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	/* Only visit the protocols that can match this hardware type, footer and length */
+	struct protocols_t *pnode = protocol_index_get(frame->hwtype, frame->plslen, frame->rawlen);
+	struct recvqueue_t *rnode = NULL;
+	int visited = 0;
+
+	while(pnode && main_loop) {
+		visited++;
+		if(recvworkers == NULL) {
+			protocol_decode(pnode->listener, frame, receive_repeat, &receiver_create_message);
+		} else if(protocol_match(pnode->listener, frame) != NULL) {
+			/* The ring slot is reused as soon as we return, so the
+			   workers get a copy. The parser holds a reference on it
+			   until all jobs are queued. */
+			if(rnode == NULL) {
+				if(!(rnode = POOL_MALLOC(&recvqueue_pool))) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
 				}
-				pnode = pnode->next;
+				memcpy(rnode->frame.raw, frame->raw, sizeof(int)*(size_t)frame->rawlen);
+				rnode->frame.rawlen = frame->rawlen;
+				rnode->frame.plslen = frame->plslen;
+				rnode->frame.hwtype = frame->hwtype;
+				rnode->refs = 1;
 			}
+			receive_worker_queue(rnode, pnode->listener);
+		}
+		pnode = pnode->next;
+	}
 
-			struct recvqueue_t *tmp = recvqueue;
-			recvqueue = recvqueue->next;
-			FREE(tmp);
-			recvqueue_number--;
-			pthread_mutex_unlock(&recvqueue_lock);
-		} else {
-			pthread_cond_wait(&recvqueue_signal, &recvqueue_lock);
+	recvqueue_frames++;
+	recvqueue_candidates += (unsigned long)visited;
+
+	if(rnode != NULL) {
+		receive_frame_release(rnode);
+	}
+}
+
+void *receive_parse_code(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct frame_t *frame = NULL;
+	int i = 0, x = 0, next = 0;
+
+	while(main_loop) {
+		if(sem_wait(&recvqueue_sem) != 0) {
+			continue;
+		}
+
+		/* Serve the rings round robin so a single busy
+		   receiver can't starve the others */
+		frame = NULL;
+		for(i=0;i<recvrings_number;i++) {
+			x = (next+i)%recvrings_number;
+			if((frame = ring_peek(recvrings[x].ring)) != NULL) {
+				break;
+			}
+		}
+		if(frame == NULL) {
+			continue;
 		}
+		next = x+1;
+
+		receive_parse_frame(frame);
+		ring_pop(recvrings[x].ring);
 	}
 	return (void *)NULL;
 }
 
+static void send_queue_stats(void) {
+	struct timeval tcurrent;
+	double elapsed = 0.0;
+
+	pthread_mutex_lock(&sendqueue_lock);
+	gettimeofday(&tcurrent, NULL);
+	/* Only count the part of a running transmission that fell in this period */
+	if(sendqueue_txstart.tv_sec > 0) {
+		sendqueue_airtime += (unsigned long)((tcurrent.tv_sec-sendqueue_txstart.tv_sec)*1000000+(tcurrent.tv_usec-sendqueue_txstart.tv_usec));
+		sendqueue_txstart = tcurrent;
+	}
+	if(sendqueue_stats.tv_sec > 0) {
+		elapsed = (double)(tcurrent.tv_sec-sendqueue_stats.tv_sec)*1000000.0+(double)(tcurrent.tv_usec-sendqueue_stats.tv_usec);
+	}
+	if(elapsed > 0 && (sendqueue_sent > 0 || sendqueue_merged > 0)) {
+		logprintf(LOG_DEBUG, "sender: %d codes queued, high watermark %d, %lu sent, %lu merged, %.2f%% air time",
+		          sendqueue_number, sendqueue_watermark, sendqueue_sent, sendqueue_merged,
+		          ((double)sendqueue_airtime/elapsed)*100.0);
+	}
+	sendqueue_stats = tcurrent;
+	sendqueue_airtime = 0;
+	sendqueue_sent = 0;
+	sendqueue_merged = 0;
+	sendqueue_watermark = sendqueue_number;
+	pthread_mutex_unlock(&sendqueue_lock);
+}
+
 void *send_code(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	int i = 0;
 	struct sched_param sched;
+	struct sendqueue_t *node = NULL;
+	struct timeval tend;
 
 	/* Make sure the pilight sender gets
 	   the highest priority available */
@@ -662,37 +941,42 @@ void *send_code(void *param) {
 
 	while(main_loop) {
 		if(sendqueue_number > 0) {
-			pthread_mutex_lock(&sendqueue_lock);
-
 			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
 
+			/* Take the code off the queue, so new codes can
+			   be queued and merged while this one is sent */
+			node = sendqueue;
+			sendqueue = sendqueue->next;
+			sendqueue_number--;
 			sending = 1;
+			pthread_mutex_unlock(&sendqueue_lock);
 
-			struct protocol_t *protocol = sendqueue->protopt;
+			struct protocol_t *protocol = node->protopt;
 			struct hardware_t *hw = NULL;
 
 			JsonNode *message = NULL;
+			JsonNode *jdecoded = NULL;
 
-			if(sendqueue->message != NULL && strcmp(sendqueue->message, "{}") != 0) {
-				if(json_validate(sendqueue->message) == true) {
+			if(node->message != NULL && strcmp(node->message, "{}") != 0) {
+				if((jdecoded = json_decode(node->message)) != NULL) {
 					if(!message) {
 						message = json_mkobject();
 					}
 					json_append_member(message, "origin", json_mkstring("sender"));
 					json_append_member(message, "protocol", json_mkstring(protocol->id));
-					json_append_member(message, "message", json_decode(sendqueue->message));
-					if(strlen(sendqueue->uuid) > 0) {
-						json_append_member(message, "uuid", json_mkstring(sendqueue->uuid));
+					json_append_member(message, "message", jdecoded);
+					if(strlen(node->uuid) > 0) {
+						json_append_member(message, "uuid", json_mkstring(node->uuid));
 					}
 					json_append_member(message, "repeat", json_mknumber(1, 0));
 				}
 			}
-			if(sendqueue->settings && strcmp(sendqueue->settings, "{}") != 0) {
-				if(json_validate(sendqueue->settings) == true) {
+			if(node->settings && strcmp(node->settings, "{}") != 0) {
+				if((jdecoded = json_decode(node->settings)) != NULL) {
 					if(!message) {
 						message = json_mkobject();
 					}
-					json_append_member(message, "settings", json_decode(sendqueue->settings));
+					json_append_member(message, "settings", jdecoded);
 				}
 			}
 
@@ -713,21 +997,25 @@ void *send_code(void *param) {
 				}
 				logprintf(LOG_DEBUG, "**** RAW CODE ****");
 				if(log_level_get() >= LOG_DEBUG) {
-					for(i=0;i<protocol->rawlen;i++) {
-						printf("%d ", protocol->raw[i]);
+					for(i=0;i<node->rawlen;i++) {
+						printf("%d ", node->code[i]);
 					}
 					printf("\n");
 				}
 				logprintf(LOG_DEBUG, "**** RAW CODE ****");
 
-				if(hw->send(sendqueue->code, protocol->rawlen, send_repeat*protocol->txrpt) == 0) {
+				pthread_mutex_lock(&sendqueue_lock);
+				gettimeofday(&sendqueue_txstart, NULL);
+				pthread_mutex_unlock(&sendqueue_lock);
+
+				if(hw->send(node->code, node->rawlen, send_repeat*protocol->txrpt) == 0) {
 					logprintf(LOG_DEBUG, "successfully send %s code", protocol->id);
 				} else {
 					logprintf(LOG_ERR, "failed to send code");
 				}
 				if(strcmp(protocol->id, "raw") == 0) {
-					int plslen = protocol->raw[protocol->rawlen-1]/PULSE_DIV;
-					receive_queue(protocol->raw, protocol->rawlen, plslen, -1);
+					int plslen = node->code[node->rawlen-1]/PULSE_DIV;
+					receive_queue(node->code, node->rawlen, plslen, -1);
 				}
 				if(hw->receive) {
 					hw->wait = 0;
@@ -736,42 +1024,157 @@ void *send_code(void *param) {
 				}
 			} else {
 				if(strcmp(protocol->id, "raw") == 0) {
-					int plslen = protocol->raw[protocol->rawlen-1]/PULSE_DIV;
-					receive_queue(protocol->raw, protocol->rawlen, plslen, -1);
+					int plslen = node->code[node->rawlen-1]/PULSE_DIV;
+					receive_queue(node->code, node->rawlen, plslen, -1);
 				}
 			}
 
 			if(message) {
-				broadcast_queue(sendqueue->protoname, message);
+				broadcast_queue(node->protoname, message);
 				json_delete(message);
 				message = NULL;
 			}
 
-			struct sendqueue_t *tmp = sendqueue;
-			if(tmp->message) {
-				FREE(tmp->message);
+			if(node->message) {
+				FREE(node->message);
 			}
-			if(tmp->settings) {
-				FREE(tmp->settings);
+			if(node->settings) {
+				FREE(node->settings);
+			}
+			json_delete(node->jid);
+			FREE(node->protoname);
+			POOL_FREE(node);
+
+			pthread_mutex_lock(&sendqueue_lock);
+			sendqueue_sent++;
+			if(sendqueue_txstart.tv_sec > 0) {
+				gettimeofday(&tend, NULL);
+				sendqueue_airtime += (unsigned long)((tend.tv_sec-sendqueue_txstart.tv_sec)*1000000+(tend.tv_usec-sendqueue_txstart.tv_usec));
+				sendqueue_txstart.tv_sec = 0;
+			}
+
+			/* Give the receiver a chance to listen before the next code.
+			   Codes queued in the meantime are still merged and ordered. */
+			if(sendqueue_number > 0 && hw && hw->receive && main_loop) {
+				pthread_mutex_unlock(&sendqueue_lock);
+				usleep(SEND_RECEIVE_WINDOW*1000);
+				pthread_mutex_lock(&sendqueue_lock);
 			}
-			FREE(tmp->protoname);
-			sendqueue = sendqueue->next;
-			FREE(tmp);
-			sendqueue_number--;
 			sending = 0;
-			pthread_mutex_unlock(&sendqueue_lock);
 		} else {
 			pthread_cond_wait(&sendqueue_signal, &sendqueue_lock);
 		}
 	}
+	pthread_mutex_unlock(&sendqueue_lock);
 	return (void *)NULL;
 }
+/* Codes for the same device, an id value only one of them has
+   matches any value, so e.g. an all code covers every unit */
+static int send_queue_device(struct sendqueue_t *a, struct sendqueue_t *b) {
+	struct JsonNode *jchilds = NULL;
+	char *value = NULL;
+
+	if(a->protopt != b->protopt) {
+		return 0;
+	}
+	jchilds = json_first_child(a->jid);
+	while(jchilds) {
+		if(json_find_string(b->jid, jchilds->key, &value) == 0 && strcmp(jchilds->string_, value) != 0) {
+			return 0;
+		}
+		jchilds = jchilds->next;
+	}
+	return 1;
+}
+
+static int send_queue_identical(struct sendqueue_t *a, struct sendqueue_t *b) {
+	return (a->protopt == b->protopt && a->rawlen == b->rawlen &&
+	   strcmp(a->uuid, b->uuid) == 0 &&
+	   memcmp(a->code, b->code, sizeof(int)*(size_t)b->rawlen) == 0 &&
+	   ((a->message == NULL && b->message == NULL) ||
+	    (a->message != NULL && b->message != NULL && strcmp(a->message, b->message) == 0)) &&
+	   strcmp(a->settings, b->settings) == 0);
+}
+
+/* A new code is merged with the last queued code for the same
+   device when they are identical, so the device ends in the same
+   state as when both were sent. Other codes are queued behind those
+   with the same or a higher priority. A merged code with a higher
+   priority is moved forward, unless that would move it past another
+   code for the same device, then the new code is queued instead. */
+static void send_queue_insert(struct sendqueue_t *mnode) {
+	struct sendqueue_t *tmp = sendqueue, *prev = NULL;
+	struct sendqueue_t *last = NULL, *lastprev = NULL;
+	int nrdevice = 0;
+
+	while(tmp) {
+		if(send_queue_device(tmp, mnode) == 1) {
+			last = tmp;
+			lastprev = prev;
+			nrdevice++;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+
+	if(last != NULL && send_queue_identical(last, mnode) == 1 &&
+	   (mnode->priority <= last->priority || nrdevice == 1)) {
+		logprintf(LOG_DEBUG, "merged %s code with an identical queued code", mnode->protoname);
+		if(mnode->priority > last->priority) {
+			/* Move it forward as if it was queued with the new priority */
+			last->priority = mnode->priority;
+			if(lastprev != NULL) {
+				lastprev->next = last->next;
+				if(sendqueue_head == last) {
+					sendqueue_head = lastprev;
+				}
+				sendqueue_number--;
+				last->next = NULL;
+				send_queue_insert(last);
+			}
+		}
+		sendqueue_merged++;
+		if(mnode->message) {
+			FREE(mnode->message);
+		}
+		json_delete(mnode->jid);
+		FREE(mnode->settings);
+		FREE(mnode->protoname);
+		POOL_FREE(mnode);
+		return;
+	}
+
+	if(sendqueue_number == 0) {
+		sendqueue = mnode;
+		sendqueue_head = mnode;
+	} else if(mnode->priority <= sendqueue_head->priority) {
+		sendqueue_head->next = mnode;
+		sendqueue_head = mnode;
+	} else {
+		tmp = sendqueue, prev = NULL;
+		while(tmp && tmp->priority >= mnode->priority) {
+			prev = tmp;
+			tmp = tmp->next;
+		}
+		mnode->next = tmp;
+		if(prev == NULL) {
+			sendqueue = mnode;
+		} else {
+			prev->next = mnode;
+		}
+	}
+	sendqueue_number++;
+	if(sendqueue_number > sendqueue_watermark) {
+		sendqueue_watermark = sendqueue_number;
+	}
+}
 
 /* Send a specific code */
 static int send_queue(JsonNode *json) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	int match = 0, x = 0;
+	double priority = 0.0;
 	struct timeval tcurrent;
 	char *uuid = NULL;
 	/* Hold the final protocol struct */
@@ -798,6 +1201,7 @@ static int send_queue(JsonNode *json) {
 		return -1;
 	} else {
 		json_find_string(jcode, "uuid", &uuid);
+		json_find_number(json, "priority", &priority);
 		/* If we matched a protocol and are not already sending, continue */
 		if((uuid == NULL || (uuid != NULL && strcmp(uuid, pilight_uuid) == 0)) && send_repeat > 0) {
 			jprotocol = json_first_child(jprotocols);
@@ -821,10 +1225,11 @@ static int send_queue(JsonNode *json) {
 
 			if(match == 1 && protocol->createCode != NULL) {
 				/* Let the protocol create his code */
+				pthread_mutex_lock(&protocol->lock);
 				if(protocol->createCode(jcode) == 0 && main_loop == 1) {
 					pthread_mutex_lock(&sendqueue_lock);
 					if(sendqueue_number <= 1024) {
-						struct sendqueue_t *mnode = MALLOC(sizeof(struct sendqueue_t));
+						struct sendqueue_t *mnode = POOL_MALLOC(&sendqueue_pool);
 						if(!mnode) {
 							logprintf(LOG_ERR, "out of memory");
 							exit(EXIT_FAILURE);
@@ -848,6 +1253,9 @@ static int send_queue(JsonNode *json) {
 						for(x=0;x<protocol->rawlen;x++) {
 							mnode->code[x]=protocol->raw[x];
 						}
+						mnode->rawlen = protocol->rawlen;
+						mnode->priority = (int)priority;
+						mnode->next = NULL;
 						mnode->protoname = MALLOC(strlen(protocol->id)+1);
 						if(!mnode->protoname) {
 							logprintf(LOG_ERR, "out of memory");
@@ -872,6 +1280,22 @@ static int send_queue(JsonNode *json) {
 							}
 							tmp_options = tmp_options->next;
 						}
+						/* Keep the id values as strings, so they compare exactly */
+						char number[32];
+						mnode->jid = json_mkobject();
+						tmp_options = protocol->options;
+						while(tmp_options) {
+							if(tmp_options->conftype == DEVICES_ID) {
+								if((jtmp = json_find_member(jcode, tmp_options->name)) != NULL && jtmp->tag == JSON_NUMBER) {
+									snprintf(number, sizeof(number), "%.*f", jtmp->decimals_, jtmp->number_);
+									json_append_member(mnode->jid, tmp_options->name, json_mkstring(number));
+								} else if(jtmp != NULL && jtmp->tag == JSON_STRING) {
+									json_append_member(mnode->jid, tmp_options->name, json_mkstring(jtmp->string_));
+								}
+							}
+							tmp_options = tmp_options->next;
+						}
+
 						char *strsett = json_stringify(jsettings, NULL);
 						mnode->settings = MALLOC(strlen(strsett)+1);
 						strcpy(mnode->settings, strsett);
@@ -883,22 +1307,19 @@ static int send_queue(JsonNode *json) {
 						} else {
 							memset(mnode->uuid, '\0', UUID_LENGTH);
 						}
-						if(sendqueue_number == 0) {
-							sendqueue = mnode;
-							sendqueue_head = mnode;
-						} else {
-							sendqueue_head->next = mnode;
-							sendqueue_head = mnode;
-						}
-						sendqueue_number++;
+						send_queue_insert(mnode);
 					} else {
 						logprintf(LOG_ERR, "send queue full");
+						pthread_mutex_unlock(&sendqueue_lock);
+						pthread_mutex_unlock(&protocol->lock);
 						return -1;
 					}
 					pthread_mutex_unlock(&sendqueue_lock);
 					pthread_cond_signal(&sendqueue_signal);
+					pthread_mutex_unlock(&protocol->lock);
 					return 0;
 				} else {
+					pthread_mutex_unlock(&protocol->lock);
 					return -1;
 				}
 			}
@@ -1132,11 +1553,10 @@ static void socket_parse_data(int i, char *buffer) {
 		if(strstr(buffer, " HTTP/")) {
 			client_webserver_parse_code(i, buffer);
 			socket_close(sd);
-		} else if(json_validate(buffer) == true) {
+		} else if((json = json_decode_arena(buffer)) != NULL) {
 #else
-		if(json_validate(buffer) == true) {
+		if((json = json_decode_arena(buffer)) != NULL) {
 #endif
-			json = json_decode(buffer);
 			if((json_find_string(json, "action", &action)) == 0) {
 				if(strcmp(action, "send") == 0 ||
 				   strcmp(action, "control") == 0) {
@@ -1174,10 +1594,13 @@ static void socket_parse_data(int i, char *buffer) {
 						memset(client->uuid, '\0', sizeof(client->uuid));
 					}
 					if(json_find_string(json, "media", &media) == 0) {
-						if(strcmp(media, "all") == 0 || strcmp(media, "mobile") == 0 ||
-						   strcmp(media, "desktop") == 0 || strcmp(media, "web") == 0) {
+						int m = 0;
+						for(m=0;m<CLIENT_MEDIA_NUMBER;m++) {
+							if(strcmp(media, client_media[m]) == 0) {
 								strcpy(client->media, media);
-							 }
+								break;
+							}
+						}
 					} else {
 						strcpy(client->media, "all");
 					}
@@ -1361,13 +1784,34 @@ static void socket_parse_data(int i, char *buffer) {
 				} else if(strcmp(action, "request config") == 0) {
 					struct JsonNode *jsend = json_mkobject();
 					struct JsonNode *jconfig = NULL;
-					if(client->forward == 1) {
-						jconfig = config_print(CONFIG_FORWARD, client->media);
+					struct JsonNode *jvalues = NULL;
+					unsigned long long epoch = 0;
+					unsigned long current = 0;
+					double nodeepoch = 0, nodeversion = 0;
+					/* Read before the changes, so an update that happens
+					   meanwhile is sent again on the next request */
+					devices_version(&epoch, &current);
+					json_append_member(jsend, "message", json_mkstring("config"));
+					json_append_member(jsend, "epoch", json_mknumber((double)epoch, 0));
+					json_append_member(jsend, "version", json_mknumber((double)current, 0));
+					/* A node that synced before only gets the devices
+					   that changed since, if that version is still known */
+					if(json_find_number(json, "epoch", &nodeepoch) == 0 &&
+					   json_find_number(json, "version", &nodeversion) == 0 &&
+					   nodeepoch >= 0 && nodeepoch < (double)ULLONG_MAX &&
+					   nodeversion >= 0 && nodeversion < (double)ULONG_MAX) {
+						jvalues = devices_changed(client->media, (unsigned long long)nodeepoch, (unsigned long)nodeversion);
+					}
+					if(jvalues != NULL) {
+						json_append_member(jsend, "values", jvalues);
 					} else {
-						jconfig = config_print(CONFIG_INTERNAL, client->media);
+						if(client->forward == 1) {
+							jconfig = config_print(CONFIG_FORWARD, client->media);
+						} else {
+							jconfig = config_print(CONFIG_INTERNAL, client->media);
+						}
+						json_append_member(jsend, "config", jconfig);
 					}
-					json_append_member(jsend, "message", json_mkstring("config"));
-					json_append_member(jsend, "config", jconfig);
 					char *output = json_stringify(jsend, NULL);
 					socket_write(sd, output);
 					json_free(output);
@@ -1458,7 +1902,8 @@ void *receive_code(void *param) {
 	sched.sched_priority = 70;
 	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
 
-	struct hardware_t *hw = (hardware_t *)param;
+	struct recvring_t *recvring = (struct recvring_t *)param;
+	struct hardware_t *hw = recvring->hw;
 	pthread_mutex_lock(&hw->lock);
 	hw->running = 1;
 	while(main_loop == 1 && hw->receive != NULL && hw->stop == 0) {
@@ -1479,7 +1924,10 @@ void *receive_code(void *param) {
 					}
 					/* Let's do a little filtering here as well */
 					if(rawlen >= minrawlen && rawlen <= maxrawlen) {
-						receive_queue(rawcode, rawlen, plslen, hw->type);
+						/* A full ring is only counted, the receiver should never block */
+						if(main_loop == 1 && ring_push(recvring->ring, rawcode, rawlen, plslen, hw->type) == 0) {
+							sem_post(&recvqueue_sem);
+						}
 					}
 					rawlen = 0;
 				}
@@ -1510,11 +1958,14 @@ void *clientize(void *param) {
 	struct JsonNode *joptions = NULL;
 	struct JsonNode *jchilds = NULL;
 	struct JsonNode *tmp = NULL;
-  char *recvBuff = NULL, *output = NULL;
+	struct socket_reader_t reader;
+	char *recvBuff = NULL, *output = NULL;
 	char *message = NULL, *action = NULL;
 	char *origin = NULL, *protocol = NULL;
 	int client_loop = 0, config_synced = 0;
 
+	memset(&reader, 0, sizeof(struct socket_reader_t));
+
 	while(main_loop) {
 
 		if(client_loop == 1) {
@@ -1544,6 +1995,7 @@ void *clientize(void *param) {
 		if(ssdp_list) {
 			ssdp_free(ssdp_list);
 		}
+		socket_reader_init(&reader, sockfd);
 
 		json = json_mkobject();
 		joptions = json_mkobject();
@@ -1562,7 +2014,7 @@ void *clientize(void *param) {
 		json_free(output);
 		json_delete(json);
 
-		if(socket_read(sockfd, &recvBuff, 1) != 0
+		if(socket_reader_next(&reader, &recvBuff, 1) != 0
 		   || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
 			continue;
 		}
@@ -1570,6 +2022,10 @@ void *clientize(void *param) {
 
 		json = json_mkobject();
 		json_append_member(json, "action", json_mkstring("request config"));
+		if(master_epoch > 0) {
+			json_append_member(json, "epoch", json_mknumber((double)master_epoch, 0));
+			json_append_member(json, "version", json_mknumber((double)master_version, 0));
+		}
 		output = json_stringify(json, NULL);
 		if(socket_write(sockfd, output) != (strlen(output)+strlen(EOSS))) {
 			json_free(output);
@@ -1579,14 +2035,26 @@ void *clientize(void *param) {
 		json_free(output);
 		json_delete(json);
 
-		if(socket_read(sockfd, &recvBuff, 0) == 0) {
+		if(socket_reader_next(&reader, &recvBuff, 0) == 0) {
 			logprintf(LOG_DEBUG, "socket recv: %s", recvBuff);
-			if(json_validate(recvBuff) == true) {
-				json = json_decode(recvBuff);
+			if((json = json_decode(recvBuff)) != NULL) {
 				if(json_find_string(json, "message", &message) == 0) {
 					if(strcmp(message, "config") == 0) {
 						struct JsonNode *jconfig = NULL;
-						if((jconfig = json_find_member(json, "config")) != NULL) {
+						struct JsonNode *jvalues = NULL;
+						double epoch = 0, version = 0;
+						if((jvalues = json_find_member(json, "values")) != NULL && jvalues->tag == JSON_ARRAY) {
+							int changed = 0;
+							jchilds = json_first_child(jvalues);
+							while(jchilds) {
+								if(devices_restore(jchilds) == 0) {
+									changed++;
+								}
+								jchilds = jchilds->next;
+							}
+							logprintf(LOG_DEBUG, "updated %d changed devices from master configuration", changed);
+							config_synced = 1;
+						} else if((jconfig = json_find_member(json, "config")) != NULL) {
 							gui_gc();
 							devices_gc();
 #ifdef EVENTS
@@ -1615,6 +2083,16 @@ void *clientize(void *param) {
 								logprintf(LOG_NOTICE, "failed to load master configuration");
 							}
 						}
+						/* Masters without versions always send the full config */
+						master_epoch = 0;
+						if(config_synced == 1 &&
+						   json_find_number(json, "epoch", &epoch) == 0 &&
+						   json_find_number(json, "version", &version) == 0 &&
+						   epoch > 0 && epoch < (double)ULLONG_MAX &&
+						   version >= 0 && version < (double)ULONG_MAX) {
+							master_epoch = (unsigned long long)epoch;
+							master_version = (unsigned long)version;
+						}
 					}
 				}
 				json_delete(json);
@@ -1630,7 +2108,7 @@ void *clientize(void *param) {
 				break;
 			}
 
-			int n = socket_read(sockfd, &recvBuff, 1);
+			int n = socket_reader_next(&reader, &recvBuff, 1);
 			if(n == -1) {
 				sockfd = 0;
 				break;
@@ -1639,36 +2117,25 @@ void *clientize(void *param) {
 			}
 
 			logprintf(LOG_DEBUG, "socket recv: %s", recvBuff);
-			char **array = NULL;
-			unsigned int z = explode(recvBuff, "\n", &array), q = 0;
-			for(q=0;q<z;q++) {
-				if(json_validate(array[q]) == true) {
-					json = json_decode(array[q]);
-					if(json_find_string(json, "action", &action) == 0) {
-						if(strcmp(action, "send") == 0 ||
-						   strcmp(action, "control") == 0) {
-							socket_parse_data(sockfd, array[q]);
-						}
-					} else if(json_find_string(json, "origin", &origin) == 0 &&
-							json_find_string(json, "protocol", &protocol) == 0) {
-							if(strcmp(origin, "receiver") == 0 ||
-								 strcmp(origin, "sender") == 0) {
-								broadcast_queue(protocol, json);
-						}
+			if((json = json_decode_arena(recvBuff)) != NULL) {
+				if(json_find_string(json, "action", &action) == 0) {
+					if(strcmp(action, "send") == 0 ||
+					   strcmp(action, "control") == 0) {
+						socket_parse_data(sockfd, recvBuff);
+					}
+				} else if(json_find_string(json, "origin", &origin) == 0 &&
+						json_find_string(json, "protocol", &protocol) == 0) {
+						if(strcmp(origin, "receiver") == 0 ||
+							 strcmp(origin, "sender") == 0) {
+							broadcast_queue(protocol, json);
 					}
-					json_delete(json);
 				}
-				FREE(array[q]);
-			}
-			if(z > 0) {
-				FREE(array);
+				json_delete(json);
 			}
 		}
 	}
 
-	if(recvBuff != NULL) {
-		FREE(recvBuff);
-	}
+	socket_reader_gc(&reader);
 
 	return NULL;
 }
@@ -1739,10 +2206,18 @@ int main_gc(void) {
 	events_gc();
 #endif
 
-	pthread_mutex_unlock(&recvqueue_lock);
-	pthread_cond_signal(&recvqueue_signal);
+	sem_post(&recvqueue_sem);
 	usleep(1000);
 
+	if(recvworkers != NULL) {
+		int w = 0;
+		for(w=0;w<recvworkers_number;w++) {
+			pthread_mutex_lock(&recvworkers[w].lock);
+			pthread_cond_signal(&recvworkers[w].signal);
+			pthread_mutex_unlock(&recvworkers[w].lock);
+		}
+	}
+
 	pthread_mutex_unlock(&sendqueue_lock);
 	pthread_cond_signal(&sendqueue_signal);
 
@@ -1795,10 +2270,22 @@ int main_gc(void) {
 	options_gc();
 	socket_gc();
 
+	/* The receive parser and workers decode with the
+	   protocols, so they must be stopped before those
+	   are freed */
+	sem_post(&recvqueue_sem);
+	thread_stop("receive parser");
+	receive_workers_gc();
+
+	/* Write the queued device updates before the journal is closed */
+	config_journal_stop();
+	thread_stop("journal");
 	config_gc();
 	protocol_gc();
 	whitelist_free();
 	threads_gc();
+	receive_rings_gc();
+	sem_destroy(&recvqueue_sem);
 	wiringXGC();	
 	dso_gc();
 	log_gc();
@@ -2064,6 +2551,11 @@ int main(int argc, char **argv) {
 		log_level_set(verbosity);
 		log_shell_enable();
 	}
+#if LOG_MAX_LEVEL < LOG_STACK
+	if(stacktracer == 1) {
+		logprintf(LOG_NOTICE, "function calls aren't logged in this build, send SIGUSR1 for the latest calls of each thread");
+	}
+#endif
 
 	if((pid = isrunning("pilight-raw")) != -1) {
 		logprintf(LOG_ERR, "pilight-raw instance found (%d)", (int)pid);
@@ -2218,6 +2710,7 @@ int main(int argc, char **argv) {
 	}
 
 	if(pilight.runmode == STANDALONE) {
+		config_journal_open();
 		socket_start((unsigned short)port);
 		if(standalone == 0) {
 			ssdp_start();
@@ -2240,10 +2733,9 @@ int main(int argc, char **argv) {
 	pthread_mutex_init(&sendqueue_lock, &sendqueue_attr);
 	pthread_cond_init(&sendqueue_signal, NULL);
 
-	pthread_mutexattr_init(&recvqueue_attr);
-	pthread_mutexattr_settype(&recvqueue_attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&recvqueue_lock, &recvqueue_attr);
-	pthread_cond_init(&recvqueue_signal, NULL);
+	pthread_mutex_init(&recvqueue_lock, NULL);
+	sem_init(&recvqueue_sem, 0, 0);
+	receive_rings_init();
 
 	pthread_mutexattr_init(&bcqueue_attr);
 	pthread_mutexattr_settype(&bcqueue_attr, PTHREAD_MUTEX_RECURSIVE);
@@ -2277,8 +2769,12 @@ int main(int argc, char **argv) {
 	}
 	threads_register("sender", &send_code, (void *)NULL, 0);
 	threads_register("broadcaster", &broadcast, (void *)NULL, 0);
+	if(pilight.runmode == STANDALONE) {
+		threads_register("journal", &config_journal_loop, (void *)NULL, 0);
+	}
 
 	struct conf_hardware_t *tmp_confhw = conf_hardware;
+	int r = 1;
 	while(tmp_confhw) {
 		if(tmp_confhw->hardware->init) {
 			if(tmp_confhw->hardware->init() == EXIT_FAILURE) {
@@ -2287,11 +2783,13 @@ int main(int argc, char **argv) {
 			}
 			tmp_confhw->hardware->wait = 0;
 			tmp_confhw->hardware->stop = 0;
-			threads_register(tmp_confhw->hardware->id, &receive_code, (void *)tmp_confhw->hardware, 0);
+			threads_register(tmp_confhw->hardware->id, &receive_code, (void *)&recvrings[r], 0);
 		}
 		tmp_confhw = tmp_confhw->next;
+		r++;
 	}
 
+	receive_workers_init();
 	threads_register("receive parser", &receive_parse_code, (void *)NULL, 0);
 
 #ifdef EVENTS
@@ -2403,6 +2901,10 @@ int main(int argc, char **argv) {
 					json_append_member(code, "ram", json_mknumber(ram, 16));
 				}
 				logprintf(LOG_DEBUG, "cpu: %f%%, ram: %f%%", cpu, ram);
+				receive_stats(code);
+				receive_rings_stats();
+				send_queue_stats();
+				mempool_stats(code);
 				json_append_member(procProtocol->message, "values", code);
 				json_append_member(procProtocol->message, "origin", json_mkstring("core"));
 				json_append_member(procProtocol->message, "type", json_mknumber(PROC, 0));
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <regex.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <ctype.h>
 #include <math.h>
 
@@ -43,11 +44,340 @@
 /* Struct to store the locations */
 static struct devices_t *devices = NULL;
 
+/*
+ * Every update stamps the devices it changed with the next version,
+ * so nodes that were synced before only need the devices changed
+ * since. The epoch identifies this run, versions of an earlier run
+ * or from before the last parse can't be compared anymore.
+ */
+static unsigned long long devices_epoch = 0;
+static unsigned long devices_current = 0;
+static unsigned long devices_parsed = 0;
+
+/*
+ * The indexes below are rebuilt every time the devices are parsed,
+ * so a received code doesn't have to walk the whole config. The
+ * slots resolve each device setting to the protocol option that
+ * updates it, in the same order as the settings themselves.
+ */
+typedef struct devices_slot_t {
+	struct options_t *value;
+	unsigned short state;
+	unsigned short id;
+} devices_slot_t;
+
+typedef struct devices_match_t {
+	struct devices_t *device;
+	struct devices_slot_t *slots;
+} devices_match_t;
+
+/* The devices having a certain value for the first id option
+   of a protocol, by their position in devices_index_t */
+typedef struct devices_key_t {
+	char *key;
+	int *devices;
+	int nrdevices;
+} devices_key_t;
+
+typedef struct devices_index_t {
+	struct protocol_t *protocol;
+	struct devices_match_t *devices;
+	int nrdevices;
+	struct options_t *idopt;
+	struct devices_key_t *keys;
+	unsigned int keys_size;
+} devices_index_t;
+
+static struct devices_t **devices_table = NULL;
+static unsigned int devices_table_size = 0;
+static struct devices_index_t *protocols_table = NULL;
+static unsigned int protocols_table_size = 0;
+
+static unsigned int devices_hash(const char *key) {
+	unsigned int hash = 2166136261u;
+
+	while(*key != '\0') {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Smallest power of two that keeps the table at most half full */
+static unsigned int devices_table_round(unsigned int nr) {
+	unsigned int size = 16;
+
+	while(size < nr*2) {
+		size <<= 1;
+	}
+	return size;
+}
+
+/* Integer ids are the norm, so numbers are rounded. Values that
+   round alike only cost an extra comparison in devices_update. */
+static void devices_index_key(char *key, size_t len, int type, const char *string_, double number_) {
+	if(type == JSON_STRING) {
+		snprintf(key, len, "s%s", string_);
+	} else {
+		snprintf(key, len, "n%.0f", number_);
+	}
+}
+
+static struct devices_key_t *devices_index_devices(struct devices_index_t *index, const char *key) {
+	unsigned int i = 0;
+
+	i = devices_hash(key) & (index->keys_size-1);
+	while(index->keys[i].key != NULL) {
+		if(strcmp(index->keys[i].key, key) == 0) {
+			return &index->keys[i];
+		}
+		i = (i+1) & (index->keys_size-1);
+	}
+	return &index->keys[i];
+}
+
+static void devices_index_ids(struct devices_index_t *index) {
+	struct devices_settings_t *sptr = NULL;
+	struct devices_values_t *vptr = NULL;
+	struct devices_key_t *entry = NULL;
+	struct options_t *opt = NULL;
+	char key[255];
+	unsigned int nr = 0;
+	int d = 0, s = 0;
+
+	opt = index->protocol->options;
+	while(opt) {
+		if(opt->conftype == DEVICES_ID) {
+			index->idopt = opt;
+			break;
+		}
+		opt = opt->next;
+	}
+	if(index->idopt == NULL || index->nrdevices == 0) {
+		return;
+	}
+
+	for(d=0;d<index->nrdevices;d++) {
+		sptr = index->devices[d].device->settings;
+		while(sptr) {
+			if(strcmp(sptr->name, "id") == 0) {
+				vptr = sptr->values;
+				while(vptr) {
+					nr++;
+					vptr = vptr->next;
+				}
+			}
+			sptr = sptr->next;
+		}
+	}
+	index->keys_size = devices_table_round(nr);
+	if(!(index->keys = CALLOC(index->keys_size, sizeof(struct devices_key_t)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	for(d=0;d<index->nrdevices;d++) {
+		s = 0;
+		sptr = index->devices[d].device->settings;
+		while(sptr) {
+			if(index->devices[d].slots[s].id == 1) {
+				vptr = sptr->values;
+				while(vptr) {
+					if(strcmp(vptr->name, index->idopt->name) == 0 &&
+					   (vptr->type == JSON_STRING || vptr->type == JSON_NUMBER)) {
+						devices_index_key(key, sizeof(key), vptr->type, vptr->string_, vptr->number_);
+						entry = devices_index_devices(index, key);
+						if(entry->key == NULL) {
+							if(!(entry->key = MALLOC(strlen(key)+1))) {
+								logprintf(LOG_ERR, "out of memory");
+								exit(EXIT_FAILURE);
+							}
+							strcpy(entry->key, key);
+						}
+						/* Devices are added in order, so checking the last is enough */
+						if(entry->nrdevices == 0 || entry->devices[entry->nrdevices-1] != d) {
+							if(!(entry->devices = REALLOC(entry->devices, sizeof(int)*(size_t)(entry->nrdevices+1)))) {
+								logprintf(LOG_ERR, "out of memory");
+								exit(EXIT_FAILURE);
+							}
+							entry->devices[entry->nrdevices++] = d;
+						}
+					}
+					vptr = vptr->next;
+				}
+			}
+			s++;
+			sptr = sptr->next;
+		}
+	}
+}
+
+static struct devices_index_t *devices_index_protocol(const char *id) {
+	unsigned int i = 0;
+
+	if(protocols_table == NULL) {
+		return NULL;
+	}
+	i = devices_hash(id) & (protocols_table_size-1);
+	while(protocols_table[i].protocol != NULL) {
+		if(strcmp(protocols_table[i].protocol->id, id) == 0) {
+			return &protocols_table[i];
+		}
+		i = (i+1) & (protocols_table_size-1);
+	}
+	return NULL;
+}
+
+static void devices_index_gc(void) {
+	unsigned int i = 0, y = 0;
+	int x = 0;
+
+	if(protocols_table != NULL) {
+		for(i=0;i<protocols_table_size;i++) {
+			for(x=0;x<protocols_table[i].nrdevices;x++) {
+				FREE(protocols_table[i].devices[x].slots);
+			}
+			if(protocols_table[i].devices != NULL) {
+				FREE(protocols_table[i].devices);
+			}
+			if(protocols_table[i].keys != NULL) {
+				for(y=0;y<protocols_table[i].keys_size;y++) {
+					if(protocols_table[i].keys[y].key != NULL) {
+						FREE(protocols_table[i].keys[y].key);
+						FREE(protocols_table[i].keys[y].devices);
+					}
+				}
+				FREE(protocols_table[i].keys);
+			}
+		}
+		FREE(protocols_table);
+	}
+	if(devices_table != NULL) {
+		FREE(devices_table);
+	}
+	protocols_table_size = 0;
+	devices_table_size = 0;
+}
+
+static void devices_index(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct protocols_t *pnode = NULL, *tmp_protocols = NULL;
+	struct devices_index_t *index = NULL;
+	struct devices_settings_t *sptr = NULL;
+	struct devices_slot_t *slots = NULL;
+	struct devices_t *dptr = NULL;
+	struct options_t *opt = NULL;
+	unsigned int nr = 0, i = 0;
+	int s = 0;
+
+	devices_index_gc();
+
+	/* Device id to device */
+	nr = 0;
+	dptr = devices;
+	while(dptr) {
+		nr++;
+		dptr = dptr->next;
+	}
+	devices_table_size = devices_table_round(nr);
+	if(!(devices_table = CALLOC(devices_table_size, sizeof(struct devices_t *)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	dptr = devices;
+	while(dptr) {
+		i = devices_hash(dptr->id) & (devices_table_size-1);
+		while(devices_table[i] != NULL) {
+			i = (i+1) & (devices_table_size-1);
+		}
+		devices_table[i] = dptr;
+		dptr = dptr->next;
+	}
+
+	/* Protocol id to the devices using that protocol */
+	nr = 0;
+	pnode = protocols;
+	while(pnode) {
+		nr++;
+		pnode = pnode->next;
+	}
+	protocols_table_size = devices_table_round(nr);
+	if(!(protocols_table = CALLOC(protocols_table_size, sizeof(struct devices_index_t)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	pnode = protocols;
+	while(pnode) {
+		if(devices_index_protocol(pnode->listener->id) != NULL) {
+			pnode = pnode->next;
+			continue;
+		}
+		i = devices_hash(pnode->listener->id) & (protocols_table_size-1);
+		while(protocols_table[i].protocol != NULL) {
+			i = (i+1) & (protocols_table_size-1);
+		}
+		index = &protocols_table[i];
+		index->protocol = pnode->listener;
+
+		dptr = devices;
+		while(dptr) {
+			tmp_protocols = dptr->protocols;
+			while(tmp_protocols) {
+				if(protocol_device_exists(index->protocol, tmp_protocols->name) == 0) {
+					break;
+				}
+				tmp_protocols = tmp_protocols->next;
+			}
+			if(tmp_protocols != NULL) {
+				s = 0;
+				sptr = dptr->settings;
+				while(sptr) {
+					s++;
+					sptr = sptr->next;
+				}
+				if(!(slots = CALLOC((size_t)s+1, sizeof(struct devices_slot_t)))) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
+				}
+				s = 0;
+				sptr = dptr->settings;
+				while(sptr) {
+					opt = index->protocol->options;
+					while(opt) {
+						if(strcmp(sptr->name, opt->name) == 0
+						   && opt->conftype == DEVICES_VALUE
+						   && opt->argtype == OPTION_HAS_VALUE) {
+							slots[s].value = opt;
+							break;
+						}
+						opt = opt->next;
+					}
+					slots[s].state = (strcmp(sptr->name, "state") == 0);
+					slots[s].id = (strcmp(sptr->name, "id") == 0);
+					s++;
+					sptr = sptr->next;
+				}
+				if(!(index->devices = REALLOC(index->devices, sizeof(struct devices_match_t)*(size_t)(index->nrdevices+1)))) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
+				}
+				index->devices[index->nrdevices].device = dptr;
+				index->devices[index->nrdevices].slots = slots;
+				index->nrdevices++;
+			}
+			dptr = dptr->next;
+		}
+		devices_index_ids(index);
+		pnode = pnode->next;
+	}
+}
+
 int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	/* The pointer to the devices devices */
-	struct devices_t *dptr = devices;
+	struct devices_t *dptr = NULL;
 	/* The pointer to the device settings */
 	struct devices_settings_t *sptr = NULL;
 	/* The pointer to the device settings */
@@ -56,14 +386,22 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 	struct protocol_t *protocol = NULL;
 	/* The pointer to the protocol options */
 	struct options_t *opt = NULL;
+	/* The devices using this protocol */
+	struct devices_index_t *index = NULL;
+	/* The protocol options of each device setting */
+	struct devices_slot_t *slots = NULL;
+	/* The devices that can match the id of this code */
+	struct devices_key_t *candidates = NULL;
+	struct JsonNode *jid = NULL;
+	char key[255];
 	/* Get the message part of the sended code */
 	JsonNode *message = json_find_member(json, "message");
 	/* Get the settings part of the sended code */
 	JsonNode *settings = json_find_member(json, "settings");
 	/* The return JSON object will all updated devices */
-	JsonNode *rroot = json_mkobject();
-	JsonNode *rdev = json_mkarray();
-	JsonNode *rval = json_mkobject();
+	JsonNode *rroot = NULL;
+	JsonNode *rdev = NULL;
+	JsonNode *rval = NULL;
 
 	/* Temporarily char pointer */
 	char *stmp = NULL;
@@ -91,19 +429,20 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 	int match = 0;
 	int match1 = 0;
 	int match2 = 0;
+	int d = 0, s = 0, c = 0, nrcandidates = 0;
 
 	/* Is is a valid new state / value */
 	int is_valid = 1;
 
 	/* Retrieve the used protocol */
-	struct protocols_t *pnode = protocols;
-	while(pnode) {
-		protocol = pnode->listener;
-		if(strcmp(protocol->id, protoname) == 0) {
-			break;
-		}
-		pnode = pnode->next;
+	if((index = devices_index_protocol(protoname)) == NULL) {
+		return -1;
 	}
+	protocol = index->protocol;
+
+	rroot = json_mkobject();
+	rdev = json_mkarray();
+	rval = json_mkobject();
 
 	time_t timenow = time(NULL);
 	struct tm *gmt = gmtime(&timenow);
@@ -114,9 +453,63 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 	json_find_string(json, "uuid", &uuid);
 
 	if((opt = protocol->options)) {
-		/* Loop through all devices */
+		/* Check how many id's we need to match */
+		while(opt) {
+			if(opt->conftype == DEVICES_ID) {
+				JsonNode *jtmp = json_first_child(message);
+				while(jtmp) {
+					if(strcmp(jtmp->key, opt->name) == 0) {
+						match1++;
+					}
+					jtmp = jtmp->next;
+				}
+			}
 
-		while(dptr) {
+			/* Retrieve the new device state */
+			if(opt->conftype == DEVICES_STATE) {
+				if(opt->argtype == OPTION_NO_VALUE) {
+					if(json_find_string(message, "state", &stmp) == 0) {
+						strcpy(sstring_, stmp);
+						stateType = JSON_STRING;
+					}
+					if(json_find_number(message, "state", &itmp) == 0) {
+						snumber_ = itmp;
+						stateType = JSON_NUMBER;
+					}
+				} else if(opt->argtype == OPTION_HAS_VALUE) {
+					if(json_find_string(message, opt->name, &stmp) == 0) {
+						strcpy(sstring_, stmp);
+						stateType = JSON_STRING;
+					}
+					struct JsonNode *jtmp = NULL;
+					if((jtmp = json_find_member(message, opt->name)) != NULL &&
+					    jtmp->tag == JSON_NUMBER) {
+						snumber_ = jtmp->number_;
+						sdecimals_ = jtmp->decimals_;
+						stateType = JSON_NUMBER;
+					}
+				}
+			}
+			opt = opt->next;
+		}
+
+		/* A device can only match when it has the same value for
+		   the first id option, so only look at those devices */
+		nrcandidates = index->nrdevices;
+		if(index->keys != NULL && (jid = json_find_member(message, index->idopt->name)) != NULL) {
+			nrcandidates = 0;
+			if(jid->tag == JSON_STRING || jid->tag == JSON_NUMBER) {
+				devices_index_key(key, sizeof(key), jid->tag, jid->string_, jid->number_);
+				candidates = devices_index_devices(index, key);
+				nrcandidates = candidates->nrdevices;
+			}
+		}
+
+		/* Loop through all devices using this protocol */
+		for(c=0;c<nrcandidates;c++) {
+			d = (candidates != NULL) ? candidates->devices[c] : c;
+			dptr = index->devices[d].device;
+			slots = index->devices[d].slots;
 			/*
 			 * uuid 				= The UUID of the pilight instance that received the specific information.
 			 * pilight_uuid	= The UUID of the currently running pilight instance this function was called on.
@@ -139,41 +532,16 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 				uuidmatch = 1;
 			}
 			if(uuidmatch == 1) {
-				struct protocols_t *tmp_protocols = dptr->protocols;
 				match = 0;
-				while(tmp_protocols) {
-					if(protocol_device_exists(protocol, tmp_protocols->name) == 0) {
-						match = 1;
-						break;
-					}
-					tmp_protocols = tmp_protocols->next;
-				}
-
-				if(match) {
-					sptr = dptr->settings;
-					/* Loop through all settings */
-					while(sptr) {
-						match1 = 0; match2 = 0;
-
-						/* Check how many id's we need to match */
+				s = 0;
+				sptr = dptr->settings;
+				/* Loop through all id settings */
+				while(sptr && match1 > 0) {
+					if(slots[s].id == 1) {
+						match2 = 0;
 						opt = protocol->options;
 						while(opt) {
 							if(opt->conftype == DEVICES_ID) {
-								JsonNode *jtmp = json_first_child(message);
-								while(jtmp) {
-									if(strcmp(jtmp->key, opt->name) == 0) {
-										match1++;
-									}
-									jtmp = jtmp->next;
-								}
-							}
-							opt = opt->next;
-						}
-
-						/* Loop through all protocol options */
-						opt = protocol->options;
-						while(opt) {
-							if(opt->conftype == DEVICES_ID && strcmp(sptr->name, "id") == 0) {
 								/* Check the devices id's to match a device */
 								vptr = sptr->values;
 								while(vptr) {
@@ -192,210 +560,175 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 									vptr = vptr->next;
 								}
 							}
-
-							/* Retrieve the new device state */
-							if(opt->conftype == DEVICES_STATE) {
-								if(opt->argtype == OPTION_NO_VALUE) {
-									if(json_find_string(message, "state", &stmp) == 0) {
-										strcpy(sstring_, stmp);
-										stateType = JSON_STRING;
-									}
-									if(json_find_number(message, "state", &itmp) == 0) {
-										snumber_ = itmp;
-										stateType = JSON_NUMBER;
-									}
-								} else if(opt->argtype == OPTION_HAS_VALUE) {
-									if(json_find_string(message, opt->name, &stmp) == 0) {
-										strcpy(sstring_, stmp);
-										stateType = JSON_STRING;
-									}
-									struct JsonNode *jtmp = NULL;
-									if((jtmp = json_find_member(message, opt->name)) != NULL &&
-									    jtmp->tag == JSON_NUMBER) {
-										snumber_ = jtmp->number_;
-										sdecimals_ = jtmp->decimals_;
-										stateType = JSON_NUMBER;
-									}
-								}
-							}
 							opt = opt->next;
 						}
-						if(match1 > 0 && match2 > 0 && match1 == match2) {
+						if(match2 > 0 && match1 == match2) {
+							match = 1;
 							break;
 						}
-						sptr = sptr->next;
 					}
-					is_valid = 1;
-
-					/* If we matched a device, update it's state */
-					if(match1 > 0 && match2 > 0 && match1 == match2) {
-						if(protocol->checkValues) {
-							is_valid = 0;
-							JsonNode *jcode = json_mkobject();
-							sptr = dptr->settings;
-							while(sptr) {
-								opt = protocol->options;
-								/* Loop through all protocol options */
-								while(opt) {
-									/* Check if there are values that can be updated */
-									if(strcmp(sptr->name, opt->name) == 0
-									   && (opt->conftype == DEVICES_VALUE)
-									   && opt->argtype == OPTION_HAS_VALUE) {
-										memset(vstring_, '\0', sizeof(vstring_));
-										vnumber_ = -1;
-										if(json_find_string(message, opt->name, &stmp) == 0) {
-											strcpy(vstring_, stmp);
-											valueType = JSON_STRING;
-											is_valid = 1;
-										}
-										struct JsonNode *jtmp = NULL;
-										if((jtmp = json_find_member(message, opt->name)) != NULL &&
-										    jtmp->tag == JSON_NUMBER) {
-											vnumber_ = jtmp->number_;
-											vdecimals_ = jtmp->decimals_;
-											valueType = JSON_NUMBER;
-											is_valid = 1;
-										}
+					s++;
+					sptr = sptr->next;
+				}
+				is_valid = 1;
+
+				/* If we matched a device, update it's state */
+				if(match == 1) {
+					if(protocol->checkValues) {
+						is_valid = 0;
+						JsonNode *jcode = json_mkobject();
+						s = 0;
+						sptr = dptr->settings;
+						while(sptr) {
+							/* Check if there are values that can be updated */
+							if((opt = slots[s].value) != NULL) {
+								memset(vstring_, '\0', sizeof(vstring_));
+								vnumber_ = -1;
+								if(json_find_string(message, opt->name, &stmp) == 0) {
+									strcpy(vstring_, stmp);
+									valueType = JSON_STRING;
+									is_valid = 1;
+								}
+								struct JsonNode *jtmp = NULL;
+								if((jtmp = json_find_member(message, opt->name)) != NULL &&
+								    jtmp->tag == JSON_NUMBER) {
+									vnumber_ = jtmp->number_;
+									vdecimals_ = jtmp->decimals_;
+									valueType = JSON_NUMBER;
+									is_valid = 1;
+								}
 
-										/* Check if the protocol settings of this device are valid to
-										   make sure no errors occur in the config.json. */
-										JsonNode *jsettings = json_first_child(settings);
-										while(jsettings) {
-											if(jsettings->tag == JSON_NUMBER) {
-												json_append_member(jcode, jsettings->key, json_mknumber(jsettings->number_, jsettings->decimals_));
-											} else if(jsettings->tag == JSON_STRING) {
-												json_append_member(jcode, jsettings->key, json_mkstring(jsettings->string_));
-											}
-											jsettings = jsettings->next;
-										}
-										if(valueType == JSON_STRING) {
-											json_append_member(jcode, opt->name, json_mkstring(vstring_));
-										} else {
-											json_append_member(jcode, opt->name, json_mknumber(vnumber_, vdecimals_));
-										}
+								/* Check if the protocol settings of this device are valid to
+								   make sure no errors occur in the config.json. */
+								JsonNode *jsettings = json_first_child(settings);
+								while(jsettings) {
+									if(jsettings->tag == JSON_NUMBER) {
+										json_append_member(jcode, jsettings->key, json_mknumber(jsettings->number_, jsettings->decimals_));
+									} else if(jsettings->tag == JSON_STRING) {
+										json_append_member(jcode, jsettings->key, json_mkstring(jsettings->string_));
 									}
-									opt = opt->next;
+									jsettings = jsettings->next;
+								}
+								if(valueType == JSON_STRING) {
+									json_append_member(jcode, opt->name, json_mkstring(vstring_));
+								} else {
+									json_append_member(jcode, opt->name, json_mknumber(vnumber_, vdecimals_));
 								}
-								sptr = sptr->next;
-							}
-							if(protocol->checkValues(jcode) != 0) {
-								is_valid = 0;
 							}
-							json_delete(jcode);
+							s++;
+							sptr = sptr->next;
 						}
+						if(protocol->checkValues(jcode) != 0) {
+							is_valid = 0;
+						}
+						json_delete(jcode);
+					}
 
-						sptr = dptr->settings;
-						while(sptr) {
-							opt = protocol->options;
-							/* Loop through all protocol options */
-							while(opt) {
-								/* Check if there are values that can be updated */
-								if(strcmp(sptr->name, opt->name) == 0
-								   && (opt->conftype == DEVICES_VALUE)
-								   && opt->argtype == OPTION_HAS_VALUE) {
-									int upd_value = 1;
-									memset(vstring_, '\0', sizeof(vstring_));
-									vnumber_ = -1;
-									vdecimals_ = 0;
-									struct JsonNode *jtmp = NULL;
-									if(json_find_string(message, opt->name, &stmp) == 0) {
-										strcpy(vstring_, stmp);
-										valueType = JSON_STRING;
-									} else if((jtmp = json_find_member(message, opt->name)) != NULL &&
-									           jtmp->tag == JSON_NUMBER) {
-										vnumber_ = jtmp->number_;
-										vdecimals_ = jtmp->decimals_;
-										valueType = JSON_NUMBER;
-									} else {
-										upd_value = 0;
-									}
-
-									if(is_valid && upd_value) {
-										if(valueType == JSON_STRING &&
-										   strlen(vstring_) > 0 &&
-										   sptr->values->type == JSON_STRING &&
-										   strcmp(sptr->values->string_, vstring_) != 0) {
-											if(!(sptr->values->string_ = REALLOC(sptr->values->string_, strlen(vstring_)+1))) {
-												logprintf(LOG_ERR, "out of memory");
-												exit(EXIT_FAILURE);
-											}
-											strcpy(sptr->values->string_, vstring_);
-											sptr->values->type = JSON_STRING;
-										} else if(valueType == JSON_NUMBER &&
-												  sptr->values->type == JSON_NUMBER &&
-												  fabs(sptr->values->number_-vnumber_) >= EPSILON) {
-											sptr->values->number_ = vnumber_;
-											sptr->values->decimals = vdecimals_;
-											sptr->values->type = JSON_NUMBER;
-										}
-										if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
-											json_append_member(rval, sptr->name, json_mkstring(sptr->values->string_));
-											update = 1;
-										} else if(sptr->values->type == JSON_NUMBER && json_find_number(rval, sptr->name, &itmp) != 0) {
-											json_append_member(rval, sptr->name, json_mknumber(sptr->values->number_, sptr->values->decimals));
-											update = 1;
-										}
-										dptr->timestamp = utct;
-									}
-									//break;
-								}
-								opt = opt->next;
+					s = 0;
+					sptr = dptr->settings;
+					while(sptr) {
+						/* Check if there are values that can be updated */
+						if((opt = slots[s].value) != NULL) {
+							int upd_value = 1;
+							memset(vstring_, '\0', sizeof(vstring_));
+							vnumber_ = -1;
+							vdecimals_ = 0;
+							struct JsonNode *jtmp = NULL;
+							if(json_find_string(message, opt->name, &stmp) == 0) {
+								strcpy(vstring_, stmp);
+								valueType = JSON_STRING;
+							} else if((jtmp = json_find_member(message, opt->name)) != NULL &&
+							           jtmp->tag == JSON_NUMBER) {
+								vnumber_ = jtmp->number_;
+								vdecimals_ = jtmp->decimals_;
+								valueType = JSON_NUMBER;
+							} else {
+								upd_value = 0;
 							}
 
-							/* Check if we need to update the state */
-							if(strcmp(sptr->name, "state") == 0) {
-								if((stateType == JSON_STRING &&
-									sptr->values->type == JSON_STRING &&
-									strcmp(sptr->values->string_, sstring_) != 0)) {
-									sptr->values->string_ = REALLOC(sptr->values->string_, strlen(sstring_)+1);
-									if(!sptr->values->string_) {
+							if(is_valid && upd_value) {
+								if(valueType == JSON_STRING &&
+								   strlen(vstring_) > 0 &&
+								   sptr->values->type == JSON_STRING &&
+								   strcmp(sptr->values->string_, vstring_) != 0) {
+									if(!(sptr->values->string_ = REALLOC(sptr->values->string_, strlen(vstring_)+1))) {
 										logprintf(LOG_ERR, "out of memory");
 										exit(EXIT_FAILURE);
 									}
-									strcpy(sptr->values->string_, sstring_);
+									strcpy(sptr->values->string_, vstring_);
 									sptr->values->type = JSON_STRING;
-									dptr->timestamp = utct;
-									update = 1;
-								} else if((stateType == JSON_NUMBER &&
-										   sptr->values->type == JSON_NUMBER &&
-										   fabs(sptr->values->number_-snumber_) < EPSILON)) {
-									sptr->values->number_ = snumber_;
-									sptr->values->decimals = sdecimals_;
+								} else if(valueType == JSON_NUMBER &&
+										  sptr->values->type == JSON_NUMBER &&
+										  fabs(sptr->values->number_-vnumber_) >= EPSILON) {
+									sptr->values->number_ = vnumber_;
+									sptr->values->decimals = vdecimals_;
 									sptr->values->type = JSON_NUMBER;
-									dptr->timestamp = utct;
-									update = 1;
 								}
 								if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
 									json_append_member(rval, sptr->name, json_mkstring(sptr->values->string_));
+									update = 1;
 								} else if(sptr->values->type == JSON_NUMBER && json_find_number(rval, sptr->name, &itmp) != 0) {
 									json_append_member(rval, sptr->name, json_mknumber(sptr->values->number_, sptr->values->decimals));
+									update = 1;
 								}
-								//break;
+								dptr->timestamp = utct;
 							}
-							if(update == 1) {
-								match = 0;
-								struct JsonNode *jchild = json_first_child(rdev);
-								while(jchild) {
-									if(jchild->tag == JSON_STRING && strcmp(dptr->id, jchild->string_) == 0) {
-										match = 1;
-										break;
-									}
-									jchild = jchild->next;
+						}
+
+						/* Check if we need to update the state */
+						if(slots[s].state == 1) {
+							if((stateType == JSON_STRING &&
+								sptr->values->type == JSON_STRING &&
+								strcmp(sptr->values->string_, sstring_) != 0)) {
+								sptr->values->string_ = REALLOC(sptr->values->string_, strlen(sstring_)+1);
+								if(!sptr->values->string_) {
+									logprintf(LOG_ERR, "out of memory");
+									exit(EXIT_FAILURE);
 								}
-								if(match == 0) {
-									json_append_element(rdev, json_mkstring(dptr->id));
+								strcpy(sptr->values->string_, sstring_);
+								sptr->values->type = JSON_STRING;
+								dptr->timestamp = utct;
+								update = 1;
+							} else if((stateType == JSON_NUMBER &&
+									   sptr->values->type == JSON_NUMBER &&
+									   fabs(sptr->values->number_-snumber_) < EPSILON)) {
+								sptr->values->number_ = snumber_;
+								sptr->values->decimals = sdecimals_;
+								sptr->values->type = JSON_NUMBER;
+								dptr->timestamp = utct;
+								update = 1;
+							}
+							if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
+								json_append_member(rval, sptr->name, json_mkstring(sptr->values->string_));
+							} else if(sptr->values->type == JSON_NUMBER && json_find_number(rval, sptr->name, &itmp) != 0) {
+								json_append_member(rval, sptr->name, json_mknumber(sptr->values->number_, sptr->values->decimals));
+							}
+						}
+						if(update == 1) {
+							dptr->version = devices_current+1;
+							match = 0;
+							struct JsonNode *jchild = json_first_child(rdev);
+							while(jchild) {
+								if(jchild->tag == JSON_STRING && strcmp(dptr->id, jchild->string_) == 0) {
+									match = 1;
+									break;
 								}
+								jchild = jchild->next;
+							}
+							if(match == 0) {
+								json_append_element(rdev, json_mkstring(dptr->id));
 							}
-							sptr = sptr->next;
 						}
+						s++;
+						sptr = sptr->next;
 					}
 				}
 			}
-			dptr = dptr->next;
 		}
 	}
 
 	if(update == 1) {
+		devices_current++;
 		json_append_member(rroot, "origin", json_mkstring("update"));
 		json_append_member(rroot, "type",  json_mknumber((int)protocol->devtype, 0));
 		if(strlen(pilight_uuid) > 0 && (protocol->hwtype == SENSOR || protocol->hwtype == HWRELAY)) {
@@ -414,10 +747,74 @@ int devices_update(char *protoname, JsonNode *json, JsonNode **out) {
 	return (update == 1) ? 0 : -1;
 }
 
+/* Apply the values of an update as created by devices_update
+   again, e.g. when replaying the state journal */
+int devices_restore(struct JsonNode *jupdate) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct JsonNode *jdevices = json_find_member(jupdate, "devices");
+	struct JsonNode *jvalues = json_find_member(jupdate, "values");
+	struct JsonNode *jchild = NULL, *jvalue = NULL;
+	struct devices_t *dptr = NULL;
+	struct devices_settings_t *sptr = NULL;
+
+	if(jdevices == NULL || jvalues == NULL || jdevices->tag != JSON_ARRAY || jvalues->tag != JSON_OBJECT) {
+		return -1;
+	}
+
+	jchild = json_first_child(jdevices);
+	while(jchild) {
+		if(jchild->tag == JSON_STRING && devices_get(jchild->string_, &dptr) == 0) {
+			jvalue = json_first_child(jvalues);
+			while(jvalue) {
+				sptr = dptr->settings;
+				while(sptr) {
+					if(strcmp(sptr->name, jvalue->key) == 0) {
+						if(jvalue->tag == JSON_STRING && sptr->values->type == JSON_STRING) {
+							if(!(sptr->values->string_ = REALLOC(sptr->values->string_, strlen(jvalue->string_)+1))) {
+								logprintf(LOG_ERR, "out of memory");
+								exit(EXIT_FAILURE);
+							}
+							strcpy(sptr->values->string_, jvalue->string_);
+						} else if(jvalue->tag == JSON_NUMBER && sptr->values->type == JSON_NUMBER) {
+							sptr->values->number_ = jvalue->number_;
+							sptr->values->decimals = jvalue->decimals_;
+						}
+						break;
+					}
+					sptr = sptr->next;
+				}
+				if(jvalue->tag == JSON_NUMBER && strcmp(jvalue->key, "timestamp") == 0) {
+					dptr->timestamp = (time_t)jvalue->number_;
+				}
+				jvalue = jvalue->next;
+			}
+		}
+		jchild = jchild->next;
+	}
+
+	return 0;
+}
+
 int devices_get(char *sid, struct devices_t **dev) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct devices_t *dptr = NULL;
+	unsigned int i = 0;
+
+	if(devices_table != NULL) {
+		i = devices_hash(sid) & (devices_table_size-1);
+		while((dptr = devices_table[i]) != NULL) {
+			if(strcmp(dptr->id, sid) == 0) {
+				if(dev != NULL) {
+					*dev = dptr;
+				}
+				return 0;
+			}
+			i = (i+1) & (devices_table_size-1);
+		}
+		return 1;
+	}
 
 	dptr = devices;
 	while(dptr) {
@@ -504,7 +901,7 @@ int devices_valid_value(char *sid, char *name, char *value) {
 	return 1;
 }
 
-struct JsonNode *devices_values(const char *media) {
+static struct JsonNode *devices_print_values(const char *media, unsigned long since) {
 	/* Temporary pointer to the different structure */
 	struct devices_t *tmp_devices = NULL;
 	struct devices_settings_t *tmp_settings = NULL;
@@ -541,7 +938,7 @@ struct JsonNode *devices_values(const char *media) {
 		if(strcmp(media, "all") == 0) {
 			match = 1;
 		}
-		if(match == 1) {
+		if(match == 1 && tmp_devices->version > since) {
 			jelement = json_mkobject();
 			jdevices = json_mkarray();
 			jvalues = json_mkobject();
@@ -596,6 +993,25 @@ struct JsonNode *devices_values(const char *media) {
 	return jroot;
 }
 
+struct JsonNode *devices_values(const char *media) {
+	return devices_print_values(media, 0);
+}
+
+void devices_version(unsigned long long *epoch, unsigned long *version) {
+	*epoch = devices_epoch;
+	*version = devices_current;
+}
+
+struct JsonNode *devices_changed(const char *media, unsigned long long epoch, unsigned long version) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	if(devices == NULL || epoch != devices_epoch ||
+	   version < devices_parsed || version > devices_current) {
+		return NULL;
+	}
+	return devices_print_values(media, version);
+}
+
 struct JsonNode *devices_sync(int level, const char *media) {
 	/* Temporary pointer to the different structure */
 	struct devices_t *tmp_devices = NULL;
@@ -1526,6 +1942,7 @@ static int devices_parse(JsonNode *root) {
 				strcpy(dnode->id, jdevices->key);
 				dnode->nrthreads = 0;
 				dnode->timestamp = 0;
+				dnode->version = 0;
 				dnode->threads = NULL;
 				dnode->settings = NULL;
 				dnode->next = NULL;
@@ -1620,6 +2037,14 @@ static int devices_parse(JsonNode *root) {
 	}
 
 clear:
+	/* The versions of earlier devices don't apply to these */
+	devices_parsed = ++devices_current;
+	tmp_devices = devices;
+	while(tmp_devices) {
+		tmp_devices->version = devices_current;
+		tmp_devices = tmp_devices->next;
+	}
+	devices_index();
 	return have_error;
 }
 
@@ -1630,6 +2055,8 @@ int devices_gc(void) {
 	struct devices_values_t *vtmp;
 	struct protocols_t *ptmp;
 
+	devices_index_gc();
+
 	/* Free devices structure */
 	while(devices) {
 		dtmp = devices;
@@ -1705,6 +2132,11 @@ static int devices_read(JsonNode *root) {
 }
 
 void devices_init(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	devices_epoch = (unsigned long long)tv.tv_sec*1000000+(unsigned long long)tv.tv_usec;
+
 	/* Request hardware json object in main configuration */
 	config_register(&config_devices, "devices");
 	config_devices->readorder = 1;
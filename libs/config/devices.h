@@ -76,6 +76,8 @@ struct devices_t {
 	int cst_uuid;
 	int nrthreads;
 	time_t timestamp;
+	/* Of the last update that changed this device */
+	unsigned long version;
 	struct protocols_t *protocols;
 	struct devices_settings_t *settings;
 	struct threadqueue_t **threads;
@@ -85,10 +87,13 @@ struct devices_t {
 struct config_t *config_devices;
 
 int devices_update(char *protoname, JsonNode *message, JsonNode **out);
+int devices_restore(struct JsonNode *jupdate);
 int devices_get(char *sid, struct devices_t **dev);
 int devices_valid_state(char *sid, char *state);
 int devices_valid_value(char *sid, char *name, char *value);
 struct JsonNode *devices_values(const char *media);
+void devices_version(unsigned long long *epoch, unsigned long *version);
+struct JsonNode *devices_changed(const char *media, unsigned long long epoch, unsigned long version);
 void devices_init(void);
 int devices_gc(void);
 
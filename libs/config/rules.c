@@ -78,19 +78,23 @@ static int rules_parse(JsonNode *root) {
 						exit(EXIT_FAILURE);
 					}
 					node->next = NULL;
-					node->values = NULL;
+					node->condition = NULL;
 					node->nrdevices = 0;
 					node->status = 0;
 					node->devices = NULL;
 					node->action = NULL;
 					node->arguments = NULL;
-					if(event_parse_rule(rule, node, 0, i, 1) == -1) {
+					if(event_parse_rule(rule, node, i) == -1) {
 						for(i=0;i<node->nrdevices;i++) {
 							FREE(node->devices[i]);
 						}
 						if(node->devices != NULL) {
 							FREE(node->devices);
 						}
+						if(node->arguments != NULL) {
+							json_delete(node->arguments);
+						}
+						rules_node_gc(node->condition);
 						FREE(node);
 						have_error = 1;
 						break;
@@ -171,13 +175,23 @@ static JsonNode *rules_sync(int level, const char *media) {
 	return root;
 }
 
+void rules_node_gc(struct rules_node_t *node) {
+	if(node != NULL) {
+		rules_node_gc(node->left);
+		rules_node_gc(node->right);
+		if(node->string_ != NULL) {
+			FREE(node->string_);
+		}
+		FREE(node);
+	}
+}
+
 struct rules_t *rules_get(void) {
 	return rules;
 }
 
 int rules_gc(void) {
 	struct rules_t *tmp_rules = NULL;
-	struct rules_values_t *tmp_values = NULL;
 	int i = 0;
 
 	while(rules) {
@@ -187,19 +201,10 @@ int rules_gc(void) {
 		for(i=0;i<tmp_rules->nrdevices;i++) {
 			FREE(tmp_rules->devices[i]);
 		}
-		while(tmp_rules->values) {
-			tmp_values = tmp_rules->values;
-			FREE(tmp_values->name);
-			FREE(tmp_values->device);
-			tmp_rules->values = tmp_rules->values->next;
-			FREE(tmp_values);
-		}
+		rules_node_gc(tmp_rules->condition);
 		if(tmp_rules->arguments) {
 			json_delete(tmp_rules->arguments);
 		}
-		if(tmp_rules->values != NULL) {
-			FREE(tmp_rules->values);
-		}
 		if(tmp_rules->devices != NULL) {
 			FREE(tmp_rules->devices);
 		}
@@ -22,12 +22,26 @@
 #include "json.h"
 #include "config.h"
 
-typedef struct rules_values_t {
-	char *device;
-	char *name;
+#define RULES_NODE_VALUE		0
+#define RULES_NODE_VARIABLE	1
+#define RULES_NODE_OPERATOR	2
+
+/*
+ * A rule condition compiled into a tree. Values are constants
+ * from the rule text, variables point straight to the settings
+ * of the device they refer to and operators point to their
+ * callback, so a rule can be evaluated without parsing it again.
+ */
+typedef struct rules_node_t {
+	unsigned short type;
+	/* Constants, or the outcome of an operator */
+	char *string_;
+	double number_;
 	struct devices_settings_t *settings;
-	struct rules_values_t *next;
-} rules_values_t;
+	struct event_operators_t *operator;
+	struct rules_node_t *left;
+	struct rules_node_t *right;
+} rules_node_t;
 
 typedef struct rules_t {
 	char *rule;
@@ -39,7 +53,7 @@ typedef struct rules_t {
 	/* Arguments to be send to the action */
 	struct JsonNode *arguments;
 	struct event_actions_t *action;
-	struct rules_values_t *values;
+	struct rules_node_t *condition;
 	struct rules_t *next;
 } rules_t;
 
@@ -47,6 +61,7 @@ struct config_t *config_rules;
 
 void rules_init(void);
 int rules_gc(void);
+void rules_node_gc(struct rules_node_t *node);
 struct rules_t *rules_get(void);
 
 #endif
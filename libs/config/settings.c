@@ -175,7 +175,9 @@ static int settings_parse(JsonNode *root) {
 	while(jsettings) {
 		if(strcmp(jsettings->key, "port") == 0
 		   || strcmp(jsettings->key, "send-repeats") == 0
-		   || strcmp(jsettings->key, "receive-repeats") == 0) {
+		   || strcmp(jsettings->key, "receive-repeats") == 0
+		   || strcmp(jsettings->key, "receive-workers") == 0
+		   || strcmp(jsettings->key, "client-buffer-size") == 0) {
 			if(jsettings->tag != JSON_NUMBER) {
 				logprintf(LOG_ERR, "config setting \"%s\" must contain a number larger than 0", jsettings->key);
 				have_error = 1;
@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "../../pilight.h"
 #include "common.h"
@@ -35,6 +37,72 @@ static int gpio_433_in = 0;
 static int gpio_433_out = 0;
 static int gpio_433_initialized = 0;
 
+/* Edges closer than this many microseconds are busy-waited for */
+#define GPIO433_BUSYWAIT	100
+
+/* Offsets in nanoseconds of each edge within a single code */
+static long long *gpio_433_schedule = NULL;
+static int gpio_433_schedule_len = 0;
+/* How late clock_nanosleep wakes up, in nanoseconds */
+static long long gpio_433_latency = 0;
+
+static void gpio433Deadline(struct timespec *ts, struct timespec *start, long long offset) {
+	ts->tv_sec = start->tv_sec + (time_t)(offset / 1000000000LL);
+	ts->tv_nsec = start->tv_nsec + (long)(offset % 1000000000LL);
+	if(ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static long long gpio433Diff(struct timespec *a, struct timespec *b) {
+	return ((long long)(a->tv_sec - b->tv_sec) * 1000000000LL) + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Sleep until shortly before the deadline and busy-wait the
+   remainder. Returns how late we are in nanoseconds. */
+static long long gpio433Wait(struct timespec *deadline) {
+	struct timespec now, wake;
+	long long left = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = gpio433Diff(deadline, &now);
+	if(left > (GPIO433_BUSYWAIT*1000LL)+gpio_433_latency) {
+		wake = *deadline;
+		wake.tv_nsec -= (long)(gpio_433_latency+(GPIO433_BUSYWAIT*500LL));
+		while(wake.tv_nsec < 0) {
+			wake.tv_sec--;
+			wake.tv_nsec += 1000000000L;
+		}
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+	while((left = gpio433Diff(deadline, &now)) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+	return -left;
+}
+
+/* Measure how late an absolute sleep wakes up on this
+   machine, so we know how early to stop sleeping */
+static void gpio433Calibrate(void) {
+	struct timespec deadline, now;
+	long long late = 0;
+	int i = 0;
+
+	gpio_433_latency = 0;
+	for(i=0;i<16;i++) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		gpio433Deadline(&deadline, &now, GPIO433_BUSYWAIT*2000LL);
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if((late = gpio433Diff(&now, &deadline)) > gpio_433_latency) {
+			gpio_433_latency = late;
+		}
+	}
+	logprintf(LOG_DEBUG, "433gpio: sleeps wake up at most %lldus late", gpio_433_latency/1000);
+}
+
 static unsigned short gpio433HwInit(void) {
 	if(wiringXSetup() == -1) {
 		return EXIT_FAILURE;
@@ -46,6 +114,7 @@ static unsigned short gpio433HwInit(void) {
 			return EXIT_FAILURE;
 		}
 		pinMode(gpio_433_out, OUTPUT);
+		gpio433Calibrate();
 	}
 	if(gpio_433_in >= 0) {
 		if(wiringXValidGPIO(gpio_433_in) != 0) {
@@ -61,23 +130,55 @@ static unsigned short gpio433HwInit(void) {
 }
 
 static unsigned short gpio433HwDeinit(void) {
+	if(gpio_433_schedule != NULL) {
+		FREE(gpio_433_schedule);
+		gpio_433_schedule = NULL;
+	}
+	gpio_433_schedule_len = 0;
 	return EXIT_SUCCESS;
 }
 
+/* Every edge is toggled at a deadline relative to the start of the
+   transmission, so the time spent toggling and sleeping never adds
+   up over the pulses and repeats of a code. */
 static int gpio433Send(int *code, int rawlen, int repeats) {
+	struct timespec start, deadline;
+	long long train = 0, late = 0, total = 0, max = 0;
 	int r = 0, x = 0;
+
 	if(gpio_433_out >= 0) {
+		if(rawlen > gpio_433_schedule_len) {
+			if(!(gpio_433_schedule = REALLOC(gpio_433_schedule, sizeof(long long)*(size_t)rawlen))) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			gpio_433_schedule_len = rawlen;
+		}
+		for(x=0;x<rawlen;x++) {
+			gpio_433_schedule[x] = train;
+			train += (long long)code[x]*1000LL;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		for(r=0;r<repeats;r++) {
-			for(x=0;x<rawlen;x+=2) {
-				digitalWrite(gpio_433_out, 1);
-				usleep((__useconds_t)code[x]);
-				digitalWrite(gpio_433_out, 0);
-				if(x+1 < rawlen) {
-					usleep((__useconds_t)code[x+1]);
+			for(x=0;x<rawlen;x++) {
+				gpio433Deadline(&deadline, &start, (train*r)+gpio_433_schedule[x]);
+				late = gpio433Wait(&deadline);
+				digitalWrite(gpio_433_out, (x%2 == 0) ? 1 : 0);
+				total += late;
+				if(late > max) {
+					max = late;
 				}
 			}
 		}
+		gpio433Deadline(&deadline, &start, train*repeats);
+		gpio433Wait(&deadline);
 		digitalWrite(gpio_433_out, 0);
+
+		if(rawlen > 0 && repeats > 0) {
+			logprintf(LOG_DEBUG, "433gpio: sent %d pulses, edges were on average %.1fus and at most %.1fus late",
+				rawlen*repeats, (double)total/(double)(rawlen*repeats)/1000.0, (double)max/1000.0);
+		}
 	} else {
 		sleep(1);
 	}
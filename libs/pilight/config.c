@@ -20,12 +20,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
 #include <regex.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <libgen.h>
+#include <limits.h>
 
 #include "../../pilight.h"
 #include "common.h"
@@ -85,6 +88,30 @@ static void sort_list(int r) {
 /* The location of the config file */
 static char *configfile = NULL;
 
+/* Device updates are appended to a journal next to the config
+   file, so they survive a crash without rewriting the config */
+static char *journalfile = NULL;
+static int journalfd = -1;
+static unsigned long journalsize = 0;
+
+/* The updates are written by the journal thread, so the broadcaster
+   doesn't wait for the disk. A snapshot is a rendered config which
+   replaces the journaled updates before it once it's on disk. */
+typedef struct journal_t {
+	char *content;
+	size_t len;
+	int snapshot;
+	struct journal_t *next;
+} journal_t;
+
+static struct journal_t *journal = NULL;
+static struct journal_t *journal_tail = NULL;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_signal = PTHREAD_COND_INITIALIZER;
+/* Held while the journal or config file is written */
+static pthread_mutex_t journal_io_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned short journal_loop = 1;
+
 int config_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -102,6 +129,13 @@ int config_gc(void) {
 	if(configfile != NULL) {
 		FREE(configfile);
 	}
+	if(journalfd != -1) {
+		close(journalfd);
+		journalfd = -1;
+	}
+	if(journalfile != NULL) {
+		FREE(journalfile);
+	}
 	logprintf(LOG_DEBUG, "garbage collected config library");
 	return 1;
 }
@@ -154,11 +188,9 @@ JsonNode *config_print(int level, const char *media) {
 	return root;
 }
 
-int config_write(int level, const char *media) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
-
+static char *config_render(int level, const char *media) {
 	struct JsonNode *root = json_mkobject();
-	FILE *fp;
+	char *content = NULL;
 
 	sort_list(0);
 	struct config_t *listeners = config;
@@ -171,21 +203,341 @@ int config_write(int level, const char *media) {
 		}
 		listeners = listeners->next;
 	}
+	content = json_stringify(root, "\t");
+	json_delete(root);
+	return content;
+}
+
+/* Returns 0 when the content is on disk */
+static int config_store(const char *content) {
+	char path[PATH_MAX+1], tmpfile[PATH_MAX+5], dir[PATH_MAX+1];
+	struct stat st;
+	FILE *fp = NULL;
+	int error = 0, fd = -1;
+
+	/* Write a new file and move it over the old config, so a crash
+	   never leaves a half written config behind. If that's not
+	   possible, overwrite the config file itself. */
+	if(realpath(configfile, path) == NULL || strlen(path) > PATH_MAX-4) {
+		strncpy(path, configfile, PATH_MAX);
+		path[PATH_MAX] = '\0';
+	}
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", path);
 
-	/* Overwrite config file with proper format */
-	if(!(fp = fopen(configfile, "w+"))) {
+	if((fp = fopen(tmpfile, "w")) != NULL) {
+		if(stat(path, &st) == 0) {
+			fchmod(fileno(fp), st.st_mode);
+		}
+		if(fwrite(content, sizeof(char), strlen(content), fp) != strlen(content) ||
+		   fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+			error = 1;
+		}
+		if(fclose(fp) != 0) {
+			error = 1;
+		}
+		if(error == 0 && rename(tmpfile, path) != 0) {
+			error = 1;
+		}
+		if(error == 1) {
+			unlink(tmpfile);
+		} else {
+			/* The rename is only durable once the folder is synced */
+			strcpy(dir, path);
+			if((fd = open(dirname(dir), O_RDONLY)) != -1) {
+				if(fsync(fd) != 0 && errno != EINVAL) {
+					error = 1;
+				}
+				close(fd);
+			}
+		}
+	} else if((fp = fopen(configfile, "w+")) != NULL) {
+		fseek(fp, 0L, SEEK_SET);
+		if(fwrite(content, sizeof(char), strlen(content), fp) != strlen(content) ||
+		   fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+			error = 1;
+		}
+		if(fclose(fp) != 0) {
+			error = 1;
+		}
+	} else {
+		error = 1;
+	}
+
+	if(error == 1) {
 		logprintf(LOG_ERR, "cannot write config file: %s", configfile);
+		return -1;
+	}
+	return 0;
+}
+
+static void config_journal_free(struct journal_t *node) {
+	if(node->snapshot == 1) {
+		json_free(node->content);
+	} else {
+		FREE(node->content);
+	}
+	FREE(node);
+}
+
+/* Appends the updates in a single write and sync, up to the
+   next snapshot. Returns that snapshot or NULL. */
+static struct journal_t *config_journal_append(struct journal_t *node) {
+	struct iovec iov[64];
+	size_t len = 0;
+	ssize_t written = 0;
+	int n = 0;
+
+	while(node != NULL && node->snapshot == 0) {
+		n = 0;
+		len = 0;
+		while(node != NULL && node->snapshot == 0 && n < 64) {
+			iov[n].iov_base = node->content;
+			iov[n].iov_len = node->len;
+			len += node->len;
+			n++;
+			node = node->next;
+		}
+		if(journalfd == -1) {
+			continue;
+		}
+		if((written = writev(journalfd, iov, n)) != (ssize_t)len) {
+			logprintf(LOG_ERR, "cannot write state journal: %s", journalfile);
+		}
+#ifndef __FreeBSD__
+		fdatasync(journalfd);
+#else
+		fsync(journalfd);
+#endif
+	}
+	return node;
+}
+
+/* Empties the journal after a config write that is on disk */
+static void config_journal_truncate(void) {
+	if(journalfd != -1) {
+		if(ftruncate(journalfd, 0) != 0) {
+			logprintf(LOG_ERR, "cannot truncate state journal: %s", journalfile);
+		}
+	}
+}
+
+/* Writes the queued updates and snapshots. The caller holds
+   journal_io_lock. */
+static void config_journal_flush(struct journal_t *queue) {
+	struct journal_t *node = queue, *tmp = NULL;
+
+	while(node != NULL) {
+		if((node = config_journal_append(node)) != NULL) {
+			logprintf(LOG_DEBUG, "writing journaled device updates to %s", configfile);
+			if(config_store(node->content) == 0) {
+				config_journal_truncate();
+			}
+			node = node->next;
+		}
+	}
+	while(queue != NULL) {
+		tmp = queue;
+		queue = queue->next;
+		config_journal_free(tmp);
+	}
+}
+
+int config_write(int level, const char *media) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct journal_t *queue = NULL, *tmp = NULL;
+	char *content = NULL;
+	int error = 0;
+
+	pthread_mutex_lock(&journal_io_lock);
+	/* The queued updates are part of this config. They are only
+	   dropped once it's on disk. */
+	pthread_mutex_lock(&journal_lock);
+	queue = journal;
+	journal = journal_tail = NULL;
+	journalsize = 0;
+	pthread_mutex_unlock(&journal_lock);
+
+	content = config_render(level, media);
+	error = config_store(content);
+	json_free(content);
+
+	if(error == 0) {
+		/* All journaled updates are part of the config now */
+		config_journal_truncate();
+		while(queue != NULL) {
+			tmp = queue;
+			queue = queue->next;
+			config_journal_free(tmp);
+		}
+	} else {
+		config_journal_flush(queue);
+	}
+	pthread_mutex_unlock(&journal_io_lock);
+
+	return (error == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Replay the device updates that didn't make it into the config
+   file yet and start journaling new ones */
+int config_journal_open(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct JsonNode *jupdate = NULL;
+	struct stat st;
+	char *content = NULL, *line = NULL, *next = NULL;
+	int fd = -1, restored = 0, skipped = 0;
+
+	if(configfile == NULL) {
 		return EXIT_FAILURE;
 	}
-	fseek(fp, 0L, SEEK_SET);
-	char *content = json_stringify(root, "\t");
- 	fwrite(content, sizeof(char), strlen(content), fp);
-	fclose(fp);
+	if(!(journalfile = REALLOC(journalfile, strlen(configfile)+strlen(".journal")+1))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(journalfile, "%s.journal", configfile);
+
+	if((fd = open(journalfile, O_RDONLY)) != -1) {
+		if(fstat(fd, &st) == 0 && st.st_size > 0) {
+			if(!(content = CALLOC((size_t)st.st_size+1, sizeof(char)))) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			if(read(fd, content, (size_t)st.st_size) != st.st_size) {
+				logprintf(LOG_ERR, "cannot read state journal: %s", journalfile);
+			}
+			line = content;
+			while(line != NULL && *line != '\0') {
+				if((next = strstr(line, "\n")) != NULL) {
+					*next = '\0';
+					next++;
+				}
+				/* The last entry can be incomplete after a power loss */
+				if((jupdate = json_decode_arena(line)) != NULL) {
+					if(devices_restore(jupdate) == 0) {
+						restored++;
+					}
+					json_delete(jupdate);
+				} else {
+					skipped++;
+				}
+				line = next;
+			}
+			FREE(content);
+		}
+		close(fd);
+	}
+	if(restored > 0) {
+		logprintf(LOG_INFO, "restored %d device updates from %s", restored, journalfile);
+	}
+	if(skipped > 0) {
+		logprintf(LOG_NOTICE, "skipped %d incomplete entries in %s", skipped, journalfile);
+	}
+
+	if((journalfd = open(journalfile, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+		logprintf(LOG_ERR, "cannot open state journal: %s", journalfile);
+		return EXIT_FAILURE;
+	}
+	journalsize = 0;
+	if(restored > 0 || skipped > 0) {
+		config_write(1, "all");
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Queue a device update for the journal thread. Once enough has been
+   journaled, the config is rendered here, while the devices don't
+   change, and written by the journal thread as well. */
+int config_journal(struct JsonNode *jupdate) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct journal_t *node = NULL, *snapshot = NULL;
+	char *content = NULL;
+	size_t len = 0;
+
+	if(journalfd == -1) {
+		return EXIT_SUCCESS;
+	}
+
+	content = json_stringify(jupdate, NULL);
+	len = strlen(content);
+	if((node = MALLOC(sizeof(struct journal_t))) == NULL ||
+	   (node->content = MALLOC(len+2)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	/* One line per update, so an entry is never interleaved */
+	memcpy(node->content, content, len);
+	node->content[len] = '\n';
+	node->content[len+1] = '\0';
+	node->len = len+1;
+	node->snapshot = 0;
+	node->next = NULL;
 	json_free(content);
-	json_delete(root);
+
+	pthread_mutex_lock(&journal_lock);
+	journalsize += (unsigned long)node->len;
+	if(journalsize >= JOURNAL_MAX_SIZE) {
+		if((snapshot = MALLOC(sizeof(struct journal_t))) == NULL) {
+			logprintf(LOG_ERR, "out of memory");
+			exit(EXIT_FAILURE);
+		}
+		snapshot->content = config_render(1, "all");
+		snapshot->len = strlen(snapshot->content);
+		snapshot->snapshot = 1;
+		snapshot->next = NULL;
+		node->next = snapshot;
+		journalsize = 0;
+	}
+	if(journal_tail == NULL) {
+		journal = node;
+	} else {
+		journal_tail->next = node;
+	}
+	journal_tail = (snapshot != NULL) ? snapshot : node;
+	pthread_mutex_unlock(&journal_lock);
+	pthread_cond_signal(&journal_signal);
+
 	return EXIT_SUCCESS;
 }
 
+void *config_journal_loop(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct journal_t *queue = NULL;
+
+	while(1) {
+		pthread_mutex_lock(&journal_lock);
+		while(journal_loop == 1 && journal == NULL) {
+			pthread_cond_wait(&journal_signal, &journal_lock);
+		}
+		/* Everything that was queued is written before stopping */
+		if(journal == NULL) {
+			pthread_mutex_unlock(&journal_lock);
+			break;
+		}
+		pthread_mutex_unlock(&journal_lock);
+
+		pthread_mutex_lock(&journal_io_lock);
+		pthread_mutex_lock(&journal_lock);
+		queue = journal;
+		journal = journal_tail = NULL;
+		pthread_mutex_unlock(&journal_lock);
+		config_journal_flush(queue);
+		pthread_mutex_unlock(&journal_io_lock);
+	}
+	return (void *)NULL;
+}
+
+void config_journal_stop(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	pthread_mutex_lock(&journal_lock);
+	journal_loop = 0;
+	pthread_mutex_unlock(&journal_lock);
+	pthread_cond_signal(&journal_signal);
+}
+
 int config_read(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -215,13 +567,12 @@ int config_read(void) {
 	}
 	fclose(fp);
 
-	/* Validate JSON and turn into JSON object */
-	if(json_validate(content) == false) {
+	/* Validate JSON and turn into JSON object in one pass */
+	if((root = json_decode(content)) == NULL) {
 		logprintf(LOG_ERR, "config is not in a valid json format");
 		FREE(content);
 		return EXIT_FAILURE;
 	}
-	root = json_decode(content);
 
 	if(config_parse(root) != EXIT_SUCCESS) {
 		FREE(content);
@@ -36,6 +36,10 @@ typedef struct config_t {
 } config_t;
 
 int config_write(int level, const char *media);
+int config_journal_open(void);
+int config_journal(struct JsonNode *jupdate);
+void *config_journal_loop(void *param);
+void config_journal_stop(void);
 int config_read(void);
 int config_parse(struct JsonNode *root);
 struct JsonNode *config_print(int level, const char *media);
@@ -30,21 +30,23 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
-#include "json.h"
 #include "common.h"
 #include "log.h"
 #include "mem.h"
+#include "tzindex.h"
 
-#define NRCOUNTRIES 	408
 #define PRECISION 		1
 
-#define min(a,b) (((a)<(b))?(a):(b))
-#define max(a,b) (((a)>(b))?(a):(b))
-
-static int ***tzcoords;
-static unsigned int tznrpolys[NRCOUNTRIES];
-static char tznames[NRCOUNTRIES][30];
+static struct tzindex_t tzindex;
+/* The mapped index file or the index built from tzdata.json */
+static char *tzbuffer = NULL;
+static size_t tzbuffersize = 0;
+static int tzmapped = 0;
+/* Copies that stay valid for the callers after a gc */
+static char (*tznames)[TZINDEX_NAMELEN] = NULL;
+static unsigned int tznrnames = 0;
 static int tzdatafilled = 0;
 static pthread_mutex_t tzlock;
 static pthread_mutexattr_t tzattr;
@@ -57,31 +59,78 @@ static int tz_lock_initialized = 0;
 static int fillingtzdata = 0;
 static int searchingtz = 0;
 
-static int fillTZData(void) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+/*
+	Timezones are read from the compiled zoneinfo database once
+	and cached, so converting times never has to switch the TZ
+	environment of the whole process.
+*/
+typedef struct tztype_t {
+	int offset;
+	int isdst;
+} tztype_t;
+
+typedef struct tzrule_t {
+	/* M(onth.week.day), J(ulian day without leap days) or D(ay) */
+	char type;
+	int month;
+	int week;
+	int day;
+	int time;
+} tzrule_t;
+
+typedef struct tzzone_t {
+	char *name;
+	unsigned int nrtransitions;
+	long long *transitions;
+	unsigned char *types;
+	unsigned int nrtypes;
+	struct tztype_t *ttypes;
+	/* The POSIX rule for everything after the last transition */
+	int hasrule;
+	int hasdst;
+	struct tztype_t std;
+	struct tztype_t dst;
+	struct tzrule_t start;
+	struct tzrule_t end;
+	struct tzzone_t *next;
+} tzzone_t;
+
+static struct tzzone_t *tzzones = NULL;
+static pthread_mutex_t tzzones_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct tm tzlocal;
+
+static int tzdata_map(void) {
+	struct stat st;
+	int fd = 0;
+	char *buffer = NULL;
 
-	if(tz_lock_initialized == 0) {
-		pthread_mutexattr_init(&tzattr);
-		pthread_mutexattr_settype(&tzattr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&tzlock, &tzattr);
-		tz_lock_initialized = 1;
+	if((fd = open(TZDATA_INDEX_FILE, O_RDONLY)) < 0) {
+		return EXIT_FAILURE;
 	}
-
-	pthread_mutex_lock(&tzlock);
-/*
-	Extra checks for gracefull (early)
-  stopping of pilight 
-*/	
-	fillingtzdata = 1;
-	if(tzdatafilled == 1) {
-		fillingtzdata = 0;
-		pthread_mutex_unlock(&tzlock);
-		return EXIT_SUCCESS;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	buffer = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(buffer == MAP_FAILED) {
+		return EXIT_FAILURE;
 	}
-	char *content = NULL;
-	JsonNode *root = NULL;
+	if(tzindex_open(&tzindex, buffer, (size_t)st.st_size) != 0) {
+		logprintf(LOG_NOTICE, "tzdata index is outdated or corrupt: %s", TZDATA_INDEX_FILE);
+		munmap(buffer, (size_t)st.st_size);
+		return EXIT_FAILURE;
+	}
+	tzbuffer = buffer;
+	tzbuffersize = (size_t)st.st_size;
+	tzmapped = 1;
+	return EXIT_SUCCESS;
+}
+
+static int tzdata_build(void) {
+	char *content = NULL, *buffer = NULL;
 	FILE *fp;
-	size_t bytes;
+	size_t bytes, size = 0;
 	struct stat st;
 
 	char tzdatafile[] = TZDATA_FILE;
@@ -97,7 +146,6 @@ static int fillTZData(void) {
 	if(!(content = calloc(bytes+1, sizeof(char)))) {
 		logprintf(LOG_ERR, "out of memory");
 		fclose(fp);
-		fillingtzdata = 0;
 		return EXIT_FAILURE;
 	}
 
@@ -106,55 +154,73 @@ static int fillTZData(void) {
 	}
 	fclose(fp);
 
-	/* Validate JSON and turn into JSON object */
-	if(json_validate(content) == false) {
+	logprintf(LOG_DEBUG, "loading timezone database...");
+	if((buffer = tzindex_build(content, &size)) == NULL || tzindex_open(&tzindex, buffer, size) != 0) {
 		logprintf(LOG_ERR, "tzdata is not in a valid json format");
+		free(buffer);
 		free(content);
+		return EXIT_FAILURE;
+	}
+	free(content);
+	tzbuffer = buffer;
+	tzbuffersize = size;
+	tzmapped = 0;
+	return EXIT_SUCCESS;
+}
+
+static void tzdata_free(void) {
+	if(tzbuffer != NULL) {
+		if(tzmapped == 1) {
+			munmap(tzbuffer, tzbuffersize);
+		} else {
+			free(tzbuffer);
+		}
+		tzbuffer = NULL;
+		tzbuffersize = 0;
+	}
+}
+
+static int fillTZData(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+	unsigned int i = 0;
+
+	if(tz_lock_initialized == 0) {
+		pthread_mutexattr_init(&tzattr);
+		pthread_mutexattr_settype(&tzattr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&tzlock, &tzattr);
+		tz_lock_initialized = 1;
+	}
+
+	pthread_mutex_lock(&tzlock);
+/*
+	Extra checks for gracefull (early)
+  stopping of pilight 
+*/	
+	fillingtzdata = 1;
+	if(tzdatafilled == 1) {
+		fillingtzdata = 0;
+		pthread_mutex_unlock(&tzlock);
+		return EXIT_SUCCESS;
+	}
+
+	/* The index compiled at build time only has to be mapped,
+	   tzdata.json is the fallback when it is missing */
+	if(tzdata_map() == EXIT_FAILURE && tzdata_build() == EXIT_FAILURE) {
 		fillingtzdata = 0;
+		pthread_mutex_unlock(&tzlock);
 		return EXIT_FAILURE;
 	}
 
-	logprintf(LOG_DEBUG, "loading timezone database...");
-	root = json_decode(content);
-
-	JsonNode *alist = json_first_child(root);
-	unsigned int i = 0, x = 0, y = 0;
-	while(alist) {
-		JsonNode *country = json_first_child(alist);
-		while(country) {
-			strcpy(tznames[i], country->key);
-			if(!(tzcoords = realloc(tzcoords, sizeof(int **)*(i+1)))) {
-				logprintf(LOG_ERR, "out of memory");
-			}
-			tzcoords[i] = NULL;
-			JsonNode *coords = json_first_child(country);
-			x = 0;
-			while(coords) {
-				y = 0;
-				if(!(tzcoords[i] = realloc(tzcoords[i], sizeof(int *)*(x+1)))) {
-					logprintf(LOG_ERR, "out of memory");
-				}
-				tzcoords[i][x] = NULL;
-				if(!(tzcoords[i][x] = malloc(sizeof(int)*2))) {
-					logprintf(LOG_ERR, "out of memory");
-				}
-				JsonNode *lonlat = json_first_child(coords);
-				while(lonlat) {
-					tzcoords[i][x][y] = (int)lonlat->number_;
-					y++;
-					lonlat = lonlat->next;
-				}
-				x++;
-				coords = coords->next;
-			}
-			tznrpolys[i] = x;
-			i++;
-			country = country->next;
+	if(tzindex.header->nrzones > tznrnames) {
+		if(!(tznames = realloc(tznames, TZINDEX_NAMELEN*tzindex.header->nrzones))) {
+			logprintf(LOG_ERR, "out of memory");
+			exit(EXIT_FAILURE);
 		}
-		alist = alist->next;
+		tznrnames = tzindex.header->nrzones;
+	}
+	for(i=0;i<tzindex.header->nrzones;i++) {
+		strcpy(tznames[i], tzindex.zones[i].name);
 	}
-	json_delete(root);
-	free(content);
 	tzdatafilled = 1;
 	fillingtzdata = 0;
 	pthread_mutex_unlock(&tzlock);
@@ -162,7 +228,7 @@ static int fillTZData(void) {
 }
 
 int datetime_gc(void) {
-	int i = 0, a = 0;
+	struct tzzone_t *zone = NULL;
 /*
 	Extra checks for gracefull (early)
   stopping of pilight 
@@ -174,16 +240,23 @@ int datetime_gc(void) {
 		usleep(10);
 	}	
 	if(tzdatafilled == 1) {
-		for(i=0;i<NRCOUNTRIES;i++) {
-			unsigned int n = tznrpolys[i];
-			for(a=0;a<n;a++) {
-				free(tzcoords[i][a]);
-			}
-			free(tzcoords[i]);
+		tzdata_free();
+		tzdatafilled = 0;
+	}
+	pthread_mutex_lock(&tzzones_lock);
+	while(tzzones) {
+		zone = tzzones;
+		tzzones = tzzones->next;
+		if(zone->nrtypes > 0) {
+			FREE(zone->transitions);
+			FREE(zone->types);
+			FREE(zone->ttypes);
 		}
-		free(tzcoords);
-		logprintf(LOG_DEBUG, "garbage collected datetime library");
+		FREE(zone->name);
+		FREE(zone);
 	}
+	pthread_mutex_unlock(&tzzones_lock);
+	logprintf(LOG_DEBUG, "garbage collected datetime library");
 	return EXIT_SUCCESS;
 }
 
@@ -200,69 +273,533 @@ char *coord2tz(double longitude, double latitude) {
 */
 	pthread_mutex_lock(&tzlock);
 	searchingtz = 1;
-	int i = 0, a = 0, margin = 1, inside = 0;
 	char *tz = NULL;
+	int i = 0;
 
-	margin *= (int)pow(10, PRECISION);
 	int y = (int)round(latitude*(int)pow(10, PRECISION));
 	int x = (int)round(longitude*(int)pow(10, PRECISION));
 
-	while(!inside && margin < (5*(int)pow(10, PRECISION))) {
-		for(i=0;i<NRCOUNTRIES;i++) {
-			unsigned int n = tznrpolys[i];
-			if(n > 0) {
-				int p1x = 0;
-				int p1y = 0;
-				for(a=0;a<n;a++) {
-					if(tzcoords[i][a][0] < p1x || ((int)p1x == 0)) {
-						p1x = tzcoords[i][a][0];
-					}
-					if(tzcoords[i][a][1] < p1y && ((int)p1y == 0)) {
-						p1y = tzcoords[i][a][1];
-					}
-				}
-				for(a=0;a<n+1;a++) {
-					int p2x = tzcoords[i][a % (int)n][0];
-					int p2y = tzcoords[i][a % (int)n][1];
-					if((round(p2x)-margin < round(x) && round(p2x)+margin > round(x))
-					   &&(round(p2y)-margin < round(y) && round(p2y)+margin > round(y))) {
-						int xinters = 0;
-						if(y > min(p1y, p2y)) {
-							if(y <= max(p1y, p2y)) {
-								if(x <= max(p1x, p2x)) {
-									if(p1y != p2y) {
-										xinters = (y-p1y)*(p2x-p1x)/(p2y-p1y)+p1x;
-									}
-									if(p1x == p2x || x <= xinters) {
-										tz = tznames[i];
-										inside = 1;
-										break;
-									}
-								}
-							}
-						}
-						p1x = p2x;
-						p1y = p2y;
-					}
+	if((i = tzindex_search(&tzindex, x, y)) > -1) {
+		tz = tznames[i];
+	}
+	searchingtz = 0;	
+	pthread_mutex_unlock(&tzlock);
+	return tz;
+}
+
+static long long tz_days(long long y, int m, int d) {
+	long long era = 0;
+	unsigned int yoe = 0, doy = 0, doe = 0;
+
+	y -= (m <= 2);
+	era = (y >= 0 ? y : y-399) / 400;
+	yoe = (unsigned int)(y-era*400);
+	doy = (unsigned int)((153*(m+(m > 2 ? -3 : 9))+2)/5+d-1);
+	doe = yoe*365+yoe/4-yoe/100+doy;
+	return era*146097+(long long)doe-719468;
+}
+
+static int tz_leap(long long y) {
+	return (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0));
+}
+
+static void tz_breakdown(long long t, int offset, int isdst, struct tm *tm) {
+	long long days = 0, secs = 0, era = 0, y = 0;
+	unsigned int doe = 0, yoe = 0, doy = 0, mp = 0, d = 0, m = 0;
+
+	t += offset;
+	days = t / 86400;
+	secs = t % 86400;
+	if(secs < 0) {
+		secs += 86400;
+		days--;
+	}
+
+	memset(tm, '\0', sizeof(struct tm));
+	tm->tm_hour = (int)(secs/3600);
+	tm->tm_min = (int)((secs%3600)/60);
+	tm->tm_sec = (int)(secs%60);
+	tm->tm_wday = (int)((days+4) % 7);
+	if(tm->tm_wday < 0) {
+		tm->tm_wday += 7;
+	}
+
+	days += 719468;
+	era = (days >= 0 ? days : days-146096) / 146097;
+	doe = (unsigned int)(days-era*146097);
+	yoe = (doe-doe/1460+doe/36524-doe/146096)/365;
+	y = (long long)yoe+era*400;
+	doy = doe-(365*yoe+yoe/4-yoe/100);
+	mp = (5*doy+2)/153;
+	d = doy-(153*mp+2)/5+1;
+	m = mp < 10 ? mp+3 : mp-9;
+	y += (m <= 2);
+
+	tm->tm_mday = (int)d;
+	tm->tm_mon = (int)m-1;
+	tm->tm_year = (int)(y-1900);
+	tm->tm_yday = (int)(days-719468-tz_days(y, 1, 1));
+	tm->tm_isdst = isdst;
+}
+
+/* Seconds since the epoch at which a rule fires in a year, in local time */
+static long long tz_rule_time(struct tzrule_t *rule, long long year) {
+	long long days = 0;
+	int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int wday = 0, mday = 0;
+
+	switch(rule->type) {
+		case 'J':
+			days = tz_days(year, 1, 1)+rule->day-1;
+			if(tz_leap(year) && rule->day >= 60) {
+				days++;
+			}
+		break;
+		case 'D':
+			days = tz_days(year, 1, 1)+rule->day;
+		break;
+		default:
+			days = tz_days(year, rule->month, 1);
+			wday = (int)(((days+4) % 7 + 7) % 7);
+			mday = 1+(rule->day-wday+7) % 7+(rule->week-1)*7;
+			if(rule->month == 2 && tz_leap(year)) {
+				mdays[1] = 29;
+			}
+			while(mday > mdays[rule->month-1]) {
+				mday -= 7;
+			}
+			days += mday-1;
+		break;
+	}
+	return days*86400+rule->time;
+}
+
+static struct tztype_t *tz_rule_type(struct tzzone_t *zone, long long t) {
+	long long year = 0, start = 0, end = 0;
+	struct tm tm;
+
+	if(zone->hasdst == 0) {
+		return &zone->std;
+	}
+	tz_breakdown(t, zone->std.offset, 0, &tm);
+	year = (long long)tm.tm_year+1900;
+	start = tz_rule_time(&zone->start, year)-zone->std.offset;
+	end = tz_rule_time(&zone->end, year)-zone->dst.offset;
+	if(start < end) {
+		return (t >= start && t < end) ? &zone->dst : &zone->std;
+	} else {
+		return (t >= end && t < start) ? &zone->std : &zone->dst;
+	}
+}
+
+/* The number of transitions at or before a time */
+static unsigned int tz_index(struct tzzone_t *zone, long long t) {
+	unsigned int lo = 0, hi = zone->nrtransitions, mid = 0;
+
+	while(lo < hi) {
+		mid = (lo+hi)/2;
+		if(zone->transitions[mid] <= t) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static struct tztype_t *tz_type(struct tzzone_t *zone, long long t) {
+	unsigned int i = 0;
+
+	if(zone->nrtransitions == 0 || t < zone->transitions[0]) {
+		if(zone->nrtransitions == 0 && zone->hasrule == 1) {
+			return tz_rule_type(zone, t);
+		}
+		/* Before the first transition the first standard time applies */
+		for(i=0;i<zone->nrtypes;i++) {
+			if(zone->ttypes[i].isdst == 0) {
+				return &zone->ttypes[i];
+			}
+		}
+		return &zone->ttypes[0];
+	}
+	if(t >= zone->transitions[zone->nrtransitions-1] && zone->hasrule == 1) {
+		return tz_rule_type(zone, t);
+	}
+	return &zone->ttypes[zone->types[tz_index(zone, t)-1]];
+}
+
+/*
+	The offset of the nearest period with the requested dst state.
+	Like mktime this looks in steps of a week, earlier times first.
+*/
+static int tz_isdst_offset(struct tzzone_t *zone, long long t, int isdst, int offset) {
+	long long prev = -1, next = -1, stride = 601200;
+	unsigned int lo = 0, i = 0;
+
+	if(zone->hasrule == 1 && (zone->nrtransitions == 0 || t >= zone->transitions[zone->nrtransitions-1])) {
+		if(isdst > 0 && zone->hasdst == 1) {
+			return zone->dst.offset;
+		} else if(isdst == 0) {
+			return zone->std.offset;
+		}
+		return offset;
+	}
+	lo = tz_index(zone, t);
+	for(i=lo;i>=2;i--) {
+		if(zone->ttypes[zone->types[i-2]].isdst == (isdst > 0)) {
+			prev = i-2;
+			break;
+		}
+	}
+	for(i=lo;i<zone->nrtransitions;i++) {
+		if(zone->ttypes[zone->types[i]].isdst == (isdst > 0)) {
+			next = i;
+			break;
+		}
+	}
+	if(prev > -1 && (next == -1 ||
+	   (t-zone->transitions[prev+1]+stride)/stride <= (zone->transitions[next]-t+stride-1)/stride)) {
+		return zone->ttypes[zone->types[prev]].offset;
+	} else if(next > -1) {
+		return zone->ttypes[zone->types[next]].offset;
+	}
+	return offset;
+}
+
+static int tz_posix_name(char **str) {
+	char *p = *str;
+
+	if(*p == '<') {
+		while(*p != '\0' && *p != '>') {
+			p++;
+		}
+		if(*p != '>') {
+			return -1;
+		}
+		p++;
+	} else {
+		while(isalpha((unsigned char)*p)) {
+			p++;
+		}
+		if(p-*str < 3) {
+			return -1;
+		}
+	}
+	*str = p;
+	return 0;
+}
+
+static int tz_posix_time(char **str, int *out) {
+	char *p = *str;
+	int sign = 1, h = 0, m = 0, s = 0;
+
+	if(*p == '+' || *p == '-') {
+		sign = (*p == '-') ? -1 : 1;
+		p++;
+	}
+	if(!isdigit((unsigned char)*p)) {
+		return -1;
+	}
+	h = (int)strtol(p, &p, 10);
+	if(*p == ':') {
+		m = (int)strtol(p+1, &p, 10);
+		if(*p == ':') {
+			s = (int)strtol(p+1, &p, 10);
+		}
+	}
+	*out = sign*(h*3600+m*60+s);
+	*str = p;
+	return 0;
+}
+
+static int tz_posix_rule(char **str, struct tzrule_t *rule) {
+	char *p = *str;
+
+	if(*p == 'M') {
+		rule->type = 'M';
+		rule->month = (int)strtol(p+1, &p, 10);
+		if(*p != '.') {
+			return -1;
+		}
+		rule->week = (int)strtol(p+1, &p, 10);
+		if(*p != '.') {
+			return -1;
+		}
+		rule->day = (int)strtol(p+1, &p, 10);
+		if(rule->month < 1 || rule->month > 12 || rule->week < 1 || rule->week > 5 || rule->day < 0 || rule->day > 6) {
+			return -1;
+		}
+	} else if(*p == 'J') {
+		rule->type = 'J';
+		rule->day = (int)strtol(p+1, &p, 10);
+	} else if(isdigit((unsigned char)*p)) {
+		rule->type = 'D';
+		rule->day = (int)strtol(p, &p, 10);
+	} else {
+		return -1;
+	}
+	rule->time = 7200;
+	if(*p == '/') {
+		p++;
+		if(tz_posix_time(&p, &rule->time) != 0) {
+			return -1;
+		}
+	}
+	*str = p;
+	return 0;
+}
+
+/* Parses rules like CET-1CEST,M3.5.0,M10.5.0/3 */
+static int tz_posix(struct tzzone_t *zone, char *str) {
+	char def[] = "M3.2.0,M11.1.0";
+	char *p = str;
+	int offset = 0;
+
+	if(tz_posix_name(&p) != 0 || tz_posix_time(&p, &offset) != 0) {
+		return -1;
+	}
+	/* POSIX offsets count westwards */
+	zone->std.offset = -offset;
+	zone->std.isdst = 0;
+	zone->hasdst = 0;
+	if(*p != '\0') {
+		if(tz_posix_name(&p) != 0) {
+			return -1;
+		}
+		zone->dst.offset = zone->std.offset+3600;
+		zone->dst.isdst = 1;
+		if(*p != ',' && *p != '\0') {
+			if(tz_posix_time(&p, &offset) != 0) {
+				return -1;
+			}
+			zone->dst.offset = -offset;
+		}
+		if(*p == ',') {
+			p++;
+			if(tz_posix_rule(&p, &zone->start) != 0 || *p != ',') {
+				return -1;
+			}
+			p++;
+			if(tz_posix_rule(&p, &zone->end) != 0) {
+				return -1;
+			}
+		} else {
+			/* The default rule of the POSIX standard */
+			p = def;
+			tz_posix_rule(&p, &zone->start);
+			p++;
+			tz_posix_rule(&p, &zone->end);
+		}
+		zone->hasdst = 1;
+	}
+	zone->hasrule = 1;
+	return 0;
+}
+
+static long long tz_be(unsigned char *p, int size) {
+	unsigned long long v = 0;
+	int i = 0;
+
+	for(i=0;i<size;i++) {
+		v = (v << 8) | p[i];
+	}
+	if(size == 4) {
+		return (long long)(int)(unsigned int)v;
+	}
+	return (long long)v;
+}
+
+/* Reads a compiled zoneinfo (TZif) file */
+static int tz_tzfile(struct tzzone_t *zone, unsigned char *buf, size_t len) {
+	unsigned long counts[6];
+	unsigned char *p = buf, *end = buf+len, *footer = NULL;
+	unsigned int i = 0;
+	int size = 4, x = 0;
+
+	if(len < 44 || memcmp(buf, "TZif", 4) != 0) {
+		return -1;
+	}
+	/* Skip the 32 bit data of version 2+ files */
+	for(x=0;x<2;x++) {
+		if(end-p < 44) {
+			return -1;
+		}
+		for(i=0;i<6;i++) {
+			counts[i] = (unsigned long)tz_be(&p[20+i*4], 4);
+		}
+		if(x == 0 && buf[4] >= '2') {
+			p += 44+counts[3]*4+counts[3]+counts[4]*6+counts[5]+counts[2]*8+counts[1]+counts[0];
+			size = 8;
+		} else {
+			p += 44;
+			break;
+		}
+	}
+	if(counts[4] == 0 || (size_t)(end-p) < counts[3]*(unsigned long)size+counts[3]+counts[4]*6) {
+		return -1;
+	}
+
+	zone->nrtransitions = (unsigned int)counts[3];
+	zone->nrtypes = (unsigned int)counts[4];
+	if((zone->transitions = MALLOC(sizeof(long long)*(zone->nrtransitions+1))) == NULL ||
+	   (zone->types = MALLOC(zone->nrtransitions+1)) == NULL ||
+	   (zone->ttypes = MALLOC(sizeof(struct tztype_t)*zone->nrtypes)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	for(i=0;i<zone->nrtransitions;i++) {
+		zone->transitions[i] = tz_be(p, size);
+		p += size;
+	}
+	for(i=0;i<zone->nrtransitions;i++) {
+		zone->types[i] = *p++;
+		if(zone->types[i] >= zone->nrtypes) {
+			return -1;
+		}
+	}
+	for(i=0;i<zone->nrtypes;i++) {
+		zone->ttypes[i].offset = (int)tz_be(p, 4);
+		zone->ttypes[i].isdst = p[4];
+		p += 6;
+	}
+	p += counts[5]+counts[2]*(unsigned long)(size+4)+counts[1]+counts[0];
+
+	/* Version 2+ files end with a POSIX rule for later times */
+	if(size == 8 && p < end && *p == '\n') {
+		footer = ++p;
+		while(p < end && *p != '\n') {
+			p++;
+		}
+		if(p < end && p > footer) {
+			*p = '\0';
+			if(tz_posix(zone, (char *)footer) != 0) {
+				zone->hasrule = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+static struct tzzone_t *tz_load(char *name) {
+	struct tzzone_t *zone = NULL;
+	unsigned char *buf = NULL;
+	char path[1024];
+	struct stat st;
+	ssize_t rc = 0;
+	size_t len = 0;
+	int fd = -1;
+
+	/* Zones are never freed before the library is
+	   garbage collected, so lookups don't need a lock */
+	for(zone=tzzones;zone!=NULL;zone=zone->next) {
+		if(strcmp(zone->name, name) == 0) {
+			return zone;
+		}
+	}
+
+	pthread_mutex_lock(&tzzones_lock);
+	for(zone=tzzones;zone!=NULL;zone=zone->next) {
+		if(strcmp(zone->name, name) == 0) {
+			pthread_mutex_unlock(&tzzones_lock);
+			return zone;
+		}
+	}
+	if((zone = MALLOC(sizeof(struct tzzone_t))) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(zone, '\0', sizeof(struct tzzone_t));
+	if((zone->name = MALLOC(strlen(name)+1)) == NULL) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(zone->name, name);
+
+	if(strstr(name, "..") == NULL) {
+		snprintf(path, sizeof(path), "%s%s", ZONEINFO_DIR, (name[0] == ':') ? &name[1] : name);
+		if((fd = open(path, O_RDONLY)) > -1) {
+			if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+				if((buf = MALLOC((size_t)st.st_size)) == NULL) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
 				}
-				if(inside == 1) {
-					break;
+				while(len < (size_t)st.st_size && (rc = read(fd, &buf[len], (size_t)st.st_size-len)) > 0) {
+					len += (size_t)rc;
 				}
 			}
+			close(fd);
 		}
-		margin /= (int)pow(10, PRECISION);
-		margin++;
-		margin *= (int)pow(10, PRECISION);
 	}
-	searchingtz = 0;	
-	pthread_mutex_unlock(&tzlock);
-	return tz;
+	if(buf == NULL || tz_tzfile(zone, buf, len) != 0) {
+		if(zone->transitions != NULL) {
+			FREE(zone->transitions);
+		}
+		if(zone->types != NULL) {
+			FREE(zone->types);
+		}
+		if(zone->ttypes != NULL) {
+			FREE(zone->ttypes);
+		}
+		zone->nrtransitions = 0;
+		zone->nrtypes = 0;
+		/* Names that aren't in the database can still be a POSIX rule */
+		if(tz_posix(zone, name) != 0) {
+			logprintf(LOG_NOTICE, "unknown timezone %s, using UTC", name);
+			memset(&zone->std, '\0', sizeof(struct tztype_t));
+			zone->hasrule = 1;
+			zone->hasdst = 0;
+		}
+	}
+	if(buf != NULL) {
+		FREE(buf);
+	}
+	zone->next = tzzones;
+	/* Make sure the zone is complete before other threads can see it */
+	__sync_synchronize();
+	tzzones = zone;
+	pthread_mutex_unlock(&tzzones_lock);
+	return zone;
+}
+
+static void tz_localtime(struct tzzone_t *zone, time_t t, struct tm *tm) {
+	struct tztype_t *type = tz_type(zone, (long long)t);
+
+	tz_breakdown((long long)t, type->offset, type->isdst, tm);
+}
+
+/* Like mktime, but in the given zone */
+static time_t tz_mktime(struct tzzone_t *zone, struct tm *tm) {
+	struct tztype_t *type = NULL;
+	long long local = 0, t = 0, year = 0;
+	int mon = tm->tm_mon, offset = 0;
+
+	year = (long long)tm->tm_year+1900+mon/12;
+	mon %= 12;
+	if(mon < 0) {
+		mon += 12;
+		year--;
+	}
+	local = (tz_days(year, mon+1, 1)+tm->tm_mday-1)*86400+
+	        (long long)tm->tm_hour*3600+(long long)tm->tm_min*60+tm->tm_sec;
+
+	offset = tz_type(zone, local)->offset;
+	type = tz_type(zone, local-offset);
+	if(type->offset != offset) {
+		offset = type->offset;
+		type = tz_type(zone, local-offset);
+	}
+	if(tm->tm_isdst >= 0 && type->isdst != (tm->tm_isdst > 0)) {
+		offset = tz_isdst_offset(zone, local-offset, tm->tm_isdst, offset);
+	}
+	t = local-offset;
+
+	tz_localtime(zone, (time_t)t, tm);
+	return (time_t)t;
 }
 
 time_t datetime2ts(int year, int month, int day, int hour, int minutes, int seconds, char *tz) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
- 	time_t t;
  	struct tm tm = {0};
 	tm.tm_sec = seconds;
 	tm.tm_min = minutes;
@@ -272,38 +809,28 @@ time_t datetime2ts(int year, int month, int day, int hour, int minutes, int seco
 	tm.tm_year = year-1900;
 
 	if(tz) {
-		setenv("TZ", tz, 1);
-	}
-	t = mktime(&tm);
-	if(tz) {
-		unsetenv("TZ");
+		return tz_mktime(tz_load(tz), &tm);
 	}
-	return t;
+	return mktime(&tm);
 }
 
 struct tm *localtztime(char *tz, time_t t) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct tm *tm = NULL;
-	setenv("TZ", tz, 1);
-	tm = localtime(&t);
-	unsetenv("TZ");
-	return tm;
+	tz_localtime(tz_load(tz), t, &tzlocal);
+	return &tzlocal;
 }
 
 int tzoffset(char *tz1, char *tz2) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	time_t utc, tzsearch, now;
-	struct tm *tm = NULL;
+	struct tm tm;
 	now = time(NULL);
-	tm = localtime(&now);
+	localtime_r(&now, &tm);
 
-	setenv("TZ", tz1, 1);
-	utc = mktime(tm);
-	setenv("TZ", tz2, 1);
-	tzsearch = mktime(tm);
-	unsetenv("TZ");
+	utc = tz_mktime(tz_load(tz1), &tm);
+	tzsearch = tz_mktime(tz_load(tz2), &tm);
 	return (int)((utc-tzsearch)/3600);
 }
 
@@ -324,14 +851,12 @@ int isdst(char *tz) {
 
 	char UTC[] = "Europe/London";
 	time_t now = 0;
-	struct tm *tm = NULL;
+	struct tm tm;
 	now = time(NULL);
-	tm = gmtime(&now);
-	tm->tm_hour += tzoffset(UTC, tz);
+	gmtime_r(&now, &tm);
+	tm.tm_hour += tzoffset(UTC, tz);
 
-	setenv("TZ", tz, 1);
-	mktime(tm);
-	unsetenv("TZ");
+	tz_mktime(tz_load(tz), &tm);
 
-	return tm->tm_isdst;
+	return tm.tm_isdst;
 }
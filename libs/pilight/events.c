@@ -44,17 +44,10 @@
 #include "socket.h"
 
 static unsigned short loop = 1;
-static char true_[2];
-static char false_[2];
 
-static char *recvBuff = NULL;
+static struct socket_reader_t recvReader;
 static int sockfd = 0;
 
-typedef union varcont_t {
-	char *string_;
-	double number_;
-} varcont_t;
-
 static pthread_mutex_t events_lock;
 static pthread_cond_t events_signal;
 static pthread_mutexattr_t events_attr;
@@ -67,10 +60,9 @@ typedef struct eventsqueue_t {
 static struct eventsqueue_t *eventsqueue;
 static struct eventsqueue_t *eventsqueue_head;
 static int eventsqueue_number = 0;
+static struct mempool_t eventsqueue_pool = MEMPOOL_INITIALIZER("eventsqueue", sizeof(struct eventsqueue_t));
 static int running = 0;
 
-int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr, unsigned short validate);
-
 int events_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -88,78 +80,26 @@ int events_gc(void) {
 	return 1;
 }
 
-static int event_store_val_ptr(struct rules_t *obj, char *device, char *name, struct devices_settings_t *settings) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
-
-	struct rules_values_t *tmp_values = obj->values;
-	int match = 0;
-	while(tmp_values) {
-		if(strcmp(tmp_values->device, device) == 0 &&
-		   strcmp(tmp_values->name, name) == 0) {
-				match = 1;
-				break;
-		}
-		tmp_values = tmp_values->next;
-	}
-
-	if(match == 0) {
-		if(!(tmp_values = MALLOC(sizeof(rules_values_t)))) {
-			logprintf(LOG_ERR, "out of memory");
-			exit(EXIT_FAILURE);
-		}
-		tmp_values->next = NULL;
-		if(!(tmp_values->name = MALLOC(strlen(name)+1))) {
-			logprintf(LOG_ERR, "out of memory");
-			FREE(tmp_values);
-			exit(EXIT_FAILURE);
-		}
-		strcpy(tmp_values->name, name);
-		if(!(tmp_values->device = MALLOC(strlen(device)+1))) {
-			logprintf(LOG_ERR, "out of memory");
-			FREE(tmp_values->name);
-			FREE(tmp_values);
-			exit(EXIT_FAILURE);
-		}
-		strcpy(tmp_values->device, device);
-		tmp_values->settings = settings;
-		tmp_values->next = obj->values;
-		obj->values = tmp_values;
-	}
-	return 0;
-}
-
 /* This functions checks if the defined event variable
    is part of one of devices in the config. If it is,
-   replace the variable with the actual value */
-static int event_lookup_variable(char *var, struct rules_t *obj, unsigned int nr, int type, union varcont_t *varcont, unsigned short validate) {
+   bind the node to the setting holding its value, else
+   the node becomes a constant */
+static int event_bind_variable(struct rules_node_t *node, struct rules_t *obj, unsigned int nr, int type) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	int cached = 0;
-	if(strcmp(true_, "1") != 0) {
-		strcpy(true_, "1");
-	}
-	if(strcmp(false_, "1") != 0) {
-		strcpy(false_, "1");
-	}
+	char *var = node->string_;
+
 	if(strcmp(var, "1") == 0 || strcmp(var, "0") == 0 ||
 		 isNumeric(var) == 0 || strcmp(var, "true") == 0 ||
 		 strcmp(var, "false") == 0) {
-		if(type == JSON_NUMBER) {
-			if(strcmp(var, "true") == 0) {
-				varcont->number_ = 1;
-			} else if(strcmp(var, "false") == 0) {
-				varcont->number_ = 0;
-			} else {
-				varcont->number_ = atof(var);
-			}
-		} else if(type == JSON_STRING) {
-			if(strcmp(var, "true") == 0) {
-				varcont->string_ = true_;
-			} else if(strcmp(var, "false") == 0) {
-				varcont->string_ = false_;
-			} else {
-				varcont->string_ = var;
-			}
+		if(strcmp(var, "true") == 0) {
+			strcpy(node->string_, "1");
+			node->number_ = 1;
+		} else if(strcmp(var, "false") == 0) {
+			strcpy(node->string_, "0");
+			node->number_ = 0;
+		} else {
+			node->number_ = atof(var);
 		}
 		return 0;
 	}
@@ -174,486 +114,344 @@ static int event_lookup_variable(char *var, struct rules_t *obj, unsigned int nr
 	}
 
 	if(nrdots == 1) {
-		char **array = NULL;
-		unsigned int n = explode(var, ".", &array), q = 0;
-		if(n < 2) {
-			logprintf(LOG_ERR, "rule #%d: an unexpected error occured", nr, var);
-			varcont->string_ = NULL;
-			varcont->number_ = 0;
-			for(q=0;q<n;q++) {
-				FREE(array[q]);
-			}
-			FREE(array);
-			return -1;
-		}
-
-		char device[strlen(array[0])+1];
-		strcpy(device, array[0]);
+		char *dot = strstr(var, ".");
 
-		char name[strlen(array[1])+1];
-		strcpy(name, array[1]);
+		char device[(dot-var)+1];
+		strncpy(device, var, (size_t)(dot-var));
+		device[dot-var] = '\0';
 
-		for(q=0;q<n;q++) {
-			FREE(array[q]);
-		}
-		FREE(array);
-
-		/* Check if the values are not already cached */
-		struct rules_values_t *tmp_values = obj->values;
-		while(tmp_values) {
-			if(strcmp(tmp_values->device, device) == 0 &&
-				 strcmp(tmp_values->name, name) == 0) {
-					if(tmp_values->settings->values->type == JSON_STRING) {
-						varcont->string_ = tmp_values->settings->values->string_;
-					} else if(tmp_values->settings->values->type == JSON_NUMBER) {
-						varcont->number_ = tmp_values->settings->values->number_;
-					}
-					cached = 1;
-					return 0;
-			}
-			tmp_values = tmp_values->next;
-		}
+		char name[strlen(&dot[1])+1];
+		strcpy(name, &dot[1]);
 
 		struct devices_t *dev = NULL;
-		if(cached == 0) {
-			if(devices_get(device, &dev) == 0) {
-				if(validate == 1) {
-					int exists = 0;
-					int o = 0;
-					for(o=0;o<obj->nrdevices;o++) {
-						if(strcmp(obj->devices[o], device) == 0) {
-							exists = 1;
-							break;
-						}
-					}
-					if(exists == 0) {
-						/* Store all devices that are present in this rule */
-						if(!(obj->devices = REALLOC(obj->devices, sizeof(char *)*(unsigned int)(obj->nrdevices+1)))) {
-							logprintf(LOG_ERR, "out of memory");
-							exit(EXIT_FAILURE);
-						}
-						if((obj->devices[obj->nrdevices] = MALLOC(strlen(device)+1)) == NULL) {
-							logprintf(LOG_ERR, "out of memory");
-							exit(EXIT_FAILURE);
-						}
-						strcpy(obj->devices[obj->nrdevices], device);
-						obj->nrdevices++;
-					}
-					struct protocols_t *tmp = dev->protocols;
-					unsigned int match1 = 0, match2 = 0, match3 = 0;
-					while(tmp) {
-						struct options_t *opt = tmp->listener->options;
-						while(opt) {
-							if(opt->conftype == DEVICES_STATE && strcmp("state", name) == 0) {
-								match1 = 1;
-								match2 = 1;
+		if(devices_get(device, &dev) == 0) {
+			int exists = 0;
+			int o = 0;
+			for(o=0;o<obj->nrdevices;o++) {
+				if(strcmp(obj->devices[o], device) == 0) {
+					exists = 1;
+					break;
+				}
+			}
+			if(exists == 0) {
+				/* Store all devices that are present in this rule */
+				if(!(obj->devices = REALLOC(obj->devices, sizeof(char *)*(unsigned int)(obj->nrdevices+1)))) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
+				}
+				if((obj->devices[obj->nrdevices] = MALLOC(strlen(device)+1)) == NULL) {
+					logprintf(LOG_ERR, "out of memory");
+					exit(EXIT_FAILURE);
+				}
+				strcpy(obj->devices[obj->nrdevices], device);
+				obj->nrdevices++;
+			}
+			struct protocols_t *tmp = dev->protocols;
+			unsigned int match1 = 0, match2 = 0, match3 = 0;
+			while(tmp) {
+				struct options_t *opt = tmp->listener->options;
+				while(opt) {
+					if(opt->conftype == DEVICES_STATE && strcmp("state", name) == 0) {
+						match1 = 1;
+						match2 = 1;
+						match3 = 1;
+						break;
+					} else if(strcmp(opt->name, name) == 0) {
+						match1 = 1;
+						if(opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_STATE || opt->conftype == DEVICES_SETTING) {
+							match2 = 1;
+							if(opt->vartype == JSON_STRING && type == JSON_STRING) {
+								match3 = 1;
+							} else if(opt->vartype == JSON_NUMBER && type == JSON_NUMBER) {
 								match3 = 1;
-								break;
-							} else if(strcmp(opt->name, name) == 0) {
-								match1 = 1;
-								if(opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_STATE || opt->conftype == DEVICES_SETTING) {
-									match2 = 1;
-									if(opt->vartype == JSON_STRING && type == JSON_STRING) {
-										match3 = 1;
-									} else if(opt->vartype == JSON_NUMBER && type == JSON_NUMBER) {
-										match3 = 1;
-									}
-									break;
-								}
 							}
-							opt = opt->next;
+							break;
 						}
-						tmp = tmp->next;
-					}
-					if(!match1) {
-						logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" has no variable \"%s\"", nr, device, name);
-					} else if(!match2) {
-						logprintf(LOG_ERR, "rule #%d invalid: variable \"%s\" of device \"%s\" cannot be used in event rules", nr, device, name);
-					} else if(!match3) {
-						logprintf(LOG_ERR, "rule #%d invalid: trying to compare a integer variable \"%s.%s\" to a string", nr, device, name);
-					}
-					if(!match1 || !match2 || !match3) {
-						varcont->string_ = NULL;
-						varcont->number_ = 0;
-						return -1;
 					}
+					opt = opt->next;
 				}
-				struct devices_settings_t *tmp_settings = dev->settings;
-				while(tmp_settings) {
-					if(strcmp(tmp_settings->name, name) == 0) {
-						if(tmp_settings->values->type == JSON_STRING) {
-							if(type == JSON_STRING) {
-								/* Cache values for faster future lookup */
-								event_store_val_ptr(obj, device, name, tmp_settings);
-								varcont->string_ = tmp_settings->values->string_;
-								return 0;
-							} else {
-								logprintf(LOG_ERR, "rule #%d invalid: trying to compare integer variable \"%s.%s\" to a string", nr, device, name);
-								varcont->string_ = NULL;
-								return -1;
-							}
-						} else if(tmp_settings->values->type == JSON_NUMBER) {
-							if(type == JSON_NUMBER) {
-								/* Cache values for faster future lookup */
-								event_store_val_ptr(obj, device, name, tmp_settings);
-								varcont->number_ = tmp_settings->values->number_;
-								return 0;
-							} else {
-								logprintf(LOG_ERR, "rule #%d invalid: trying to compare string variable \"%s.%s\" to an integer", nr, device, name);
-								varcont->number_ = 0;
-								return -1;
-							}
+				tmp = tmp->next;
+			}
+			if(!match1) {
+				logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" has no variable \"%s\"", nr, device, name);
+			} else if(!match2) {
+				logprintf(LOG_ERR, "rule #%d invalid: variable \"%s\" of device \"%s\" cannot be used in event rules", nr, device, name);
+			} else if(!match3) {
+				logprintf(LOG_ERR, "rule #%d invalid: trying to compare a integer variable \"%s.%s\" to a string", nr, device, name);
+			}
+			if(!match1 || !match2 || !match3) {
+				return -1;
+			}
+			struct devices_settings_t *tmp_settings = dev->settings;
+			while(tmp_settings) {
+				if(strcmp(tmp_settings->name, name) == 0) {
+					if(tmp_settings->values->type != type) {
+						if(type == JSON_STRING) {
+							logprintf(LOG_ERR, "rule #%d invalid: trying to compare integer variable \"%s.%s\" to a string", nr, device, name);
+						} else {
+							logprintf(LOG_ERR, "rule #%d invalid: trying to compare string variable \"%s.%s\" to an integer", nr, device, name);
 						}
+						return -1;
 					}
-					tmp_settings = tmp_settings->next;
+					/* The setting is updated in place, so its
+					   current value can be read when the rule runs */
+					FREE(node->string_);
+					node->string_ = NULL;
+					node->settings = tmp_settings;
+					node->type = RULES_NODE_VARIABLE;
+					return 0;
 				}
-				logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" has no variable \"%s\"", nr, device, name);
-				varcont->string_ = NULL;
-				varcont->number_ = 0;
-				return -1;
-			} else {
-				logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" does not exist in the config", nr, device);
-				varcont->string_ = NULL;
-				varcont->number_ = 0;
-				return -1;
+				tmp_settings = tmp_settings->next;
 			}
+			logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" has no variable \"%s\"", nr, device, name);
+			return -1;
+		} else {
+			logprintf(LOG_ERR, "rule #%d invalid: device \"%s\" does not exist in the config", nr, device);
+			return -1;
 		}
-		return 1;
 	} else if(nrdots > 2) {
 		logprintf(LOG_ERR, "rule #%d invalid: variable \"%s\" is invalid", nr, var);
-		varcont->string_ = NULL;
-		varcont->number_ = 0;
 		return -1;
 	} else {
-		if(type == JSON_STRING) {
-			varcont->string_ = var;
-		} else if(type == JSON_NUMBER) {
-			varcont->number_ = atof(var);
-		}
+		node->number_ = atof(var);
 		return 0;
 	}
 }
 
-static int event_parse_hooks(char **rule, struct rules_t *obj, int depth, unsigned int nr, int (func)(char *rule, struct rules_t *obj, int depth, unsigned int nr, unsigned short validate), unsigned short validate) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+/* Return the position and length of the next word of a
+   condition. Hooks are always a word on their own. */
+static int event_next_word(char *rule, int *pos, int *len) {
+	int start = *pos;
+
+	while(rule[start] == ' ') {
+		start++;
+	}
+	if(rule[start] == '\0') {
+		*pos = start;
+		*len = 0;
+		return -1;
+	}
+	*len = 1;
+	if(rule[start] != '(' && rule[start] != ')') {
+		while(rule[start+*len] != '\0' && rule[start+*len] != ' ' &&
+		      rule[start+*len] != '(' && rule[start+*len] != ')') {
+			(*len)++;
+		}
+	}
+	*pos = start+*len;
+	return start;
+}
+
+static struct rules_node_t *event_create_node(unsigned short type, char *word, int len) {
+	struct rules_node_t *node = NULL;
 
-	int hooks = 0, res = 0;
-	unsigned long buflen = MEMBUFFER, len = 0, i = 0;
-	char *subrule = MALLOC(buflen);
-	char *tmp = *rule;
+	if(!(node = MALLOC(sizeof(struct rules_node_t)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(node, '\0', sizeof(struct rules_node_t));
+	node->type = type;
 
-	if(!subrule) {
+	/* Operators need room to store their outcome */
+	if(word == NULL) {
+		len = 254;
+	}
+	if(!(node->string_ = MALLOC((size_t)len+1))) {
 		logprintf(LOG_ERR, "out of memory");
 		exit(EXIT_FAILURE);
 	}
+	memset(node->string_, '\0', (size_t)len+1);
+	if(word != NULL) {
+		strncpy(node->string_, word, (size_t)len);
+		node->number_ = atof(node->string_);
+	}
+	return node;
+}
+
+static struct rules_node_t *event_compile_formula(char *rule, int *pos, struct rules_t *obj, unsigned int nr);
+
+static struct rules_node_t *event_compile_operand(char *rule, int *pos, struct rules_t *obj, unsigned int nr, int *hooks) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct rules_node_t *node = NULL;
+	int start = 0, len = 0;
 
-	while(tmp[i] != '\0') {
-		if(tmp[i] == '(') {
-			hooks++;
+	*hooks = 0;
+	if((start = event_next_word(rule, pos, &len)) == -1 || rule[start] == ')') {
+		logprintf(LOG_ERR, "rule #%d invalid: missing a value", nr);
+		return NULL;
+	}
+	if(rule[start] == '(') {
+		if((node = event_compile_formula(rule, pos, obj, nr)) == NULL) {
+			return NULL;
 		}
-		if(tmp[i] == ')') {
-			hooks--;
+		/* The formula stopped at the closing hook */
+		if(event_next_word(rule, pos, &len) == -1) {
+			logprintf(LOG_ERR, "rule #%d invalid: missing one or more )", nr);
+			rules_node_gc(node);
+			return NULL;
 		}
+		*hooks = 1;
+		return node;
+	}
+	return event_create_node(RULES_NODE_VALUE, &rule[start], len);
+}
 
-		if(hooks > 0) {
-			subrule[len++] = tmp[i+1];
-			if(buflen <= len) {
-				buflen *= 2;
-				subrule = REALLOC(subrule, buflen);
-				memset(&subrule[len], '\0', buflen-(unsigned long)len);
-			}
-		} else {
-			if(len > 0) {
-				unsigned long z = 1;
-				char *replace = MALLOC(len+3);
-
-				subrule[len-1] = '\0';
-
-				sprintf(replace, "(%s)", subrule);
-				replace[len+2] = '\0';
-				/* If successful, the variable subrule will be
-				   replaced with the outcome of the formula */
-				if((res = func(subrule, obj, depth, nr, validate)) > -1) {
-					z = strlen(subrule);
-					/* Remove the hooks and the content within.
-						 Replace this content with the result of the sum.
-
-					   e.g.: ((1 + 2) + (3 + 4))
-									 (   3    +    7   )
-					*/
-					// printf("Replace \"%s\" with \"%s\" in \"%s\"\n", replace, subrule, tmp);
-					str_replace(replace, subrule, &tmp);
+static struct event_operators_t *event_compile_operator(char *rule, int *pos, unsigned int nr) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-					FREE(replace);
-				} else {
-					FREE(subrule);
-					FREE(replace);
-					return -1;
-				}
-				memset(subrule, '\0', (unsigned long)len);
-				i -= (len-z);
-				len = 0;
-			}
+	struct event_operators_t *tmp_operator = event_operators;
+	int start = 0, len = 0;
+
+	if((start = event_next_word(rule, pos, &len)) == -1 || rule[start] == '(' || rule[start] == ')') {
+		logprintf(LOG_ERR, "rule #%d invalid: missing an operator", nr);
+		return NULL;
+	}
+	while(tmp_operator) {
+		if(strncmp(&rule[start], tmp_operator->name, (size_t)len) == 0 &&
+		   strlen(tmp_operator->name) == (size_t)len) {
+			return tmp_operator;
 		}
-		i++;
+		tmp_operator = tmp_operator->next;
 	}
-	FREE(subrule);
-	return 0;
+
+	char func[len+1];
+	strncpy(func, &rule[start], (size_t)len);
+	func[len] = '\0';
+	logprintf(LOG_ERR, "rule #%d invalid: operator %s does not exist", nr, func);
+	return NULL;
 }
 
-static int event_parse_formula(char **rule, struct rules_t *obj, int depth, unsigned int nr, unsigned short validate) {
+static struct rules_node_t *event_compile_solve(struct event_operators_t *op, struct rules_node_t *left, struct rules_node_t *right, struct rules_t *obj, unsigned int nr) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	union varcont_t v1;
-	union varcont_t v2;
-	char *var1 = NULL, *func = NULL, *var2 = NULL, *tmp = *rule, *search = NULL;
-	int element = 0, i = 0, match = 0, error = 0;
-	unsigned long len = strlen(tmp), pos = 0, word = 0;
-	char *res = MALLOC(255);
-	memset(res, '\0', 255);
-
-	/* If there are no hooks, we are going to solve the whole (sub)formula.
-	   This formula can be as simple as:
-	   e.g.: 1 + 2
-	   or more complex as:
-	   e.g.: 1 AND 1 AND 0 AND 1
-			 1 AND location.device.state IS on
-	*/
-	while(pos <= len) {
-		/* If we encounter a space we have the formula part */
-		if(tmp[pos] == ' ' || pos == len) {
-			switch(element) {
-				/* The first value of three is always the first variable.
-				   The second value is always the function.
-				   The third value of the three is always the second variable (or second formula).
-				*/
-				case 0:
-					var1 = REALLOC(var1, ((pos-word)+1));
-					memset(var1, '\0', ((pos-word)+1));
-					strncpy(var1, &tmp[word], (pos-word));
-				break;
-				case 1:
-					func = REALLOC(func, ((pos-word)+1));
-					memset(func, '\0', ((pos-word)+1));
-					strncpy(func, &tmp[word], (pos-word));
-				break;
-				case 2:
-					var2 = REALLOC(var2, ((pos-word)+1));
-					memset(var2, '\0', ((pos-word)+1));
-					strncpy(var2, &tmp[word], (pos-word));
-
-					unsigned long l = (strlen(var1)+strlen(var2)+strlen(func))+2;
-					search = REALLOC(search, (l+1));
-					memset(search, '\0', l+1);
-					l = (unsigned long)sprintf(search, "%s %s %s", var1, func, var2);
-					search[l] = '\0';
-				break;
-				default:;
-			}
-			word = pos+1;
-			element++;
-			if(element > 2) {
-				element = 0;
-			}
-		}
+	struct rules_node_t *node = NULL;
+	int type = (op->callback_number != NULL) ? JSON_NUMBER : JSON_STRING;
 
-		if(func && strlen(func) > 0 &&
-		   var1 && strlen(var1) > 0 &&
-		   var2 && strlen(var2) > 0) {
-			i = 0;
-			/* Check if the operator exists */
-			match = 0;
-			struct event_operators_t *tmp_operator = event_operators;
-			while(tmp_operator) {
-				int type = 0;
-				if(tmp_operator->callback_number) {
-					type = JSON_NUMBER;
-				} else {
-					type = JSON_STRING;
-				}
+	node = event_create_node(RULES_NODE_OPERATOR, NULL, 0);
+	node->operator = op;
+	node->left = left;
+	node->right = right;
 
-				if(strcmp(func, tmp_operator->name) == 0) {
-					match = 1;
-					int ret1 = 0, ret2 = 0;
-					if(tmp_operator->callback_string) {
-						ret1 = event_lookup_variable(var1, obj, nr, type, &v1, validate);
-						ret2 = event_lookup_variable(var2, obj, nr, type, &v2, validate);
-
-						if(ret1 == -1 || ret2 == -1) {
-							error = -1;
-							goto close;
-						} else if(v1.string_ != NULL && v2.string_ != NULL) {
-							/* Solve the formula */
-							tmp_operator->callback_string(v1.string_, v2.string_, &res);
-						} else {
-							error = 0;
-							goto close;
-						}
-					} else if(tmp_operator->callback_number) {
-						/* Replace the (more complex) subpart of the formula with the solutions:
-						   e.g.: 0 AND location.device.state IS on
-								 0 AND location.device.state IS on AND location.device.state IS off
-						   to:
-								 0 AND 1
-								 0 AND 1 AND 0
-						   This function will solve all AND's from left to right.
-
-						   The more simple AND and OR operators will be handled by the rest of this function.
-						*/
-						if((strcmp(func, "AND") == 0 || strcmp(func, "OR") == 0) && (strcmp(var2, "1") != 0 && strcmp(var2, "0") != 0)) {
-							int flen = (int)strlen(func)+3, rlen = (int)strlen(tmp), nrspaces = 0;
-							char *subrule = NULL;
-							unsigned long buflen = MEMBUFFER, part2len = 0, sublen = 0;
-							if(!(subrule = MALLOC(buflen))) {
-								logprintf(LOG_ERR, "out of memory");
-								exit(EXIT_FAILURE);
-							}
-							while(flen <= rlen) {
-								if(tmp[flen] == ' ') {
-									nrspaces++;
-								}
-								if(nrspaces == 3) {
-									break;
-								}
-								if(nrspaces >= 1) {
-									part2len++;
-								}
-								subrule[sublen++] = tmp[flen];
-								if(buflen <= sublen) {
-									buflen *= 2;
-									subrule = REALLOC(subrule, buflen);
-									memset(&subrule[sublen], '\0', buflen-sublen);
-								}
-								flen++;
-							}
+	if((left->type == RULES_NODE_VALUE && event_bind_variable(left, obj, nr, type) == -1) ||
+	   (right->type == RULES_NODE_VALUE && event_bind_variable(right, obj, nr, type) == -1)) {
+		rules_node_gc(node);
+		return NULL;
+	}
+	return node;
+}
 
-							if(subrule != NULL) {
-								subrule[sublen] = '\0';
-								search = REALLOC(search, strlen(subrule)+1);
-								strcpy(search, subrule);
-								if(event_parse_formula(&subrule, obj, depth, nr, validate) == 0) {
-									char *res1 = MALLOC(255);
-									memset(res, '\0', 255);
-									if(tmp_operator->callback_number) {
-										tmp_operator->callback_number(atof(var1), atof(subrule), &res1);
-									} else {
-										char r[strlen(res)+1];
-										strcpy(r, res);
-										tmp_operator->callback_string(var1, r, &res1);
-									}
-									unsigned long r = 0;
-									char *t = MALLOC(strlen(res1)+1);
-									strcpy(t, res1);
-									// printf("Replace \"%s\" with \"%s\" in \"%s\"\n", search, t, tmp);
-									if((r = (unsigned long)str_replace(search, t, &tmp)) == -1) {
-										logprintf(LOG_ERR, "rule #%d: an unexpected error occured while parsing", nr);
-										error = -1;
-										FREE(res1);
-										FREE(t);
-										FREE(subrule);
-										goto close;
-									} else {
-										len = r;
-									}
-									var2 = REALLOC(var2, strlen(res1)+1);
-									strcpy(var2, res1);
-									FREE(res1);
-									FREE(t);
-								} else {
-									logprintf(LOG_ERR, "rule #%d: an unexpected error occured while parsing", nr);
-									error = -1;
-									FREE(subrule);
-									goto close;
-								}
-								FREE(subrule);
-								subrule = NULL;
-							} else {
-								logprintf(LOG_ERR, "rule #%d: an unexpected error occured while parsing", nr);
-								error = -1;
-								goto close;
-							}
-							/* Adapt the search string to be replaced */
-							unsigned long l = strlen(var1)+strlen(func)+strlen(var2)+2;
-							search = REALLOC(search, l+1);
-							sprintf(search, "%s %s %s", var1, func, var2);
-						}
+/* Formulas are solved from left to right, except that the
+   comparison following an AND or OR is solved first:
+   e.g.: 1 AND location.device.state IS on AND 0
+   is compiled as:
+         ((1 AND (location.device.state IS on)) AND 0)
+   A plain 0 or 1, or a hook followed by another AND or OR,
+   is used as is.
+*/
+static struct rules_node_t *event_compile_formula(char *rule, int *pos, struct rules_t *obj, unsigned int nr) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-						/* Continue with regular numeric operator parsing */
-						ret1 = event_lookup_variable(var1, obj, nr, type, &v1, validate);
-						ret2 = event_lookup_variable(var2, obj, nr, type, &v2, validate);
-						if(ret1 == -1 || ret2 == -1) {
-							error = -1;
-							goto close;
-						} else if(ret1 == 1 || ret2 == 1) {
-							error = 0;
-							goto close;
-						} else {
-							/* Solve the formula */
-							tmp_operator->callback_number(v1.number_, v2.number_, &res);
-						}
-					}
-					if(res) {
-						/* Replace the subpart of the formula with the solutions in case of simple AND's
-						   e.g.: 0 AND 1 AND 1 AND 0
-								     0 AND 1 AND 0
-						*/
-						char *p = MALLOC(strlen(res)+1);
-						strcpy(p, res);
-						unsigned long r = 0;
-						// printf("Replace \"%s\" with \"%s\" in \"%s\"\n", search, p, tmp);
-						if((r = (unsigned long)str_replace(search, p, &tmp)) == -1) {
-							logprintf(LOG_ERR, "rule #%d: an unexpected error occured while parsing", nr);
-							FREE(p);
-							error = -1;
-							goto close;
-						}
-						len = r;
-						FREE(p);
-					}
-					pos = 0, word = 0, element = 0;
-					break;
+	struct rules_node_t *left = NULL, *right = NULL, *node = NULL;
+	struct event_operators_t *op = NULL, *op2 = NULL;
+	int hooks = 0, start = 0, len = 0, next = 0;
+
+	if((left = event_compile_operand(rule, pos, obj, nr, &hooks)) == NULL) {
+		return NULL;
+	}
+	while(1) {
+		next = *pos;
+		if((start = event_next_word(rule, &next, &len)) == -1 || rule[start] == ')') {
+			break;
+		}
+		if((op = event_compile_operator(rule, pos, nr)) == NULL) {
+			rules_node_gc(left);
+			return NULL;
+		}
+		if((right = event_compile_operand(rule, pos, obj, nr, &hooks)) == NULL) {
+			rules_node_gc(left);
+			return NULL;
+		}
+		if((strcmp(op->name, "AND") == 0 || strcmp(op->name, "OR") == 0) &&
+		   (hooks == 1 || (strcmp(right->string_, "1") != 0 && strcmp(right->string_, "0") != 0))) {
+			next = *pos;
+			if((start = event_next_word(rule, &next, &len)) != -1 && rule[start] != ')' &&
+			   (hooks == 0 || (strncmp(&rule[start], "AND ", 4) != 0 && strncmp(&rule[start], "OR ", 3) != 0))) {
+				if((op2 = event_compile_operator(rule, pos, nr)) == NULL ||
+				   (node = event_compile_operand(rule, pos, obj, nr, &hooks)) == NULL) {
+					rules_node_gc(left);
+					rules_node_gc(right);
+					return NULL;
+				}
+				if((right = event_compile_solve(op2, right, node, obj, nr)) == NULL) {
+					rules_node_gc(left);
+					return NULL;
 				}
-				i++;
-				tmp_operator = tmp_operator->next;
-			}
-			if(match == 0) {
-				logprintf(LOG_ERR, "rule #%d invalid: operator %s does not exist", nr, func);
-				error = -1;
-				goto close;
-			}
-			if(var1) {
-				memset(var1, '\0', strlen(var1));
-			} if(func) {
-				memset(func, '\0', strlen(func));
-			} if(var2) {
-				memset(var2, '\0', strlen(var2));
-			} if(search) {
-				memset(search, '\0', strlen(search));
 			}
 		}
-		pos++;
+		if((left = event_compile_solve(op, left, right, obj, nr)) == NULL) {
+			return NULL;
+		}
 	}
+	return left;
+}
 
-close:
-	FREE(res);
-	if(var1) {
-		FREE(var1);
-		var1 = NULL;
-	} if(func) {
-		FREE(func);
-		func = NULL;
-	} if(var2) {
-		FREE(var2);
-		var2 = NULL;
-	} if(search) {
-		FREE(search);
-		search = NULL;
+/* The functions below run for every rule on every device update,
+   so they only read the compiled tree */
+static int event_node_value(struct rules_node_t *node, int type, char **string_, double *number_);
+
+static int event_node_solve(struct rules_node_t *node) {
+	struct event_operators_t *op = node->operator;
+	char *s1 = NULL, *s2 = NULL;
+	double n1 = 0.0, n2 = 0.0;
+
+	if(op->callback_number) {
+		if(event_node_value(node->left, JSON_NUMBER, &s1, &n1) != 0 ||
+		   event_node_value(node->right, JSON_NUMBER, &s2, &n2) != 0) {
+			return -1;
+		}
+		op->callback_number(n1, n2, &node->string_);
+	} else if(op->callback_string) {
+		if(event_node_value(node->left, JSON_STRING, &s1, &n1) != 0 ||
+		   event_node_value(node->right, JSON_STRING, &s2, &n2) != 0 ||
+		   s1 == NULL || s2 == NULL) {
+			return -1;
+		}
+		op->callback_string(s1, s2, &node->string_);
 	}
+	return 0;
+}
 
-	return error;
+static int event_node_value(struct rules_node_t *node, int type, char **string_, double *number_) {
+	struct devices_values_t *values = NULL;
+
+	switch(node->type) {
+		case RULES_NODE_VALUE:
+			*string_ = node->string_;
+			*number_ = node->number_;
+		break;
+		case RULES_NODE_VARIABLE:
+			values = node->settings->values;
+			if(values->type != type) {
+				return -1;
+			}
+			*string_ = values->string_;
+			*number_ = values->number_;
+		break;
+		case RULES_NODE_OPERATOR:
+			if(event_node_solve(node) != 0) {
+				return -1;
+			}
+			*string_ = node->string_;
+			*number_ = atof(node->string_);
+		break;
+		default:
+			return -1;
+	}
+	return 0;
 }
 
-static int event_parse_action(char *action, struct rules_t *obj, int validate) {
+static int event_parse_action(char *action, struct rules_t *obj) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct JsonNode *jvalues = NULL;
@@ -965,16 +763,8 @@ static int event_parse_action(char *action, struct rules_t *obj, int validate) {
 		}
 	}
 
-	if(error == 0) {
-		if(validate == 1) {
-			if(obj->action->checkArguments) {
-				error = obj->action->checkArguments(obj->arguments);
-			}
-		} else {
-			if(obj->action->run) {
-				error = obj->action->run(obj->arguments);
-			}
-		}
+	if(error == 0 && obj->action->checkArguments) {
+		error = obj->action->checkArguments(obj->arguments);
 	}
 	if(var1) {
 		FREE(var1);
@@ -995,12 +785,12 @@ static int event_parse_action(char *action, struct rules_t *obj, int validate) {
 	return error;
 }
 
-int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr, unsigned short validate) {
+int event_parse_rule(char *rule, struct rules_t *obj, unsigned int nr) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	char *tloc = 0, *condition = NULL, *action = NULL;
 	unsigned int tpos = 0, rlen = strlen(rule), tlen = 0;
-	int x = 0, nrhooks = 0, has_hooks = 0, error = 0;
+	int x = 0, nrhooks = 0, error = 0, pos = 0, len = 0;
 	/* Check if rule has more than one spaces in a row */
 	while(x < rlen) {
 		if(strncmp(&rule[x], "  ", 2) == 0) {
@@ -1010,7 +800,6 @@ int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr
 		}
 		if(rule[x] == '(') {
 			nrhooks++;
-			has_hooks = 1;
 		}
 		if(rule[x] == ')') {
 			nrhooks--;
@@ -1018,47 +807,45 @@ int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr
 		x++;
 	}
 
-	if(depth == 0) {
-		if(strncmp(&rule[0], "IF ", 3) != 0) {
-			logprintf(LOG_ERR, "rule #%d invalid: missing IF", nr);
-			error = -1;
-			goto close;
-		}
+	if(strncmp(&rule[0], "IF ", 3) != 0) {
+		logprintf(LOG_ERR, "rule #%d invalid: missing IF", nr);
+		error = -1;
+		goto close;
+	}
 
-		if((tloc = strstr(rule, " THEN ")) == NULL) {
-			logprintf(LOG_ERR, "rule #%d invalid: missing THEN", nr);
-			error = -1;
-			goto close;
-		}
+	if((tloc = strstr(rule, " THEN ")) == NULL) {
+		logprintf(LOG_ERR, "rule #%d invalid: missing THEN", nr);
+		error = -1;
+		goto close;
+	}
 
-		tpos = (size_t)(tloc-rule);
+	tpos = (size_t)(tloc-rule);
 
-		if(!(action = MALLOC((rlen-tpos)+6+1))) {
-			logprintf(LOG_ERR, "out of memory");
-			exit(EXIT_FAILURE);
-		}
-
-		strncpy(action, &rule[tpos+6], rlen-tpos);
-		action[rlen-tpos+6] = '\0';
-		tlen = rlen-tpos+6;
+	if(!(action = MALLOC((rlen-tpos)+6+1))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
 
-		if(validate == 1 && event_parse_action(action, obj, validate) != 0) {
-			logprintf(LOG_ERR, "rule #%d invalid: invalid action", nr);
-			error = -1;
-			goto close;
-		}
+	strncpy(action, &rule[tpos+6], rlen-tpos);
+	action[rlen-tpos+6] = '\0';
+	tlen = rlen-tpos+6;
 
-		/* Extract the command part between the IF and THEN
-		   ("IF " length = 3) */
-		if(!(condition = MALLOC(rlen-tlen+3+1))) {
-			logprintf(LOG_ERR, "out of memory");
-			exit(EXIT_FAILURE);
-		}
+	if(event_parse_action(action, obj) != 0) {
+		logprintf(LOG_ERR, "rule #%d invalid: invalid action", nr);
+		error = -1;
+		goto close;
+	}
 
-		strncpy(condition, &rule[3], rlen-tlen+3);
-		condition[rlen-tlen+3] = '\0';
+	/* Extract the command part between the IF and THEN
+	   ("IF " length = 3) */
+	if(!(condition = MALLOC(rlen-tlen+3+1))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
 	}
 
+	strncpy(condition, &rule[3], rlen-tlen+3);
+	condition[rlen-tlen+3] = '\0';
+
 	if(nrhooks > 0) {
 		logprintf(LOG_ERR, "rule #%d invalid: missing one or more )", nr);
 		error = -1;
@@ -1069,35 +856,21 @@ int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr
 		goto close;
 	}
 
-	if(depth > 0) {
-		condition = rule;
-	}
-	if(has_hooks == 1) {
-		int res = 0;
-		if((res = event_parse_hooks(&condition, obj, depth+1, nr, event_parse_rule, validate)) == -1) {
-			error = -1;
-			goto close;
-		}
-	}
-
-	if(event_parse_formula(&condition, obj, depth, nr, validate) == -1) {
+	/* Compile the condition once, so running the
+	   rule doesn't require any parsing anymore */
+	if((obj->condition = event_compile_formula(condition, &pos, obj, nr)) == NULL) {
 		error = -1;
 		goto close;
 	}
-
-	obj->status = atoi(condition);
-	if(obj->status > 0 && depth == 0) {
-		if(validate == 0 && event_parse_action(action, obj, validate) != 0) {
-			error = -1;
-			goto close;
-		}
-
-		obj->status = 1;
+	if(event_next_word(condition, &pos, &len) != -1) {
+		logprintf(LOG_ERR, "rule #%d invalid: missing one or more (", nr);
+		error = -1;
+		goto close;
 	}
 
 close:
-	if(depth == 0) {
-		if(condition) FREE(condition);
+	if(condition) {
+		FREE(condition);
 	}
 	if(action) {
 		FREE(action);
@@ -1106,6 +879,25 @@ close:
 	return error;
 }
 
+int event_run_rule(struct rules_t *obj) {
+	char *string_ = NULL;
+	double number_ = 0.0;
+
+	if(event_node_value(obj->condition, JSON_STRING, &string_, &number_) != 0 ||
+	   string_ == NULL) {
+		return -1;
+	}
+
+	obj->status = atoi(string_);
+	if(obj->status > 0) {
+		if(obj->action->run && obj->action->run(obj->arguments) != 0) {
+			return -1;
+		}
+		obj->status = 1;
+	}
+	return 0;
+}
+
 void *events_loop(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -1116,7 +908,6 @@ void *events_loop(void *param) {
 
 	struct JsonNode *jdevices = NULL, *jchilds = NULL;
 	struct rules_t *tmp_rules = NULL;
-	char *str = NULL;
 	unsigned short match = 0;
 	unsigned int i = 0;
 
@@ -1134,11 +925,6 @@ void *events_loop(void *param) {
 			while(tmp_rules) {
 				if(tmp_rules->active == 1) {
 					match = 0;
-					if((str = MALLOC(strlen(tmp_rules->rule)+1)) == NULL) {
-						logprintf(LOG_ERR, "out of memory");
-						exit(EXIT_FAILURE);
-					}
-					strcpy(str, tmp_rules->rule);
 					/* Only run those events that affect the updates devices */
 					if(jdevices != NULL) {
 						jchilds = json_first_child(jdevices);
@@ -1157,21 +943,20 @@ void *events_loop(void *param) {
 						}
 					}
 					if(match == 1 && tmp_rules->status == 0) {
-						if(event_parse_rule(str, tmp_rules, 0, 1, 0) == 0) {
+						if(event_run_rule(tmp_rules) == 0) {
 							if(tmp_rules->status) {
 								logprintf(LOG_INFO, "executed rule: %s", tmp_rules->name);
 							}
 						}
 						tmp_rules->status = 0;
 					}
-					FREE(str);
 				}
 				tmp_rules = tmp_rules->next;
 			}
 			struct eventsqueue_t *tmp = eventsqueue;
 			json_delete(tmp->jconfig);
 			eventsqueue = eventsqueue->next;
-			FREE(tmp);
+			POOL_FREE(tmp);
 			eventsqueue_number--;
 			running = 0;
 			pthread_mutex_unlock(&events_lock);
@@ -1192,12 +977,12 @@ static void events_queue(char *message) {
 
 	pthread_mutex_lock(&events_lock);
 	if(eventsqueue_number < 1024) {
-		struct eventsqueue_t *enode = MALLOC(sizeof(eventsqueue_t));
+		struct eventsqueue_t *enode = POOL_MALLOC(&eventsqueue_pool);
 		if(enode == NULL) {
 			logprintf(LOG_ERR, "out of memory");
 			exit(EXIT_FAILURE);
 		}
-		enode->jconfig = json_decode(message);
+		enode->jconfig = json_decode_arena(message);
 
 		if(eventsqueue_number == 0) {
 			eventsqueue = enode;
@@ -1218,6 +1003,7 @@ static void events_queue(char *message) {
 void *events_clientize(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	char *message = NULL;
 	unsigned int failures = 0;
 	while(loop && failures <= 5) {
 		struct ssdp_list_t *ssdp_list = NULL;
@@ -1242,6 +1028,8 @@ void *events_clientize(void *param) {
 			ssdp_free(ssdp_list);
 		}
 
+		socket_reader_init(&recvReader, sockfd);
+
 		struct JsonNode *jclient = json_mkobject();
 		struct JsonNode *joptions = json_mkobject();
 		json_append_member(jclient, "action", json_mkstring("identify"));
@@ -1253,25 +1041,22 @@ void *events_clientize(void *param) {
 		json_free(out);
 		json_delete(jclient);
 
-		if(socket_read(sockfd, &recvBuff, 0) != 0
-			 || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
+		if(socket_reader_next(&recvReader, &message, 0) != 0
+			 || strcmp(message, "{\"status\":\"success\"}") != 0) {
 				failures++;
 			continue;
 		}
 		failures = 0;
 		while(loop) {
-			if(socket_read(sockfd, &recvBuff, 0) != 0) {
+			if(socket_reader_next(&recvReader, &message, 0) != 0) {
 				break;
 			} else {
-				events_queue(recvBuff);
+				events_queue(message);
 			}
 		}
 	}
 
-	if(recvBuff) {
-		FREE(recvBuff);
-		recvBuff = NULL;
-	}
+	socket_reader_gc(&recvReader);
 	socket_close(sockfd);
 	return 0;
 }
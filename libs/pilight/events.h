@@ -21,7 +21,8 @@
 
 #include "rules.h"
 
-int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned int nr, int validate);
+int event_parse_rule(char *rule, struct rules_t *obj, unsigned int nr);
+int event_run_rule(struct rules_t *obj);
 void *events_clientize(void *param);
 int events_gc(void);
 void *events_loop(void *param);
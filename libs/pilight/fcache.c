@@ -23,25 +23,47 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include "../../defines.h"
+#ifdef WEBSERVER_GZIP
+	#include <zlib.h>
+#endif
 #include "fcache.h"
 #include "common.h"
 #include "mem.h"
 #include "log.h"
 #include "gc.h"
 
+static struct fcache_t *fcache[FCACHE_SIZE];
+
+static unsigned long fcache_hash(char *name) {
+	unsigned long h = 2166136261UL;
+	while(*name != '\0') {
+		h = (h ^ (unsigned char)*name++) * 16777619UL;
+	}
+	return h;
+}
+
+static void fcache_free(struct fcache_t *node) {
+	FREE(node->name);
+	FREE(node->bytes);
+	if(node->gzbytes != NULL) {
+		FREE(node->gzbytes);
+	}
+	FREE(node);
+}
+
 int fcache_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct fcache_t *tmp = fcache;
-	while(fcache) {
-		tmp = fcache;
-		FREE(tmp->name);
-		FREE(tmp->bytes);
-		fcache = fcache->next;
-		FREE(tmp);
-	}
-	if(fcache != NULL) {
-		FREE(fcache);
+	struct fcache_t *tmp = NULL;
+	int i = 0;
+
+	for(i=0;i<FCACHE_SIZE;i++) {
+		while(fcache[i]) {
+			tmp = fcache[i];
+			fcache[i] = fcache[i]->next;
+			fcache_free(tmp);
+		}
 	}
 
 	logprintf(LOG_DEBUG, "garbage collected fcache library");
@@ -64,9 +86,7 @@ void fcache_remove_node(struct fcache_t **cache, char *name) {
 				prevP->next = currP->next;
 			}
 
-			FREE(currP->name);
-			FREE(currP->bytes);
-			FREE(currP);
+			fcache_free(currP);
 
 			break;
 		}
@@ -76,15 +96,47 @@ void fcache_remove_node(struct fcache_t **cache, char *name) {
 int fcache_rm(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	fcache_remove_node(&fcache, filename);
+	fcache_remove_node(&fcache[fcache_hash(filename) & (FCACHE_SIZE-1)], filename);
 	logprintf(LOG_DEBUG, "removed %s from cache", filename);
 	return 1;
 }
 
+#ifdef WEBSERVER_GZIP
+/* Only keep the compressed copy when it is worth sending */
+static void fcache_compress(struct fcache_t *node) {
+	z_stream strm;
+	unsigned long len = 0;
+
+	memset(&strm, '\0', sizeof(z_stream));
+	/* A window of 15+16 bits makes zlib write a gzip header */
+	if(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return;
+	}
+	len = deflateBound(&strm, (unsigned long)node->size);
+	if(!(node->gzbytes = MALLOC(len))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	strm.next_in = node->bytes;
+	strm.avail_in = (unsigned int)node->size;
+	strm.next_out = node->gzbytes;
+	strm.avail_out = (unsigned int)len;
+	if(deflate(&strm, Z_FINISH) == Z_STREAM_END && strm.total_out < (unsigned long)node->size-(unsigned long)node->size/10) {
+		node->gzsize = (int)strm.total_out;
+		logprintf(LOG_DEBUG, "compressed %s from %d to %d bytes", node->name, node->size, node->gzsize);
+	} else {
+		FREE(node->gzbytes);
+		node->gzsize = 0;
+	}
+	deflateEnd(&strm);
+}
+#endif
+
 int fcache_add(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	unsigned long filesize = 0, i = 0;
+	unsigned long filesize = 0, i = 0, h = 0;
+	unsigned long long hash = 14695981039346656037ULL;
 	struct stat sb;
 	ssize_t rc = 0;
 	int fd = 0;
@@ -108,52 +160,77 @@ int fcache_add(char *filename) {
 		memset(node->bytes, '\0', filesize + 100);
 		if((fd = open(filename, O_RDONLY, 0)) > -1) {
 			i = 0;
-			while (i < filesize) {
-				rc = read(fd, node->bytes+i, filesize-i);
+			while(i < filesize) {
+				if((rc = read(fd, node->bytes+i, filesize-i)) <= 0) {
+					break;
+				}
 				i += (unsigned long)rc;
 			}
 			close(fd);
 
-			node->size = (int)filesize;
+			node->size = (int)i;
 			node->name = MALLOC(strlen(filename)+1);
 			if(!node->name) {
 				logprintf(LOG_ERR, "out of memory");
 				exit(EXIT_FAILURE);
 			}
 			strcpy(node->name, filename);
-			node->next = fcache;
-			fcache = node;
+
+			/* The ETag changes whenever the content does */
+			for(i=0;i<(unsigned long)node->size;i++) {
+				hash = (hash ^ node->bytes[i]) * 1099511628211ULL;
+			}
+			snprintf(node->etag, sizeof(node->etag), "\"%016llx\"", hash);
+
+			node->gzbytes = NULL;
+			node->gzsize = 0;
+#ifdef WEBSERVER_GZIP
+			fcache_compress(node);
+#endif
+
+			h = fcache_hash(filename) & (FCACHE_SIZE-1);
+			node->next = fcache[h];
+			fcache[h] = node;
 			return 0;
 		} else {
+			FREE(node->bytes);
+			FREE(node);
 			return -1;
 		}
 	}
 	return -1;
 }
 
-short fcache_get_size(char *filename, int *out) {
+struct fcache_t *fcache_get(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct fcache_t *ftmp = fcache;
+	struct fcache_t *ftmp = fcache[fcache_hash(filename) & (FCACHE_SIZE-1)];
 	while(ftmp) {
 		if(strcmp(ftmp->name, filename) == 0) {
-			*out = ftmp->size;
-			return 0;
+			return ftmp;
 		}
 		ftmp = ftmp->next;
 	}
+	return NULL;
+}
+
+short fcache_get_size(char *filename, int *out) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct fcache_t *ftmp = fcache_get(filename);
+	if(ftmp != NULL) {
+		*out = ftmp->size;
+		return 0;
+	}
 	return -1;
 }
 
 unsigned char *fcache_get_bytes(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct fcache_t *ftmp = fcache;
-	while(ftmp) {
-		if(strcmp(ftmp->name, filename) == 0) {
-			return ftmp->bytes;
-		}
-		ftmp = ftmp->next;
+	struct fcache_t *ftmp = fcache_get(filename);
+	if(ftmp != NULL) {
+		return ftmp->bytes;
 	}
 	return NULL;
 }
@@ -24,14 +24,17 @@ typedef struct fcache_t {
 	char *name;
 	int size;
 	unsigned char *bytes;
+	/* A gzip compressed copy, if it turned out smaller */
+	int gzsize;
+	unsigned char *gzbytes;
+	char etag[19];
 	struct fcache_t *next;
 } fcaches_t;
 
-struct fcache_t *fcache;
-
 int fcache_gc(void);
 int fcache_add(char *filename);
 int fcache_rm(char *filename);
+struct fcache_t *fcache_get(char *filename);
 short fcache_get_size(char *filename, int *out);
 unsigned char *fcache_get_bytes(char *filename);
 
@@ -45,6 +45,10 @@ void gc_handler(int sig) {
 	unw_word_t ip, sp, offp;
 
 	switch(sig) {
+		case SIGUSR1:
+			log_trace_dump();
+			memtrack_dump();
+		return;
 		case SIGSEGV:
 		case SIGBUS:
 		case SIGILL:
@@ -68,6 +72,7 @@ void gc_handler(int sig) {
 				printf("%-30s ip = %10p, sp = %10p\n", name, (void *)ip, (void *)sp);
 				logerror("%-30s ip = %10p, sp = %10p", name, (void *)ip, (void *)sp);
 			}
+			log_trace_dump();
 		}
 		break;
 		default:;
@@ -146,4 +151,6 @@ void gc_catch(void) {
 	sigaction(SIGILL,  &act, NULL);
 	sigaction(SIGSEGV, &act, NULL);
 	sigaction(SIGFPE,  &act, NULL);
+
+	sigaction(SIGUSR1, &act, NULL);
 }
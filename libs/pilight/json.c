@@ -22,6 +22,7 @@
 */
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,9 @@
 #include "json.h"
 #include "mem.h"
 
+/* Nodes are created and deleted for every message */
+static struct mempool_t json_nodes = MEMPOOL_INITIALIZER("json", sizeof(JsonNode));
+
 #define out_of_memory() do {                    \
 		fprintf(stderr, "Out of memory.\n");    \
 		exit(EXIT_FAILURE);                     \
@@ -47,12 +51,7 @@ static char *json_strdup(const char *str)
 
 /* String buffer */
 
-typedef struct
-{
-	char *cur;
-	char *end;
-	char *start;
-} SB;
+typedef JsonBuffer SB;
 
 static void sb_init(SB *sb)
 {
@@ -115,6 +114,251 @@ static void sb_free(SB *sb)
 	free(sb->start);
 }
 
+/*
+ * Arena
+ *
+ * A decoded message is mostly read once and thrown away, so
+ * json_decode_arena carves its nodes and strings out of a few
+ * blocks instead of allocating and freeing every one of them.
+ */
+
+#define JSON_ARENA_NODE     1   /* node lives in an arena */
+#define JSON_ARENA_ROOT     2   /* node is the JsonArena itself */
+#define JSON_ARENA_KEY      4   /* key lives in an arena */
+
+typedef struct JsonBlock JsonBlock;
+
+struct JsonBlock
+{
+	JsonBlock *next;
+	size_t size;
+	size_t used;
+};
+
+typedef struct
+{
+	/* Must stay first, the root is cast back to its arena */
+	JsonNode root;
+	JsonBlock *block;
+	bool rooted;
+} JsonArena;
+
+static JsonArena *arena_new(size_t size)
+{
+	JsonArena *arena = (JsonArena*) malloc(sizeof(JsonArena) + sizeof(JsonBlock) + size);
+	if (arena == NULL)
+		out_of_memory();
+	/* The first block is part of the same allocation */
+	arena->block = (JsonBlock*) (arena + 1);
+	arena->block->next = NULL;
+	arena->block->size = size;
+	arena->block->used = 0;
+	arena->rooted = false;
+	return arena;
+}
+
+static void *arena_alloc(JsonArena *arena, size_t size, size_t align)
+{
+	JsonBlock *block = arena->block;
+	size_t used = (block->used + align - 1) & ~(align - 1);
+	size_t alloc;
+
+	if (used + size > block->size) {
+		alloc = block->size * 2;
+		while (alloc < size)
+			alloc *= 2;
+		block = (JsonBlock*) malloc(sizeof(JsonBlock) + alloc);
+		if (block == NULL)
+			out_of_memory();
+		block->next = arena->block;
+		block->size = alloc;
+		arena->block = block;
+		used = 0;
+	}
+	block->used = used + size;
+	return (char*) (block + 1) + used;
+}
+
+static void arena_free(JsonArena *arena)
+{
+	JsonBlock *block, *next;
+
+	for (block = arena->block; block->next != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+/*
+ * Member index
+ *
+ * Objects that are searched past JSON_INDEX_MIN members get a hash
+ * table of their members. Every function that links or unlinks a
+ * member keeps it in sync and it is freed along with the object.
+ */
+
+#define JSON_INDEX_MIN      16
+
+typedef struct
+{
+	uint32_t hash;
+	JsonNode *node;
+} JsonSlot;
+
+struct JsonIndex
+{
+	size_t size;    /* always a power of two */
+	size_t count;
+	size_t dups;    /* members hidden by an earlier one with the same key */
+	JsonSlot slots[];
+};
+
+static uint32_t index_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key != '\0') {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static JsonIndex *index_alloc(size_t size)
+{
+	JsonIndex *index = (JsonIndex*) calloc(1, sizeof(JsonIndex) + size * sizeof(JsonSlot));
+	if (index == NULL)
+		out_of_memory();
+	index->size = size;
+	return index;
+}
+
+/* Return the slot holding key, or the empty slot where it belongs */
+static JsonSlot *index_slot(JsonIndex *index, const char *key, uint32_t hash)
+{
+	size_t mask = index->size - 1;
+	size_t i = hash & mask;
+
+	while (index->slots[i].node != NULL) {
+		if (index->slots[i].hash == hash && strcmp(index->slots[i].node->key, key) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+	return &index->slots[i];
+}
+
+/*
+ * Add a member to a table with room to spare. The first
+ * member with a key wins, unless the new one is prepended.
+ */
+static void index_put(JsonIndex *index, JsonNode *node, bool first)
+{
+	uint32_t hash = index_hash(node->key);
+	JsonSlot *slot = index_slot(index, node->key, hash);
+
+	if (slot->node == NULL) {
+		slot->hash = hash;
+		slot->node = node;
+		index->count++;
+	} else {
+		if (first)
+			slot->node = node;
+		index->dups++;
+	}
+}
+
+static void index_insert(JsonNode *object, JsonNode *node, bool first)
+{
+	JsonIndex *index = object->children.index;
+	JsonIndex *grown;
+	size_t i;
+
+	if ((index->count + 1) * 2 > index->size) {
+		grown = index_alloc(index->size * 2);
+		for (i = 0; i < index->size; i++)
+			if (index->slots[i].node != NULL)
+				*index_slot(grown, index->slots[i].node->key, index->slots[i].hash) = index->slots[i];
+		grown->count = index->count;
+		grown->dups = index->dups;
+		free(index);
+		object->children.index = index = grown;
+	}
+	index_put(index, node, first);
+}
+
+/* Called after node is unlinked from object, but before its key is freed */
+static void index_remove(JsonNode *object, JsonNode *node)
+{
+	JsonIndex *index = object->children.index;
+	JsonSlot *slot = index_slot(index, node->key, index_hash(node->key));
+	JsonNode *member;
+	size_t mask = index->size - 1;
+	size_t i, j, k;
+
+	if (slot->node == NULL)
+		return;
+	if (slot->node != node) {
+		index->dups--;
+		return;
+	}
+	if (index->dups > 0) {
+		/* Let the next member with the same key take over */
+		json_foreach(member, object) {
+			if (strcmp(member->key, node->key) == 0) {
+				slot->node = member;
+				index->dups--;
+				return;
+			}
+		}
+	}
+
+	/* Shift back the entries that probed past the emptied slot */
+	i = j = slot - index->slots;
+	for (;;) {
+		index->slots[i].node = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (index->slots[j].node == NULL) {
+				index->count--;
+				return;
+			}
+			k = index->slots[j].hash & mask;
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+}
+
+static void index_build(JsonNode *object)
+{
+	JsonIndex *index;
+	JsonNode *member;
+	size_t size = 32;
+	size_t count = 0;
+
+	json_foreach(member, object)
+		count++;
+	while (size < count * 2)
+		size *= 2;
+
+	index = index_alloc(size);
+	json_foreach(member, object)
+		index_put(index, member, false);
+
+	/* Lookups are reads, so two of them may race to build the index */
+	if (!__sync_bool_compare_and_swap(&object->children.index, NULL, index))
+		free(index);
+}
+
+static void index_free(JsonNode *object)
+{
+	if (object->tag == JSON_OBJECT) {
+		free(object->children.index);
+		object->children.index = NULL;
+	}
+}
+
 /*
  * Unicode helper functions
  *
@@ -329,14 +573,26 @@ static void to_surrogate_pair(uchar_t unicode, uint16_t *uc, uint16_t *lc)
 #define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
+static bool parse_value     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_string    (const char **sp, char            **out, JsonArena *arena, SB *scratch);
 static bool parse_number    (const char **sp, double           *out, int *decimals);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
+static bool parse_array     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_object    (const char **sp, JsonNode        **out, JsonArena *arena);
 static bool parse_hex16     (const char **sp, uint16_t         *out);
 
 static bool expect_literal  (const char **sp, const char *str);
+
+typedef struct
+{
+	const JsonSax *sax;
+	void *data;
+	SB key;
+	SB str;
+} SaxState;
+
+static bool sax_value       (const char **sp, const char *key, SaxState *st);
+static bool sax_array       (const char **sp, const char *key, SaxState *st);
+static bool sax_object      (const char **sp, const char *key, SaxState *st);
 static void skip_space      (const char **sp);
 
 static void emit_value              (SB *out, const JsonNode *node);
@@ -351,6 +607,8 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 static int write_hex16(char *out, uint16_t val);
 
 static JsonNode *mknode(JsonTag tag);
+static JsonNode *mknode_arena(JsonArena *arena, JsonTag tag);
+static void arena_delete(JsonNode *node);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
@@ -365,7 +623,7 @@ JsonNode *json_decode(const char *json)
 	JsonNode *ret;
 
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
+	if (!parse_value(&s, &ret, NULL))
 		return NULL;
 
 	skip_space(&s);
@@ -377,6 +635,28 @@ JsonNode *json_decode(const char *json)
 	return ret;
 }
 
+JsonNode *json_decode_arena(const char *json)
+{
+	const char *s = json;
+	/* Enough for a typical message or config without a second block */
+	JsonArena *arena = arena_new(strlen(json) * 4 + 256);
+	JsonNode *ret;
+
+	skip_space(&s);
+	if (!parse_value(&s, &ret, arena)) {
+		arena_free(arena);
+		return NULL;
+	}
+
+	skip_space(&s);
+	if (*s != 0) {
+		arena_free(arena);
+		return NULL;
+	}
+
+	return ret;
+}
+
 char *json_encode(const JsonNode *node)
 {
 	return json_stringify(node, NULL);
@@ -405,11 +685,39 @@ char *json_stringify(const JsonNode *node, const char *space)
 	return sb_finish(&sb);
 }
 
+char *json_stringify_buffer(JsonBuffer *buf, const JsonNode *node, const char *space)
+{
+	if (buf->start == NULL)
+		sb_init(buf);
+	else
+		buf->cur = buf->start;
+
+	if (space != NULL)
+		emit_value_indented(buf, node, space, 0);
+	else
+		emit_value(buf, node);
+
+	return sb_finish(buf);
+}
+
+void json_buffer_free(JsonBuffer *buf)
+{
+	sb_free(buf);
+	buf->start = buf->cur = buf->end = NULL;
+}
+
 void json_delete(JsonNode *node)
 {
 	if (node != NULL) {
 		json_remove_from_parent(node);
 
+		if (node->arena_ != 0) {
+			arena_delete(node);
+			return;
+		}
+
+		index_free(node);
+
 		switch (node->tag) {
 			case JSON_STRING:
 				free(node->string_);
@@ -427,16 +735,39 @@ void json_delete(JsonNode *node)
 			default:;
 		}
 
-		free(node);
+		mempool_free(node);
 	}
 }
 
+/*
+ * Arena nodes go away with their root, so only the heap
+ * nodes that were appended to the tree are deleted here.
+ */
+static void arena_delete(JsonNode *node)
+{
+	JsonNode *child, *next;
+
+	index_free(node);
+	if (node->tag == JSON_ARRAY || node->tag == JSON_OBJECT) {
+		for (child = node->children.head; child != NULL; child = next) {
+			next = child->next;
+			if ((child->arena_ & (JSON_ARENA_NODE | JSON_ARENA_ROOT)) == JSON_ARENA_NODE)
+				arena_delete(child);
+			else
+				json_delete(child);
+		}
+	}
+
+	if (node->arena_ & JSON_ARENA_ROOT)
+		arena_free((JsonArena*) node);
+}
+
 bool json_validate(const char *json)
 {
 	const char *s = json;
 
 	skip_space(&s);
-	if (!parse_value(&s, NULL))
+	if (!parse_value(&s, NULL, NULL))
 		return false;
 
 	skip_space(&s);
@@ -446,6 +777,30 @@ bool json_validate(const char *json)
 	return true;
 }
 
+bool json_parse_sax(const char *json, const JsonSax *sax, void *data)
+{
+	const char *s = json;
+	SaxState st;
+	bool ret;
+
+	st.sax = sax;
+	st.data = data;
+	/* Keys and strings are decoded into the same two buffers over and over */
+	sb_init(&st.key);
+	sb_init(&st.str);
+
+	skip_space(&s);
+	ret = sax_value(&s, NULL, &st);
+	if (ret) {
+		skip_space(&s);
+		ret = (*s == 0);
+	}
+
+	sb_free(&st.key);
+	sb_free(&st.str);
+	return ret;
+}
+
 JsonNode *json_find_element(JsonNode *array, int index)
 {
 	JsonNode *element;
@@ -466,15 +821,25 @@ JsonNode *json_find_element(JsonNode *array, int index)
 JsonNode *json_find_member(JsonNode *object, const char *name)
 {
 	JsonNode *member;
+	int i = 0;
 
 	if (object == NULL || object->tag != JSON_OBJECT)
 		return NULL;
 
-	json_foreach(member, object)
+	if (object->children.index != NULL)
+		return index_slot(object->children.index, name, index_hash(name))->node;
+
+	json_foreach(member, object) {
 		if (strcmp(member->key, name) == 0)
-			return member;
+			break;
+		i++;
+	}
 
-	return NULL;
+	/* Only index the objects that are actually searched in depth */
+	if (i >= JSON_INDEX_MIN)
+		index_build(object);
+
+	return member;
 }
 
 JsonNode *json_first_child(const JsonNode *node)
@@ -486,13 +851,33 @@ JsonNode *json_first_child(const JsonNode *node)
 
 static JsonNode *mknode(JsonTag tag)
 {
-	JsonNode *ret = (JsonNode*) calloc(1, sizeof(JsonNode));
+	JsonNode *ret = (JsonNode*) mempool_alloc(&json_nodes);
 	if (ret == NULL)
 		out_of_memory();
 	ret->tag = tag;
 	return ret;
 }
 
+static JsonNode *mknode_arena(JsonArena *arena, JsonTag tag)
+{
+	JsonNode *ret;
+
+	if (arena == NULL)
+		return mknode(tag);
+
+	/* The first node of a parse is always its root */
+	if (!arena->rooted) {
+		arena->rooted = true;
+		ret = &arena->root;
+	} else {
+		ret = (JsonNode*) arena_alloc(arena, sizeof(JsonNode), sizeof(double));
+	}
+	memset(ret, 0, sizeof(JsonNode));
+	ret->tag = tag;
+	ret->arena_ = (ret == &arena->root) ? (JSON_ARENA_NODE | JSON_ARENA_ROOT) : JSON_ARENA_NODE;
+	return ret;
+}
+
 JsonNode *json_mknull(void)
 {
 	return mknode(JSON_NULL);
@@ -565,6 +950,8 @@ static void append_member(JsonNode *object, char *key, JsonNode *value)
 {
 	value->key = key;
 	append_node(object, value);
+	if (object->children.index != NULL)
+		index_insert(object, value, false);
 }
 
 void json_append_element(JsonNode *array, JsonNode *element)
@@ -598,6 +985,8 @@ void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
 
 	value->key = json_strdup(key);
 	prepend_node(object, value);
+	if (object->children.index != NULL)
+		index_insert(object, value, true);
 }
 
 void json_remove_from_parent(JsonNode *node)
@@ -614,15 +1003,20 @@ void json_remove_from_parent(JsonNode *node)
 		else
 			parent->children.tail = node->prev;
 
-		free(node->key);
+		if (parent->tag == JSON_OBJECT && parent->children.index != NULL)
+			index_remove(parent, node);
+
+		if (!(node->arena_ & JSON_ARENA_KEY))
+			free(node->key);
 
 		node->parent = NULL;
 		node->prev = node->next = NULL;
 		node->key = NULL;
+		node->arena_ &= ~JSON_ARENA_KEY;
 	}
 }
 
-static bool parse_value(const char **sp, JsonNode **out)
+static bool parse_value(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
 
@@ -630,7 +1024,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'n':
 			if (expect_literal(&s, "null")) {
 				if (out)
-					*out = json_mknull();
+					*out = mknode_arena(arena, JSON_NULL);
 				*sp = s;
 				return true;
 			}
@@ -638,8 +1032,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 
 		case 'f':
 			if (expect_literal(&s, "false")) {
-				if (out)
-					*out = json_mkbool(false);
+				if (out) {
+					*out = mknode_arena(arena, JSON_BOOL);
+					(*out)->bool_ = false;
+				}
 				*sp = s;
 				return true;
 			}
@@ -647,8 +1043,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 
 		case 't':
 			if (expect_literal(&s, "true")) {
-				if (out)
-					*out = json_mkbool(true);
+				if (out) {
+					*out = mknode_arena(arena, JSON_BOOL);
+					(*out)->bool_ = true;
+				}
 				*sp = s;
 				return true;
 			}
@@ -656,9 +1054,11 @@ static bool parse_value(const char **sp, JsonNode **out)
 
 		case '"': {
 			char *str;
-			if (parse_string(&s, out ? &str : NULL)) {
-				if (out)
-					*out = mkstring(str);
+			if (parse_string(&s, out ? &str : NULL, arena, NULL)) {
+				if (out) {
+					*out = mknode_arena(arena, JSON_STRING);
+					(*out)->string_ = str;
+				}
 				*sp = s;
 				return true;
 			}
@@ -666,14 +1066,14 @@ static bool parse_value(const char **sp, JsonNode **out)
 		}
 
 		case '[':
-			if (parse_array(&s, out)) {
+			if (parse_array(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
 			return false;
 
 		case '{':
-			if (parse_object(&s, out)) {
+			if (parse_object(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
@@ -683,8 +1083,11 @@ static bool parse_value(const char **sp, JsonNode **out)
 			double num;
 			int decimals = 0;
 			if (parse_number(&s, out ? &num : NULL, &decimals)) {
-				if (out)
-					*out = json_mknumber(num, decimals);
+				if (out) {
+					*out = mknode_arena(arena, JSON_NUMBER);
+					(*out)->number_ = num;
+					(*out)->decimals_ = decimals;
+				}
 				*sp = s;
 				return true;
 			}
@@ -693,10 +1096,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 	}
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+static bool parse_array(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkarray() : NULL;
+	JsonNode *ret = out ? mknode_arena(arena, JSON_ARRAY) : NULL;
 	JsonNode *element;
 
 	if (*s++ != '[')
@@ -709,7 +1112,7 @@ static bool parse_array(const char **sp, JsonNode **out)
 	}
 
 	for (;;) {
-		if (!parse_value(&s, out ? &element : NULL))
+		if (!parse_value(&s, out ? &element : NULL, arena))
 			goto failure;
 		skip_space(&s);
 
@@ -733,14 +1136,16 @@ success:
 	return true;
 
 failure:
-	json_delete(ret);
+	/* Arena nodes are dropped with the whole arena */
+	if (arena == NULL)
+		json_delete(ret);
 	return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+static bool parse_object(const char **sp, JsonNode **out, JsonArena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkobject() : NULL;
+	JsonNode *ret = out ? mknode_arena(arena, JSON_OBJECT) : NULL;
 	char *key;
 	JsonNode *value;
 
@@ -754,7 +1159,7 @@ static bool parse_object(const char **sp, JsonNode **out)
 	}
 
 	for (;;) {
-		if (!parse_string(&s, out ? &key : NULL))
+		if (!parse_string(&s, out ? &key : NULL, arena, NULL))
 			goto failure;
 		skip_space(&s);
 
@@ -762,12 +1167,15 @@ static bool parse_object(const char **sp, JsonNode **out)
 			goto failure_free_key;
 		skip_space(&s);
 
-		if (!parse_value(&s, out ? &value : NULL))
+		if (!parse_value(&s, out ? &value : NULL, arena))
 			goto failure_free_key;
 		skip_space(&s);
 
-		if (out)
+		if (out) {
 			append_member(ret, key, value);
+			if (arena != NULL)
+				value->arena_ |= JSON_ARENA_KEY;
+		}
 
 		if (*s == '}') {
 			s++;
@@ -786,26 +1194,50 @@ success:
 	return true;
 
 failure_free_key:
-	if (out)
+	if (out && arena == NULL)
 		free(key);
 failure:
-	json_delete(ret);
+	if (arena == NULL)
+		json_delete(ret);
 	return false;
 }
 
-bool parse_string(const char **sp, char **out)
+/*
+ * The string is written to the arena when there is one, else to scratch
+ * when given, which keeps ownership, else to a new heap allocation.
+ */
+bool parse_string(const char **sp, char **out, JsonArena *arena, SB *scratch)
 {
 	const char *s = *sp;
 	SB sb;
 	char throwaway_buffer[4];
 		/* enough space for a UTF-8 character */
 	char *b;
+	char *start = NULL;
 
 	if (*s++ != '"')
 		return false;
 
-	if (out) {
-		sb_init(&sb);
+	if (out && arena != NULL) {
+		/*
+		 * No escape sequence grows when it is decoded, so the
+		 * raw length bounds the string written to the arena.
+		 */
+		const char *e = s;
+		while (*e != '"') {
+			if (*e == '\\' && *++e == '\0')
+				return false;
+			if (*e++ == '\0')
+				return false;
+		}
+		start = b = (char*) arena_alloc(arena, (e - s) + 1, 1);
+	} else if (out) {
+		if (scratch != NULL) {
+			sb = *scratch;
+			sb.cur = sb.start;
+		} else {
+			sb_init(&sb);
+		}
 		sb_need(&sb, 4);
 		b = sb.cur;
 	} else {
@@ -887,27 +1319,180 @@ bool parse_string(const char **sp, char **out)
 		 * Update sb to know about the new bytes,
 		 * and set up b to write another character.
 		 */
-		if (out) {
+		if (out && arena == NULL) {
 			sb.cur = b;
 			sb_need(&sb, 4);
 			b = sb.cur;
-		} else {
+		} else if (out == NULL) {
 			b = throwaway_buffer;
 		}
 	}
 	s++;
 
-	if (out)
+	if (out && arena != NULL) {
+		*b = 0;
+		*out = start;
+	} else if (out) {
 		*out = sb_finish(&sb);
+		if (scratch != NULL)
+			*scratch = sb;
+	}
 	*sp = s;
 	return true;
 
 failed:
-	if (out)
-		sb_free(&sb);
+	if (out && arena == NULL) {
+		if (scratch != NULL)
+			*scratch = sb;
+		else
+			sb_free(&sb);
+	}
 	return false;
 }
 
+static bool sax_value(const char **sp, const char *key, SaxState *st)
+{
+	const JsonSax *sax = st->sax;
+	const char *s = *sp;
+
+	switch (*s) {
+		case 'n':
+			if (!expect_literal(&s, "null"))
+				return false;
+			if (sax->null != NULL && !sax->null(st->data, key))
+				return false;
+			break;
+
+		case 'f':
+			if (!expect_literal(&s, "false"))
+				return false;
+			if (sax->boolean != NULL && !sax->boolean(st->data, key, false))
+				return false;
+			break;
+
+		case 't':
+			if (!expect_literal(&s, "true"))
+				return false;
+			if (sax->boolean != NULL && !sax->boolean(st->data, key, true))
+				return false;
+			break;
+
+		case '"': {
+			char *str;
+			if (!parse_string(&s, &str, NULL, &st->str))
+				return false;
+			if (sax->string != NULL && !sax->string(st->data, key, str))
+				return false;
+			break;
+		}
+
+		case '[':
+			if (!sax_array(&s, key, st))
+				return false;
+			break;
+
+		case '{':
+			if (!sax_object(&s, key, st))
+				return false;
+			break;
+
+		default: {
+			double num;
+			int decimals = 0;
+			if (!parse_number(&s, sax->number != NULL ? &num : NULL, &decimals))
+				return false;
+			if (sax->number != NULL && !sax->number(st->data, key, num, decimals))
+				return false;
+			break;
+		}
+	}
+
+	*sp = s;
+	return true;
+}
+
+static bool sax_array(const char **sp, const char *key, SaxState *st)
+{
+	const JsonSax *sax = st->sax;
+	const char *s = *sp;
+
+	if (*s++ != '[')
+		return false;
+	if (sax->start_array != NULL && !sax->start_array(st->data, key))
+		return false;
+	skip_space(&s);
+
+	if (*s == ']') {
+		s++;
+	} else {
+		for (;;) {
+			if (!sax_value(&s, NULL, st))
+				return false;
+			skip_space(&s);
+
+			if (*s == ']') {
+				s++;
+				break;
+			}
+
+			if (*s++ != ',')
+				return false;
+			skip_space(&s);
+		}
+	}
+
+	if (sax->end_array != NULL && !sax->end_array(st->data))
+		return false;
+	*sp = s;
+	return true;
+}
+
+static bool sax_object(const char **sp, const char *key, SaxState *st)
+{
+	const JsonSax *sax = st->sax;
+	const char *s = *sp;
+	char *member;
+
+	if (*s++ != '{')
+		return false;
+	if (sax->start_object != NULL && !sax->start_object(st->data, key))
+		return false;
+	skip_space(&s);
+
+	if (*s == '}') {
+		s++;
+	} else {
+		for (;;) {
+			if (!parse_string(&s, &member, NULL, &st->key))
+				return false;
+			skip_space(&s);
+
+			if (*s++ != ':')
+				return false;
+			skip_space(&s);
+
+			/* Nested members reuse the key buffer once this one is reported */
+			if (!sax_value(&s, member, st))
+				return false;
+			skip_space(&s);
+
+			if (*s == '}') {
+				s++;
+				break;
+			}
+
+			if (*s++ != ',')
+				return false;
+			skip_space(&s);
+		}
+	}
+
+	if (sax->end_object != NULL && !sax->end_object(st->data))
+		return false;
+	*sp = s;
+	return true;
+}
+
 /*
  * The JSON spec says that a number shall follow this precise pattern
  * (spaces and quotes added for readability):
@@ -1266,9 +1851,26 @@ static void emit_number(SB *out, double num, int decimals)
 	 * like 0.3 -> 0.299999999999999988898 .
 	 */
 	char buf[64];
-	sprintf(buf, "%.*f", decimals, num);
 
-	if (number_is_valid(buf))
+	/* Whole numbers are the common case and need no sprintf */
+	if (decimals == 0 && num > -1e15 && num < 1e15 &&
+	    num == (double)(long long)num && !(num == 0 && signbit(num))) {
+		long long n = (long long)num;
+		unsigned long long u = (n < 0) ? -(unsigned long long)n : (unsigned long long)n;
+		char *p = buf + sizeof(buf);
+
+		do {
+			*--p = '0' + (u % 10);
+			u /= 10;
+		} while (u > 0);
+		if (n < 0)
+			*--p = '-';
+		sb_put(out, p, (buf + sizeof(buf)) - p);
+		return;
+	}
+
+	/* Anything that doesn't fit could never be read back anyway */
+	if (snprintf(buf, sizeof(buf), "%.*f", decimals, num) < (int)sizeof(buf) && number_is_valid(buf))
 		sb_puts(out, buf);
 	else
 		sb_puts(out, "null");
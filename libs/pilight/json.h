@@ -38,6 +38,7 @@ typedef enum {
 } JsonTag;
 
 typedef struct JsonNode JsonNode;
+typedef struct JsonIndex JsonIndex;
 
 struct JsonNode
 {
@@ -63,21 +64,73 @@ struct JsonNode
 		/* JSON_OBJECT */
 		struct {
 			JsonNode *head, *tail;
+			/* JSON_OBJECT member hash, built on demand */
+			JsonIndex *index;
 		} children;
 	};
 	int decimals_;
+	/* arena ownership flags, 0 for nodes that own their memory */
+	unsigned char arena_;
 };
 
+/* Reusable output buffer for json_stringify_buffer */
+typedef struct JsonBuffer
+{
+	char *cur;
+	char *end;
+	char *start;
+} JsonBuffer;
+
+#define JSON_BUFFER_INITIALIZER { NULL, NULL, NULL }
+
 /*** Encoding, decoding, and validation ***/
 
 JsonNode   *json_decode         (const char *json);
+JsonNode   *json_decode_arena   (const char *json);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
+char       *json_stringify_buffer(JsonBuffer *buf, const JsonNode *node, const char *space);
+void        json_buffer_free    (JsonBuffer *buf);
 void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
 
+/*
+ * json_decode_arena places all nodes, keys and strings of the tree in a
+ * few large blocks that a json_delete of the returned root releases at
+ * once. Heap nodes may be appended to such a tree and are freed along
+ * with it, but nodes of the tree must not outlive its root.
+ *
+ * json_stringify_buffer renders into a caller owned buffer that is reused
+ * between calls. The result stays valid until the next call on the same
+ * buffer or json_buffer_free.
+ */
+
+/*** Streaming ***/
+
+/*
+ * Callbacks for json_parse_sax. The key is the member name inside an
+ * object and NULL elsewhere. Keys and strings are only valid during
+ * the call. Unset callbacks are skipped and a callback returning false
+ * stops the parse. Callbacks run while parsing, so invalid input may
+ * already have produced some of them by the time it fails.
+ */
+typedef struct JsonSax
+{
+	bool (*null)        (void *data, const char *key);
+	bool (*boolean)     (void *data, const char *key, bool b);
+	bool (*number)      (void *data, const char *key, double n, int decimals);
+	bool (*string)      (void *data, const char *key, const char *s);
+	bool (*start_array) (void *data, const char *key);
+	bool (*end_array)   (void *data);
+	bool (*start_object)(void *data, const char *key);
+	bool (*end_object)  (void *data);
+} JsonSax;
+
+/* Returns true when json is valid and no callback stopped the parse */
+bool        json_parse_sax      (const char *json, const JsonSax *sax, void *data);
+
 /*** Lookup and traversal ***/
 
 JsonNode   *json_find_element   (JsonNode *array, int index);
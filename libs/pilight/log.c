@@ -25,64 +25,186 @@
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "../../pilight.h"
 #include "common.h"
 #include "gc.h"
 #include "log.h"
 
-struct logqueue_t {
-	char *line;
-	struct logqueue_t *next;
-} logqueue_t;
-
-static pthread_mutex_t logqueue_lock;
-static pthread_cond_t logqueue_signal;
-static pthread_mutexattr_t logqueue_attr;
-
-static struct logqueue_t *logqueue;
-static struct logqueue_t *logqueue_head;
-static unsigned int logqueue_number = 0;
-static unsigned int loop = 1;
-static unsigned int stop = 0;
+/*
+ * Lines for the log file are passed to the log thread through a
+ * fixed ring of records. Each record carries a sequence number that
+ * tells producers when it's free and the log thread when it's
+ * filled, so logging threads never take a lock or allocate memory.
+ * The sequence numbers are stored relative to the record index so
+ * the zero initialized ring is ready to use.
+ */
+typedef struct logrecord_t {
+	volatile unsigned int seq;
+	char line[LOG_RECORD_SIZE];
+} logrecord_t;
+
+static struct logrecord_t logring[LOG_RING_SIZE];
+static volatile unsigned int loghead = 0;
+static unsigned int logtail = 0;
+static volatile unsigned long logdropped = 0;
+static unsigned long logreported = 0;
+
+static sem_t logsem;
+static volatile unsigned int loop = 1;
+static volatile unsigned int stop = 0;
 static unsigned int pthinitialized = 0;
-static unsigned int pthactive = 0;
+static volatile unsigned int pthactive = 0;
 static unsigned int pthfree = 0;
 static pthread_t pth;
 
+/*
+ * Every thread keeps the names of the last functions it entered.
+ * The name pointers are stored without formatting, and a thread only
+ * claims one of the static traces the first time it logs.
+ */
+typedef struct logtrace_t {
+	volatile int used;
+	unsigned long thread;
+	unsigned int pos;
+	const char *functions[LOG_TRACE_SIZE];
+} logtrace_t;
+
+static struct logtrace_t logtraces[LOG_TRACE_THREADS];
+/* libpilight is never loaded with dlopen, so the cheaper TLS model is safe */
+static __thread struct logtrace_t *logtrace __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread int logtrace_full __attribute__((tls_model("initial-exec"))) = 0;
+static pthread_key_t logtrace_key;
+static pthread_once_t logtrace_once = PTHREAD_ONCE_INIT;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
 static char *logfile = NULL;
 static char *logpath = NULL;
 static int filelog = 1;
 static int shelllog = 0;
 static int loglevel = LOG_DEBUG;
 
+/* The log file stays open while a batch of lines is written */
+static FILE *logfp = NULL;
+
 void logwrite(char *line) {
 	struct stat sb;
-	FILE *lf = NULL;
 	if(logfile != NULL) {
-		if((stat(logfile, &sb)) == 0) {
-			if(sb.st_nlink != 0 && sb.st_size > LOG_MAX_SIZE) {
-				if(lf != NULL) {
-					fclose(lf);
+		if(logfp == NULL) {
+			if((stat(logfile, &sb)) == 0) {
+				if(sb.st_nlink != 0 && sb.st_size > LOG_MAX_SIZE) {
+					char tmp[strlen(logfile)+5];
+					strcpy(tmp, logfile);
+					strcat(tmp, ".old");
+					rename(logfile, tmp);
 				}
-				char tmp[strlen(logfile)+5];
-				strcpy(tmp, logfile);
-				strcat(tmp, ".old");
-				rename(logfile, tmp);
+			}
+			if((logfp = fopen(logfile, "a")) == NULL) {
+				filelog = 0;
+				return;
 			}
 		}
-		if((lf = fopen(logfile, "a")) == NULL) {
-			filelog = 0;
-		} else {
-			fwrite(line, sizeof(char), strlen(line), lf);
-			fflush(lf);
-			fclose(lf);
-			lf = NULL;
+		fwrite(line, sizeof(char), strlen(line), logfp);
+	}
+}
+
+static void logwrite_close(void) {
+	if(logfp != NULL) {
+		fflush(logfp);
+		fclose(logfp);
+		logfp = NULL;
+	}
+}
+
+/* Without a log file the lines end up in pilight.err */
+static void logwrite_error(char *line) {
+	/* [ Datetime ] Progname: */
+	/*  24 + 14 + 2 */
+	size_t pos = 24+strlen(progname)+3;
+	size_t len = strlen(line);
+	if(len > pos) {
+		memmove(&line[0], &line[pos], len-pos);
+		/* Remove newline */
+		line[(len-pos)-1] = '\0';
+		logerror(line);
+	}
+}
+
+static int logprefix(char *line, size_t len, int prio) {
+	struct timeval tv;
+	struct tm tm;
+	char fmt[64], buf[64];
+	const char *level = "";
+
+	memset(buf, '\0', sizeof(buf));
+	gettimeofday(&tv, NULL);
+	if(localtime_r(&tv.tv_sec, &tm) != NULL) {
+		strftime(fmt, sizeof(fmt), "%b %d %H:%M:%S", &tm);
+		snprintf(buf, sizeof(buf), "%s:%03u", fmt, (unsigned int)tv.tv_usec);
+	}
+
+	switch(prio) {
+		case LOG_WARNING:
+			level = "WARNING: ";
+		break;
+		case LOG_ERR:
+			level = "ERROR: ";
+		break;
+		case LOG_INFO:
+			level = "INFO: ";
+		break;
+		case LOG_NOTICE:
+			level = "NOTICE: ";
+		break;
+		case LOG_DEBUG:
+			level = "DEBUG: ";
+		break;
+		case LOG_STACK:
+			level = "STACK: ";
+		break;
+		default:
+		break;
+	}
+	return snprintf(line, len, "[%22.22s] %s: %s", buf, progname, level);
+}
+
+/* Only called by a single consumer: the log thread, or log_gc
+   when there is no log thread */
+static void logdrain(void (*callback)(char *line)) {
+	struct logrecord_t *record = NULL;
+	unsigned int idx = 0;
+	unsigned long dropped = 0;
+	char line[LOG_RECORD_SIZE];
+	int pos = 0;
+
+	while(1) {
+		idx = logtail & (LOG_RING_SIZE-1);
+		record = &logring[idx];
+		if(record->seq != (logtail-idx)+1) {
+			break;
 		}
+		/* Don't read the line before we've seen it published */
+		__sync_synchronize();
+		callback(record->line);
+		/* Finish reading before handing the record back */
+		__sync_synchronize();
+		record->seq = (logtail-idx)+LOG_RING_SIZE;
+		logtail++;
+	}
+
+	dropped = logdropped;
+	if(dropped != logreported) {
+		pos = logprefix(line, sizeof(line), LOG_WARNING);
+		snprintf(&line[pos], sizeof(line)-(size_t)pos, "log ring full, dropped %lu lines\n", dropped-logreported);
+		callback(line);
+		logreported = dropped;
 	}
+	logwrite_close();
 }
 
 int log_gc(void) {
@@ -93,49 +215,25 @@ int log_gc(void) {
 	stop = 1;
 	loop = 0;
 
-	pthread_mutex_unlock(&logqueue_lock);
-	pthread_cond_signal(&logqueue_signal);
-
-	/* Flush log queue to pilight.err file */
 	if(pthactive == 0) {
-		struct logqueue_t *tmp;
-		while(logqueue) {
-			tmp = logqueue;
-			if(tmp->line != NULL) {
-				if(filelog == 1 && logfile != NULL) {
-					logwrite(tmp->line);
-				} else {
-					/* [ Datetime ] Progname: */
-					/*  24 + 14 + 2 */
-					size_t pos = 24+strlen(progname)+3;
-					size_t len = strlen(tmp->line);
-					memmove(&tmp->line[0], &tmp->line[pos], len-pos);
-					/* Remove newline */
-					tmp->line[(len-pos)-1] = '\0';
-					logerror(tmp->line);
-				}
-				FREE(tmp->line);
-			}
-			logqueue = logqueue->next;
-			FREE(tmp);
-			logqueue_number--;
-		}
-		if(logqueue != NULL) {
-			FREE(logqueue);
+		/* Flush log ring to pilight.err file */
+		if(filelog == 1 && logfile != NULL) {
+			logdrain(logwrite);
+		} else {
+			logdrain(logwrite_error);
 		}
 		if(pthfree == 1) {
 			pthread_join(pth, NULL);
 		}
 	} else {
-		/* Flush log queue by log thread */
-		while(logqueue_number > 0) {
-			usleep(10);
-		}
-		while(pthactive > 0) {
-			usleep(10);
-		}
+		/* Flush log ring by log thread */
+		sem_post(&logsem);
 		pthread_join(pth, NULL);
 	}
+	if(pthinitialized == 1) {
+		sem_destroy(&logsem);
+		pthinitialized = 0;
+	}
 	if(logfile != NULL) {
 		FREE(logfile);
 	}
@@ -145,107 +243,73 @@ int log_gc(void) {
 	return 1;
 }
 
-void logprintf(int prio, const char *format_str, ...) {
-	struct timeval tv;
-	struct tm *tm = NULL;
-	va_list ap, apcpy;
-	char fmt[64], buf[64], *line = MALLOC(128), nul;
-	int save_errno = -1, pos = 0, bytes = 0;
+void (logprintf)(int prio, const char *format_str, ...) {
+	struct logrecord_t *record = NULL;
+	va_list ap;
+	char prefix[LOG_RECORD_SIZE];
+	unsigned int head = 0, idx = 0;
+	int save_errno = -1, pos = 0, diff = 0, bytes = 0;
 
-	if(line == NULL) {
-		fprintf(stderr, "out of memory");
-		exit(EXIT_FAILURE);
+	/* Filtered lines should cost as little as possible */
+	if(loglevel < prio) {
+		return;
 	}
 	save_errno = errno;
 
-	memset(line, '\0', 128);
-
-	if(loglevel >= prio) {
-		gettimeofday(&tv, NULL);
-		if((tm = localtime(&tv.tv_sec)) != NULL) {
-			strftime(fmt, sizeof(fmt), "%b %d %H:%M:%S", tm);
-			snprintf(buf, sizeof(buf), "%s:%03u", fmt, (unsigned int)tv.tv_usec);
-		}
-		pos += sprintf(line, "[%22.22s] %s: ", buf, progname);
+	if(shelllog == 1) {
+		pos = logprefix(prefix, sizeof(prefix), prio);
+		flockfile(stderr);
+		fputs(prefix, stderr);
+		va_start(ap, format_str);
+		vfprintf(stderr, format_str, ap);
+		va_end(ap);
+		fputc('\n', stderr);
+		funlockfile(stderr);
+	}
 
-		switch(prio) {
-			case LOG_WARNING:
-				pos += sprintf(&line[pos], "WARNING: ");
-			break;
-			case LOG_ERR:
-				pos += sprintf(&line[pos], "ERROR: ");
-			break;
-			case LOG_INFO:
-				pos += sprintf(&line[pos], "INFO: ");
-			break;
-			case LOG_NOTICE:
-				pos += sprintf(&line[pos], "NOTICE: ");
-			break;
-			case LOG_DEBUG:
-				pos += sprintf(&line[pos], "DEBUG: ");
-			break;
-			case LOG_STACK:
-				pos += sprintf(&line[pos], "STACK: ");
-			break;
-			default:
-			break;
+	if(stop == 0 && prio < LOG_DEBUG) {
+		/* Claim the next free record */
+		head = loghead;
+		while(1) {
+			idx = head & (LOG_RING_SIZE-1);
+			record = &logring[idx];
+			diff = (int)(record->seq-(head-idx));
+			if(diff == 0) {
+				if(__sync_bool_compare_and_swap(&loghead, head, head+1)) {
+					break;
+				}
+			} else if(diff < 0) {
+				__sync_fetch_and_add(&logdropped, 1);
+				errno = save_errno;
+				return;
+			}
+			head = loghead;
 		}
 
-		va_copy(apcpy, ap);
-		va_start(apcpy, format_str);
-		bytes = vsnprintf(&nul, 1, format_str, apcpy);
-		if(bytes == -1) {
-			fprintf(stderr, "ERROR: unproperly formatted logprintf message %s\n", format_str);
+		if(shelllog == 1) {
+			strcpy(record->line, prefix);
 		} else {
-			va_end(apcpy);
-			if((line = REALLOC(line, (size_t)bytes+(size_t)pos+3)) == NULL) {
-				fprintf(stderr, "out of memory");
-				exit(EXIT_FAILURE);
-			}
-			va_start(ap, format_str);
-			pos += vsprintf(&line[pos], format_str, ap);
-			va_end(ap);
+			pos = logprefix(record->line, LOG_RECORD_SIZE, prio);
 		}
-		line[pos++]='\n';
-		line[pos++]='\0';
-	}
-	if(shelllog == 1) {
-		fprintf(stderr, "%s", line);
-	}
-	if(stop == 0 && pos > 0) {
-		if(prio < LOG_DEBUG) {
-			pthread_mutex_lock(&logqueue_lock);	
-			if(logqueue_number < 1024) {		
-				struct logqueue_t *node = MALLOC(sizeof(logqueue_t));
-				if(node == NULL) {
-					fprintf(stderr, "out of memory");
-					exit(EXIT_FAILURE);
-				}
-				if((node->line = MALLOC((size_t)pos+1)) == NULL) {
-					fprintf(stderr, "out of memory");
-					exit(EXIT_FAILURE);
-				}
-				memset(node->line, '\0', (size_t)pos+1);
-				strcpy(node->line, line);
-				node->next = NULL;
-
-				if(logqueue_number == 0) {
-					logqueue = node;
-					logqueue_head = node;
-				} else {
-					logqueue_head->next = node;
-					logqueue_head = node;
-				}
-
-				logqueue_number++;
-			} else {
-				fprintf(stderr, "log queue full\n");
-			}
-			pthread_mutex_unlock(&logqueue_lock);
-			pthread_cond_signal(&logqueue_signal);
+		va_start(ap, format_str);
+		if((bytes = vsnprintf(&record->line[pos], LOG_RECORD_SIZE-(size_t)pos, format_str, ap)) > 0) {
+			pos += bytes;
+		}
+		va_end(ap);
+		/* Long lines are truncated, but always end with a newline */
+		if(pos > LOG_RECORD_SIZE-2) {
+			pos = LOG_RECORD_SIZE-2;
+		}
+		record->line[pos++] = '\n';
+		record->line[pos] = '\0';
+
+		/* Publish the line before handing it to the log thread */
+		__sync_synchronize();
+		record->seq = (head-idx)+1;
+		if(pthinitialized == 1) {
+			sem_post(&logsem);
 		}
 	}
-	FREE(line);
 	errno = save_errno;
 }
 
@@ -254,27 +318,104 @@ void *logloop(void *param) {
 
 	pthactive = 1;
 	pthfree = 1;
-	
-	pthread_mutex_lock(&logqueue_lock);
+
+	/* Lines logged before the thread started are waiting already */
 	while(loop) {
-		if(logqueue_number > 0) {
-			pthread_mutex_lock(&logqueue_lock);
+		logdrain(logwrite);
+		sem_wait(&logsem);
+	}
+	logdrain(logwrite);
 
-			logwrite(logqueue->line);
+	pthactive = 0;
+	return (void *)NULL;
+}
 
-			struct logqueue_t *tmp = logqueue;
-			FREE(tmp->line);
-			logqueue = logqueue->next;
-			FREE(tmp);
-			logqueue_number--;
-			pthread_mutex_unlock(&logqueue_lock);
-		} else {
-			pthread_cond_wait(&logqueue_signal, &logqueue_lock);
+/* Hand the trace back when its thread exits */
+static void log_trace_free(void *param) {
+	struct logtrace_t *trace = param;
+	trace->used = 0;
+}
+
+static void log_trace_init(void) {
+	pthread_key_create(&logtrace_key, log_trace_free);
+}
+
+void log_trace(const char *function) {
+	struct logtrace_t *trace = logtrace;
+	int i = 0;
+
+	if(trace == NULL) {
+		if(logtrace_full == 1) {
+			return;
+		}
+		pthread_once(&logtrace_once, log_trace_init);
+		for(i=0;i<LOG_TRACE_THREADS;i++) {
+			if(__sync_bool_compare_and_swap(&logtraces[i].used, 0, 1)) {
+				trace = &logtraces[i];
+				break;
+			}
+		}
+		if(trace == NULL) {
+			logtrace_full = 1;
+			return;
 		}
+		trace->thread = (unsigned long)pthread_self();
+		trace->pos = 0;
+		memset(trace->functions, 0, sizeof(trace->functions));
+		pthread_setspecific(logtrace_key, trace);
+		logtrace = trace;
 	}
+	trace->functions[trace->pos & (LOG_TRACE_SIZE-1)] = function;
+	trace->pos++;
+}
 
-	pthactive = 0;	
-	return (void *)NULL;
+static void log_trace_write(int fd, const char *line, int len) {
+	ssize_t n = 0;
+
+	if(len <= 0) {
+		return;
+	}
+	if(len >= LOG_RECORD_SIZE) {
+		len = LOG_RECORD_SIZE-1;
+	}
+	if(fd != -1) {
+		n = write(fd, line, (size_t)len);
+	}
+	if(fd == -1 || shelllog == 1) {
+		n = write(STDERR_FILENO, line, (size_t)len);
+	}
+	(void)n;
+}
+
+/* Can be called from a signal handler, so only plain writes
+   to the log file and stderr are used */
+void log_trace_dump(void) {
+	struct logtrace_t *trace = NULL;
+	const char *function = NULL;
+	char line[LOG_RECORD_SIZE];
+	unsigned int pos = 0, nr = 0, x = 0;
+	int fd = -1, i = 0;
+
+	if(logfile != NULL) {
+		fd = open(logfile, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	}
+	for(i=0;i<LOG_TRACE_THREADS;i++) {
+		trace = &logtraces[i];
+		if(trace->used == 0) {
+			continue;
+		}
+		pos = trace->pos;
+		nr = (pos < LOG_TRACE_SIZE) ? pos : LOG_TRACE_SIZE;
+		log_trace_write(fd, line, snprintf(line, sizeof(line), "-- TRACE THREAD %lu (LAST %u CALLS) --\n", trace->thread, nr));
+		for(x=1;x<=nr;x++) {
+			if((function = trace->functions[(pos-x) & (LOG_TRACE_SIZE-1)]) != NULL) {
+				log_trace_write(fd, line, snprintf(line, sizeof(line), "%s\n", function));
+			}
+		}
+	}
+	if(fd != -1) {
+		close(fd);
+	}
 }
 
 void logperror(int prio, const char *s) {
@@ -290,13 +431,16 @@ void logperror(int prio, const char *s) {
 	// errno = save_errno;
 }
 
+/* The timezone is read once, localtime_r doesn't reread it per line */
+static void log_init(void) {
+	tzset();
+}
+
 void log_file_enable(void) {
+	pthread_once(&log_once, log_init);
 	filelog = 1;
 	if(pthinitialized == 0) {
-		pthread_mutexattr_init(&logqueue_attr);
-		pthread_mutexattr_settype(&logqueue_attr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&logqueue_lock, &logqueue_attr);
-		pthread_cond_init(&logqueue_signal, NULL);
+		sem_init(&logsem, 0, 0);
 		pthinitialized = 1;
 	}
 }
@@ -306,6 +450,7 @@ void log_file_disable(void) {
 }
 
 void log_shell_enable(void) {
+	pthread_once(&log_once, log_init);
 	shelllog = 1;
 }
 
@@ -21,9 +21,29 @@
 
 #include <syslog.h>
 
+#include "../../defines.h"
+
 #define LOG_STACK		255
 
-void logprintf(int prio, const char *format_str, ...);
+void (logprintf)(int prio, const char *format_str, ...);
+void log_trace(const char *function);
+void log_trace_dump(void);
+
+/*
+ * Lines more verbose than LOG_MAX_LEVEL are removed at compile time.
+ * The LOG_STACK lines that start most functions always leave their
+ * function name in a small per-thread trace, so there are breadcrumbs
+ * even when those lines are compiled out or filtered.
+ */
+#define logprintf(prio, ...) \
+	do { \
+		if((prio) == LOG_STACK) { \
+			log_trace(__FUNCTION__); \
+		} \
+		if((prio) <= LOG_MAX_LEVEL) { \
+			(logprintf)(prio, __VA_ARGS__); \
+		} \
+	} while(0)
 void logperror(int prio, const char *s);
 void *logloop(void *param);
 void log_file_enable(void);
@@ -22,63 +22,279 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
 
+#include "../../defines.h"
 #include "mem.h"
 
 static unsigned short memdbg = 0;
 static unsigned long openallocs = 0;
 static unsigned long totalnrallocs = 0;
 
-struct mallocs_t {
+/* Allocations are aggregated per file and line they were made at */
+typedef struct memsite_t {
+	const char *file;
+	int line;
+	unsigned int shard;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long live;
+	unsigned long bytes;
+	struct memsite_t *next;
+} memsite_t;
+
+typedef struct mallocs_t {
 	void *p;
 	unsigned long size;
-	int line;
-	char file[255];
+	struct memsite_t *site;
 	struct mallocs_t *next;
 } mallocs_t;
 
-static struct mallocs_t *mallocs = NULL;
+/* Both pointers and sites are spread over shards that each have their
+   own lock, so threads tracking allocations hardly ever contend */
+typedef struct memshard_t {
+	pthread_mutex_t lock;
+	struct mallocs_t **mallocs;
+	unsigned long size;
+	unsigned long nr;
+	struct memsite_t *sites[MEMTRACK_SITES];
+} memshard_t;
+
+static struct memshard_t memshards[MEMTRACK_SHARDS];
+
+static unsigned long memtrack_hash(uintptr_t a) {
+	uint64_t h = (uint64_t)a * 0x9E3779B97F4A7C15ULL;
+	return (unsigned long)(h ^ (h >> 32));
+}
+
+static unsigned long memtrack_site_hash(const char *file, int line) {
+	unsigned long h = 2166136261UL;
+	while(*file != '\0') {
+		h = (h ^ (unsigned char)*file++) * 16777619UL;
+	}
+	return (h ^ (unsigned long)line) * 16777619UL;
+}
 
 void memtrack(void) {
+	int i = 0;
+
+	for(i=0;i<MEMTRACK_SHARDS;i++) {
+		pthread_mutex_init(&memshards[i].lock, NULL);
+		memshards[i].size = 64;
+		if((memshards[i].mallocs = calloc(memshards[i].size, sizeof(struct mallocs_t *))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 	memdbg = 1;
 }
 
+static struct memsite_t *memtrack_site(const char *file, int line) {
+	unsigned long h = memtrack_site_hash(file, line);
+	unsigned int shard = (unsigned int)(h & (MEMTRACK_SHARDS-1));
+	unsigned long bucket = (h / MEMTRACK_SHARDS) & (MEMTRACK_SITES-1);
+	struct memsite_t *site = NULL;
+
+	pthread_mutex_lock(&memshards[shard].lock);
+	for(site=memshards[shard].sites[bucket];site!=NULL;site=site->next) {
+		if(site->line == line && (site->file == file || strcmp(site->file, file) == 0)) {
+			break;
+		}
+	}
+	if(site == NULL) {
+		/* The file names are string literals, so they don't have to be copied */
+		if((site = calloc(1, sizeof(struct memsite_t))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		site->file = file;
+		site->line = line;
+		site->shard = shard;
+		site->next = memshards[shard].sites[bucket];
+		memshards[shard].sites[bucket] = site;
+	}
+	pthread_mutex_unlock(&memshards[shard].lock);
+	return site;
+}
+
+static void memtrack_add(void *p, unsigned long size, const char *file, int line) {
+	struct memsite_t *site = memtrack_site(file, line);
+	struct mallocs_t *node = NULL, **mallocs = NULL;
+	unsigned long h = memtrack_hash((uintptr_t)p), i = 0, x = 0, size2 = 0;
+	struct memshard_t *shard = &memshards[h & (MEMTRACK_SHARDS-1)];
+
+	if((node = malloc(sizeof(struct mallocs_t))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	node->p = p;
+	node->size = size;
+	node->site = site;
+
+	pthread_mutex_lock(&shard->lock);
+	if(shard->nr >= shard->size) {
+		size2 = shard->size*2;
+		if((mallocs = calloc(size2, sizeof(struct mallocs_t *))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for(i=0;i<shard->size;i++) {
+			struct mallocs_t *tmp = shard->mallocs[i], *next = NULL;
+			while(tmp) {
+				next = tmp->next;
+				x = (memtrack_hash((uintptr_t)tmp->p) / MEMTRACK_SHARDS) & (size2-1);
+				tmp->next = mallocs[x];
+				mallocs[x] = tmp;
+				tmp = next;
+			}
+		}
+		free(shard->mallocs);
+		shard->mallocs = mallocs;
+		shard->size = size2;
+	}
+	x = (h / MEMTRACK_SHARDS) & (shard->size-1);
+	node->next = shard->mallocs[x];
+	shard->mallocs[x] = node;
+	shard->nr++;
+	pthread_mutex_unlock(&shard->lock);
+
+	pthread_mutex_lock(&memshards[site->shard].lock);
+	site->allocs++;
+	site->live++;
+	site->bytes += size;
+	pthread_mutex_unlock(&memshards[site->shard].lock);
+
+	__sync_add_and_fetch(&openallocs, 1);
+	__sync_add_and_fetch(&totalnrallocs, 1);
+}
+
+/* Returns the size of the pointer that stopped being tracked, or -1 */
+static long memtrack_remove(void *p) {
+	unsigned long h = memtrack_hash((uintptr_t)p);
+	struct memshard_t *shard = &memshards[h & (MEMTRACK_SHARDS-1)];
+	struct mallocs_t *node = NULL, **prev = NULL;
+	struct memsite_t *site = NULL;
+	unsigned long size = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	prev = &shard->mallocs[(h / MEMTRACK_SHARDS) & (shard->size-1)];
+	while((node = *prev) != NULL && node->p != p) {
+		prev = &node->next;
+	}
+	if(node != NULL) {
+		*prev = node->next;
+		shard->nr--;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if(node == NULL) {
+		return -1;
+	}
+	site = node->site;
+	size = node->size;
+	free(node);
+
+	pthread_mutex_lock(&memshards[site->shard].lock);
+	site->frees++;
+	site->live--;
+	site->bytes -= size;
+	pthread_mutex_unlock(&memshards[site->shard].lock);
+
+	__sync_sub_and_fetch(&openallocs, 1);
+	return (long)size;
+}
+
 void xfree(void) {
 	if(memdbg == 1) {
-		unsigned long totalsize = 0;
-		struct mallocs_t *tmp;
-		while(mallocs) {
-			tmp = mallocs;
-			totalsize += mallocs->size;
-			free(mallocs->p);
-			fprintf(stderr, "WARNING: unfreed pointer in %s at line #%d\n", tmp->file, tmp->line);
-			mallocs = mallocs->next;
-			free(tmp);
+		unsigned long totalsize = 0, i = 0;
+		struct mallocs_t *tmp = NULL;
+		struct memsite_t *site = NULL;
+		int x = 0;
+
+		for(x=0;x<MEMTRACK_SHARDS;x++) {
+			for(i=0;i<memshards[x].size;i++) {
+				while((tmp = memshards[x].mallocs[i]) != NULL) {
+					memshards[x].mallocs[i] = tmp->next;
+					totalsize += tmp->size;
+					free(tmp->p);
+					free(tmp);
+				}
+			}
+		}
+		for(x=0;x<MEMTRACK_SHARDS;x++) {
+			for(i=0;i<MEMTRACK_SITES;i++) {
+				while((site = memshards[x].sites[i]) != NULL) {
+					if(site->live > 0) {
+						fprintf(stderr, "WARNING: %lu unfreed pointers (%lu bytes) in %s at line #%d\n",
+						        site->live, site->bytes, site->file, site->line);
+					}
+					memshards[x].sites[i] = site->next;
+					free(site);
+				}
+			}
+			free(memshards[x].mallocs);
+			memshards[x].mallocs = NULL;
+			memshards[x].size = 0;
+			memshards[x].nr = 0;
 		}
 		fprintf(stderr, "%s: leaked %lu bytes from pilight libraries and programs.\n", 
 										(totalsize > 0) ? "ERROR" : "NOTICE", totalsize);
 		fprintf(stderr, "NOTICE: memory allocations total: %lu, still open: %lu\n", totalnrallocs, openallocs);
-		free(mallocs);
+		memdbg = 0;
+	}
+}
+
+/* Safe to call from a signal handler, shards that are
+   locked by the interrupted thread are skipped */
+void memtrack_dump(void) {
+	struct memsite_t *site = NULL;
+	char line[512];
+	int x = 0, i = 0, n = 0;
+
+	if(memdbg == 0) {
+		return;
+	}
+	n = snprintf(line, sizeof(line), "-- MEMTRACK (%lu OF %lu ALLOCATIONS OPEN) --\n", openallocs, totalnrallocs);
+	if(write(STDERR_FILENO, line, (size_t)n) != n) {
+		return;
+	}
+	for(x=0;x<MEMTRACK_SHARDS;x++) {
+		if(pthread_mutex_trylock(&memshards[x].lock) != 0) {
+			n = snprintf(line, sizeof(line), "shard %d busy, skipped\n", x);
+			if(write(STDERR_FILENO, line, (size_t)n) != n) {
+				return;
+			}
+			continue;
+		}
+		for(i=0;i<MEMTRACK_SITES;i++) {
+			for(site=memshards[x].sites[i];site!=NULL;site=site->next) {
+				if(site->live == 0) {
+					continue;
+				}
+				n = snprintf(line, sizeof(line), "%s:%d: %lu open (%lu bytes), %lu allocations, %lu frees\n",
+				             site->file, site->line, site->live, site->bytes, site->allocs, site->frees);
+				if(n >= (int)sizeof(line)) {
+					n = (int)sizeof(line)-1;
+				}
+				if(write(STDERR_FILENO, line, (size_t)n) != n) {
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&memshards[x].lock);
 	}
 }
 
 void *_malloc(unsigned long a, const char *file, int line) {
 	if(memdbg == 1) {
-		struct mallocs_t *node = malloc(sizeof(mallocs_t));
-		if((node->p = malloc(a)) == NULL) {
+		void *p = NULL;
+		if((p = malloc(a)) == NULL) {
 			fprintf(stderr, "out of memory\n");
-			free(node);
 			xfree();
 			exit(EXIT_FAILURE);
 		}
-		openallocs++;
-		totalnrallocs++;
-		node->size = a;
-		node->line = line;
-		strcpy(node->file, file);
-		node->next = mallocs;
-		mallocs = node;
-		return node->p;
+		memtrack_add(p, a, file, line);
+		return p;
 	} else {
 		return malloc(a);
 	}
@@ -88,31 +304,17 @@ void *_realloc(void *a, unsigned long b, const char *file, int line) {
 	if(memdbg == 1) {
 		if(a == NULL) {
 			return _malloc(b, file, line);
+		} else if(memtrack_remove(a) == -1) {
+			fprintf(stderr, "ERROR: calling realloc on an unknown pointer in %s at line #%d\n", file, line);
+			return _malloc(b, file, line);
 		} else {
-			struct mallocs_t *tmp = mallocs;
-			while(tmp) {
-				if(tmp->p == a) {
-					tmp->line = line;
-					strcpy(tmp->file, file);
-					tmp->size = b;
-					if((a = realloc(a, b)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						xfree();
-						exit(EXIT_FAILURE);
-					}
-					tmp->p = a;
-					break;
-				}
-				tmp = tmp->next;
-			}
-			if(tmp == NULL) {
-				fprintf(stderr, "ERROR: calling realloc on an unknown pointer in %s at line #%d\n", file, line);
-				return _malloc(b, file, line);
-			} else if(tmp != NULL && tmp->p != NULL) {
-				return a;
-			} else {
-				return _malloc(b, file, line);
+			if((a = realloc(a, b)) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				xfree();
+				exit(EXIT_FAILURE);
 			}
+			memtrack_add(a, b, file, line);
+			return a;
 		}
 	} else {
 		return realloc(a, b);
@@ -121,22 +323,14 @@ void *_realloc(void *a, unsigned long b, const char *file, int line) {
 
 void *_calloc(unsigned long a, unsigned long b, const char *file, int line) {
 	if(memdbg == 1) {
-		struct mallocs_t *node = malloc(sizeof(mallocs_t));
-		if((node->p = malloc(a*b)) == NULL) {
+		void *p = NULL;
+		if((p = calloc(a, b)) == NULL) {
 			fprintf(stderr, "out of memory\n");
-			free(node);
 			xfree();
 			exit(EXIT_FAILURE);
 		}
-		openallocs++;
-		totalnrallocs++;
-		memset(node->p, '\0', a*b);
-		node->size = a*b;
-		node->line = line;
-		strcpy(node->file, file);
-		node->next = mallocs;
-		mallocs = node;
-		return node->p;
+		memtrack_add(p, a*b, file, line);
+		return p;
 	} else {
 		return calloc(a, b);
 	}
@@ -147,32 +341,229 @@ void _free(void *a, const char *file, int line) {
 		if(a == NULL) {
 			fprintf(stderr, "WARNING: calling free on already freed pointer in %s at line #%d\n", file, line);
 		} else {
-			struct mallocs_t *currP, *prevP;
-			int match = 0;
-
-			prevP = NULL;
-
-			for(currP = mallocs; currP != NULL; prevP = currP, currP = currP->next) {
-				if(currP->p == a) {
-					match = 1;
-					if(prevP == NULL) {
-						mallocs = currP->next;
-					} else {
-						prevP->next = currP->next;
-					}
-					free(currP->p);
-					free(currP);
-
-					break;
-				}
-			}
-			openallocs--;
-			if(match == 0) {
+			if(memtrack_remove(a) == -1) {
 				fprintf(stderr, "ERROR: trying to free an unknown pointer in %s at line #%d\n", file, line);
-				free(a);
 			}
+			free(a);
 		}
 	} else {
 		free(a);
 	}
 }
+
+/* Every slab is aligned to its size, so an object
+   finds its slab by masking its address */
+typedef struct memslab_t {
+	struct mempool_t *pool;
+	struct memslab_t *prev;
+	struct memslab_t *next;
+	void *free;
+	unsigned int used;
+	/* Objects behind this one were never handed out */
+	unsigned int carved;
+} memslab_t;
+
+#define MEMSLAB_HEADER ((sizeof(struct memslab_t)+15) & ~(size_t)15)
+
+/* A few freed objects per pool are kept by each thread,
+   so most allocations don't have to take the pool lock */
+typedef struct memcache_t {
+	void *free;
+	unsigned int count;
+} memcache_t;
+
+static __thread struct memcache_t memcache[MEMPOOL_MAX] __attribute__((tls_model("initial-exec")));
+static __thread int memcache_active __attribute__((tls_model("initial-exec"))) = 0;
+static pthread_key_t memcache_key;
+static pthread_once_t memcache_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t mempools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mempool_t *mempools = NULL;
+static unsigned int mempools_number = 0;
+
+static void mempool_link(struct mempool_t *pool, struct memslab_t *slab) {
+	slab->prev = NULL;
+	slab->next = pool->partial;
+	if(pool->partial != NULL) {
+		pool->partial->prev = slab;
+	}
+	pool->partial = slab;
+}
+
+static void mempool_unlink(struct mempool_t *pool, struct memslab_t *slab) {
+	if(slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		pool->partial = slab->next;
+	}
+	if(slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void mempool_release(void *a) {
+	struct memslab_t *slab = (struct memslab_t *)((uintptr_t)a & ~(uintptr_t)(MEMPOOL_SLAB_SIZE-1));
+	struct mempool_t *pool = slab->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	*(void **)a = slab->free;
+	slab->free = a;
+	if(slab->used == pool->perslab) {
+		mempool_link(pool, slab);
+	}
+	slab->used--;
+	pool->used--;
+
+	/* Keep a single empty slab around so a pool that
+	   hovers around a slab boundary doesn't thrash */
+	if(slab->used == 0) {
+		mempool_unlink(pool, slab);
+		if(pool->spare == NULL) {
+			slab->free = NULL;
+			slab->carved = 0;
+			pool->spare = slab;
+		} else {
+			free(slab);
+			pool->slabs--;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Hand the objects cached by an exiting thread back to their slabs */
+static void memcache_free(void *param) {
+	void *a = NULL;
+	int i = 0;
+
+	for(i=0;i<MEMPOOL_MAX;i++) {
+		while((a = memcache[i].free) != NULL) {
+			memcache[i].free = *(void **)a;
+			mempool_release(a);
+		}
+		memcache[i].count = 0;
+	}
+	/* Anything freed after this goes straight back to the slabs */
+	memcache_active = -1;
+}
+
+static void memcache_init(void) {
+	pthread_key_create(&memcache_key, memcache_free);
+}
+
+static void mempool_register(struct mempool_t *pool) {
+	/* Keep the objects aligned like malloc does */
+	pool->size = (pool->size+15) & ~(unsigned long)15;
+	if((MEMPOOL_SLAB_SIZE-MEMSLAB_HEADER)/pool->size == 0) {
+		fprintf(stderr, "%s pool objects don't fit a slab\n", pool->name);
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_lock(&mempools_lock);
+	/* Pools beyond the maximum just don't get a thread cache */
+	pool->id = mempools_number++;
+	pool->next = mempools;
+	mempools = pool;
+	pthread_mutex_unlock(&mempools_lock);
+
+	/* Marks the pool as ready for the lockless paths */
+	__sync_synchronize();
+	pool->perslab = (unsigned int)((MEMPOOL_SLAB_SIZE-MEMSLAB_HEADER)/pool->size);
+}
+
+void *mempool_alloc(struct mempool_t *pool) {
+	struct memcache_t *cache = NULL;
+	struct memslab_t *slab = NULL;
+	void *a = NULL;
+	void *mem = NULL;
+
+	if(pool->perslab > 0 && pool->id < MEMPOOL_MAX) {
+		cache = &memcache[pool->id];
+		if((a = cache->free) != NULL) {
+			cache->free = *(void **)a;
+			cache->count--;
+			memset(a, '\0', pool->size);
+			return a;
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->perslab == 0) {
+		mempool_register(pool);
+	}
+
+	if((slab = pool->partial) == NULL) {
+		if(pool->spare != NULL) {
+			slab = pool->spare;
+			pool->spare = NULL;
+		} else {
+			if(posix_memalign(&mem, MEMPOOL_SLAB_SIZE, MEMPOOL_SLAB_SIZE) != 0) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			slab = mem;
+			slab->pool = pool;
+			slab->free = NULL;
+			slab->used = 0;
+			slab->carved = 0;
+			pool->slabs++;
+		}
+		mempool_link(pool, slab);
+	}
+
+	if(slab->free != NULL) {
+		a = slab->free;
+		slab->free = *(void **)a;
+	} else {
+		a = (char *)slab+MEMSLAB_HEADER+(slab->carved*pool->size);
+		slab->carved++;
+	}
+	slab->used++;
+	if(slab->used == pool->perslab) {
+		mempool_unlink(pool, slab);
+	}
+
+	pool->used++;
+	if(pool->used > pool->peak) {
+		pool->peak = pool->used;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	memset(a, '\0', pool->size);
+	return a;
+}
+
+void mempool_free(void *a) {
+	struct memslab_t *slab = NULL;
+	struct memcache_t *cache = NULL;
+	unsigned int id = 0;
+
+	if(a == NULL) {
+		return;
+	}
+	slab = (struct memslab_t *)((uintptr_t)a & ~(uintptr_t)(MEMPOOL_SLAB_SIZE-1));
+	id = slab->pool->id;
+
+	if(id < MEMPOOL_MAX && memcache_active >= 0 && memcache[id].count < MEMPOOL_CACHE) {
+		if(memcache_active == 0) {
+			pthread_once(&memcache_once, memcache_init);
+			pthread_setspecific(memcache_key, (void *)memcache);
+			memcache_active = 1;
+		}
+		cache = &memcache[id];
+		*(void **)a = cache->free;
+		cache->free = a;
+		cache->count++;
+		return;
+	}
+	mempool_release(a);
+}
+
+struct mempool_t *mempool_list(void) {
+	struct mempool_t *pool = NULL;
+
+	pthread_mutex_lock(&mempools_lock);
+	pool = mempools;
+	pthread_mutex_unlock(&mempools_lock);
+	return pool;
+}
@@ -19,8 +19,39 @@
 #ifndef _MEM_H_
 #define _MEM_H_
 
+#include <pthread.h>
+
 void xfree(void);
 void memtrack(void);
+void memtrack_dump(void);
+
+/*
+ * Pools for objects of a single size that are allocated and freed all
+ * the time, like JSON nodes and queue nodes. Objects are carved from
+ * aligned slabs, so they are packed together instead of fragmenting
+ * the heap, and empty slabs are handed back.
+ */
+typedef struct mempool_t {
+	const char *name;
+	unsigned long size;
+	pthread_mutex_t lock;
+	struct memslab_t *partial;
+	struct memslab_t *spare;
+	unsigned int perslab;
+	unsigned int id;
+	/* Statistics, objects held in the thread caches count as used */
+	unsigned long slabs;
+	unsigned long used;
+	unsigned long peak;
+	struct mempool_t *next;
+} mempool_t;
+
+#define MEMPOOL_INITIALIZER(name, size) \
+	{ name, size, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, 0, 0, 0, NULL }
+
+void *mempool_alloc(struct mempool_t *pool);
+void mempool_free(void *a);
+struct mempool_t *mempool_list(void);
 
 /*
   We only use these functions for extensive memory debugging
@@ -41,4 +72,8 @@ void _free(void *a, const char *file, int line);
 #define CALLOC(a, b) calloc(a, b)
 #define FREE(a) free((void *)(a)),(a)=NULL
 
+/* Pool objects are returned zeroed, like with CALLOC */
+#define POOL_MALLOC(a) mempool_alloc(a)
+#define POOL_FREE(a) mempool_free((void *)(a)),(a)=NULL
+
 #endif
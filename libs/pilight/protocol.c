@@ -37,6 +37,27 @@
 
 #include "protocol_header.h"
 
+/* Footer pulse lengths are grouped in buckets of this width. The
+   receiver caps footer pulse lengths at 3000, so everything above
+   that is looked up through the full protocol list. */
+#define PLSLEN_BUCKET_WIDTH		16
+#define PLSLEN_BUCKETS				((3000/PLSLEN_BUCKET_WIDTH)+1)
+/* Pulse train lengths are grouped in buckets of this width */
+#define RAWLEN_BUCKET_WIDTH		8
+#define RAWLEN_BUCKETS				((MAXPULSESTREAMLENGTH/RAWLEN_BUCKET_WIDTH)+1)
+/* HWINTERNAL (-1) till API */
+#define HWTYPE_SLOTS					(API+2)
+
+/* Per hardware type, footer pulse bucket and rawlen bucket, the
+   protocols that could possibly match a received pulse train. The
+   rawlen buckets of a footer bucket are only allocated when any
+   protocol uses it. The lists keep the order of the global
+   protocols list. */
+static struct protocols_t **protocol_index[HWTYPE_SLOTS][PLSLEN_BUCKETS];
+static int protocol_index_built = 0;
+
+static void protocol_index_free(void);
+
 void protocol_remove(char *name) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -44,6 +65,8 @@ void protocol_remove(char *name) {
 
 	prevP = NULL;
 
+	protocol_index_free();
+
 	for(currP = protocols; currP != NULL; prevP = currP, currP = currP->next) {
 
 		if(strcmp(currP->listener->id, name) == 0) {
@@ -84,6 +107,11 @@ void protocol_remove(char *name) {
 				}
 			}
 			FREE(currP->listener->devices);
+			if(currP->listener->code != NULL) {
+				FREE(currP->listener->code);
+				FREE(currP->listener->pCode);
+				FREE(currP->listener->binary);
+			}
 			FREE(currP->listener);
 			FREE(currP);
 
@@ -188,6 +216,330 @@ void protocol_init(void) {
 	if(protocol_root_free) {
 		FREE(protocol_root);
 	}
+
+	protocol_index_build();
+}
+
+static int protocol_can_decode(protocol_t *proto) {
+	if((((proto->parseRaw || proto->parseCode || proto->parseFrame) &&
+	   (proto->rawlen > 0 || (proto->minrawlen > 0 && proto->maxrawlen > 0)))
+	    || proto->parseBinary) && proto->pulse > 0 && proto->plslen) {
+		return 1;
+	}
+	return 0;
+}
+
+static void protocol_index_add(int slot, int bucket, int rawbucket, protocol_t *proto) {
+	struct protocols_t *pnode = NULL;
+	struct protocols_t *tail = NULL;
+
+	if(protocol_index[slot][bucket] == NULL) {
+		if(!(protocol_index[slot][bucket] = MALLOC(sizeof(struct protocols_t *)*RAWLEN_BUCKETS))) {
+			logprintf(LOG_ERR, "out of memory");
+			exit(EXIT_FAILURE);
+		}
+		memset(protocol_index[slot][bucket], 0, sizeof(struct protocols_t *)*RAWLEN_BUCKETS);
+	}
+
+	pnode = protocol_index[slot][bucket][rawbucket];
+	while(pnode) {
+		/* A protocol can have multiple pulse lengths or
+		   rawlens in the same bucket */
+		if(pnode->listener == proto) {
+			return;
+		}
+		tail = pnode;
+		pnode = pnode->next;
+	}
+
+	if(!(pnode = MALLOC(sizeof(struct protocols_t)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	pnode->listener = proto;
+	pnode->name = NULL;
+	pnode->next = NULL;
+	if(tail == NULL) {
+		protocol_index[slot][bucket][rawbucket] = pnode;
+	} else {
+		tail->next = pnode;
+	}
+}
+
+static void protocol_index_free(void) {
+	struct protocols_t *tmp = NULL;
+	int x = 0, y = 0, z = 0;
+
+	for(x=0;x<HWTYPE_SLOTS;x++) {
+		for(y=0;y<PLSLEN_BUCKETS;y++) {
+			if(protocol_index[x][y] == NULL) {
+				continue;
+			}
+			for(z=0;z<RAWLEN_BUCKETS;z++) {
+				while(protocol_index[x][y][z]) {
+					tmp = protocol_index[x][y][z];
+					protocol_index[x][y][z] = protocol_index[x][y][z]->next;
+					FREE(tmp);
+				}
+			}
+			FREE(protocol_index[x][y]);
+		}
+	}
+	protocol_index_built = 0;
+}
+
+void protocol_index_build(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct protocols_t *pnode = protocols;
+	struct protocol_plslen_t *plslen = NULL;
+	struct protocol_t *proto = NULL;
+	int slot = 0, bucket = 0, first = 0, last = 0, rawbucket = 0, minraw = 0, maxraw = 0;
+
+	protocol_index_free();
+
+	while(pnode) {
+		proto = pnode->listener;
+		/* Only protocols that can be parsed from a pulse train are indexed */
+		if(protocol_can_decode(proto) == 1) {
+			for(slot=0;slot<HWTYPE_SLOTS;slot++) {
+				if(proto->hwtype != HWINTERNAL && (int)proto->hwtype != slot-1) {
+					continue;
+				}
+				plslen = proto->plslen;
+				while(plslen) {
+					first = (plslen->length-5)/PLSLEN_BUCKET_WIDTH;
+					last = (plslen->length+5)/PLSLEN_BUCKET_WIDTH;
+					if(first < 0) {
+						first = 0;
+					}
+					if(last > PLSLEN_BUCKETS-1) {
+						last = PLSLEN_BUCKETS-1;
+					}
+					for(bucket=first;bucket<=last;bucket++) {
+						/* The exact rawlen and the rawlen range both match */
+						if(proto->rawlen > 0 && proto->rawlen <= MAXPULSESTREAMLENGTH) {
+							protocol_index_add(slot, bucket, proto->rawlen/RAWLEN_BUCKET_WIDTH, proto);
+						}
+						if(proto->minrawlen > 0 && proto->maxrawlen > 0) {
+							minraw = proto->minrawlen/RAWLEN_BUCKET_WIDTH;
+							maxraw = proto->maxrawlen;
+							if(maxraw > MAXPULSESTREAMLENGTH) {
+								maxraw = MAXPULSESTREAMLENGTH;
+							}
+							maxraw /= RAWLEN_BUCKET_WIDTH;
+							for(rawbucket=minraw;rawbucket<=maxraw;rawbucket++) {
+								protocol_index_add(slot, bucket, rawbucket, proto);
+							}
+						}
+					}
+					plslen = plslen->next;
+				}
+			}
+		}
+		pnode = pnode->next;
+	}
+	protocol_index_built = 1;
+}
+
+struct protocols_t *protocol_index_get(int hwtype, int plslen, int rawlen) {
+	struct protocols_t **rawlens = NULL;
+
+	/* Frames of an unknown hardware type (e.g. the raw simulator) or
+	   with an out of range footer or length can match anything */
+	if(protocol_index_built == 0 || hwtype < 0 || hwtype > API ||
+	   plslen < 0 || plslen/PLSLEN_BUCKET_WIDTH >= PLSLEN_BUCKETS ||
+	   rawlen < 0 || rawlen > MAXPULSESTREAMLENGTH) {
+		return protocols;
+	}
+	if((rawlens = protocol_index[hwtype+1][plslen/PLSLEN_BUCKET_WIDTH]) == NULL) {
+		return NULL;
+	}
+	return rawlens[rawlen/RAWLEN_BUCKET_WIDTH];
+}
+
+struct protocol_plslen_t *protocol_match(protocol_t *proto, const struct frame_t *frame) {
+	struct protocol_plslen_t *plslengths = NULL;
+
+	if((proto->hwtype == frame->hwtype || proto->hwtype == -1 || frame->hwtype == -1) &&
+	   protocol_can_decode(proto) == 1) {
+		plslengths = proto->plslen;
+		while(plslengths) {
+			if((frame->plslen >= ((double)plslengths->length-5) &&
+			    frame->plslen <= ((double)plslengths->length+5))) {
+				break;
+			}
+			plslengths = plslengths->next;
+		}
+		if(plslengths != NULL && (frame->rawlen == proto->rawlen || (
+		   (proto->minrawlen > 0 && proto->maxrawlen > 0 &&
+		    (frame->rawlen >= proto->minrawlen && frame->rawlen <= proto->maxrawlen))))) {
+			return plslengths;
+		}
+	}
+	return NULL;
+}
+
+/* The legacy callbacks decode from the buffers inside the protocol struct */
+static void protocol_legacy_buffers(protocol_t *proto) {
+	if(proto->code == NULL) {
+		proto->code = MALLOC(sizeof(int)*MAXPULSESTREAMLENGTH);
+		proto->pCode = MALLOC(sizeof(int)*MAXPULSESTREAMLENGTH);
+		proto->binary = MALLOC(sizeof(int)*(MAXPULSESTREAMLENGTH/2));
+		if(proto->code == NULL || proto->pCode == NULL || proto->binary == NULL) {
+			logprintf(LOG_ERR, "out of memory");
+			exit(EXIT_FAILURE);
+		}
+		memset(proto->code, 0, sizeof(int)*MAXPULSESTREAMLENGTH);
+		memset(proto->pCode, 0, sizeof(int)*MAXPULSESTREAMLENGTH);
+		memset(proto->binary, 0, sizeof(int)*(MAXPULSESTREAMLENGTH/2));
+	}
+}
+
+static void protocol_legacy_input(protocol_t *proto, const struct frame_t *frame, struct decode_ctx_t *ctx) {
+	int x = 0;
+
+	protocol_legacy_buffers(proto);
+	for(x=0;x<frame->rawlen && x<MAXPULSESTREAMLENGTH;x++) {
+		proto->raw[x] = frame->raw[x];
+		proto->pCode[x] = proto->code[x];
+		proto->code[x] = ctx->code[x];
+	}
+	for(x=0;x<MAXPULSESTREAMLENGTH/2;x++) {
+		proto->binary[x] = ctx->binary[x];
+	}
+}
+
+/* Run a protocol decoder on a frame. Every message that is decoded
+   is handed to the callback. Returns the number of decoded messages. */
+int protocol_decode(protocol_t *proto, const struct frame_t *frame, int repeats, void (*callback)(protocol_t *proto, struct decode_ctx_t *ctx)) {
+	struct protocol_plslen_t *plslengths = NULL;
+	struct decode_ctx_t ctx;
+	struct timeval tv;
+	int x = 0, nrmsg = 0, nrrepeats = 0, rawlen = frame->rawlen;
+
+	if((plslengths = protocol_match(proto, frame)) == NULL) {
+		return 0;
+	}
+	if(rawlen > MAXPULSESTREAMLENGTH) {
+		rawlen = MAXPULSESTREAMLENGTH;
+	}
+
+	ctx.plslen = plslengths->length;
+	ctx.binlen = 0;
+	ctx.repeats = 0;
+	ctx.message = NULL;
+
+	/* Convert the raw codes to one's and zero's */
+	for(x=0;x<rawlen;x++) {
+		if(frame->raw[x] >= (plslengths->length * (1+proto->pulse)/2)) {
+			ctx.code[x] = 1;
+		} else {
+			ctx.code[x] = 0;
+		}
+	}
+
+	/* Convert the one's and zero's into binary */
+	memset(ctx.binary, 0, sizeof(ctx.binary));
+	for(x=0;x<rawlen;x+=4) {
+		if(x+proto->lsb < rawlen && ctx.code[x+proto->lsb] == 1) {
+			ctx.binary[x/4] = 1;
+		} else {
+			ctx.binary[x/4] = 0;
+		}
+	}
+
+	if((double)frame->raw[1]/((plslengths->length * (1+proto->pulse)/2)) < 2.1) {
+		x -= 4;
+	}
+
+	/* Check if the binary matches the binary length */
+	if(((proto->binlen > 0) && ((x/4) == proto->binlen)) ||
+	   ((proto->binlen == 0) && ((x == proto->rawlen) ||
+	                             (x == proto->minrawlen) ||
+	                             (x == proto->maxrawlen)))) {
+		ctx.binlen = x/4;
+	}
+
+	pthread_mutex_lock(&proto->lock);
+	if(proto->parseRaw) {
+		logprintf(LOG_DEBUG, "recevied pulse length of %d", frame->plslen);
+		logprintf(LOG_DEBUG, "called %s parseRaw()", proto->id);
+		protocol_legacy_input(proto, frame, &ctx);
+		proto->parseRaw();
+		proto->repeats = -1;
+		ctx.repeats = -1;
+		ctx.message = proto->message;
+		proto->message = NULL;
+		if(ctx.message != NULL) {
+			callback(proto, &ctx);
+			nrmsg++;
+		}
+	}
+
+	gettimeofday(&tv, NULL);
+	if(proto->first > 0) {
+		proto->first = proto->second;
+	}
+	proto->second = 1000000 * (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
+	if(proto->first == 0) {
+		proto->first = proto->second;
+	}
+
+	/* Reset # of repeats after a certain delay */
+	if(((int)proto->second-(int)proto->first) > 500000) {
+		proto->repeats = 0;
+	}
+
+	proto->repeats++;
+	nrrepeats = proto->repeats;
+
+	/* Continue if we have recognized enough repeated codes */
+	if(nrrepeats < (repeats*proto->rxrpt) && strcmp(proto->id, "pilight_firmware") != 0) {
+		pthread_mutex_unlock(&proto->lock);
+		return nrmsg;
+	}
+	ctx.repeats = nrrepeats;
+
+	if(proto->parseCode) {
+		logprintf(LOG_DEBUG, "caught minimum # of repeats %d of %s", nrrepeats, proto->id);
+		logprintf(LOG_DEBUG, "called %s parseCode()", proto->id);
+		protocol_legacy_input(proto, frame, &ctx);
+		proto->parseCode();
+		ctx.message = proto->message;
+		proto->message = NULL;
+		if(ctx.message != NULL) {
+			callback(proto, &ctx);
+			nrmsg++;
+		}
+	}
+
+	if(proto->parseBinary && ctx.binlen > 0) {
+		logprintf(LOG_DEBUG, "called %s parseBinary()", proto->id);
+		protocol_legacy_input(proto, frame, &ctx);
+		proto->parseBinary();
+		ctx.message = proto->message;
+		proto->message = NULL;
+		if(ctx.message != NULL) {
+			callback(proto, &ctx);
+			nrmsg++;
+		}
+	}
+	pthread_mutex_unlock(&proto->lock);
+
+	/* Reentrant decoders don't touch the protocol struct */
+	if(proto->parseFrame) {
+		logprintf(LOG_DEBUG, "called %s parseFrame()", proto->id);
+		ctx.message = NULL;
+		if(proto->parseFrame(frame, &ctx) == 0 && ctx.message != NULL) {
+			callback(proto, &ctx);
+			nrmsg++;
+		} else if(ctx.message != NULL) {
+			json_delete(ctx.message);
+		}
+	}
+
+	return nrmsg;
 }
 
 void protocol_register(protocol_t **proto) {
@@ -215,6 +567,7 @@ void protocol_register(protocol_t **proto) {
 	(*proto)->parseRaw = NULL;
 	(*proto)->parseBinary = NULL;
 	(*proto)->parseCode = NULL;
+	(*proto)->parseFrame = NULL;
 	(*proto)->createCode = NULL;
 	(*proto)->checkValues = NULL;
 	(*proto)->initDev = NULL;
@@ -229,9 +582,13 @@ void protocol_register(protocol_t **proto) {
 	(*proto)->second = 0;
 
 	memset(&(*proto)->raw[0], 0, sizeof((*proto)->raw));
-	memset(&(*proto)->code[0], 0, sizeof((*proto)->code));
-	memset(&(*proto)->pCode[0], 0, sizeof((*proto)->pCode));
-	memset(&(*proto)->binary[0], 0, sizeof((*proto)->binary));
+	(*proto)->code = NULL;
+	(*proto)->pCode = NULL;
+	(*proto)->binary = NULL;
+
+	pthread_mutexattr_init(&(*proto)->attr);
+	pthread_mutexattr_settype(&(*proto)->attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&(*proto)->lock, &(*proto)->attr);
 
 	struct protocols_t *pnode = MALLOC(sizeof(struct protocols_t));
 	if(!pnode) {
@@ -389,6 +746,8 @@ int protocol_gc(void) {
 	struct protocol_devices_t *dtmp;
 	struct protocol_plslen_t *ttmp;
 
+	protocol_index_free();
+
 	while(protocols) {
 		ptmp = protocols;
 		logprintf(LOG_DEBUG, "protocol %s", ptmp->listener->id);
@@ -428,6 +787,11 @@ int protocol_gc(void) {
 		if(ptmp->listener->devices != NULL) {
 			FREE(ptmp->listener->devices);
 		}
+		if(ptmp->listener->code != NULL) {
+			FREE(ptmp->listener->code);
+			FREE(ptmp->listener->pCode);
+			FREE(ptmp->listener->binary);
+		}
 		FREE(ptmp->listener);
 		protocols = protocols->next;
 		FREE(ptmp);
@@ -67,6 +67,27 @@ typedef struct protocol_threads_t {
 	struct protocol_threads_t *next;
 } protocol_threads_t;
 
+/* A pulse train as received from a hardware module */
+typedef struct frame_t {
+	int raw[MAXPULSESTREAMLENGTH];
+	int rawlen;
+	int plslen;
+	int hwtype;
+} frame_t;
+
+/* Per frame decoding state, so protocols can be
+   decoded from multiple threads at the same time */
+typedef struct decode_ctx_t {
+	/* The protocol pulse length that matched the frame footer */
+	int plslen;
+	int code[MAXPULSESTREAMLENGTH];
+	int binary[MAXPULSESTREAMLENGTH/2];
+	/* Number of valid binary digits, 0 if the binary length did not match */
+	int binlen;
+	int repeats;
+	JsonNode *message;
+} decode_ctx_t;
+
 typedef struct protocol_t {
 	char *id;
 	int pulse;
@@ -87,10 +108,16 @@ typedef struct protocol_t {
 	unsigned long first;
 	unsigned long second;
 
+	/* Serializes the repeat counters and the legacy
+	   parseRaw, parseCode and parseBinary callbacks */
+	pthread_mutex_t lock;
+	pthread_mutexattr_t attr;
+
 	int raw[MAXPULSESTREAMLENGTH];
-	int code[MAXPULSESTREAMLENGTH];
-	int pCode[MAXPULSESTREAMLENGTH];
-	int binary[MAXPULSESTREAMLENGTH/2]; // Max. the half the raw length
+	/* Only allocated for protocols using the legacy parse callbacks */
+	int *code;
+	int *pCode;
+	int *binary; // Max. the half the raw length
 
 	hwtype_t hwtype;
 	devtype_t devtype;
@@ -100,6 +127,9 @@ typedef struct protocol_t {
 	void (*parseRaw)(void);
 	void (*parseCode)(void);
 	void (*parseBinary)(void);
+	/* Reentrant decoder, called with the frame once the
+	   minimum number of repeats has been received */
+	int (*parseFrame)(const struct frame_t *in, struct decode_ctx_t *out);
 	int (*createCode)(JsonNode *code);
 	int (*checkValues)(JsonNode *code);
 	struct threadqueue_t *(*initDev)(JsonNode *device);
@@ -126,6 +156,10 @@ void protocol_plslen_add(protocol_t *proto, int plslen);
 void protocol_register(protocol_t **proto);
 void protocol_device_add(protocol_t *proto, const char *id, const char *desc);
 int protocol_device_exists(protocol_t *proto, const char *id);
+void protocol_index_build(void);
+struct protocol_plslen_t *protocol_match(struct protocol_t *proto, const struct frame_t *frame);
+int protocol_decode(struct protocol_t *proto, const struct frame_t *frame, int repeats, void (*callback)(struct protocol_t *proto, struct decode_ctx_t *ctx));
+struct protocols_t *protocol_index_get(int hwtype, int plslen, int rawlen);
 int protocol_gc(void);
 
 #endif
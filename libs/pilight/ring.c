@@ -0,0 +1,114 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../pilight.h"
+#include "common.h"
+#include "log.h"
+#include "ring.h"
+
+struct ring_t *ring_init(unsigned int size) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct ring_t *ring = NULL;
+	unsigned int i = 1;
+
+	/* Round up to a power of two so indexes can be masked */
+	while(i < size) {
+		i <<= 1;
+	}
+
+	if(!(ring = MALLOC(sizeof(struct ring_t)))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	if(!(ring->frames = MALLOC(sizeof(struct frame_t)*i))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	ring->size = i;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->pushed = 0;
+	ring->dropped = 0;
+	ring->watermark = 0;
+	return ring;
+}
+
+/* The functions below run inside the real-time receiver
+   threads, so they deliberately don't call logprintf */
+int ring_push(struct ring_t *ring, int *raw, int rawlen, int plslen, int hwtype) {
+	unsigned int head = ring->head;
+	unsigned int tail = ring->tail;
+	unsigned int used = 0;
+	struct frame_t *frame = NULL;
+
+	if(head - tail >= ring->size) {
+		ring->dropped++;
+		return -1;
+	}
+	/* Don't start overwriting the slot before the
+	   consumer is done reading it */
+	__sync_synchronize();
+
+	frame = &ring->frames[head & (ring->size-1)];
+	memcpy(frame->raw, raw, sizeof(int)*(size_t)rawlen);
+	frame->rawlen = rawlen;
+	frame->plslen = plslen;
+	frame->hwtype = hwtype;
+
+	/* Publish the frame before moving the head */
+	__sync_synchronize();
+	ring->head = head+1;
+
+	ring->pushed++;
+	used = (head+1) - tail;
+	if(used > ring->watermark) {
+		ring->watermark = used;
+	}
+	return 0;
+}
+
+struct frame_t *ring_peek(struct ring_t *ring) {
+	unsigned int tail = ring->tail;
+
+	if(ring->head == tail) {
+		return NULL;
+	}
+	/* Don't read the frame before we've seen the head move */
+	__sync_synchronize();
+	return &ring->frames[tail & (ring->size-1)];
+}
+
+void ring_pop(struct ring_t *ring) {
+	/* Finish reading the frame before handing the slot back */
+	__sync_synchronize();
+	ring->tail = ring->tail+1;
+}
+
+void ring_gc(struct ring_t *ring) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	if(ring != NULL) {
+		FREE(ring->frames);
+		FREE(ring);
+	}
+}
@@ -0,0 +1,49 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "protocol.h"
+
+/*
+ * A fixed size ring of received frames shared by exactly one
+ * producer and one consumer thread. Neither side ever takes a
+ * lock or allocates memory, so the producer can safely be a
+ * real-time receiver thread.
+ */
+typedef struct ring_t {
+	struct frame_t *frames;
+	unsigned int size;
+	/* Only written by the producer */
+	volatile unsigned int head;
+	/* Only written by the consumer */
+	volatile unsigned int tail;
+	/* Statistics, only written by the producer */
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned int watermark;
+} ring_t;
+
+struct ring_t *ring_init(unsigned int size);
+int ring_push(struct ring_t *ring, int *raw, int rawlen, int plslen, int hwtype);
+struct frame_t *ring_peek(struct ring_t *ring);
+void ring_pop(struct ring_t *ring);
+void ring_gc(struct ring_t *ring);
+
+#endif
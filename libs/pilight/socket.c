@@ -28,6 +28,7 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -35,6 +36,9 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#ifndef __FreeBSD__
+	#include <sys/epoll.h>
+#endif
 
 #include "../../pilight.h"
 #include "common.h"
@@ -43,13 +47,41 @@
 #include "settings.h"
 #include "socket.h"
 
-static char recvBuff[BUFFER_SIZE];
-static char *waitMessage = NULL;
 static unsigned short socket_loop = 1;
 static unsigned int socket_port = 0;
 static int socket_loopback = 0;
 static int socket_server = 0;
-static int socket_clients[MAX_CLIENTS];
+typedef struct socket_clients_t {
+	int fd;
+	/* The reader buffer is kept when the slot is reused */
+	struct socket_reader_t reader;
+	/* Outbound data the kernel didn't accept yet,
+	   the pending bytes are buffer[start] until buffer[end] */
+	char *buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+} socket_clients_t;
+
+/* The client table starts with MAX_CLIENTS slots and
+   doubles whenever all of them are in use */
+static struct socket_clients_t *socket_clients = NULL;
+static int socket_clients_size = 0;
+/* Maximum number of pending outbound bytes per client */
+static int socket_buffer_size = CLIENT_BUFFER_SIZE;
+static pthread_mutex_t socket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Forget about a client slot, the caller holds the socket_lock */
+static void socket_clear_client(int i) {
+	if(socket_clients[i].buffer != NULL) {
+		FREE(socket_clients[i].buffer);
+	}
+	socket_clients[i].fd = 0;
+	socket_clients[i].reader.fd = 0;
+	socket_clients[i].size = 0;
+	socket_clients[i].start = 0;
+	socket_clients[i].end = 0;
+}
 
 int socket_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
@@ -61,20 +93,29 @@ int socket_gc(void) {
        socket_read functions can actually close and the
 	   all threads using sockets can end gracefully */
 
-	for(x=1;x<MAX_CLIENTS;x++) {
-		if(socket_clients[x] > 0) {
-			send(socket_clients[x], "1", 1, MSG_NOSIGNAL);
+	pthread_mutex_lock(&socket_lock);
+	for(x=1;x<socket_clients_size;x++) {
+		if(socket_clients[x].fd > 0) {
+			send(socket_clients[x].fd, "1", 1, MSG_NOSIGNAL);
 		}
 	}
+	pthread_mutex_unlock(&socket_lock);
 
 	if(socket_loopback > 0) {
 		send(socket_loopback, "1", 1, MSG_NOSIGNAL);
 		socket_close(socket_loopback);
 	}
 
-	if(waitMessage) {
-		FREE(waitMessage);
+	pthread_mutex_lock(&socket_lock);
+	if(socket_clients != NULL) {
+		for(x=0;x<socket_clients_size;x++) {
+			socket_clear_client(x);
+			socket_reader_gc(&socket_clients[x].reader);
+		}
+		FREE(socket_clients);
 	}
+	socket_clients_size = 0;
+	pthread_mutex_unlock(&socket_lock);
 
 	logprintf(LOG_DEBUG, "garbage collected socket library");
 	return EXIT_SUCCESS;
@@ -89,7 +130,17 @@ int socket_start(unsigned short port) {
 	int opt = 1;
 
 	memset(&address, '\0', sizeof(struct sockaddr_in));
-	memset(socket_clients, 0, sizeof(socket_clients));
+
+	settings_find_number("client-buffer-size", &socket_buffer_size);
+
+	pthread_mutex_lock(&socket_lock);
+	if(!(socket_clients = MALLOC(sizeof(struct socket_clients_t)*MAX_CLIENTS))) {
+		logprintf(LOG_ERR, "out of memory");
+		exit(EXIT_FAILURE);
+	}
+	memset(socket_clients, 0, sizeof(struct socket_clients_t)*MAX_CLIENTS);
+	socket_clients_size = MAX_CLIENTS;
+	pthread_mutex_unlock(&socket_lock);
 
 	//create a master socket
 	if((socket_server = socket(AF_INET , SOCK_STREAM , 0)) == 0)  {
@@ -118,8 +169,8 @@ int socket_start(unsigned short port) {
 		exit(EXIT_FAILURE);
 	}
 
-	//try to specify maximum of 3 pending connections for the master socket
-	if(listen(socket_server, 3) < 0) {
+	//allow bursts of connecting clients
+	if(listen(socket_server, SOMAXCONN) < 0) {
 		logprintf(LOG_ERR, "failed to listen to socket");
 		exit(EXIT_FAILURE);
 	}
@@ -137,7 +188,9 @@ int socket_start(unsigned short port) {
 	   or else the select statement will wait forever for an activity */
 	char localhost[16] = "127.0.0.1";
 	socket_loopback = socket_connect(localhost, (unsigned short)socket_port);
-	socket_clients[0] = socket_loopback;
+	pthread_mutex_lock(&socket_lock);
+	socket_clients[0].fd = socket_loopback;
+	pthread_mutex_unlock(&socket_lock);
 	logprintf(LOG_INFO, "daemon listening to port: %d", socket_port);
 
 	return 0;
@@ -158,7 +211,51 @@ int socket_get_fd(void) {
 int socket_get_clients(int i) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	return socket_clients[i];
+	int sd = 0;
+
+	pthread_mutex_lock(&socket_lock);
+	if(i >= 0 && i < socket_clients_size) {
+		sd = socket_clients[i].fd;
+	}
+	pthread_mutex_unlock(&socket_lock);
+
+	return sd;
+}
+
+/* Store a new client in the first free slot of the
+   client table and return its id, or -1 on failure */
+static int socket_add_client(int sd) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	int i = 0, x = -1;
+
+	pthread_mutex_lock(&socket_lock);
+	if(socket_clients != NULL) {
+		for(i=0;i<socket_clients_size;i++) {
+			if(socket_clients[i].fd == 0) {
+				x = i;
+				break;
+			}
+		}
+		if(x == -1) {
+			int size = socket_clients_size*2;
+			struct socket_clients_t *tmp = REALLOC(socket_clients, sizeof(struct socket_clients_t)*(size_t)size);
+			if(tmp == NULL) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			memset(&tmp[socket_clients_size], 0, sizeof(struct socket_clients_t)*(size_t)(size-socket_clients_size));
+			x = socket_clients_size;
+			socket_clients = tmp;
+			socket_clients_size = size;
+			logprintf(LOG_DEBUG, "grown client table to %d clients", size);
+		}
+		socket_clients[x].fd = sd;
+		socket_reader_init(&socket_clients[x].reader, sd);
+	}
+	pthread_mutex_unlock(&socket_lock);
+
+	return x;
 }
 
 int socket_connect(char *address, unsigned short port) {
@@ -225,22 +322,138 @@ void socket_close(int sockfd) {
 			logprintf(LOG_DEBUG, "client disconnected, ip %s, port %d", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
 		}
 
-		for(i=0;i<MAX_CLIENTS;i++) {
-			if(socket_clients[i] == sockfd) {
-				socket_clients[i] = 0;
+		pthread_mutex_lock(&socket_lock);
+		for(i=0;i<socket_clients_size;i++) {
+			if(socket_clients[i].fd == sockfd) {
+				socket_clear_client(i);
 				break;
 			}
 		}
+		pthread_mutex_unlock(&socket_lock);
 		shutdown(sockfd, 2);
 		close(sockfd);
 	}
 }
 
+/* The functions below expect the caller to hold the socket_lock */
+static struct socket_clients_t *socket_find_client(int sockfd) {
+	int i = 0;
+
+	for(i=1;i<socket_clients_size;i++) {
+		if(socket_clients[i].fd == sockfd) {
+			return &socket_clients[i];
+		}
+	}
+	return NULL;
+}
+
+/* Keep the bytes the kernel didn't accept for later, fails
+   when the client would exceed its outbound buffer limit */
+static int socket_buffer_client(struct socket_clients_t *client, const char *data, size_t len) {
+	size_t pending = client->end - client->start;
+	size_t size = 0;
+	char *tmp = NULL;
+
+	if(pending+len > (size_t)socket_buffer_size) {
+		return -1;
+	}
+	if(client->end+len > client->size) {
+		/* First reuse the space of the bytes already sent */
+		if(client->start > 0) {
+			memmove(client->buffer, &client->buffer[client->start], pending);
+			client->start = 0;
+			client->end = pending;
+		}
+		if(client->end+len > client->size) {
+			size = (client->size > 0) ? client->size : BUFFER_SIZE;
+			while(size < client->end+len) {
+				size *= 2;
+			}
+			if(size > (size_t)socket_buffer_size) {
+				size = (size_t)socket_buffer_size;
+			}
+			if((tmp = REALLOC(client->buffer, size)) == NULL) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			client->buffer = tmp;
+			client->size = size;
+		}
+	}
+	memcpy(&client->buffer[client->end], data, len);
+	client->end += len;
+	return 0;
+}
+
+/* Write as much of the pending bytes as the kernel accepts */
+static int socket_flush_client(struct socket_clients_t *client) {
+	int bytes = 0;
+
+	while(client->start < client->end) {
+		bytes = (int)send(client->fd, &client->buffer[client->start], client->end-client->start, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(bytes == -1) {
+			if(errno == EINTR) {
+				continue;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+		client->start += (size_t)bytes;
+	}
+	client->start = 0;
+	client->end = 0;
+	return 0;
+}
+
+/* Write a message to one of our own clients without blocking, whatever
+   the socket doesn't accept is flushed later by socket_wait. Returns 1
+   when the sockfd isn't a client of the socket server. */
+static int socket_write_client(int sockfd, const char *buffer, size_t n) {
+	struct socket_clients_t *client = NULL;
+	size_t ptr = 0;
+	int bytes = 0, r = 0;
+
+	pthread_mutex_lock(&socket_lock);
+	if((client = socket_find_client(sockfd)) == NULL) {
+		pthread_mutex_unlock(&socket_lock);
+		return 1;
+	}
+	/* Never overtake bytes that are still pending */
+	if(client->start == client->end) {
+		while(ptr < n) {
+			bytes = (int)send(sockfd, &buffer[ptr], n-ptr, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(bytes == -1) {
+				if(errno == EINTR) {
+					continue;
+				} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					r = -1;
+				}
+				break;
+			}
+			ptr += (size_t)bytes;
+		}
+	}
+	if(r == 0 && ptr < n) {
+		if(socket_buffer_client(client, &buffer[ptr], n-ptr) != 0) {
+			logprintf(LOG_NOTICE, "client fd %d exceeded its buffer of %d bytes, disconnecting", sockfd, socket_buffer_size);
+			client->start = 0;
+			client->end = 0;
+			/* The socket_wait loop will notice the client is gone */
+			shutdown(sockfd, SHUT_RDWR);
+			r = -1;
+		}
+	}
+	pthread_mutex_unlock(&socket_lock);
+
+	return r;
+}
+
 int socket_write(int sockfd, const char *msg, ...) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	va_list ap;
-	int bytes = -1;
+	int bytes = -1, r = 0;
 	int ptr = 0, n = 0, x = BUFFER_SIZE, len = (int)strlen(EOSS);
 	char *sendBuff = NULL;
 	if(strlen(msg) > 0 && sockfd > 0) {
@@ -261,7 +474,16 @@ int socket_write(int sockfd, const char *msg, ...) {
 
 		memcpy(&sendBuff[n-len], EOSS, (size_t)len);
 
-		while(ptr < n) {
+		if((r = socket_write_client(sockfd, sendBuff, (size_t)n)) == -1) {
+			/* Change the delimiter into regular newlines */
+			sendBuff[n-(len-1)] = '\0';
+			sendBuff[n-(len)] = '\n';
+			logprintf(LOG_DEBUG, "socket write failed: %s", sendBuff);
+			FREE(sendBuff);
+			return -1;
+		}
+
+		while(r == 1 && ptr < n) {
 			if((n-ptr) < BUFFER_SIZE) {
 				x = (n-ptr);
 			} else {
@@ -294,7 +516,11 @@ void socket_rm_client(int i, struct socket_callback_t *socket_callback) {
 
 	struct sockaddr_in address;
 	int addrlen = sizeof(address);
-	int sd = socket_clients[i];
+	int sd = socket_get_clients(i);
+
+	if(sd <= 0) {
+		return;
+	}
 
 	//Somebody disconnected, get his details and print
 	getpeername(sd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
@@ -304,98 +530,394 @@ void socket_rm_client(int i, struct socket_callback_t *socket_callback) {
 	//Close the socket and mark as 0 in list for reuse
 	shutdown(sd, 2);
 	close(sd);
-	socket_clients[i] = 0;
+	pthread_mutex_lock(&socket_lock);
+	if(i < socket_clients_size) {
+		socket_clear_client(i);
+	}
+	pthread_mutex_unlock(&socket_lock);
 }
 
-int socket_read(int sockfd, char **message, time_t timeout) {
+void socket_reader_init(struct socket_reader_t *reader, int sockfd) {
+	reader->fd = sockfd;
+	reader->start = 0;
+	reader->end = 0;
+	reader->scan = 0;
+	if(reader->buffer == NULL) {
+		reader->size = 0;
+	}
+}
+
+void socket_reader_gc(struct socket_reader_t *reader) {
+	if(reader->buffer != NULL) {
+		FREE(reader->buffer);
+	}
+	reader->size = 0;
+	reader->start = 0;
+	reader->end = 0;
+	reader->scan = 0;
+}
+
+/* Take the message up to the next delimiter out of the buffer.
+   Only the bytes that weren't scanned before are looked at. */
+static int socket_reader_frame(struct socket_reader_t *reader, char **message) {
+	size_t len = strlen(EOSS), i = 0;
+
+	if(reader->scan < reader->start) {
+		reader->scan = reader->start;
+	}
+	for(i=reader->scan;i+len<=reader->end;i++) {
+		if(reader->buffer[i] == EOSS[0] && strncmp(&reader->buffer[i], EOSS, len) == 0) {
+			reader->buffer[i] = '\0';
+			*message = &reader->buffer[reader->start];
+			reader->start = i+len;
+			reader->scan = reader->start;
+			return 0;
+		}
+	}
+	/* A delimiter can be split over two reads */
+	reader->scan = (reader->end-reader->start >= len) ? reader->end-(len-1) : reader->start;
+	return -1;
+}
+
+/* Wait until the socket is readable, a NULL tv waits forever */
+static int socket_reader_wait(struct socket_reader_t *reader, struct timeval *tv) {
+	fd_set fdsread;
+	int n = 0;
+
+	do {
+		FD_ZERO(&fdsread);
+		FD_SET((unsigned long)reader->fd, &fdsread);
+		n = select(reader->fd+1, &fdsread, NULL, NULL, tv);
+	} while(n == -1 && errno == EINTR && socket_loop);
+
+	/* Immediatly stop if the select was waken up by the garbage collector */
+	if(socket_loop == 0 || n == -1) {
+		return -1;
+	} else if(n == 0) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Get the next message from a socket. The message points into the
+ * reader buffer and stays valid until the next call for this reader.
+ * A timeout of 0 waits forever and a negative timeout doesn't wait
+ * at all. Returns 0 on a message, 1 on a timeout (or when there is
+ * nothing to read without waiting) and -1 when the connection is gone.
+ */
+int socket_reader_next(struct socket_reader_t *reader, char **message, time_t timeout) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct timeval tv;
-	int bytes = 0;
-	size_t msglen = 0;
-	int ptr = 0, n = 0, len = (int)strlen(EOSS);
-	fd_set fdsread;
-	fcntl(sockfd, F_SETFL, O_NONBLOCK);
+	size_t pending = 0;
+	int bytes = 0, n = 0;
+	char *tmp = NULL;
 
-	if(timeout > 0) {
-		tv.tv_sec = timeout;
-    tv.tv_usec = 0;
+	/* The remaining time is kept by select over multiple waits */
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+
+	while(socket_loop && reader->fd > 0) {
+		if(socket_reader_frame(reader, message) == 0) {
+			break;
+		}
+
+		/* Make room for at least a full BUFFER_SIZE read, the
+		   unread bytes are only moved once per read */
+		pending = reader->end-reader->start;
+		if(reader->start > 0) {
+			memmove(reader->buffer, &reader->buffer[reader->start], pending);
+			reader->scan -= reader->start;
+			reader->start = 0;
+			reader->end = pending;
+		}
+		if(reader->size < pending+BUFFER_SIZE+1) {
+			size_t size = (reader->size > 0) ? reader->size : BUFFER_SIZE+1;
+			while(size < pending+BUFFER_SIZE+1) {
+				size *= 2;
+			}
+			if((tmp = REALLOC(reader->buffer, size)) == NULL) {
+				logprintf(LOG_ERR, "out of memory");
+				exit(EXIT_FAILURE);
+			}
+			reader->buffer = tmp;
+			reader->size = size;
+		}
+
+		bytes = (int)recv(reader->fd, &reader->buffer[reader->end], reader->size-reader->end-1, MSG_DONTWAIT);
+		if(bytes == 0) {
+			return -1;
+		} else if(bytes > 0) {
+			reader->end += (size_t)bytes;
+			continue;
+		} else if(errno == EINTR) {
+			continue;
+		} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+
+		/* Older clients don't end their messages with the delimiter,
+		   so a short message followed by silence is complete as well */
+		if(pending > 0 && pending < BUFFER_SIZE) {
+			reader->buffer[reader->end] = '\0';
+			*message = reader->buffer;
+			reader->start = 0;
+			reader->end = 0;
+			reader->scan = 0;
+			break;
+		}
+
+		if(timeout < 0) {
+			return 1;
+		}
+		if((n = socket_reader_wait(reader, (timeout > 0) ? &tv : NULL)) != 0) {
+			return n;
+		}
+	}
+	if(socket_loop == 0 || reader->fd <= 0) {
+		return -1;
 	}
-	
-	while(socket_loop && sockfd > 0) {
-		FD_ZERO(&fdsread);
-		FD_SET((unsigned long)sockfd, &fdsread);
 
-		do {
-			if(timeout > 0) {
-				n = select(sockfd+1, &fdsread, NULL, NULL, &tv);
+	if(strcmp(*message, "1") == 0 || strcmp(*message, "BEAT") == 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Read everything that was sent in one go, multiple messages
+   are separated by newlines in the returned buffer */
+int socket_read(int sockfd, char **message, time_t timeout) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct socket_reader_t reader;
+	char *msg = NULL;
+	size_t len = 0, ptr = 0;
+	int r = 0;
+
+	memset(&reader, 0, sizeof(struct socket_reader_t));
+	socket_reader_init(&reader, sockfd);
+
+	while((r = socket_reader_next(&reader, &msg, (ptr == 0) ? timeout : -1)) == 0) {
+		len = strlen(msg);
+		if((*message = REALLOC(*message, ptr+len+2)) == NULL) {
+			logprintf(LOG_ERR, "out of memory");
+			exit(EXIT_FAILURE);
+		}
+		if(ptr > 0) {
+			(*message)[ptr++] = '\n';
+		}
+		memcpy(&(*message)[ptr], msg, len+1);
+		ptr += len;
+		/* Stop when everything received so far is used */
+		if(reader.start == reader.end) {
+			break;
+		}
+	}
+	socket_reader_gc(&reader);
+
+	if(ptr > 0) {
+		return 0;
+	}
+	return r;
+}
+
+/* Called by socket_wait when a client can take more data,
+   returns -1 when the client socket is broken */
+static int socket_flush(int i, int sd) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	int r = 0;
+
+	pthread_mutex_lock(&socket_lock);
+	if(i < socket_clients_size && socket_clients[i].fd == sd) {
+		r = socket_flush_client(&socket_clients[i]);
+	}
+	pthread_mutex_unlock(&socket_lock);
+
+	return r;
+}
+
+/* Hand a message read from a client to the data callback */
+static void socket_client_data(int i, char *message, struct socket_callback_t *socket_callback) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	if(socket_callback->client_data_callback) {
+		size_t l = strlen(message);
+		if(l > 0) {
+			/* Older clients separate their messages by newlines */
+			if(strstr(message, "\n") != NULL) {
+				char **array = NULL;
+				unsigned int n = explode(message, "\n", &array), q = 0;
+				for(q=0;q<n;q++) {
+					socket_callback->client_data_callback(i, array[q]);
+					FREE(array[q]);
+				}
+				if(n > 0) {
+					FREE(array);
+				}
 			} else {
-				n = select(sockfd+1, &fdsread, NULL, NULL, 0);
+				socket_callback->client_data_callback(i, message);
 			}
-		} while(n == -1 && errno == EINTR && socket_loop);
-		if(timeout > 0 && n == 0) {
-			return 1;
 		}
-		/* Immediatly stop loop if the select was waken up by the garbage collector */
-		if(socket_loop == 0) {
+	}
+}
+
+/* Handle all messages a client has sent so far without waiting for more */
+static void socket_client_read(int i, int sd, struct socket_callback_t *socket_callback) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	char *message = NULL;
+	int r = 0;
+
+	while(socket_loop) {
+		/* The client table is only resized by this thread */
+		if((r = socket_reader_next(&socket_clients[i].reader, &message, -1)) == 1) {
+			break;
+		} else if(r == -1) {
+			socket_rm_client(i, socket_callback);
 			break;
 		}
-		if(n == -1) {
+		socket_client_data(i, message, socket_callback);
+
+		/* The callback can close the client itself */
+		if(socket_get_clients(i) != sd) {
+			break;
+		}
+	}
+}
+
+/* Accept a new client, returns the client id, -1 when the client
+   was rejected or -2 when there was nothing left to accept */
+static int socket_accept_client(struct socket_callback_t *socket_callback) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct sockaddr_in address;
+	int addrlen = sizeof(address);
+	int socket_client = 0, i = -1;
+
+	if((socket_client = accept(socket_get_fd(), (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
+		if(errno == EINTR) {
 			return -1;
-		} else if(n > 0) {
-			if(FD_ISSET((unsigned long)sockfd, &fdsread)) {
-				bytes = (int)recv(sockfd, recvBuff, BUFFER_SIZE, 0);
-
-				if(bytes <= 0) {
-					return -1;
-				} else {
-					ptr+=bytes;
-					if((*message = REALLOC(*message, (size_t)ptr+1)) == NULL) {
-						logprintf(LOG_ERR, "out of memory");
-						exit(EXIT_FAILURE);
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			logprintf(LOG_ERR, "failed to accept client");
+		}
+		return -2;
+	}
+	if(whitelist_check(inet_ntoa(address.sin_addr)) != 0) {
+		logprintf(LOG_INFO, "rejected client, ip: %s, port: %d", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+		shutdown(socket_client, 2);
+		close(socket_client);
+		return -1;
+	}
+#ifdef __FreeBSD__
+	if(socket_client >= FD_SETSIZE) {
+		logprintf(LOG_ERR, "rejected client, ip: %s, port: %d, too many clients", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+		shutdown(socket_client, 2);
+		close(socket_client);
+		return -1;
+	}
+#endif
+
+	//inform user of socket number - used in send and receive commands
+	logprintf(LOG_INFO, "new client, ip: %s, port: %d", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+	logprintf(LOG_DEBUG, "client fd: %d", socket_client);
+
+	static struct linger linger = { 0, 0 };
+	socklen_t lsize = sizeof(struct linger);
+	setsockopt(socket_client, SOL_SOCKET, SO_LINGER, (void *)&linger, lsize);
+	int flags = fcntl(socket_client, F_GETFL, 0);
+	if(flags != -1) {
+		fcntl(socket_client, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	//add new socket to array of sockets
+	if((i = socket_add_client(socket_client)) == -1) {
+		shutdown(socket_client, 2);
+		close(socket_client);
+		return -1;
+	}
+	if(socket_callback->client_connected_callback)
+		socket_callback->client_connected_callback(i);
+	logprintf(LOG_DEBUG, "client id: %d", i);
+
+	return i;
+}
+
+#ifndef __FreeBSD__
+void *socket_wait(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct socket_callback_t *socket_callback = (struct socket_callback_t *)param;
+	struct epoll_event ev, events[MAX_CLIENTS];
+	int epollfd = 0, nrevents = 0, i = 0, x = 0, sd = 0;
+
+	if((epollfd = epoll_create(MAX_CLIENTS)) == -1) {
+		logprintf(LOG_ERR, "could not create epoll instance");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The event data holds the client id, the
+	   server socket is marked with a -1 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = (uint32_t)-1;
+	fcntl(socket_get_fd(), F_SETFL, fcntl(socket_get_fd(), F_GETFL, 0) | O_NONBLOCK);
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, socket_get_fd(), &ev);
+
+	while(socket_loop) {
+		do {
+			nrevents = epoll_wait(epollfd, events, MAX_CLIENTS, -1);
+		} while(nrevents == -1 && errno == EINTR && socket_loop);
+
+		/* Immediatly stop loop if the epoll was waken up by the garbage collector */
+		if(socket_loop == 0 || nrevents == -1) {
+			break;
+		}
+
+		for(x=0;x<nrevents && socket_loop;x++) {
+			if(events[x].data.u32 == (uint32_t)-1) {
+				/* Edge triggered, so accept all pending connections */
+				while(socket_loop) {
+					if((i = socket_accept_client(socket_callback)) == -2) {
+						break;
+					} else if(i == -1) {
+						continue;
 					}
-					memset(&(*message)[(ptr-bytes)], '\0', (size_t)bytes+1);
-					memcpy(&(*message)[(ptr-bytes)], recvBuff, (size_t)bytes);
-					msglen = strlen(*message);
-				}
-				if(*message && msglen > 0) {
-					/* When a stream is larger then the buffer size, it has to contain
-					   the pilight delimiter to know when the stream ends. If the stream
-					   is shorter then the buffer size, we know we received the full stream */
-					int l = 0;
-					if(((l = strncmp(&(*message)[ptr-(len)], EOSS, (unsigned int)(len))) == 0) || ptr < BUFFER_SIZE) {
-						/* If the socket contains buffered TCP messages, separate them by
-						   changing the delimiters into newlines */
-						if(ptr > msglen) {
-							int i = 0;
-							for(i=0;i<ptr;i++) {
-								if(i+(len-1) < ptr && strncmp(&(*message)[i], EOSS, (size_t)len) == 0) {
-									memmove(&(*message)[i], message[i+(len-1)], (size_t)(ptr-(i+(len-1))));
-									ptr-=(len-1);
-									(*message)[i] = '\n';
-								}
-							}
-							(*message)[ptr] = '\0';
-						} else {
-							if(l == 0) {
-								(*message)[ptr-(len)] = '\0'; // remove delimiter
-							} else {
-								(*message)[ptr] = '\0';
-							}
-							if(strcmp(*message, "1") == 0 || strcmp(*message, "BEAT") == 0) {
-								return -1;
-							}
-						}
-						return 0;
+					ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+					ev.data.u32 = (uint32_t)i;
+					if(epoll_ctl(epollfd, EPOLL_CTL_ADD, socket_get_clients(i), &ev) == -1) {
+						logprintf(LOG_ERR, "could not add client to epoll instance");
+						socket_rm_client(i, socket_callback);
 					}
 				}
+				continue;
+			}
+
+			i = (int)events[x].data.u32;
+			/* The client could already be gone by an earlier event */
+			if((sd = socket_get_clients(i)) <= 0) {
+				continue;
 			}
+
+			if((events[x].events & EPOLLOUT) && socket_flush(i, sd) == -1) {
+				socket_rm_client(i, socket_callback);
+				continue;
+			}
+			if(!(events[x].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				continue;
+			}
+
+			/* Edge triggered, so the reader drains the socket */
+			socket_client_read(i, sd, socket_callback);
 		}
 	}
+	close(epollfd);
 
-	return -1;
+	return NULL;
 }
-
+#else
 void *socket_wait(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -404,34 +926,38 @@ void *socket_wait(void *param) {
 	int activity;
 	int i, sd;
 	int max_sd;
-	struct sockaddr_in address;
-	int socket_client;
-	int addrlen = sizeof(address);
-	fd_set readfds;
+	fd_set readfds, writefds;
 
 	while(socket_loop) {
 		do {
 			//clear the socket set
 			FD_ZERO(&readfds);
+			FD_ZERO(&writefds);
 
 			//add master socket to set
 			FD_SET((unsigned long)socket_get_fd(), &readfds);
 			max_sd = socket_get_fd();
 
 			//add child sockets to set
-			for(i=0;i<MAX_CLIENTS;i++) {
+			pthread_mutex_lock(&socket_lock);
+			for(i=0;i<socket_clients_size;i++) {
 				//socket descriptor
-				sd = socket_clients[i];
+				sd = socket_clients[i].fd;
 				//if valid socket descriptor then add to read list
 				if(sd > 0)
 					FD_SET((unsigned long)sd, &readfds);
 
+				//wait for room to write the pending data
+				if(sd > 0 && socket_clients[i].start < socket_clients[i].end)
+					FD_SET((unsigned long)sd, &writefds);
+
 				//highest file descriptor number, need it for the select function
 				if(sd > max_sd)
 					max_sd = sd;
 			}
+			pthread_mutex_unlock(&socket_lock);
 			//wait for an activity on one of the sockets, timeout is NULL, so wait indefinitely
-			activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
+			activity = select(max_sd + 1, &readfds, &writefds, NULL, NULL);
 		} while(activity == -1 && errno == EINTR && socket_loop);
 
 		/* Immediatly stop loop if the select was waken up by the garbage collector */
@@ -439,75 +965,26 @@ void *socket_wait(void *param) {
 			break;
 		}
 
-			//If something happened on the master socket, then its an incoming connection
-			if(FD_ISSET((unsigned long)socket_get_fd(), &readfds)) {
-				if((socket_client = accept(socket_get_fd(), (struct sockaddr *)&address, (socklen_t*)&addrlen))<0) {
-					logprintf(LOG_ERR, "failed to accept client");
-					exit(EXIT_FAILURE);
-				}
-			if(whitelist_check(inet_ntoa(address.sin_addr)) != 0) {
-				logprintf(LOG_INFO, "rejected client, ip: %s, port: %d", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-				shutdown(socket_client, 2);
-				close(socket_client);
-			} else {
-				//inform user of socket number - used in send and receive commands
-				logprintf(LOG_INFO, "new client, ip: %s, port: %d", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-				logprintf(LOG_DEBUG, "client fd: %d", socket_client);
-				//send new connection accept message
-				//socket_write(socket_client, "{\"message\":\"accept connection\"}");
-
-				static struct linger linger = { 0, 0 };
-				socklen_t lsize = sizeof(struct linger);
-				setsockopt(socket_client, SOL_SOCKET, SO_LINGER, (void *)&linger, lsize);
-				int flags = fcntl(socket_client, F_GETFL, 0);
-				if(flags != -1) {
-					fcntl(socket_client, F_SETFL, flags | O_NONBLOCK);
-				}
-
-				//add new socket to array of sockets
-				for(i=0;i<MAX_CLIENTS;i++) {
-					//if position is empty
-					if(socket_clients[i] == 0) {
-						socket_clients[i] = socket_client;
-						if(socket_callback->client_connected_callback)
-							socket_callback->client_connected_callback(i);
-						logprintf(LOG_DEBUG, "client id: %d", i);
-						break;
-					}
-				}
-			}
-        }
+		//If something happened on the master socket, then its an incoming connection
+		if(FD_ISSET((unsigned long)socket_get_fd(), &readfds)) {
+			socket_accept_client(socket_callback);
+		}
 
 		//else its some IO operation on some other socket :)
-		for(i=1;i<MAX_CLIENTS;i++) {
-			sd = socket_clients[i];
-			if(FD_ISSET((unsigned long)socket_clients[i], &readfds)) {
-				FD_CLR((unsigned long)socket_clients[i], &readfds);
-				if(socket_read(sd, &waitMessage, 0) == 0) {
-					if(socket_callback->client_data_callback) {
-						size_t l = strlen(waitMessage);
-						if(l > 0) {
-							if(strstr(waitMessage, "\n") != NULL) {
-								char **array = NULL;
-								unsigned int n = explode(waitMessage, "\n", &array), q = 0;
-								for(q=0;q<n;q++) {
-									socket_callback->client_data_callback(i, array[q]);
-									FREE(array[q]);
-								}
-								if(n > 0) {
-									FREE(array);
-								}
-							} else {
-								socket_callback->client_data_callback(i, waitMessage);
-							}
-						}
-					}
-				} else {
+		for(i=1;i<socket_clients_size;i++) {
+			sd = socket_get_clients(i);
+			if(sd > 0 && FD_ISSET((unsigned long)sd, &writefds)) {
+				if(socket_flush(i, sd) == -1) {
 					socket_rm_client(i, socket_callback);
-					i--;
+					continue;
 				}
 			}
+			if(sd > 0 && FD_ISSET((unsigned long)sd, &readfds)) {
+				FD_CLR((unsigned long)sd, &readfds);
+				socket_client_read(i, sd, socket_callback);
+			}
 		}
 	}
 	return NULL;
 }
+#endif
@@ -19,6 +19,18 @@
 #ifndef _SOCKETS_H_
 #define _SOCKETS_H_
 
+/* Splits the stream of a socket into messages */
+typedef struct socket_reader_t {
+	int fd;
+	char *buffer;
+	size_t size;
+	/* Unread data is buffer[start] until buffer[end] */
+	size_t start;
+	size_t end;
+	/* Where to continue looking for a delimiter */
+	size_t scan;
+} socket_reader_t;
+
 typedef struct socket_callback_t {
     void (*client_connected_callback)(int);
     void (*client_disconnected_callback)(int);
@@ -31,6 +43,9 @@ int socket_connect(char *address, unsigned short port);
 void socket_close(int i);
 int socket_write(int sockfd, const char *msg, ...);
 int socket_read(int sockfd, char **out, time_t timeout);
+void socket_reader_init(struct socket_reader_t *reader, int sockfd);
+int socket_reader_next(struct socket_reader_t *reader, char **message, time_t timeout);
+void socket_reader_gc(struct socket_reader_t *reader);
 void *socket_wait(void *param);
 int socket_gc(void);
 unsigned int socket_get_port(void);
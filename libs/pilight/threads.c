@@ -171,7 +171,7 @@ void threads_start() {
 	threads_create(&pth, NULL, &threads_loop, (void *)NULL);
 }
 
-void thread_stop(char *id) {
+void thread_stop(const char *id) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 	pthread_mutex_lock(&threadqueue_lock);
 
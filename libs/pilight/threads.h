@@ -37,7 +37,7 @@ typedef struct threadqueue_t {
 struct threadqueue_t *threads_register(const char *id, void *(*function)(void* param), void *param, int force);
 void threads_create(pthread_t *pth, const pthread_attr_t *attr,  void *(*start_routine) (void *), void *arg);
 void threads_start(void);
-void thread_stop(char *id);
+void thread_stop(const char *id);
 void threads_cpu_usage(int print);
 int threads_gc(void);
 void thread_signal(char *id, int signal);
@@ -0,0 +1,424 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "json.h"
+#include "tzindex.h"
+
+/*
+	This file is also built into the tzdata compiler, so
+	it only depends on the json parser and libc.
+*/
+
+#define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+
+/*
+	The tzdata file is a list of { "zone": [ [ lon, lat ], ... ] }
+	objects, so the nesting depth tells what a value belongs to
+*/
+typedef struct tzparse_t {
+	int depth;
+	int error;
+	struct tzindex_zone_t *zones;
+	unsigned int nrzones;
+	unsigned int zonesize;
+	struct tzindex_point_t *points;
+	unsigned int nrpoints;
+	unsigned int pointsize;
+	unsigned int coord;
+} tzparse_t;
+
+static void *tzindex_grow(void *array, unsigned int *size, unsigned int need, size_t width) {
+	if(need > *size) {
+		*size = (*size == 0) ? 64 : *size*2;
+		if((array = realloc(array, width*(*size))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return array;
+}
+
+static bool tzparse_start(void *data, const char *key) {
+	struct tzparse_t *parse = data;
+	struct tzindex_zone_t *zone = NULL;
+
+	parse->depth++;
+	if(parse->depth == 3) {
+		if(key == NULL || strlen(key) >= TZINDEX_NAMELEN || parse->nrzones >= UINT16_MAX) {
+			return false;
+		}
+		parse->zones = tzindex_grow(parse->zones, &parse->zonesize, parse->nrzones+1, sizeof(struct tzindex_zone_t));
+		zone = &parse->zones[parse->nrzones++];
+		memset(zone, '\0', sizeof(struct tzindex_zone_t));
+		strcpy(zone->name, key);
+		zone->point = parse->nrpoints;
+	} else if(parse->depth == 4) {
+		parse->points = tzindex_grow(parse->points, &parse->pointsize, parse->nrpoints+1, sizeof(struct tzindex_point_t));
+		parse->nrpoints++;
+		parse->zones[parse->nrzones-1].nrpoints++;
+		parse->coord = 0;
+	} else if(parse->depth > 4) {
+		return false;
+	}
+	return true;
+}
+
+static bool tzparse_end(void *data) {
+	struct tzparse_t *parse = data;
+
+	/* Every point needs both its coordinates */
+	if(parse->depth == 4 && parse->coord != 2) {
+		return false;
+	}
+	parse->depth--;
+	return true;
+}
+
+static bool tzparse_number(void *data, const char *key, double n, int decimals) {
+	struct tzparse_t *parse = data;
+	struct tzindex_point_t *point = &parse->points[parse->nrpoints-1];
+
+	if(parse->depth != 4 || parse->coord >= 2 || n < INT16_MIN || n > INT16_MAX) {
+		return false;
+	}
+	if(parse->coord++ == 0) {
+		point->x = (int16_t)n;
+	} else {
+		point->y = (int16_t)n;
+	}
+	return true;
+}
+
+static const JsonSax tzparse_sax = {
+	.number = tzparse_number,
+	.start_array = tzparse_start,
+	.end_array = tzparse_end,
+	.start_object = tzparse_start,
+	.end_object = tzparse_end
+};
+
+static int tzindex_col(int x) {
+	unsigned int cell = 0;
+
+	if(x < -1800) {
+		return 0;
+	}
+	cell = (unsigned int)(x+1800)/TZINDEX_CELL;
+	return (cell < TZINDEX_COLS-1) ? (int)cell : TZINDEX_COLS-1;
+}
+
+static int tzindex_row(int y) {
+	unsigned int cell = 0;
+
+	if(y < -900) {
+		return 0;
+	}
+	cell = (unsigned int)(y+900)/TZINDEX_CELL;
+	return (cell < TZINDEX_ROWS-1) ? (int)cell : TZINDEX_ROWS-1;
+}
+
+char *tzindex_build(const char *json, size_t *size) {
+	struct tzindex_header_t header;
+	struct tzparse_t parse;
+	struct tzindex_zone_t *zone = NULL;
+	struct tzindex_block_t *blocks = NULL;
+	struct tzindex_point_t *point = NULL;
+	uint32_t *cells = NULL;
+	uint16_t *cellzones = NULL;
+	char *buffer = NULL, *p = NULL;
+	uint64_t total = 0;
+	unsigned int i = 0, a = 0, b = 0, nrblocks = 0;
+	int c = 0, r = 0;
+
+	memset(&parse, '\0', sizeof(struct tzparse_t));
+	if(json_parse_sax(json, &tzparse_sax, &parse) == false) {
+		free(parse.zones);
+		free(parse.points);
+		return NULL;
+	}
+
+	for(i=0;i<parse.nrzones;i++) {
+		nrblocks += (parse.zones[i].nrpoints+TZINDEX_BLOCK-1)/TZINDEX_BLOCK;
+	}
+	if((blocks = calloc(nrblocks+1, sizeof(struct tzindex_block_t))) == NULL
+	   || (cells = calloc(TZINDEX_COLS*TZINDEX_ROWS+1, sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The starting point and bounds of every polygon and its blocks */
+	nrblocks = 0;
+	for(i=0;i<parse.nrzones;i++) {
+		zone = &parse.zones[i];
+		zone->block = nrblocks;
+		for(a=0;a<zone->nrpoints;a++) {
+			point = &parse.points[zone->point+a];
+			/* The same odd starting point coord2tz always used */
+			if(point->x < zone->p1x || zone->p1x == 0) {
+				zone->p1x = point->x;
+			}
+			if(point->y < zone->p1y && zone->p1y == 0) {
+				zone->p1y = point->y;
+			}
+			if(a == 0) {
+				zone->minx = zone->maxx = point->x;
+				zone->miny = zone->maxy = point->y;
+			} else {
+				zone->minx = min(zone->minx, point->x);
+				zone->maxx = max(zone->maxx, point->x);
+				zone->miny = min(zone->miny, point->y);
+				zone->maxy = max(zone->maxy, point->y);
+			}
+			b = nrblocks + a/TZINDEX_BLOCK;
+			if(a % TZINDEX_BLOCK == 0) {
+				blocks[b].minx = blocks[b].maxx = point->x;
+				blocks[b].miny = blocks[b].maxy = point->y;
+			} else {
+				blocks[b].minx = min(blocks[b].minx, point->x);
+				blocks[b].maxx = max(blocks[b].maxx, point->x);
+				blocks[b].miny = min(blocks[b].miny, point->y);
+				blocks[b].maxy = max(blocks[b].maxy, point->y);
+			}
+		}
+		nrblocks += (zone->nrpoints+TZINDEX_BLOCK-1)/TZINDEX_BLOCK;
+	}
+
+	/* List each zone in every cell within the widest margin of it,
+	   first counting the entries per cell, then filling them in */
+	for(b=0;b<2;b++) {
+		for(i=0;i<parse.nrzones;i++) {
+			zone = &parse.zones[i];
+			if(zone->nrpoints == 0) {
+				continue;
+			}
+			for(r=tzindex_row(zone->miny-TZINDEX_MARGIN);r<=tzindex_row(zone->maxy+TZINDEX_MARGIN);r++) {
+				for(c=tzindex_col(zone->minx-TZINDEX_MARGIN);c<=tzindex_col(zone->maxx+TZINDEX_MARGIN);c++) {
+					if(b == 0) {
+						cells[r*TZINDEX_COLS+c+1]++;
+					} else {
+						cellzones[cells[r*TZINDEX_COLS+c]++] = (uint16_t)i;
+					}
+				}
+			}
+		}
+		if(b == 0) {
+			for(a=0;a<TZINDEX_COLS*TZINDEX_ROWS;a++) {
+				cells[a+1] += cells[a];
+			}
+			if((cellzones = calloc(cells[TZINDEX_COLS*TZINDEX_ROWS]+1, sizeof(uint16_t))) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			/* Filling moved every start to the next cell */
+			memmove(&cells[1], &cells[0], sizeof(uint32_t)*TZINDEX_COLS*TZINDEX_ROWS);
+			cells[0] = 0;
+		}
+	}
+
+	memset(&header, '\0', sizeof(struct tzindex_header_t));
+	memcpy(header.magic, TZINDEX_MAGIC, sizeof(header.magic));
+	header.version = TZINDEX_VERSION;
+	header.endian = TZINDEX_ENDIAN;
+	header.nrzones = parse.nrzones;
+	header.nrblocks = nrblocks;
+	header.nrpoints = parse.nrpoints;
+	header.nrcells = TZINDEX_COLS*TZINDEX_ROWS;
+	header.nrcellzones = cells[header.nrcells];
+	total = (uint64_t)sizeof(struct tzindex_header_t)
+		+ (uint64_t)sizeof(struct tzindex_zone_t)*header.nrzones
+		+ (uint64_t)sizeof(struct tzindex_block_t)*header.nrblocks
+		+ (uint64_t)sizeof(struct tzindex_point_t)*header.nrpoints
+		+ (uint64_t)sizeof(uint32_t)*(header.nrcells+1)
+		+ (uint64_t)sizeof(uint16_t)*header.nrcellzones;
+	/* The header stores the size in 32 bits */
+	if(total > UINT32_MAX) {
+		fprintf(stderr, "tzdata is too large to be indexed\n");
+		free(parse.zones);
+		free(parse.points);
+		free(blocks);
+		free(cells);
+		free(cellzones);
+		return NULL;
+	}
+	header.size = (uint32_t)total;
+
+	if((p = buffer = calloc(1, header.size)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(p, &header, sizeof(struct tzindex_header_t));
+	p += sizeof(struct tzindex_header_t);
+	memcpy(p, parse.zones, sizeof(struct tzindex_zone_t)*header.nrzones);
+	p += sizeof(struct tzindex_zone_t)*header.nrzones;
+	memcpy(p, blocks, sizeof(struct tzindex_block_t)*header.nrblocks);
+	p += sizeof(struct tzindex_block_t)*header.nrblocks;
+	memcpy(p, parse.points, sizeof(struct tzindex_point_t)*header.nrpoints);
+	p += sizeof(struct tzindex_point_t)*header.nrpoints;
+	memcpy(p, cells, sizeof(uint32_t)*(header.nrcells+1));
+	p += sizeof(uint32_t)*(header.nrcells+1);
+	memcpy(p, cellzones, sizeof(uint16_t)*header.nrcellzones);
+
+	free(parse.zones);
+	free(parse.points);
+	free(blocks);
+	free(cells);
+	free(cellzones);
+
+	*size = header.size;
+	return buffer;
+}
+
+int tzindex_open(struct tzindex_t *index, const char *buffer, size_t size) {
+	const struct tzindex_header_t *header = (const struct tzindex_header_t *)buffer;
+	const char *p = buffer;
+	unsigned int i = 0;
+
+	if(size < sizeof(struct tzindex_header_t)
+	   || memcmp(header->magic, TZINDEX_MAGIC, sizeof(header->magic)) != 0
+	   || header->version != TZINDEX_VERSION
+	   || header->endian != TZINDEX_ENDIAN
+	   || header->size != size
+	   || header->nrcells != TZINDEX_COLS*TZINDEX_ROWS
+	   || header->nrzones > UINT16_MAX
+	   || header->nrpoints > size || header->nrblocks > size || header->nrcellzones > size) {
+		return -1;
+	}
+	if(sizeof(struct tzindex_header_t)
+		+ sizeof(struct tzindex_zone_t)*header->nrzones
+		+ sizeof(struct tzindex_block_t)*header->nrblocks
+		+ sizeof(struct tzindex_point_t)*header->nrpoints
+		+ sizeof(uint32_t)*(header->nrcells+1)
+		+ sizeof(uint16_t)*header->nrcellzones != size) {
+		return -1;
+	}
+
+	p += sizeof(struct tzindex_header_t);
+	index->zones = (const struct tzindex_zone_t *)p;
+	p += sizeof(struct tzindex_zone_t)*header->nrzones;
+	index->blocks = (const struct tzindex_block_t *)p;
+	p += sizeof(struct tzindex_block_t)*header->nrblocks;
+	index->points = (const struct tzindex_point_t *)p;
+	p += sizeof(struct tzindex_point_t)*header->nrpoints;
+	index->cells = (const uint32_t *)p;
+	p += sizeof(uint32_t)*(header->nrcells+1);
+	index->cellzones = (const uint16_t *)p;
+	index->header = header;
+
+	/* A damaged file must not send a search out of bounds */
+	for(i=0;i<header->nrzones;i++) {
+		if(index->zones[i].name[TZINDEX_NAMELEN-1] != '\0'
+		   || index->zones[i].point > header->nrpoints
+		   || index->zones[i].nrpoints > header->nrpoints-index->zones[i].point
+		   || index->zones[i].block > header->nrblocks
+		   || (index->zones[i].nrpoints+TZINDEX_BLOCK-1)/TZINDEX_BLOCK > header->nrblocks-index->zones[i].block) {
+			return -1;
+		}
+	}
+	for(i=0;i<header->nrcells;i++) {
+		if(index->cells[i] > index->cells[i+1]) {
+			return -1;
+		}
+	}
+	if(index->cells[0] != 0 || index->cells[header->nrcells] != header->nrcellzones) {
+		return -1;
+	}
+	for(i=0;i<header->nrcellzones;i++) {
+		if(index->cellzones[i] >= header->nrzones) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Walk the polygon the way coord2tz always did. Only the points
+	within the margin take part, so the blocks without any of them
+	can be skipped without changing the outcome.
+*/
+static int tzindex_walk(const struct tzindex_t *index, const struct tzindex_zone_t *zone, int x, int y, int margin) {
+	const struct tzindex_block_t *block = NULL;
+	const struct tzindex_point_t *point = NULL;
+	unsigned int a = 0, b = 0, end = 0;
+	unsigned int nrblocks = (zone->nrpoints+TZINDEX_BLOCK-1)/TZINDEX_BLOCK;
+	int p1x = zone->p1x, p1y = zone->p1y, p2x = 0, p2y = 0;
+
+	for(b=0;b<=nrblocks;b++) {
+		if(b < nrblocks) {
+			block = &index->blocks[zone->block+b];
+			if(block->minx >= x+margin || block->maxx <= x-margin ||
+			   block->miny >= y+margin || block->maxy <= y-margin) {
+				continue;
+			}
+			a = b*TZINDEX_BLOCK;
+			end = min(a+TZINDEX_BLOCK, zone->nrpoints);
+		} else {
+			/* The walk closes by visiting the first point again */
+			a = 0;
+			end = 1;
+		}
+		for(;a<end;a++) {
+			point = &index->points[zone->point+a];
+			p2x = point->x;
+			p2y = point->y;
+			if(p2x-margin < x && p2x+margin > x && p2y-margin < y && p2y+margin > y) {
+				int xinters = 0;
+				if(y > min(p1y, p2y) && y <= max(p1y, p2y) && x <= max(p1x, p2x)) {
+					if(p1y != p2y) {
+						xinters = (y-p1y)*(p2x-p1x)/(p2y-p1y)+p1x;
+					}
+					if(p1x == p2x || x <= xinters) {
+						return 1;
+					}
+				}
+				p1x = p2x;
+				p1y = p2y;
+			}
+		}
+	}
+	return 0;
+}
+
+int tzindex_search(const struct tzindex_t *index, int x, int y) {
+	const struct tzindex_zone_t *zone = NULL;
+	unsigned int cell = (unsigned int)(tzindex_row(y)*TZINDEX_COLS+tzindex_col(x));
+	unsigned int i = 0;
+	int margin = 0;
+
+	/* Widen the margin by a degree until a polygon matches */
+	for(margin=TZINDEX_CELL/10;margin<=TZINDEX_MARGIN;margin+=TZINDEX_CELL/10) {
+		for(i=index->cells[cell];i<index->cells[cell+1];i++) {
+			zone = &index->zones[index->cellzones[i]];
+			if(zone->minx-margin >= x || zone->maxx+margin <= x ||
+			   zone->miny-margin >= y || zone->maxy+margin <= y) {
+				continue;
+			}
+			if(tzindex_walk(index, zone, x, y, margin) == 1) {
+				return index->cellzones[i];
+			}
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,104 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+#ifndef _TZINDEX_H_
+#define _TZINDEX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	The timezone polygons of tzdata.json compiled into a flat
+	file that can be mapped and searched as is. Coordinates are
+	in tenths of a degree. The layout is, each part 4 byte aligned:
+
+	tzindex_header_t
+	tzindex_zone_t[nrzones]
+	tzindex_block_t[nrblocks]    bounds of every TZINDEX_BLOCK points
+	tzindex_point_t[nrpoints]
+	uint32_t[nrcells+1]          start of each grid cell in the list below
+	uint16_t[nrcellzones]        zones that may match inside a cell
+*/
+
+#define TZINDEX_MAGIC		"PTZI"
+#define TZINDEX_VERSION		1
+#define TZINDEX_ENDIAN		0x01020304
+#define TZINDEX_NAMELEN		32
+#define TZINDEX_BLOCK			16
+/* Grid cells of 10 by 10 degrees */
+#define TZINDEX_CELL			100
+#define TZINDEX_COLS			((3600/TZINDEX_CELL)+1)
+#define TZINDEX_ROWS			((1800/TZINDEX_CELL)+1)
+/* The widest margin coord2tz searches with */
+#define TZINDEX_MARGIN		40
+
+typedef struct tzindex_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t size;
+	uint32_t nrzones;
+	uint32_t nrblocks;
+	uint32_t nrpoints;
+	uint32_t nrcells;
+	uint32_t nrcellzones;
+} tzindex_header_t;
+
+typedef struct tzindex_zone_t {
+	char name[TZINDEX_NAMELEN];
+	/* Where the polygon walk starts */
+	int32_t p1x;
+	int32_t p1y;
+	int32_t minx;
+	int32_t maxx;
+	int32_t miny;
+	int32_t maxy;
+	uint32_t point;
+	uint32_t nrpoints;
+	uint32_t block;
+} tzindex_zone_t;
+
+typedef struct tzindex_block_t {
+	int16_t minx;
+	int16_t maxx;
+	int16_t miny;
+	int16_t maxy;
+} tzindex_block_t;
+
+typedef struct tzindex_point_t {
+	int16_t x;
+	int16_t y;
+} tzindex_point_t;
+
+typedef struct tzindex_t {
+	const struct tzindex_header_t *header;
+	const struct tzindex_zone_t *zones;
+	const struct tzindex_block_t *blocks;
+	const struct tzindex_point_t *points;
+	const uint32_t *cells;
+	const uint16_t *cellzones;
+} tzindex_t;
+
+/* Compile the tzdata.json content, returns a malloc'ed buffer or NULL */
+char *tzindex_build(const char *json, size_t *size);
+/* Point index at the parts of a compiled buffer, 0 when it is usable */
+int tzindex_open(struct tzindex_t *index, const char *buffer, size_t size);
+/* Return the zone at the coordinate in tenths of a degree, or -1 */
+int tzindex_search(const struct tzindex_t *index, int x, int y);
+
+#endif
@@ -58,7 +58,7 @@ static char *webserver_root = NULL;
 static char *webgui_tpl = NULL;
 static struct mg_server *mgserver[WEBSERVER_WORKERS];
 
-static char *recvBuff = NULL;
+static struct socket_reader_t recvReader;
 static unsigned short webgui_tpl_free = 0;
 static unsigned short webserver_root_free = 0;
 static unsigned short webserver_user_free = 0;
@@ -85,6 +85,7 @@ static pthread_cond_t webqueue_signal;
 static pthread_mutexattr_t webqueue_attr;
 
 static int webqueue_number = 0;
+static struct mempool_t webqueue_pool = MEMPOOL_INITIALIZER("webqueue", sizeof(struct webqueue_t));
 
 int webserver_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
@@ -95,7 +96,7 @@ int webserver_gc(void) {
 		struct webqueue_t *tmp = webqueue;
 		FREE(webqueue->message);
 		webqueue = webqueue->next;
-		FREE(tmp);
+		POOL_FREE(tmp);
 		webqueue_number--;
 	}
 
@@ -147,6 +148,27 @@ void webserver_create_header(unsigned char **p, const char *message, char *mimet
 		len);
 }
 
+/* Cached files carry an ETag so browsers can revalidate them with a 304 */
+static void webserver_create_cache_header(unsigned char **p, const char *message, char *mimetype, struct fcache_t *file, int gzip, unsigned int len) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	*p += sprintf((char *)*p,
+		"HTTP/1.0 %s\r\n"
+		"Server: pilight\r\n"
+		"ETag: %s\r\n"
+		"Vary: Accept-Encoding\r\n",
+		message, file->etag);
+	if(mimetype != NULL) {
+		*p += sprintf((char *)*p, "Content-Type: %s\r\n", mimetype);
+	}
+	if(gzip == 1) {
+		*p += sprintf((char *)*p, "Content-Encoding: gzip\r\n");
+	}
+	*p += sprintf((char *)*p,
+		"Content-Length: %u\r\n\r\n",
+		len);
+}
+
 static void webserver_create_minimal_header(unsigned char **p, const char *message, unsigned int len) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -307,6 +329,7 @@ static int webserver_request_handler(struct mg_connection *conn) {
 	unsigned char *p;
 	static unsigned char buffer[4096];
 	struct filehandler_t *filehandler = (struct filehandler_t *)conn->connection_param;
+	struct fcache_t *cached = NULL;
 	unsigned int chunk = WEBSERVER_CHUNK_SIZE;
 	struct stat st;
 
@@ -414,7 +437,7 @@ static int webserver_request_handler(struct mg_connection *conn) {
 					} else {
 						sprintf(request, "%s/%s/%s%s", webserver_root, webgui_tpl, conn->uri, array[q]);
 					}
-					if(access(request, F_OK) == 0) {
+					if((webserver_cache && fcache_get(request) != NULL) || access(request, F_OK) == 0) {
 						break;
 					}
 				}
@@ -490,13 +513,17 @@ static int webserver_request_handler(struct mg_connection *conn) {
 			memset(buffer, '\0', 4096);
 			p = buffer;
 
-			if(access(request, F_OK) == 0) {
+			if(webserver_cache && (cached = fcache_get(request)) != NULL) {
+				/* Cached files don't have to be looked up on disk again */
+			} else if(access(request, F_OK) == 0) {
 				stat(request, &st);
 				if(webserver_cache && st.st_size <= MAX_CACHE_FILESIZE &&
-				  strcmp(mimetype, "application/x-httpd-php") != 0 &&
-				  fcache_get_size(request, &size) != 0 && fcache_add(request) != 0) {
-					FREE(mimetype);
-					goto filenotfound;
+				  strcmp(mimetype, "application/x-httpd-php") != 0) {
+					if(fcache_add(request) != 0) {
+						FREE(mimetype);
+						goto filenotfound;
+					}
+					cached = fcache_get(request);
 				}
 			} else {
 				FREE(mimetype);
@@ -658,8 +685,8 @@ static int webserver_request_handler(struct mg_connection *conn) {
 					return MG_TRUE;
 				}
 			} else {
-				stat(request, &st);
-				if(!webserver_cache || st.st_size > MAX_CACHE_FILESIZE) {
+				if(cached == NULL) {
+					stat(request, &st);
 					FILE *fp = fopen(request, "rb");
 					fseek(fp, 0, SEEK_END);
 					size = (int)ftell(fp);
@@ -715,41 +742,62 @@ static int webserver_request_handler(struct mg_connection *conn) {
 					FREE(request);
 					return MG_TRUE;
 				} else {
-					if(fcache_get_size(request, &size) == 0) {
-						if(strstr(mimetype, "text") != NULL) {
-							webserver_create_header(&p, "200 OK", mimetype, (unsigned int)size);
-							mg_write(conn, buffer, (int)(p-buffer));
-							mg_write(conn, fcache_get_bytes(request), size);
-							FREE(mimetype);
-							FREE(request);
-							return MG_TRUE;
-						} else {
-							if(filehandler == NULL) {
-								filehandler = MALLOC(sizeof(filehandler_t));
-								filehandler->bytes = fcache_get_bytes(request);
-								filehandler->length = (unsigned int)size;
-								filehandler->ptr = 0;
-								filehandler->free = 0;
-								filehandler->fp = NULL;
-								conn->connection_param = filehandler;
+					const char *header = NULL;
+					unsigned char *bytes = cached->bytes;
+					int gzip = 0;
+
+					size = cached->size;
+					if((header = mg_get_header(conn, "If-None-Match")) != NULL && strstr(header, cached->etag) != NULL) {
+						webserver_create_cache_header(&p, "304 Not Modified", NULL, cached, 0, 0);
+						mg_write(conn, buffer, (int)(p-buffer));
+						FREE(mimetype);
+						FREE(request);
+						return MG_TRUE;
+					}
+					if(cached->gzbytes != NULL && (header = mg_get_header(conn, "Accept-Encoding")) != NULL && strstr(header, "gzip") != NULL) {
+						bytes = cached->gzbytes;
+						size = cached->gzsize;
+						gzip = 1;
+					}
+					if(strstr(mimetype, "text") != NULL) {
+						webserver_create_cache_header(&p, "200 OK", mimetype, cached, gzip, (unsigned int)size);
+						mg_write(conn, buffer, (int)(p-buffer));
+						mg_write(conn, bytes, size);
+						FREE(mimetype);
+						FREE(request);
+						return MG_TRUE;
+					} else {
+						if(filehandler == NULL) {
+							filehandler = MALLOC(sizeof(filehandler_t));
+							filehandler->bytes = bytes;
+							filehandler->length = (unsigned int)size;
+							filehandler->ptr = 0;
+							filehandler->free = 0;
+							filehandler->fp = NULL;
+							conn->connection_param = filehandler;
+						}
+						mg_send_header(conn, "Content-Type", mimetype);
+						mg_send_header(conn, "ETag", cached->etag);
+						mg_send_header(conn, "Vary", "Accept-Encoding");
+						if(gzip == 1) {
+							mg_send_header(conn, "Content-Encoding", "gzip");
+						}
+						chunk = WEBSERVER_CHUNK_SIZE;
+						if(filehandler != NULL) {
+							if((filehandler->length-filehandler->ptr) < chunk) {
+								chunk = (filehandler->length-filehandler->ptr);
 							}
-							chunk = WEBSERVER_CHUNK_SIZE;
-							if(filehandler != NULL) {
-								if((filehandler->length-filehandler->ptr) < chunk) {
-									chunk = (filehandler->length-filehandler->ptr);
-								}
-								mg_send_data(conn, &filehandler->bytes[filehandler->ptr], (int)chunk);
-								filehandler->ptr += chunk;
+							mg_send_data(conn, &filehandler->bytes[filehandler->ptr], (int)chunk);
+							filehandler->ptr += chunk;
 
-								FREE(mimetype);
-								FREE(request);
-								if(filehandler->ptr == filehandler->length || conn->wsbits != 0) {
-									FREE(filehandler);
-									conn->connection_param = NULL;
-									return MG_TRUE;
-								} else {
-									return MG_MORE;
-								}
+							FREE(mimetype);
+							FREE(request);
+							if(filehandler->ptr == filehandler->length || conn->wsbits != 0) {
+								FREE(filehandler);
+								conn->connection_param = NULL;
+								return MG_TRUE;
+							} else {
+								return MG_MORE;
 							}
 						}
 					}
@@ -763,8 +811,8 @@ static int webserver_request_handler(struct mg_connection *conn) {
 		strncpy(input, conn->content, conn->content_len);
 		input[conn->content_len] = '\0';
 
-		if(json_validate(input) == true) {
-			JsonNode *json = json_decode(input);
+		JsonNode *json = NULL;
+		if((json = json_decode_arena(input)) != NULL) {
 			char *action = NULL;
 			if(json_find_string(json, "action", &action) == 0) {
 				if(strcmp(action, "request config") == 0) {
@@ -831,7 +879,7 @@ static void webserver_queue(char *message) {
 
 	pthread_mutex_lock(&webqueue_lock);
 	if(webqueue_number <= 1024) {
-		struct webqueue_t *wnode = MALLOC(sizeof(struct webqueue_t));
+		struct webqueue_t *wnode = POOL_MALLOC(&webqueue_pool);
 		if(wnode == NULL) {
 			logprintf(LOG_ERR, "out of memory");
 			exit(EXIT_FAILURE);
@@ -882,7 +930,7 @@ void *webserver_broadcast(void *param) {
 			struct webqueue_t *tmp = webqueue;
 			FREE(webqueue->message);
 			webqueue = webqueue->next;
-			FREE(tmp);
+			POOL_FREE(tmp);
 			webqueue_number--;
 			pthread_mutex_unlock(&webqueue_lock);
 		} else {
@@ -895,6 +943,7 @@ void *webserver_broadcast(void *param) {
 void *webserver_clientize(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	char *message = NULL;
 	unsigned int failures = 0;
 	while(webserver_loop && failures <= 5) {
 		struct ssdp_list_t *ssdp_list = NULL;
@@ -919,6 +968,8 @@ void *webserver_clientize(void *param) {
 			ssdp_free(ssdp_list);
 		}
 
+		socket_reader_init(&recvReader, sockfd);
+
 		struct JsonNode *jclient = json_mkobject();
 		struct JsonNode *joptions = json_mkobject();
 		json_append_member(jclient, "action", json_mkstring("identify"));
@@ -931,18 +982,18 @@ void *webserver_clientize(void *param) {
 		json_free(out);
 		json_delete(jclient);
 
-		if(socket_read(sockfd, &recvBuff, 0) != 0
-			 || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
+		if(socket_reader_next(&recvReader, &message, 0) != 0
+			 || strcmp(message, "{\"status\":\"success\"}") != 0) {
 				failures++;
 			continue;
 		}
 		failures = 0;
 		while(webserver_loop) {
 			if(webgui_websockets == 1) {
-				if(socket_read(sockfd, &recvBuff, 0) != 0) {
+				if(socket_reader_next(&recvReader, &message, 0) != 0) {
 					break;
 				} else {
-					webserver_queue(recvBuff);
+					webserver_queue(message);
 				}
 			} else {
 				sleep(1);
@@ -950,10 +1001,7 @@ void *webserver_clientize(void *param) {
 		}
 	}
 
-	if(recvBuff != NULL) {
-		FREE(recvBuff);
-		recvBuff = NULL;
-	}
+	socket_reader_gc(&recvReader);
 	if(sockfd > 0) {
 		socket_close(sockfd);
 	}
@@ -31,29 +31,36 @@
 #include "gc.h"
 #include "arctech_contact.h"
 
-static void arctechContactCreateMessage(int id, int unit, int state, int all) {
-	arctech_contact->message = json_mkobject();
-	json_append_member(arctech_contact->message, "id", json_mknumber(id, 0));
+static JsonNode *arctechContactCreateMessage(int id, int unit, int state, int all) {
+	JsonNode *message = json_mkobject();
+	json_append_member(message, "id", json_mknumber(id, 0));
 	if(all == 1) {
-		json_append_member(arctech_contact->message, "all", json_mknumber(all, 0));
+		json_append_member(message, "all", json_mknumber(all, 0));
 	} else {
-		json_append_member(arctech_contact->message, "unit", json_mknumber(unit, 0));
+		json_append_member(message, "unit", json_mknumber(unit, 0));
 	}
 
 	if(state == 1) {
-		json_append_member(arctech_contact->message, "state", json_mkstring("opened"));
+		json_append_member(message, "state", json_mkstring("opened"));
 	} else {
-		json_append_member(arctech_contact->message, "state", json_mkstring("closed"));
+		json_append_member(message, "state", json_mkstring("closed"));
 	}
+
+	return message;
 }
 
-static void arctechContactParseBinary(void) {
-	int unit = binToDecRev(arctech_contact->binary, 28, 31);
-	int state = arctech_contact->binary[27];
-	int all = arctech_contact->binary[26];
-	int id = binToDecRev(arctech_contact->binary, 0, 25);
+static int arctechContactParseFrame(const struct frame_t *in, struct decode_ctx_t *out) {
+	int unit = binToDecRev(out->binary, 28, 31);
+	int state = out->binary[27];
+	int all = out->binary[26];
+	int id = binToDecRev(out->binary, 0, 25);
+
+	if(out->binlen == 0) {
+		return -1;
+	}
 
-	arctechContactCreateMessage(id, unit, state, all);
+	out->message = arctechContactCreateMessage(id, unit, state, all);
+	return 0;
 }
 
 #ifndef MODULE
@@ -85,7 +92,7 @@ void arctechContactInit(void) {
 	options_add(&arctech_contact->options, 'a', "all", OPTION_HAS_VALUE, DEVICES_SETTING, JSON_NUMBER, (void *)0, "^[10]{1}$");
 	options_add(&arctech_contact->options, 0, "readonly", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)0, "^[10]{1}$");
 
-	arctech_contact->parseBinary=&arctechContactParseBinary;
+	arctech_contact->parseFrame=&arctechContactParseFrame;
 }
 
 #ifdef MODULE
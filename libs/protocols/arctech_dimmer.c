@@ -31,33 +31,40 @@
 #include "gc.h"
 #include "arctech_dimmer.h"
 
-static void arctechDimCreateMessage(int id, int unit, int state, int all, int dimlevel) {
-	arctech_dimmer->message = json_mkobject();
-	json_append_member(arctech_dimmer->message, "id", json_mknumber(id, 0));
+static JsonNode *arctechDimCreateMessage(int id, int unit, int state, int all, int dimlevel) {
+	JsonNode *message = json_mkobject();
+	json_append_member(message, "id", json_mknumber(id, 0));
 	if(all == 1) {
-		json_append_member(arctech_dimmer->message, "all", json_mknumber(all, 0));
+		json_append_member(message, "all", json_mknumber(all, 0));
 	} else {
-		json_append_member(arctech_dimmer->message, "unit", json_mknumber(unit, 0));
+		json_append_member(message, "unit", json_mknumber(unit, 0));
 	}
 	if(dimlevel >= 0) {
 		state = 1;
-		json_append_member(arctech_dimmer->message, "dimlevel", json_mknumber(dimlevel, 0));
+		json_append_member(message, "dimlevel", json_mknumber(dimlevel, 0));
 	}
 	if(state == 1) {
-		json_append_member(arctech_dimmer->message, "state", json_mkstring("on"));
+		json_append_member(message, "state", json_mkstring("on"));
 	} else {
-		json_append_member(arctech_dimmer->message, "state", json_mkstring("off"));
+		json_append_member(message, "state", json_mkstring("off"));
 	}
+
+	return message;
 }
 
-static void arctechDimParseBinary(void) {
-	int dimlevel = binToDecRev(arctech_dimmer->binary, 32, 35);
-	int unit = binToDecRev(arctech_dimmer->binary, 28, 31);
-	int state = arctech_dimmer->binary[27];
-	int all = arctech_dimmer->binary[26];
-	int id = binToDecRev(arctech_dimmer->binary, 0, 25);
+static int arctechDimParseFrame(const struct frame_t *in, struct decode_ctx_t *out) {
+	int dimlevel = binToDecRev(out->binary, 32, 35);
+	int unit = binToDecRev(out->binary, 28, 31);
+	int state = out->binary[27];
+	int all = out->binary[26];
+	int id = binToDecRev(out->binary, 0, 25);
+
+	if(out->binlen == 0) {
+		return -1;
+	}
 
-	arctechDimCreateMessage(id, unit, state, all, dimlevel);
+	out->message = arctechDimCreateMessage(id, unit, state, all, dimlevel);
+	return 0;
 }
 
 static void arctechDimCreateLow(int s, int e) {
@@ -232,7 +239,7 @@ static int arctechDimCreateCode(JsonNode *code) {
 		if(dimlevel >= 0) {
 			state = -1;
 		}
-		arctechDimCreateMessage(id, unit, state, all, dimlevel);
+		arctech_dimmer->message = arctechDimCreateMessage(id, unit, state, all, dimlevel);
 		arctechDimCreateStart();
 		arctechDimClearCode();
 		arctechDimCreateId(id);
@@ -281,7 +288,7 @@ void arctechDimInit(void) {
 	options_add(&arctech_dimmer->options, 0, "dimlevel-maximum", OPTION_HAS_VALUE, DEVICES_SETTING, JSON_NUMBER, (void *)15, "^([0-9]{1}|[1][0-5])$");
 	options_add(&arctech_dimmer->options, 0, "readonly", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)0, "^[10]{1}$");
 
-	arctech_dimmer->parseBinary=&arctechDimParseBinary;
+	arctech_dimmer->parseFrame=&arctechDimParseFrame;
 	arctech_dimmer->createCode=&arctechDimCreateCode;
 	arctech_dimmer->printHelp=&arctechDimPrintHelp;
 	arctech_dimmer->checkValues=&arctechDimCheckValues;
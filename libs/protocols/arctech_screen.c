@@ -31,29 +31,36 @@
 #include "gc.h"
 #include "arctech_screen.h"
 
-static void arctechSrCreateMessage(int id, int unit, int state, int all) {
-	arctech_screen->message = json_mkobject();
-	json_append_member(arctech_screen->message, "id", json_mknumber(id, 0));
+static JsonNode *arctechSrCreateMessage(int id, int unit, int state, int all) {
+	JsonNode *message = json_mkobject();
+	json_append_member(message, "id", json_mknumber(id, 0));
 	if(all == 1) {
-		json_append_member(arctech_screen->message, "all", json_mknumber(all, 0));
+		json_append_member(message, "all", json_mknumber(all, 0));
 	} else {
-		json_append_member(arctech_screen->message, "unit", json_mknumber(unit, 0));
+		json_append_member(message, "unit", json_mknumber(unit, 0));
 	}
 
 	if(state == 1) {
-		json_append_member(arctech_screen->message, "state", json_mkstring("up"));
+		json_append_member(message, "state", json_mkstring("up"));
 	} else {
-		json_append_member(arctech_screen->message, "state", json_mkstring("down"));
+		json_append_member(message, "state", json_mkstring("down"));
 	}
+
+	return message;
 }
 
-static void arctechSrParseBinary(void) {
-	int unit = binToDecRev(arctech_screen->binary, 28, 31);
-	int state = arctech_screen->binary[27];
-	int all = arctech_screen->binary[26];
-	int id = binToDecRev(arctech_screen->binary, 0, 25);
+static int arctechSrParseFrame(const struct frame_t *in, struct decode_ctx_t *out) {
+	int unit = binToDecRev(out->binary, 28, 31);
+	int state = out->binary[27];
+	int all = out->binary[26];
+	int id = binToDecRev(out->binary, 0, 25);
+
+	if(out->binlen == 0) {
+		return -1;
+	}
 
-	arctechSrCreateMessage(id, unit, state, all);
+	out->message = arctechSrCreateMessage(id, unit, state, all);
+	return 0;
 }
 
 static void arctechSrCreateLow(int s, int e) {
@@ -162,7 +169,7 @@ static int arctechSrCreateCode(JsonNode *code) {
 		if(unit == -1 && all == 1) {
 			unit = 0;
 		}
-		arctechSrCreateMessage(id, unit, state, all);
+		arctech_screen->message = arctechSrCreateMessage(id, unit, state, all);
 		arctechSrCreateStart();
 		arctechSrClearCode();
 		arctechSrCreateId(id);
@@ -208,7 +215,7 @@ void arctechSrInit(void) {
 
 	options_add(&arctech_screen->options, 0, "readonly", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)0, "^[10]{1}$");
 
-	arctech_screen->parseBinary=&arctechSrParseBinary;
+	arctech_screen->parseFrame=&arctechSrParseFrame;
 	arctech_screen->createCode=&arctechSrCreateCode;
 	arctech_screen->printHelp=&arctechSrPrintHelp;
 }
@@ -31,29 +31,36 @@
 #include "gc.h"
 #include "arctech_switch.h"
 
-static void arctechSwCreateMessage(int id, int unit, int state, int all) {
-	arctech_switch->message = json_mkobject();
-	json_append_member(arctech_switch->message, "id", json_mknumber(id, 0));
+static JsonNode *arctechSwCreateMessage(int id, int unit, int state, int all) {
+	JsonNode *message = json_mkobject();
+	json_append_member(message, "id", json_mknumber(id, 0));
 	if(all == 1) {
-		json_append_member(arctech_switch->message, "all", json_mknumber(all, 0));
+		json_append_member(message, "all", json_mknumber(all, 0));
 	} else {
-		json_append_member(arctech_switch->message, "unit", json_mknumber(unit, 0));
+		json_append_member(message, "unit", json_mknumber(unit, 0));
 	}
 
 	if(state == 1) {
-		json_append_member(arctech_switch->message, "state", json_mkstring("on"));
+		json_append_member(message, "state", json_mkstring("on"));
 	} else {
-		json_append_member(arctech_switch->message, "state", json_mkstring("off"));
+		json_append_member(message, "state", json_mkstring("off"));
 	}
+
+	return message;
 }
 
-static void arctechSwParseBinary(void) {
-	int unit = binToDecRev(arctech_switch->binary, 28, 31);
-	int state = arctech_switch->binary[27];
-	int all = arctech_switch->binary[26];
-	int id = binToDecRev(arctech_switch->binary, 0, 25);
+static int arctechSwParseFrame(const struct frame_t *in, struct decode_ctx_t *out) {
+	int unit = binToDecRev(out->binary, 28, 31);
+	int state = out->binary[27];
+	int all = out->binary[26];
+	int id = binToDecRev(out->binary, 0, 25);
+
+	if(out->binlen == 0) {
+		return -1;
+	}
 
-	arctechSwCreateMessage(id, unit, state, all);
+	out->message = arctechSwCreateMessage(id, unit, state, all);
+	return 0;
 }
 
 static void arctechSwCreateLow(int s, int e) {
@@ -162,7 +169,7 @@ static int arctechSwCreateCode(JsonNode *code) {
 		if(unit == -1 && all == 1) {
 			unit = 0;
 		}
-		arctechSwCreateMessage(id, unit, state, all);
+		arctech_switch->message = arctechSwCreateMessage(id, unit, state, all);
 		arctechSwCreateStart();
 		arctechSwClearCode();
 		arctechSwCreateId(id);
@@ -211,7 +218,7 @@ void arctechSwInit(void) {
 
 	options_add(&arctech_switch->options, 0, "readonly", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)0, "^[10]{1}$");
 
-	arctech_switch->parseBinary=&arctechSwParseBinary;
+	arctech_switch->parseFrame=&arctechSwParseFrame;
 	arctech_switch->createCode=&arctechSwCreateCode;
 	arctech_switch->printHelp=&arctechSwPrintHelp;
 }
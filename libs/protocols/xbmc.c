@@ -219,8 +219,8 @@ static void *xbmcParse(void *param) {
 						pthread_mutex_unlock(&xbmclock);
 						break;
 					} else {
-						if(json_validate(recvBuff) == true) {
-							JsonNode *joutput = json_decode(recvBuff);
+						JsonNode *joutput = NULL;
+						if((joutput = json_decode(recvBuff)) != NULL) {
 							JsonNode *params = NULL;
 							JsonNode *data = NULL;
 							JsonNode *item = NULL;
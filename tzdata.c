@@ -0,0 +1,80 @@
+/*
+	Copyright (C) 2014 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+	Compiles tzdata.json into the binary timezone index at build
+	time, so pilight can map it instead of parsing the json.
+
+	Usage: pilight-tzdata tzdata.json tzdata.bin
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libs/pilight/tzindex.h"
+
+int main(int argc, char **argv) {
+	struct tzindex_t index;
+	struct stat st;
+	FILE *fp = NULL;
+	char *content = NULL, *buffer = NULL;
+	size_t size = 0;
+
+	if(argc != 3) {
+		fprintf(stderr, "Usage: %s tzdata.json tzdata.bin\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((fp = fopen(argv[1], "rb")) == NULL || fstat(fileno(fp), &st) != 0) {
+		fprintf(stderr, "cannot read tzdata file: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if((content = calloc((size_t)st.st_size+1, sizeof(char))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	if(fread(content, sizeof(char), (size_t)st.st_size, fp) != (size_t)st.st_size) {
+		fprintf(stderr, "cannot read tzdata file: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	fclose(fp);
+
+	if((buffer = tzindex_build(content, &size)) == NULL || tzindex_open(&index, buffer, size) != 0) {
+		fprintf(stderr, "cannot index tzdata file: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if((fp = fopen(argv[2], "wb")) == NULL) {
+		fprintf(stderr, "cannot write tzdata index: %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	if(fwrite(buffer, sizeof(char), size, fp) != size || fclose(fp) != 0) {
+		fprintf(stderr, "cannot write tzdata index: %s\n", argv[2]);
+		remove(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	printf("compiled %u timezones with %u points into %s (%zu bytes)\n",
+		index.header->nrzones, index.header->nrpoints, argv[2], size);
+
+	free(content);
+	free(buffer);
+	return EXIT_SUCCESS;
+}